@@ -0,0 +1,431 @@
+/// @file
+/// @brief Google Benchmark suite measuring reads, writes and opening of each image format the library can create.
+///
+/// Usage: disk_bench [--disk_size_mb=N] [--disk_block_kb=N] [--disk_fragmentation=F] [--disk_fill=F]
+///                   [--disk_threads=N] [--disk_dir=PATH] [--disk_direct_io=0|1] [Google Benchmark options]
+///
+/// A scratch image of each kind - VDI normal and fixed, VHD fixed and dynamic - is created in disk_dir, filled, and
+/// deleted once the benchmarks have run. disk_fill is the fraction of blocks that are written, and disk_fragmentation
+/// the fraction of those written out of order, so that blocks of dynamic images are scattered through the file.
+///
+/// Results are printed as JSON unless --benchmark_format says otherwise. Each result has an "MB/s" counter and, for
+/// requests of a fixed size, an "IOPS" counter. Pass --benchmark_filter to run only some benchmarks - for example
+/// --benchmark_filter=vhd_dynamic.
+
+// Copyright Martin Hughes 2018.
+
+#include "virtualdisk/virtualdisk.h"
+#include "virtualdisk/virt_disk_vdi.h"
+#include "virtualdisk/virt_disk_vhd.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+  /// @brief The images to benchmark, from the command line.
+  ///
+  struct bench_config
+  {
+    uint64_t disk_size = 256 * 1024 * 1024; ///< The size of each virtual disk, in bytes.
+    uint32_t block_size = 0; ///< The block size of dynamic images, in bytes. Zero selects the format's default.
+    double fragmentation = 0.5; ///< The fraction of blocks that are written out of order when filling an image.
+    double fill = 1.0; ///< The fraction of blocks that are written when filling an image.
+    uint32_t max_threads = 0; ///< The most threads in the multi-threaded benchmarks. Zero selects the core count.
+    string directory = "."; ///< Where to create the images.
+    bool direct_io = false; ///< Whether to open the images with open_config::direct_io set.
+  };
+
+  /// @brief One kind of image to benchmark.
+  ///
+  struct image_kind
+  {
+    const char *name; ///< Used in the names of the benchmarks.
+    uint32_t format; ///< One of the image_format constants.
+  };
+
+  const image_kind IMAGE_KINDS[] =
+    {
+      { "vdi_normal", virt_disk::image_format::VDI_NORMAL },
+      { "vdi_fixed", virt_disk::image_format::VDI_FIXED },
+      { "vhd_fixed", virt_disk::image_format::VHD_FIXED },
+      { "vhd_dynamic", virt_disk::image_format::VHD_DYNAMIC },
+    };
+
+  /// The size of each request in the small random benchmarks.
+  const uint64_t SMALL_REQUEST = 4096;
+
+  /// The size of each request in the sequential benchmarks.
+  const uint64_t SEQUENTIAL_REQUEST = 1024 * 1024;
+
+  /// The size of each request in the large-block benchmarks.
+  const uint64_t LARGE_REQUEST = 16 * 1024 * 1024;
+
+  /// The size of the pieces that fixed images are filled in.
+  const uint64_t FIXED_FILL_CHUNK = 1024 * 1024;
+
+  /// The disks being benchmarked. They are opened before the benchmarks run and shared by their threads.
+  vector<unique_ptr<virt_disk::virt_disk>> open_disks;
+
+  /// @brief Create a new image of the given kind.
+  ///
+  /// @param kind The kind of image.
+  ///
+  /// @param filename The file to create.
+  ///
+  /// @param config The benchmark settings.
+  ///
+  /// @return The size of the pieces the image should be filled in - its block size, for dynamic images.
+  uint64_t create_image(const image_kind &kind, const string &filename, const bench_config &config)
+  {
+    switch (kind.format)
+    {
+    case virt_disk::image_format::VDI_NORMAL:
+      virt_disk::vdi_disk::create(filename, config.disk_size, virt_disk::VDI_TYPE_NORMAL, config.block_size);
+      return (config.block_size != 0) ? config.block_size : virt_disk::VDI_DEFAULT_BLOCK_SIZE;
+
+    case virt_disk::image_format::VDI_FIXED:
+      virt_disk::vdi_disk::create(filename, config.disk_size, virt_disk::VDI_TYPE_FIXED_SIZE, config.block_size);
+      return FIXED_FILL_CHUNK;
+
+    case virt_disk::image_format::VHD_FIXED:
+      virt_disk::vhd_disk::create(filename, config.disk_size, virt_disk::vhd_disk_type::FIXED, config.block_size);
+      return FIXED_FILL_CHUNK;
+
+    default:
+      virt_disk::vhd_disk::create(filename, config.disk_size, virt_disk::vhd_disk_type::DYNAMIC, config.block_size);
+      return (config.block_size != 0) ? config.block_size : virt_disk::VHD_DEFAULT_BLOCK_SIZE;
+    }
+  }
+
+  /// @brief Write data to a new image, in a partly shuffled order.
+  ///
+  /// @param disk The image to fill.
+  ///
+  /// @param chunk_size The size of each piece written, in bytes.
+  ///
+  /// @param config The benchmark settings.
+  void fill_image(virt_disk::virt_disk *disk, uint64_t chunk_size, const bench_config &config)
+  {
+    const uint64_t disk_length = disk->get_length();
+    const uint64_t chunk_count = (disk_length + chunk_size - 1) / chunk_size;
+    mt19937_64 generator(1);
+    uniform_real_distribution<double> chance(0.0, 1.0);
+
+    vector<uint64_t> order;
+    for (uint64_t chunk = 0; chunk < chunk_count; chunk++)
+    {
+      if (chance(generator) < config.fill)
+      {
+        order.push_back(chunk);
+      }
+    }
+
+    for (uint64_t i = 0; i < order.size(); i++)
+    {
+      if (chance(generator) < config.fragmentation)
+      {
+        swap(order[i], order[generator() % order.size()]);
+      }
+    }
+
+    // Data that is not all zeroes, so that it is really stored.
+    vector<uint8_t> data(chunk_size);
+    for (uint64_t i = 0; i < chunk_size; i++)
+    {
+      data[i] = static_cast<uint8_t>(generator());
+    }
+
+    for (uint64_t chunk : order)
+    {
+      const uint64_t start = chunk * chunk_size;
+      const uint64_t length = min(chunk_size, disk_length - start);
+      disk->write(data.data(), start, length, length);
+    }
+
+    disk->flush();
+  }
+
+  /// @brief Report the rates of a benchmark that transferred fixed size requests.
+  ///
+  /// @param state The benchmark's state.
+  ///
+  /// @param request_size The size of each request, in bytes.
+  void report_rates(benchmark::State &state, uint64_t request_size)
+  {
+    const double requests = static_cast<double>(state.iterations());
+    state.SetBytesProcessed(state.iterations() * request_size);
+    state.counters["MB/s"] = benchmark::Counter((requests * request_size) / (1024 * 1024), benchmark::Counter::kIsRate);
+    state.counters["IOPS"] = benchmark::Counter(requests, benchmark::Counter::kIsRate);
+  }
+
+  /// @brief Read or write a disk sequentially, wrapping round at the end. Each thread streams through its own part.
+  ///
+  /// @param state The benchmark's state.
+  ///
+  /// @param disk The disk to access.
+  ///
+  /// @param request_size The size of each request, in bytes.
+  ///
+  /// @param is_write Whether to write (true) or read (false).
+  void sequential_io(benchmark::State &state, virt_disk::virt_disk *disk, uint64_t request_size, bool is_write)
+  {
+    const uint64_t slots = disk->get_length() / request_size;
+    const uint64_t thread_slots = max<uint64_t>(slots / state.threads(), 1);
+    const uint64_t first_slot = (thread_slots * state.thread_index()) % slots;
+    vector<uint8_t> buffer(request_size, 0x5A);
+    uint64_t slot = 0;
+
+    for (auto _ : state)
+    {
+      const uint64_t start = ((first_slot + slot) % slots) * request_size;
+      if (is_write)
+      {
+        disk->write(buffer.data(), start, request_size, request_size);
+      }
+      else
+      {
+        disk->read(buffer.data(), start, request_size, request_size);
+      }
+      slot = (slot + 1) % thread_slots;
+    }
+
+    report_rates(state, request_size);
+  }
+
+  /// @brief Read or write random, request size aligned, parts of a disk.
+  ///
+  /// @param state The benchmark's state.
+  ///
+  /// @param disk The disk to access.
+  ///
+  /// @param request_size The size of each request, in bytes.
+  ///
+  /// @param is_write Whether to write (true) or read (false).
+  void random_io(benchmark::State &state, virt_disk::virt_disk *disk, uint64_t request_size, bool is_write)
+  {
+    const uint64_t slots = disk->get_length() / request_size;
+    mt19937_64 generator(state.thread_index() + 1);
+    vector<uint8_t> buffer(request_size, 0x5A);
+
+    for (auto _ : state)
+    {
+      const uint64_t start = (generator() % slots) * request_size;
+      if (is_write)
+      {
+        disk->write(buffer.data(), start, request_size, request_size);
+      }
+      else
+      {
+        disk->read(buffer.data(), start, request_size, request_size);
+      }
+    }
+
+    report_rates(state, request_size);
+  }
+
+  /// @brief Open and close an image.
+  ///
+  /// @param state The benchmark's state.
+  ///
+  /// @param filename The image to open.
+  ///
+  /// @param config The benchmark settings.
+  void open_image(benchmark::State &state, string filename, const bench_config &config)
+  {
+    virt_disk::open_config open_settings;
+    open_settings.direct_io = config.direct_io;
+
+    for (auto _ : state)
+    {
+      unique_ptr<virt_disk::virt_disk> disk(virt_disk::virt_disk::create_virtual_disk(filename, open_settings));
+      benchmark::DoNotOptimize(disk->get_length());
+    }
+  }
+
+  /// @brief Register every benchmark of one image.
+  ///
+  /// @param kind The kind of image.
+  ///
+  /// @param filename The image.
+  ///
+  /// @param disk The image, opened.
+  ///
+  /// @param config The benchmark settings.
+  void register_benchmarks(const image_kind &kind,
+                           const string &filename,
+                           virt_disk::virt_disk *disk,
+                           const bench_config &config)
+  {
+    const string prefix = string(kind.name) + "/";
+
+    benchmark::RegisterBenchmark((prefix + "open").c_str(), open_image, filename, config);
+
+    benchmark::RegisterBenchmark((prefix + "sequential_read").c_str(), sequential_io, disk, SEQUENTIAL_REQUEST, false)
+      ->UseRealTime();
+    benchmark::RegisterBenchmark((prefix + "sequential_write").c_str(), sequential_io, disk, SEQUENTIAL_REQUEST, true)
+      ->UseRealTime();
+    benchmark::RegisterBenchmark((prefix + "random_read_4k").c_str(), random_io, disk, SMALL_REQUEST, false)
+      ->UseRealTime();
+    benchmark::RegisterBenchmark((prefix + "random_write_4k").c_str(), random_io, disk, SMALL_REQUEST, true)
+      ->UseRealTime();
+    benchmark::RegisterBenchmark((prefix + "large_read").c_str(), random_io, disk, LARGE_REQUEST, false)
+      ->UseRealTime();
+    benchmark::RegisterBenchmark((prefix + "large_write").c_str(), random_io, disk, LARGE_REQUEST, true)
+      ->UseRealTime();
+
+    if (config.max_threads > 1)
+    {
+      benchmark::RegisterBenchmark((prefix + "random_read_4k_threads").c_str(), random_io, disk, SMALL_REQUEST, false)
+        ->ThreadRange(2, config.max_threads)
+        ->UseRealTime();
+      benchmark::RegisterBenchmark((prefix + "random_write_4k_threads").c_str(), random_io, disk, SMALL_REQUEST, true)
+        ->ThreadRange(2, config.max_threads)
+        ->UseRealTime();
+      benchmark::RegisterBenchmark((prefix + "sequential_read_threads").c_str(),
+                                   sequential_io,
+                                   disk,
+                                   SEQUENTIAL_REQUEST,
+                                   false)
+        ->ThreadRange(2, config.max_threads)
+        ->UseRealTime();
+    }
+  }
+
+  /// @brief Take this program's own options out of the command line, leaving Google Benchmark's.
+  ///
+  /// @param argc The number of arguments. Updated to the number left.
+  ///
+  /// @param argv The arguments. Those that are used are removed.
+  ///
+  /// @return The settings given.
+  bench_config parse_options(int &argc, char **argv)
+  {
+    bench_config config;
+    int kept = 1;
+
+    for (int i = 1; i < argc; i++)
+    {
+      const string arg = argv[i];
+      const size_t equals = arg.find('=');
+      const string name = arg.substr(0, equals);
+      const string value = (equals == string::npos) ? "" : arg.substr(equals + 1);
+
+      if (name == "--disk_size_mb")
+      {
+        config.disk_size = stoull(value) * 1024 * 1024;
+      }
+      else if (name == "--disk_block_kb")
+      {
+        config.block_size = static_cast<uint32_t>(stoul(value) * 1024);
+      }
+      else if (name == "--disk_fragmentation")
+      {
+        config.fragmentation = stod(value);
+      }
+      else if (name == "--disk_fill")
+      {
+        config.fill = stod(value);
+      }
+      else if (name == "--disk_threads")
+      {
+        config.max_threads = static_cast<uint32_t>(stoul(value));
+      }
+      else if (name == "--disk_dir")
+      {
+        config.directory = value;
+      }
+      else if (name == "--disk_direct_io")
+      {
+        config.direct_io = (value != "0");
+      }
+      else
+      {
+        argv[kept++] = argv[i];
+      }
+    }
+
+    argc = kept;
+    if (config.max_threads == 0)
+    {
+      config.max_threads = max(thread::hardware_concurrency(), 1U);
+    }
+
+    return config;
+  }
+}
+
+/// @brief Benchmark entry point.
+///
+int main(int argc, char **argv)
+{
+  bench_config config = parse_options(argc, argv);
+
+  // JSON is the default output, so that results can be compared between releases.
+  vector<char *> args(argv, argv + argc);
+  string json_format = "--benchmark_format=json";
+  if (none_of(args.begin(), args.end(), [](char *arg) { return string(arg).find("--benchmark_format") == 0; }))
+  {
+    args.push_back(&json_format[0]);
+  }
+  int arg_count = static_cast<int>(args.size());
+
+  benchmark::Initialize(&arg_count, args.data());
+  if (benchmark::ReportUnrecognizedArguments(arg_count, args.data()))
+  {
+    return 1;
+  }
+
+  benchmark::AddCustomContext("disk_size_mb", to_string(config.disk_size / (1024 * 1024)));
+  benchmark::AddCustomContext("disk_block_kb", to_string(config.block_size / 1024));
+  benchmark::AddCustomContext("disk_fragmentation", to_string(config.fragmentation));
+  benchmark::AddCustomContext("disk_fill", to_string(config.fill));
+  benchmark::AddCustomContext("disk_direct_io", config.direct_io ? "1" : "0");
+
+  vector<string> filenames;
+  int result = 0;
+
+  try
+  {
+    virt_disk::open_config open_settings;
+    open_settings.direct_io = config.direct_io;
+
+    for (const image_kind &kind : IMAGE_KINDS)
+    {
+      string filename = config.directory + "/disk_bench_" + kind.name + ".img";
+      remove(filename.c_str());
+      filenames.push_back(filename);
+
+      const uint64_t chunk_size = create_image(kind, filename, config);
+      open_disks.emplace_back(virt_disk::virt_disk::create_virtual_disk(filename, open_settings));
+      fill_image(open_disks.back().get(), chunk_size, config);
+      register_benchmarks(kind, filename, open_disks.back().get(), config);
+    }
+
+    benchmark::RunSpecifiedBenchmarks();
+  }
+  catch (exception &e)
+  {
+    cerr << "Benchmark failed: " << e.what() << endl;
+    result = 1;
+  }
+
+  open_disks.clear();
+  for (const string &filename : filenames)
+  {
+    remove(filename.c_str());
+  }
+
+  benchmark::Shutdown();
+  return result;
+}
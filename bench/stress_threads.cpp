@@ -0,0 +1,128 @@
+/// @file
+/// @brief Measures how throughput on one shared virt_disk object scales with the number of threads.
+///
+/// Usage: stress_threads <image file> [seconds per step] [max threads] [request size] [write percent]
+///
+/// For 1, 2, 4, ... up to max threads, every thread issues random, request-size aligned reads (and, if write percent is
+/// non-zero, that proportion of writes) against the same disk object for the given number of seconds. The total
+/// throughput at each thread count is printed. Writes modify the image, so use a scratch copy.
+
+// Copyright Martin Hughes 2018.
+
+#include "virtualdisk/virtualdisk.h"
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+  /// @brief Run one step of the benchmark.
+  ///
+  /// @param disk The disk to access.
+  ///
+  /// @param thread_count How many threads to run.
+  ///
+  /// @param seconds How long to run for.
+  ///
+  /// @param request_size The size of each request, in bytes.
+  ///
+  /// @param write_percent The percentage of requests that are writes.
+  ///
+  /// @return The number of requests completed.
+  uint64_t run_step(virt_disk::virt_disk *disk,
+                    uint32_t thread_count,
+                    uint32_t seconds,
+                    uint64_t request_size,
+                    uint32_t write_percent)
+  {
+    atomic<bool> stop{false};
+    atomic<uint64_t> total_requests{0};
+    uint64_t request_slots = disk->get_length() / request_size;
+    vector<thread> threads;
+
+    for (uint32_t i = 0; i < thread_count; i++)
+    {
+      threads.emplace_back([&, i]()
+      {
+        mt19937_64 generator(i + 1);
+        unique_ptr<uint8_t[]> buffer(new uint8_t[request_size]);
+        uint64_t requests = 0;
+
+        while (!stop.load(memory_order_relaxed))
+        {
+          uint64_t start = (generator() % request_slots) * request_size;
+          if ((generator() % 100) < write_percent)
+          {
+            disk->write(buffer.get(), start, request_size, request_size);
+          }
+          else
+          {
+            disk->read(buffer.get(), start, request_size, request_size);
+          }
+          requests++;
+        }
+
+        total_requests += requests;
+      });
+    }
+
+    this_thread::sleep_for(chrono::seconds(seconds));
+    stop = true;
+
+    for (thread &t : threads)
+    {
+      t.join();
+    }
+
+    return total_requests;
+  }
+}
+
+/// @brief Benchmark entry point.
+///
+int main(int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    cerr << "Usage: " << argv[0] << " <image file> [seconds per step] [max threads] [request size] [write percent]"
+         << endl;
+    return 1;
+  }
+
+  string filename = argv[1];
+  uint32_t seconds = (argc > 2) ? stoul(argv[2]) : 5;
+  uint32_t max_threads = (argc > 3) ? stoul(argv[3]) : thread::hardware_concurrency();
+  uint64_t request_size = (argc > 4) ? stoull(argv[4]) : 4096;
+  uint32_t write_percent = (argc > 5) ? stoul(argv[5]) : 0;
+
+  if (max_threads == 0)
+  {
+    max_threads = 1;
+  }
+
+  unique_ptr<virt_disk::virt_disk> disk(virt_disk::virt_disk::create_virtual_disk(filename));
+  if ((disk->get_length() / request_size) == 0)
+  {
+    cerr << "Image is smaller than one request" << endl;
+    return 1;
+  }
+
+  for (uint32_t threads = 1; threads <= max_threads; threads *= 2)
+  {
+    uint64_t requests = run_step(disk.get(), threads, seconds, request_size, write_percent);
+    double per_second = static_cast<double>(requests) / seconds;
+
+    cout << threads << " threads: " << static_cast<uint64_t>(per_second) << " requests/s, "
+         << (per_second * request_size) / (1024 * 1024) << " MB/s" << endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,697 @@
+/// @file
+/// @brief Implements a sharded block cache with CLOCK or ARC eviction.
+
+// Copyright Martin Hughes 2018.
+
+#include "virtualdisk/virt_disk_cache.h"
+
+#include <algorithm>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <string.h>
+
+namespace
+{
+  /// @brief Identifies one cached block.
+  ///
+  struct cache_key
+  {
+    virt_disk::virt_disk *owner; ///< The disk the block belongs to.
+    uint64_t block; ///< The logical block number, in units of the cache block size.
+
+    bool operator==(const cache_key &other) const
+    {
+      return (owner == other.owner) && (block == other.block);
+    }
+  };
+
+  /// @brief Hash function for cache_key.
+  ///
+  struct cache_key_hash
+  {
+    size_t operator()(const cache_key &key) const
+    {
+      return std::hash<uint64_t>()((key.block * 0x9E3779B97F4A7C15ULL) ^ reinterpret_cast<uintptr_t>(key.owner));
+    }
+  };
+
+  /// Value of cache_entry::arc_list for blocks seen once recently.
+  const uint8_t ARC_T1 = 1;
+
+  /// Value of cache_entry::arc_list for blocks seen at least twice recently.
+  const uint8_t ARC_T2 = 2;
+
+  /// @brief One cached block.
+  ///
+  struct cache_entry
+  {
+    std::unique_ptr<uint8_t[]> data; ///< The contents of the block.
+    uint64_t length; ///< The number of valid bytes in data. Only less than the block size at the end of a disk.
+    bool dirty; ///< Whether data has been written to the cache but not yet to the disk.
+    bool referenced; ///< CLOCK: Whether the block has been used since the hand last passed.
+    bool prefetched; ///< Whether the block was read ahead, and has not been used since.
+    uint32_t clock_slot; ///< CLOCK: The slot this block occupies.
+    uint8_t arc_list; ///< ARC: Which list (ARC_T1 or ARC_T2) this block is in.
+    std::list<cache_key>::iterator arc_position; ///< ARC: This block's position in its list.
+  };
+}
+
+namespace virt_disk
+{
+  /// @brief One independently locked part of a block_cache.
+  ///
+  /// Every member must only be used with lock held.
+  class cache_shard
+  {
+  public:
+    std::mutex lock; ///< Protects every other member.
+    uint32_t capacity{1}; ///< The most blocks this shard can hold.
+    uint32_t policy{cache_policy::CLOCK}; ///< One of the cache_policy constants.
+    uint64_t block_size{0}; ///< The size of each block, in bytes.
+    uint64_t generation{0}; ///< Incremented whenever any block in this shard is written or invalidated.
+    cache_stats stats{}; ///< Counters for this shard.
+
+    std::unordered_map<cache_key, cache_entry, cache_key_hash> entries; ///< The cached blocks.
+
+    std::vector<cache_key> clock_slots; ///< CLOCK: The ring of slots. Unused slots have a null owner.
+    std::vector<uint32_t> free_slots; ///< CLOCK: Slots that are not in use.
+    uint32_t clock_hand{0}; ///< CLOCK: The next slot to consider for eviction.
+
+    std::list<cache_key> arc_t1; ///< ARC: Resident blocks seen once recently, most recent first.
+    std::list<cache_key> arc_t2; ///< ARC: Resident blocks seen more than once recently, most recent first.
+    std::list<cache_key> arc_b1; ///< ARC: Ghosts of blocks evicted from arc_t1, most recent first.
+    std::list<cache_key> arc_b2; ///< ARC: Ghosts of blocks evicted from arc_t2, most recent first.
+    std::unordered_map<cache_key, std::list<cache_key>::iterator, cache_key_hash> arc_ghosts; ///< ARC: Ghost index.
+    uint32_t arc_target_t1{0}; ///< ARC: The adaptive target size of arc_t1.
+
+    /// @brief Set up the shard.
+    ///
+    /// @param shard_capacity The most blocks this shard can hold.
+    ///
+    /// @param shard_policy One of the cache_policy constants.
+    ///
+    /// @param shard_block_size The size of each block, in bytes.
+    void init(uint32_t shard_capacity, uint32_t shard_policy, uint64_t shard_block_size)
+    {
+      capacity = std::max(1U, shard_capacity);
+      policy = shard_policy;
+      block_size = shard_block_size;
+
+      if (policy == cache_policy::CLOCK)
+      {
+        clock_slots.resize(capacity, {nullptr, 0});
+        for (uint32_t i = capacity; i > 0; i--)
+        {
+          free_slots.push_back(i - 1);
+        }
+      }
+    }
+
+    /// @brief Note that a block has been used.
+    ///
+    /// @param key The block's key.
+    ///
+    /// @param entry The block.
+    void touch(const cache_key &key, cache_entry &entry)
+    {
+      if (policy == cache_policy::CLOCK)
+      {
+        entry.referenced = true;
+      }
+      else
+      {
+        // Any hit moves the block to the front of T2 - except the first use of a block that was read ahead, which is
+        // its first real access. Otherwise a sequential scan would flood T2.
+        std::list<cache_key> &target = entry.prefetched ? arc_t1 : arc_t2;
+        if (entry.arc_list == ARC_T1)
+        {
+          arc_t1.erase(entry.arc_position);
+        }
+        else
+        {
+          arc_t2.erase(entry.arc_position);
+        }
+        target.push_front(key);
+        entry.arc_position = target.begin();
+        entry.arc_list = entry.prefetched ? ARC_T1 : ARC_T2;
+      }
+
+      entry.prefetched = false;
+    }
+
+    /// @brief Write a block to its disk if it is dirty.
+    ///
+    /// @param key The block's key.
+    ///
+    /// @param entry The block.
+    void write_back(const cache_key &key, cache_entry &entry)
+    {
+      if (entry.dirty)
+      {
+        key.owner->write_uncached(entry.data.get(), key.block * block_size, entry.length);
+        entry.dirty = false;
+        stats.write_backs++;
+      }
+    }
+
+    /// @brief Remove a block from the cache, without keeping any history of it.
+    ///
+    /// @param key The block to remove. It must be in the cache.
+    void remove(const cache_key &key)
+    {
+      auto it = entries.find(key);
+      if (policy == cache_policy::CLOCK)
+      {
+        clock_slots[it->second.clock_slot] = {nullptr, 0};
+        free_slots.push_back(it->second.clock_slot);
+      }
+      else if (it->second.arc_list == ARC_T1)
+      {
+        arc_t1.erase(it->second.arc_position);
+      }
+      else
+      {
+        arc_t2.erase(it->second.arc_position);
+      }
+
+      entries.erase(it);
+    }
+
+    /// @brief Evict the block chosen by the CLOCK algorithm.
+    ///
+    void evict_clock()
+    {
+      while (true)
+      {
+        cache_key &key = clock_slots[clock_hand];
+        clock_hand = (clock_hand + 1) % capacity;
+        if (key.owner == nullptr)
+        {
+          continue;
+        }
+
+        cache_entry &entry = entries.find(key)->second;
+        if (entry.referenced)
+        {
+          entry.referenced = false;
+          continue;
+        }
+
+        write_back(key, entry);
+        cache_key victim = key;
+        remove(victim);
+        stats.evictions++;
+        return;
+      }
+    }
+
+    /// @brief Remember a ghost of an evicted block in one of the ARC history lists.
+    ///
+    /// @param key The evicted block.
+    ///
+    /// @param history Either arc_b1 or arc_b2.
+    void add_ghost(const cache_key &key, std::list<cache_key> &history)
+    {
+      history.push_front(key);
+      arc_ghosts[key] = history.begin();
+    }
+
+    /// @brief Forget the oldest ghost in one of the ARC history lists.
+    ///
+    /// @param history Either arc_b1 or arc_b2.
+    void drop_oldest_ghost(std::list<cache_key> &history)
+    {
+      if (!history.empty())
+      {
+        arc_ghosts.erase(history.back());
+        history.pop_back();
+      }
+    }
+
+    /// @brief The ARC "REPLACE" step - evict from T1 or T2 depending on the adaptive target.
+    ///
+    /// @param in_b2 Whether the block being inserted was found in arc_b2.
+    void arc_replace(bool in_b2)
+    {
+      if (entries.size() < capacity)
+      {
+        return;
+      }
+
+      bool from_t1 = !arc_t1.empty() &&
+                     ((arc_t1.size() > arc_target_t1) || (in_b2 && (arc_t1.size() == arc_target_t1)));
+      std::list<cache_key> &source = (from_t1 || arc_t2.empty()) ? arc_t1 : arc_t2;
+      std::list<cache_key> &history = (&source == &arc_t1) ? arc_b1 : arc_b2;
+
+      cache_key victim = source.back();
+      write_back(victim, entries.find(victim)->second);
+      remove(victim);
+      add_ghost(victim, history);
+      stats.evictions++;
+    }
+
+    /// @brief Make room for, and place, a new block according to the ARC algorithm.
+    ///
+    /// @param key The new block.
+    ///
+    /// @param entry The new block. Its ARC members are filled in.
+    void arc_place(const cache_key &key, cache_entry &entry)
+    {
+      auto ghost = arc_ghosts.find(key);
+      bool into_t2 = false;
+
+      if ((ghost != arc_ghosts.end()) && (std::find(arc_b1.begin(), arc_b1.end(), key) != arc_b1.end()))
+      {
+        // Recently evicted from T1 - T1 should have been bigger.
+        uint32_t step = std::max<uint32_t>(1, static_cast<uint32_t>(arc_b2.size() / arc_b1.size()));
+        arc_target_t1 = std::min(capacity, arc_target_t1 + step);
+        arc_replace(false);
+        arc_b1.erase(ghost->second);
+        arc_ghosts.erase(ghost);
+        into_t2 = true;
+      }
+      else if (ghost != arc_ghosts.end())
+      {
+        // Recently evicted from T2 - T2 should have been bigger.
+        uint32_t step = std::max<uint32_t>(1, static_cast<uint32_t>(arc_b1.size() / arc_b2.size()));
+        arc_target_t1 = (arc_target_t1 > step) ? (arc_target_t1 - step) : 0;
+        arc_replace(true);
+        arc_b2.erase(ghost->second);
+        arc_ghosts.erase(ghost);
+        into_t2 = true;
+      }
+      else if ((arc_t1.size() + arc_b1.size()) >= capacity)
+      {
+        if (arc_t1.size() < capacity)
+        {
+          drop_oldest_ghost(arc_b1);
+          arc_replace(false);
+        }
+        else
+        {
+          cache_key victim = arc_t1.back();
+          write_back(victim, entries.find(victim)->second);
+          remove(victim);
+          stats.evictions++;
+        }
+      }
+      else
+      {
+        uint64_t total = arc_t1.size() + arc_t2.size() + arc_b1.size() + arc_b2.size();
+        if (total >= capacity)
+        {
+          if (total >= (2ULL * capacity))
+          {
+            drop_oldest_ghost(arc_b2);
+          }
+          arc_replace(false);
+        }
+      }
+
+      std::list<cache_key> &target = into_t2 ? arc_t2 : arc_t1;
+      target.push_front(key);
+      entry.arc_position = target.begin();
+      entry.arc_list = into_t2 ? ARC_T2 : ARC_T1;
+    }
+
+    /// @brief Add a new block to the shard, evicting another if needed.
+    ///
+    /// @param key The new block. It must not already be in the cache.
+    ///
+    /// @param data The contents of the block.
+    ///
+    /// @param length The number of bytes in data.
+    ///
+    /// @param dirty Whether the block has not yet been written to its disk.
+    ///
+    /// @param prefetched Whether the block is being read ahead, rather than having been used.
+    void add(const cache_key &key, const uint8_t *data, uint64_t length, bool dirty, bool prefetched)
+    {
+      cache_entry entry;
+      entry.data = std::unique_ptr<uint8_t[]>(new uint8_t[block_size]);
+      memcpy(entry.data.get(), data, length);
+      entry.length = length;
+      entry.dirty = dirty;
+      entry.referenced = false;
+      entry.prefetched = prefetched;
+      entry.clock_slot = 0;
+      entry.arc_list = 0;
+
+      if (policy == cache_policy::CLOCK)
+      {
+        if (free_slots.empty())
+        {
+          evict_clock();
+        }
+        entry.clock_slot = free_slots.back();
+        free_slots.pop_back();
+        clock_slots[entry.clock_slot] = key;
+      }
+      else
+      {
+        arc_place(key, entry);
+      }
+
+      entries.emplace(key, std::move(entry));
+      stats.insertions++;
+    }
+  };
+};
+
+namespace virt_disk
+{
+  /// @brief Create an empty cache.
+  ///
+  /// @param config The size and behaviour of the cache.
+  block_cache::block_cache(const cache_config &config) :
+    config{config}
+  {
+    if (this->config.shard_count == 0)
+    {
+      this->config.shard_count = 1;
+    }
+    if (this->config.block_size == 0)
+    {
+      throw std::fstream::failure("Cache block size must not be zero");
+    }
+
+    uint64_t total_blocks = this->config.capacity_bytes / this->config.block_size;
+    uint32_t per_shard = static_cast<uint32_t>(std::max<uint64_t>(1, total_blocks / this->config.shard_count));
+
+    shards = std::unique_ptr<cache_shard[]>(new cache_shard[this->config.shard_count]);
+    for (uint32_t i = 0; i < this->config.shard_count; i++)
+    {
+      shards[i].init(per_shard, this->config.policy, this->config.block_size);
+    }
+  }
+
+  block_cache::~block_cache()
+  {
+  }
+
+  /// @brief Get the counters for this cache.
+  ///
+  /// @return The sum of the counters across all shards.
+  cache_stats block_cache::get_stats()
+  {
+    cache_stats total{};
+
+    for (uint32_t i = 0; i < config.shard_count; i++)
+    {
+      std::lock_guard<std::mutex> guard(shards[i].lock);
+      total.hits += shards[i].stats.hits;
+      total.misses += shards[i].stats.misses;
+      total.insertions += shards[i].stats.insertions;
+      total.evictions += shards[i].stats.evictions;
+      total.write_backs += shards[i].stats.write_backs;
+      total.blocks_cached += shards[i].entries.size();
+    }
+
+    return total;
+  }
+
+  /// @brief Set all counters to zero, except for blocks_cached.
+  ///
+  void block_cache::reset_stats()
+  {
+    for (uint32_t i = 0; i < config.shard_count; i++)
+    {
+      std::lock_guard<std::mutex> guard(shards[i].lock);
+      shards[i].stats = cache_stats{};
+    }
+  }
+
+  /// @brief Copy part of a block out of the cache, if it is there.
+  ///
+  /// @param owner The disk the block belongs to.
+  ///
+  /// @param block The block number.
+  ///
+  /// @param buffer The buffer to copy in to.
+  ///
+  /// @param offset The offset within the block to begin copying from.
+  ///
+  /// @param length The number of bytes to copy.
+  ///
+  /// @param generation On a miss, set to a value that must be passed to insert() when the block is read from disk.
+  ///
+  /// @return True if the data was copied, false on a miss.
+  bool block_cache::lookup(virt_disk *owner,
+                           uint64_t block,
+                           uint8_t *buffer,
+                           uint64_t offset,
+                           uint64_t length,
+                           uint64_t &generation)
+  {
+    cache_key key{owner, block};
+    cache_shard &shard = shard_for(owner, block);
+    std::lock_guard<std::mutex> guard(shard.lock);
+
+    auto it = shard.entries.find(key);
+    if ((it == shard.entries.end()) || ((offset + length) > it->second.length))
+    {
+      shard.stats.misses++;
+      generation = shard.generation;
+      return false;
+    }
+
+    memcpy(buffer, it->second.data.get() + offset, length);
+    shard.touch(key, it->second);
+    shard.stats.hits++;
+    return true;
+  }
+
+  /// @brief Check whether a block is in the cache, without counting a hit or miss.
+  ///
+  /// @param owner The disk the block belongs to.
+  ///
+  /// @param block The block number.
+  ///
+  /// @param generation If the block is not cached, set to a value that must be passed to insert().
+  ///
+  /// @return True if the block is in the cache.
+  bool block_cache::contains(virt_disk *owner, uint64_t block, uint64_t &generation)
+  {
+    cache_key key{owner, block};
+    cache_shard &shard = shard_for(owner, block);
+    std::lock_guard<std::mutex> guard(shard.lock);
+
+    generation = shard.generation;
+    return shard.entries.find(key) != shard.entries.end();
+  }
+
+  /// @brief Add a complete block to the cache.
+  ///
+  /// A clean block is only added if nothing in its shard has been written since the lookup() that missed it.
+  /// Otherwise the data read from disk may already be out of date. A dirty block replaces any existing copy.
+  ///
+  /// @param owner The disk the block belongs to.
+  ///
+  /// @param block The block number.
+  ///
+  /// @param data The contents of the block.
+  ///
+  /// @param length The number of bytes in the block.
+  ///
+  /// @param dirty Whether the block has not yet been written to its disk.
+  ///
+  /// @param generation For clean blocks, the generation returned by lookup() or contains().
+  ///
+  /// @param prefetched Whether the block is being read ahead, rather than having been requested.
+  void block_cache::insert(virt_disk *owner,
+                           uint64_t block,
+                           const uint8_t *data,
+                           uint64_t length,
+                           bool dirty,
+                           uint64_t generation,
+                           bool prefetched)
+  {
+    cache_key key{owner, block};
+    cache_shard &shard = shard_for(owner, block);
+    std::lock_guard<std::mutex> guard(shard.lock);
+
+    if (dirty)
+    {
+      shard.generation++;
+    }
+    else if (generation != shard.generation)
+    {
+      return;
+    }
+
+    auto it = shard.entries.find(key);
+    if (it != shard.entries.end())
+    {
+      if (dirty)
+      {
+        memcpy(it->second.data.get(), data, length);
+        it->second.length = length;
+        it->second.dirty = true;
+        shard.touch(key, it->second);
+      }
+      return;
+    }
+
+    shard.add(key, data, length, dirty, prefetched);
+  }
+
+  /// @brief Update part of a block, if it is in the cache.
+  ///
+  /// @param owner The disk the block belongs to.
+  ///
+  /// @param block The block number.
+  ///
+  /// @param data The new data.
+  ///
+  /// @param offset The offset within the block to begin copying to.
+  ///
+  /// @param length The number of bytes to copy.
+  ///
+  /// @param dirty Whether the new data has not yet been written to the disk.
+  ///
+  /// @return True if the block was in the cache and has been updated, false otherwise.
+  bool block_cache::update(virt_disk *owner,
+                           uint64_t block,
+                           const uint8_t *data,
+                           uint64_t offset,
+                           uint64_t length,
+                           bool dirty)
+  {
+    cache_key key{owner, block};
+    cache_shard &shard = shard_for(owner, block);
+    std::lock_guard<std::mutex> guard(shard.lock);
+
+    shard.generation++;
+
+    auto it = shard.entries.find(key);
+    if ((it == shard.entries.end()) || ((offset + length) > it->second.length))
+    {
+      return false;
+    }
+
+    memcpy(it->second.data.get() + offset, data, length);
+    if (dirty)
+    {
+      it->second.dirty = true;
+    }
+    shard.touch(key, it->second);
+
+    return true;
+  }
+
+  /// @brief Write dirty blocks in a range back to their disk, and optionally remove them from the cache.
+  ///
+  /// @param owner The disk the blocks belong to.
+  ///
+  /// @param first_block The first block in the range.
+  ///
+  /// @param last_block The last block in the range.
+  ///
+  /// @param invalidate Whether to remove the blocks from the cache, as well as writing them back.
+  void block_cache::flush_range(virt_disk *owner, uint64_t first_block, uint64_t last_block, bool invalidate)
+  {
+    uint64_t total_capacity = (config.capacity_bytes / config.block_size) + 1;
+
+    if ((last_block - first_block) < total_capacity)
+    {
+      // A small range - quicker to look up each block.
+      for (uint64_t block = first_block; block <= last_block; block++)
+      {
+        cache_key key{owner, block};
+        cache_shard &shard = shard_for(owner, block);
+        std::lock_guard<std::mutex> guard(shard.lock);
+
+        if (invalidate)
+        {
+          shard.generation++;
+        }
+
+        auto it = shard.entries.find(key);
+        if (it != shard.entries.end())
+        {
+          shard.write_back(key, it->second);
+          if (invalidate)
+          {
+            shard.remove(key);
+          }
+        }
+      }
+    }
+    else
+    {
+      for (uint32_t i = 0; i < config.shard_count; i++)
+      {
+        cache_shard &shard = shards[i];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        std::vector<cache_key> matches;
+
+        if (invalidate)
+        {
+          shard.generation++;
+        }
+
+        for (auto &entry : shard.entries)
+        {
+          if ((entry.first.owner == owner) && (entry.first.block >= first_block) && (entry.first.block <= last_block))
+          {
+            matches.push_back(entry.first);
+          }
+        }
+
+        for (const cache_key &key : matches)
+        {
+          shard.write_back(key, shard.entries.find(key)->second);
+          if (invalidate)
+          {
+            shard.remove(key);
+          }
+        }
+      }
+    }
+  }
+
+  /// @brief Write back and remove every block belonging to a disk, and forget any history of them.
+  ///
+  /// @param owner The disk that is leaving the cache.
+  void block_cache::release(virt_disk *owner)
+  {
+    flush_range(owner, 0, ~0ULL, true);
+
+    for (uint32_t i = 0; i < config.shard_count; i++)
+    {
+      cache_shard &shard = shards[i];
+      std::lock_guard<std::mutex> guard(shard.lock);
+
+      for (std::list<cache_key> *history : {&shard.arc_b1, &shard.arc_b2})
+      {
+        for (auto it = history->begin(); it != history->end();)
+        {
+          if (it->owner == owner)
+          {
+            shard.arc_ghosts.erase(*it);
+            it = history->erase(it);
+          }
+          else
+          {
+            it++;
+          }
+        }
+      }
+    }
+  }
+
+  /// @brief Find the shard responsible for a block.
+  ///
+  /// Neighbouring blocks are spread across shards so that sequential access from several threads does not contend.
+  ///
+  /// @param owner The disk the block belongs to.
+  ///
+  /// @param block The block number.
+  ///
+  /// @return The shard.
+  cache_shard &block_cache::shard_for(virt_disk *owner, uint64_t block)
+  {
+    return shards[cache_key_hash()({owner, block}) % config.shard_count];
+  }
+};
@@ -0,0 +1,299 @@
+/// @file
+/// @brief Implements the in-memory copy of a block table that is stored in a disk image.
+
+// Copyright Martin Hughes 2018.
+
+#include "virtualdisk/virt_disk_table.h"
+#include "virtualdisk/virt_disk_file.h"
+
+#include <algorithm>
+#include <boost/endian/conversion.hpp>
+
+namespace
+{
+  /// The most pages read from the file in one go when the whole table is loaded at once.
+  const uint64_t EAGER_READ_PAGES = 256;
+}
+
+namespace virt_disk
+{
+  /// @brief Create a block table, reading it from the file now or later depending on config.
+  ///
+  /// @param file The file the table is stored in. It must outlive this object.
+  ///
+  /// @param file_offset The offset of the table in the file.
+  ///
+  /// @param entry_count The number of 32-bit entries in the table.
+  ///
+  /// @param big_endian Whether the entries are stored big-endian (true) or little-endian (false).
+  ///
+  /// @param config Says whether to read the table now, and how many pages may be held at once.
+  block_table::block_table(disk_file *file,
+                           uint64_t file_offset,
+                           uint64_t entry_count,
+                           bool big_endian,
+                           const open_config &config) :
+    file{file},
+    file_offset{file_offset},
+    entry_count{entry_count},
+    big_endian{big_endian},
+    max_pages{(config.table_loading == table_load::ON_DEMAND) ? config.max_table_pages : 0},
+    page_count{(entry_count + table_page::ENTRIES - 1) / table_page::ENTRIES},
+    loaded_pages{0},
+    clock_hand{0}
+  {
+    pages = std::unique_ptr<std::atomic<table_page *>[]>(new std::atomic<table_page *>[page_count]);
+    for (uint64_t i = 0; i < page_count; i++)
+    {
+      pages[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    if (config.table_loading != table_load::ON_DEMAND)
+    {
+      try
+      {
+        table_page *new_pages[EAGER_READ_PAGES];
+        for (uint64_t first_page = 0; first_page < page_count; first_page += EAGER_READ_PAGES)
+        {
+          uint64_t read_count = std::min(EAGER_READ_PAGES, page_count - first_page);
+          read_pages(first_page, read_count, new_pages);
+          for (uint64_t i = 0; i < read_count; i++)
+          {
+            pages[first_page + i].store(new_pages[i], std::memory_order_relaxed);
+          }
+        }
+      }
+      catch (...)
+      {
+        for (uint64_t i = 0; i < page_count; i++)
+        {
+          delete pages[i].load(std::memory_order_relaxed);
+        }
+        throw;
+      }
+      loaded_pages = page_count;
+    }
+  }
+
+  block_table::~block_table()
+  {
+    for (uint64_t i = 0; i < page_count; i++)
+    {
+      delete pages[i].load(std::memory_order_relaxed);
+    }
+  }
+
+  /// @brief Get an entry from the table, reading its page from the file if needed.
+  ///
+  /// @param index The number of the entry.
+  ///
+  /// @return The entry, in native byte order.
+  uint32_t block_table::get(uint64_t index)
+  {
+    const uint64_t page_number = index / table_page::ENTRIES;
+    std::unique_lock<std::mutex> guard(page_locks[page_number % PAGE_LOCK_COUNT], std::defer_lock);
+
+    // With a page limit, pages can be evicted at any time unless the lock is held.
+    table_page *page = (max_pages == 0) ? pages[page_number].load(std::memory_order_acquire) : nullptr;
+    if (page == nullptr)
+    {
+      guard.lock();
+      page = load_page(page_number);
+    }
+
+    return page->entries[index % table_page::ENTRIES].load(std::memory_order_acquire);
+  }
+
+  /// @brief Change an entry in the table. The change is written to the file by write_changes().
+  ///
+  /// @param index The number of the entry.
+  ///
+  /// @param value The new value, in native byte order.
+  void block_table::set(uint64_t index, uint32_t value)
+  {
+    const uint64_t page_number = index / table_page::ENTRIES;
+    std::unique_lock<std::mutex> guard(page_locks[page_number % PAGE_LOCK_COUNT], std::defer_lock);
+
+    table_page *page = (max_pages == 0) ? pages[page_number].load(std::memory_order_acquire) : nullptr;
+    if (page == nullptr)
+    {
+      guard.lock();
+      page = load_page(page_number);
+    }
+
+    page->entries[index % table_page::ENTRIES].store(value, std::memory_order_release);
+    if (!page->dirty.exchange(true))
+    {
+      std::lock_guard<std::mutex> dirty_guard(dirty_lock);
+      dirty_pages.push_back(page_number);
+    }
+  }
+
+  /// @brief Are there any changes that write_changes() has not yet written?
+  ///
+  /// @return True if any entries have changed since they were last written.
+  bool block_table::has_changes()
+  {
+    std::lock_guard<std::mutex> dirty_guard(dirty_lock);
+    return !dirty_pages.empty();
+  }
+
+  /// @brief Write every page containing a changed entry to the file.
+  ///
+  /// The file is not flushed first. Callers whose entries refer to data they have just written must flush it before
+  /// calling this, or a crash could leave the table on disk referring to data that never reached it.
+  void block_table::write_changes()
+  {
+    std::vector<uint64_t> changed;
+    {
+      std::lock_guard<std::mutex> dirty_guard(dirty_lock);
+      changed.swap(dirty_pages);
+    }
+    std::sort(changed.begin(), changed.end());
+
+    uint32_t raw_entries[table_page::ENTRIES];
+    for (size_t i = 0; i < changed.size(); i++)
+    {
+      const uint64_t page_number = changed[i];
+      const uint64_t first_entry = page_number * table_page::ENTRIES;
+      const uint64_t count = std::min(static_cast<uint64_t>(table_page::ENTRIES), entry_count - first_entry);
+      table_page *page;
+
+      {
+        // The page is clean from here on, so a change made while it is being written marks it dirty again.
+        std::lock_guard<std::mutex> guard(page_locks[page_number % PAGE_LOCK_COUNT]);
+        page = pages[page_number].load(std::memory_order_acquire);
+        page->dirty.store(false);
+        for (uint64_t j = 0; j < count; j++)
+        {
+          uint32_t value = page->entries[j].load(std::memory_order_acquire);
+          raw_entries[j] = big_endian ? boost::endian::native_to_big(value) : boost::endian::native_to_little(value);
+        }
+      }
+
+      try
+      {
+        file->write_at(raw_entries, count * sizeof(uint32_t), file_offset + (first_entry * sizeof(uint32_t)));
+      }
+      catch (...)
+      {
+        // Leave this page, and the ones not yet written, to be written next time. Dirty pages are never evicted, so
+        // the pointers are still valid.
+        std::lock_guard<std::mutex> dirty_guard(dirty_lock);
+        for (size_t j = i; j < changed.size(); j++)
+        {
+          table_page *unwritten = pages[changed[j]].load(std::memory_order_acquire);
+          if ((unwritten != nullptr) && !unwritten->dirty.exchange(true))
+          {
+            dirty_pages.push_back(changed[j]);
+          }
+        }
+        throw;
+      }
+    }
+  }
+
+  /// @brief Get a page of the table, reading it from the file if it is not loaded.
+  ///
+  /// page_locks[page_number % PAGE_LOCK_COUNT] must be held.
+  ///
+  /// @param page_number The number of the page.
+  ///
+  /// @return The page.
+  table_page *block_table::load_page(uint64_t page_number)
+  {
+    table_page *page = pages[page_number].load(std::memory_order_acquire);
+    if (page == nullptr)
+    {
+      if ((max_pages != 0) && (loaded_pages >= max_pages))
+      {
+        evict_page(page_number % PAGE_LOCK_COUNT);
+      }
+
+      read_pages(page_number, 1, &page);
+      pages[page_number].store(page, std::memory_order_release);
+      loaded_pages++;
+    }
+
+    page->referenced.store(true, std::memory_order_relaxed);
+    return page;
+  }
+
+  /// @brief Read consecutive pages of the table from the file.
+  ///
+  /// @param first_page The number of the first page to read.
+  ///
+  /// @param count The number of pages to read.
+  ///
+  /// @param pages_out Receives a newly allocated page for each page read. The caller takes ownership.
+  void block_table::read_pages(uint64_t first_page, uint64_t count, table_page **pages_out)
+  {
+    const uint64_t first_entry = first_page * table_page::ENTRIES;
+    const uint64_t read_entries = std::min(count * table_page::ENTRIES, entry_count - first_entry);
+
+    std::vector<uint32_t> raw_entries(read_entries);
+    file->read_at(raw_entries.data(), read_entries * sizeof(uint32_t), file_offset + (first_entry * sizeof(uint32_t)));
+
+    for (uint64_t i = 0; i < count; i++)
+    {
+      table_page *page = new table_page;
+      for (uint64_t j = 0; j < table_page::ENTRIES; j++)
+      {
+        uint64_t entry = (i * table_page::ENTRIES) + j;
+        uint32_t value = 0;
+        if (entry < read_entries)
+        {
+          value = big_endian ? boost::endian::big_to_native(raw_entries[entry]) :
+                               boost::endian::little_to_native(raw_entries[entry]);
+        }
+        page->entries[j].store(value, std::memory_order_relaxed);
+      }
+      page->referenced.store(false, std::memory_order_relaxed);
+      page->dirty.store(false, std::memory_order_relaxed);
+
+      pages_out[i] = page;
+    }
+  }
+
+  /// @brief Evict one unchanged page, chosen by CLOCK, to make room for another.
+  ///
+  /// If every page is changed, or in use by another thread, nothing is evicted and the limit is briefly exceeded.
+  ///
+  /// @param held_lock The index of the page lock held by the caller.
+  void block_table::evict_page(uint32_t held_lock)
+  {
+    std::lock_guard<std::mutex> clock_guard(clock_lock);
+
+    // The first pass over the table clears the referenced flags, so the second is sure to find a page if there is one.
+    for (uint64_t i = 0; i < (page_count * 2); i++)
+    {
+      const uint64_t candidate = clock_hand;
+      clock_hand = (clock_hand + 1) % page_count;
+
+      table_page *page = pages[candidate].load(std::memory_order_acquire);
+      if ((page == nullptr) || page->dirty.load() || page->referenced.exchange(false))
+      {
+        continue;
+      }
+
+      // Locks are taken in page then clock order elsewhere, so only try for the candidate's lock here.
+      const uint32_t lock_idx = candidate % PAGE_LOCK_COUNT;
+      std::unique_lock<std::mutex> guard(page_locks[lock_idx], std::defer_lock);
+      if ((lock_idx != held_lock) && !guard.try_lock())
+      {
+        continue;
+      }
+
+      page = pages[candidate].load(std::memory_order_relaxed);
+      if ((page == nullptr) || page->dirty.load())
+      {
+        continue;
+      }
+
+      pages[candidate].store(nullptr, std::memory_order_relaxed);
+      loaded_pages--;
+      delete page;
+      return;
+    }
+  }
+};
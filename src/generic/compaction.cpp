@@ -0,0 +1,599 @@
+/// @file
+/// @brief Implements compaction of virtual disk images while they remain in use.
+
+// Copyright Martin Hughes 2018.
+
+#include "virtualdisk/virtualdisk.h"
+#include "virtualdisk/virt_disk_file.h"
+#include "virtualdisk/virt_disk_zero.h"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <thread>
+
+namespace
+{
+  /// The size of the pieces of a fixed image that are checked for zeroes, and released if they are.
+  const uint64_t PUNCH_GRANULE_BYTES = 64 * 1024;
+
+  /// The most times the blocks are laid out again, to pick up blocks allocated while the previous pass ran.
+  const uint32_t MAX_MOVE_PASSES = 2;
+
+  /// How long to wait before trying again when I/O in progress stops a step from starting.
+  const std::chrono::milliseconds STEP_RETRY_DELAY(10);
+
+  /// @brief Keeps the rate at which compaction reads and copies data below a limit.
+  ///
+  class compact_throttle
+  {
+  public:
+    /// @brief Start timing.
+    ///
+    /// @param max_bytes_per_second The limit, or zero for no limit.
+    compact_throttle(uint64_t max_bytes_per_second) :
+      max_bytes_per_second{max_bytes_per_second},
+      bytes_done{0},
+      start_time{std::chrono::steady_clock::now()}
+    {
+    }
+
+    /// @brief Count some data, and sleep for long enough to keep the average rate within the limit.
+    ///
+    /// @param bytes The number of bytes read or copied since the last call.
+    void account(uint64_t bytes)
+    {
+      if (max_bytes_per_second == 0)
+      {
+        return;
+      }
+
+      bytes_done += bytes;
+      auto due = start_time + std::chrono::microseconds((bytes_done * 1000000) / max_bytes_per_second);
+      std::this_thread::sleep_until(due);
+    }
+
+  protected:
+    /// The limit, or zero for no limit.
+    uint64_t max_bytes_per_second;
+
+    /// The number of bytes counted so far.
+    uint64_t bytes_done;
+
+    /// When timing started.
+    std::chrono::steady_clock::time_point start_time;
+  };
+
+  /// @brief Tell the caller how compaction is going.
+  ///
+  /// @param config The configuration passed to compact().
+  ///
+  /// @param done The amount of work done so far.
+  ///
+  /// @param total The total amount of work.
+  ///
+  /// @return False if the caller wants compaction to stop.
+  bool report_progress(const virt_disk::compact_config &config, uint64_t done, uint64_t total)
+  {
+    return !config.progress || config.progress(std::min(done, total), total);
+  }
+}
+
+namespace virt_disk
+{
+  /// @brief Reduce the space an image takes, and optionally lay its blocks out in order, while it stays in use.
+  ///
+  /// For dynamic images, blocks containing only zeroes are removed, and the remaining blocks are moved down to fill
+  /// the gaps - so the file can be shortened. If reorder_blocks is set, they are also put in the same order as on the
+  /// disk, which makes sequential reads of the disk sequential in the file too. For fixed images, which must store
+  /// every block, holes are punched in the file where it contains only zeroes, if the filesystem supports it.
+  ///
+  /// The work is done in small steps. During a step no other I/O takes place - new reads and writes wait for it to
+  /// end - but between steps the disk is used as normal. Each block is copied to its new place, then the metadata is
+  /// written and flushed, before the old copy is ever overwritten, so a crash part way through loses nothing.
+  ///
+  /// Requests submitted to an io_queue hold up steps until they are reaped, so they must not be left unreaped by
+  /// the thread calling this. Views returned by map_view() stay safe to read, since the file is not shortened while
+  /// any view of it exists - so the space after the last block is only given back once they are all gone. But a view
+  /// of a block that is moved or removed goes on showing the old copy, not the disk's current contents.
+  ///
+  /// @param config Controls what is done, and how fast.
+  ///
+  /// @return What was done.
+  compact_result virt_disk::compact(const compact_config &config)
+  {
+    std::lock_guard<std::mutex> compact_guard(compact_lock);
+
+    // Any cached changes must be in the image before its blocks are examined.
+    flush();
+
+    block_geometry geometry;
+    if (!get_block_geometry(geometry))
+    {
+      return punch_zero_ranges(config);
+    }
+
+    return move_blocks(config, geometry);
+  }
+
+  /// @brief Punch holes in the backing file wherever it holds only zeroes, for formats whose blocks cannot move.
+  ///
+  /// @param config Controls how fast this is done.
+  ///
+  /// @return What was done.
+  compact_result virt_disk::punch_zero_ranges(const compact_config &config)
+  {
+    compact_result result;
+    compact_throttle throttle(config.max_bytes_per_second);
+    disk_file *file = get_backing_file();
+    const uint64_t disk_length = get_length();
+    const uint64_t step_bytes = PUNCH_GRANULE_BYTES * std::max(1U, config.blocks_per_step);
+    const uint64_t total_granules = (disk_length + PUNCH_GRANULE_BYTES - 1) / PUNCH_GRANULE_BYTES;
+    std::unique_ptr<uint8_t[]> buffer(new uint8_t[PUNCH_GRANULE_BYTES]);
+
+    if (!config.reclaim_zero_blocks)
+    {
+      return result;
+    }
+
+    for (uint64_t step_start = 0; step_start < disk_length; step_start += step_bytes)
+    {
+      const uint64_t step_length = std::min(step_bytes, disk_length - step_start);
+      std::vector<disk_extent> extents;
+      std::vector<disk_extent> candidates;
+
+      // Look for zeroes first, without stopping other I/O...
+      map_range(step_start, step_length, false, extents);
+      for (const disk_extent &extent : extents)
+      {
+        if ((extent.file_offset == EXTENT_UNALLOCATED) || (extent.file != nullptr))
+        {
+          continue;
+        }
+
+        // Only whole granules of the file can be released.
+        uint64_t first = ((extent.file_offset + PUNCH_GRANULE_BYTES - 1) / PUNCH_GRANULE_BYTES) * PUNCH_GRANULE_BYTES;
+        uint64_t end = ((extent.file_offset + extent.length) / PUNCH_GRANULE_BYTES) * PUNCH_GRANULE_BYTES;
+        for (uint64_t offset = first; offset < end; offset += PUNCH_GRANULE_BYTES)
+        {
+          file->read_at(buffer.get(), PUNCH_GRANULE_BYTES, offset);
+          throttle.account(PUNCH_GRANULE_BYTES);
+          if (is_zero_buffer(buffer.get(), PUNCH_GRANULE_BYTES))
+          {
+            candidates.push_back({0, PUNCH_GRANULE_BYTES, offset, nullptr});
+          }
+        }
+      }
+
+      // ... then check again while nothing can write to them, and release them.
+      if (!candidates.empty())
+      {
+        while (!begin_block_moves())
+        {
+          std::this_thread::sleep_for(STEP_RETRY_DELAY);
+        }
+
+        try
+        {
+          for (const disk_extent &candidate : candidates)
+          {
+            file->read_at(buffer.get(), candidate.length, candidate.file_offset);
+            if (is_zero_buffer(buffer.get(), candidate.length) &&
+                file->punch_hole(candidate.file_offset, candidate.length))
+            {
+              result.bytes_released += candidate.length;
+            }
+          }
+        }
+        catch (...)
+        {
+          end_block_moves();
+          throw;
+        }
+
+        end_block_moves();
+      }
+
+      uint64_t granules_done = (step_start + step_length + PUNCH_GRANULE_BYTES - 1) / PUNCH_GRANULE_BYTES;
+      if (!report_progress(config, granules_done, total_granules))
+      {
+        break;
+      }
+    }
+
+    return result;
+  }
+
+  /// @brief Remove blocks containing only zeroes from a dynamic image, then move the rest to close up the gaps.
+  ///
+  /// Blocks are placed one after another from the start of the data area. Normally blocks already in place stay put and
+  /// the gaps are filled with blocks from the end of the file; if reorder_blocks is set, blocks are put in disk order.
+  /// A block in the way of another is first moved to free space past the end of the data area. Space freed by a move
+  /// is only reused once the metadata saying so has been written and flushed.
+  ///
+  /// @param config Controls what is done, and how fast.
+  ///
+  /// @param geometry The layout of the blocks in the backing file.
+  ///
+  /// @return What was done.
+  compact_result virt_disk::move_blocks(const compact_config &config, const block_geometry &geometry)
+  {
+    compact_result result;
+    compact_throttle throttle(config.max_bytes_per_second);
+    disk_file *file = get_backing_file();
+    const uint64_t disk_length = get_length();
+    const uint32_t blocks_per_step = std::max(1U, config.blocks_per_step);
+    const bool removing_zero_blocks = config.reclaim_zero_blocks && geometry.zero_blocks_removable;
+    const uint64_t total_work = removing_zero_blocks ? (geometry.block_count * 2) : geometry.block_count;
+    const uint64_t move_work_start = removing_zero_blocks ? geometry.block_count : 0;
+    uint64_t work_reported = 0;
+    const uint64_t start_length = file->get_length();
+    std::unique_ptr<uint8_t[]> buffer(new uint8_t[std::max(geometry.stored_block_bytes, geometry.block_size)]);
+    bool stopping = false;
+
+    // Report progress, never going backwards - a second pass over the blocks starts from the beginning again.
+    auto report = [&](uint64_t done)
+    {
+      work_reported = std::max(work_reported, done);
+      return report_progress(config, work_reported, total_work);
+    };
+
+    // Start a step, waiting for any I/O in progress to finish.
+    auto begin_step = [this]()
+    {
+      while (!begin_block_moves())
+      {
+        std::this_thread::sleep_for(STEP_RETRY_DELAY);
+      }
+    };
+
+    // Make everything done so far permanent, so the space it freed can be reused. This is done before each step ends,
+    // so new blocks never go in space that the metadata on disk still says is in use. The copied blocks are flushed
+    // before the metadata pointing at them is written, and the metadata is flushed before the old copies can be
+    // overwritten, so whatever a crash leaves in the file refers to complete blocks.
+    auto save_changes = [this, file]()
+    {
+      file->flush();
+      flush_metadata();
+      file->flush();
+    };
+
+    // Read a block as it appears on the disk, and check whether it is all zeroes.
+    auto block_is_zero = [&](uint64_t block_number, bool in_step)
+    {
+      uint64_t start_posn = block_number * geometry.block_size;
+      uint64_t length = std::min(geometry.block_size, disk_length - start_posn);
+      if (in_step)
+      {
+        std::vector<disk_extent> extents;
+        map_range(start_posn, length, false, extents);
+        read_extents(buffer.get(), start_posn, extents, 0);
+      }
+      else
+      {
+        read_uncached(buffer.get(), start_posn, length);
+      }
+      throttle.account(length);
+      return is_zero_buffer(buffer.get(), length);
+    };
+
+    if (removing_zero_blocks)
+    {
+      std::vector<uint64_t> candidates;
+
+      for (uint64_t block_number = 0; (block_number < geometry.block_count) && !stopping; block_number++)
+      {
+        if ((get_block_location(block_number) != EXTENT_UNALLOCATED) && block_is_zero(block_number, false))
+        {
+          candidates.push_back(block_number);
+        }
+
+        if ((candidates.size() < blocks_per_step) && ((block_number + 1) < geometry.block_count))
+        {
+          continue;
+        }
+
+        // The blocks may have been written since they were checked, so check again while nothing else can.
+        if (!candidates.empty())
+        {
+          begin_step();
+          try
+          {
+            for (uint64_t candidate : candidates)
+            {
+              if ((get_block_location(candidate) != EXTENT_UNALLOCATED) && block_is_zero(candidate, true))
+              {
+                set_block_location(candidate, EXTENT_UNALLOCATED);
+                result.blocks_removed++;
+              }
+            }
+
+            save_changes();
+          }
+          catch (...)
+          {
+            end_block_moves();
+            throw;
+          }
+          end_block_moves();
+          candidates.clear();
+        }
+
+        stopping = !report(block_number + 1);
+      }
+    }
+
+    for (uint32_t pass = 0; (pass < MAX_MOVE_PASSES) && !stopping; pass++)
+    {
+      const uint64_t block_bytes = geometry.stored_block_bytes;
+
+      // Where every block is now. Blocks below the data area are left alone. Space up to the end of the last block is
+      // either used by a block or free - new blocks go after it, unless the image has run out of room there and reuses
+      // free space, in which case this is done again.
+      std::map<uint64_t, uint64_t> by_location;
+      uint64_t known_end = geometry.data_start;
+      uint64_t reuse_seen = 0;
+      auto find_blocks = [&]()
+      {
+        reuse_seen = space_reused;
+        by_location.clear();
+        for (uint64_t block_number = 0; block_number < geometry.block_count; block_number++)
+        {
+          uint64_t location = get_block_location(block_number);
+          if ((location != EXTENT_UNALLOCATED) && (location >= geometry.data_start))
+          {
+            by_location[location] = block_number;
+            known_end = std::max(known_end, location + block_bytes);
+          }
+        }
+      };
+      find_blocks();
+
+      // The block to go in each slot of the data area. When not reordering, blocks already in a slot stay there and
+      // the rest fill the gaps, so as few blocks as possible are moved.
+      std::vector<uint64_t> order;
+      if (config.reorder_blocks)
+      {
+        for (uint64_t block_number = 0; block_number < geometry.block_count; block_number++)
+        {
+          uint64_t location = get_block_location(block_number);
+          if ((location != EXTENT_UNALLOCATED) && (location >= geometry.data_start))
+          {
+            order.push_back(block_number);
+          }
+        }
+      }
+      else
+      {
+        const uint64_t slot_count = by_location.size();
+        const uint64_t UNASSIGNED = ~0ULL;
+        std::vector<uint64_t> unplaced;
+        order.assign(slot_count, UNASSIGNED);
+
+        for (const auto &entry : by_location)
+        {
+          uint64_t offset = entry.first - geometry.data_start;
+          if (((offset % block_bytes) == 0) && ((offset / block_bytes) < slot_count))
+          {
+            order[offset / block_bytes] = entry.second;
+          }
+          else
+          {
+            unplaced.push_back(entry.second);
+          }
+        }
+
+        size_t next_unplaced = 0;
+        for (uint64_t &slot : order)
+        {
+          if (slot == UNASSIGNED)
+          {
+            slot = unplaced[next_unplaced++];
+          }
+        }
+      }
+
+      const uint64_t slots_end = geometry.data_start + (order.size() * block_bytes);
+      std::vector<uint64_t> appended;
+      uint64_t moves_this_pass = 0;
+      bool no_spare_space = false;
+      size_t next = 0;
+      uint64_t target = geometry.data_start;
+
+      while ((next < order.size()) && !stopping && !no_spare_space)
+      {
+        // Space freed during this step, which must not be written to until the step's changes have been saved.
+        std::vector<uint64_t> freed;
+
+        // Find something overlapping the block-sized space at location - either a block, or space freed this step.
+        // Returns the end of the first one found, or zero if the space is free.
+        auto find_overlap = [&](uint64_t location) -> uint64_t
+        {
+          auto it = by_location.lower_bound((location >= block_bytes) ? (location - block_bytes + 1) : 0);
+          if ((it != by_location.end()) && (it->first < (location + block_bytes)))
+          {
+            return it->first + block_bytes;
+          }
+
+          for (uint64_t freed_location : freed)
+          {
+            if ((location < (freed_location + block_bytes)) && (freed_location < (location + block_bytes)))
+            {
+              return freed_location + block_bytes;
+            }
+          }
+
+          return 0;
+        };
+
+        // Find the first free space for a block between two offsets, or EXTENT_UNALLOCATED if there is none.
+        auto find_free_between = [&](uint64_t location, uint64_t end) -> uint64_t
+        {
+          while ((location + block_bytes) <= end)
+          {
+            uint64_t overlap_end = find_overlap(location);
+            if (overlap_end == 0)
+            {
+              return location;
+            }
+            location = overlap_end;
+          }
+
+          return EXTENT_UNALLOCATED;
+        };
+
+        // Find space for a block that is in the way. Gaps past the slots being filled are used first, then space
+        // appended earlier in this pass, then the file is extended. If the image has no room for that either, a slot
+        // that is to be filled later is borrowed. Returns EXTENT_UNALLOCATED if there is no space at all.
+        auto find_spare_space = [&]()
+        {
+          uint64_t location = find_free_between(slots_end, known_end);
+          if (location != EXTENT_UNALLOCATED)
+          {
+            return location;
+          }
+
+          for (uint64_t spare : appended)
+          {
+            if (find_overlap(spare) == 0)
+            {
+              return spare;
+            }
+          }
+
+          location = append_block_space();
+          if (location != EXTENT_UNALLOCATED)
+          {
+            appended.push_back(location);
+            return location;
+          }
+
+          return find_free_between(target + block_bytes, slots_end);
+        };
+
+        auto move_block = [&](uint64_t block_number, uint64_t from, uint64_t to)
+        {
+          file->read_at(buffer.get(), block_bytes, from);
+          file->write_at(buffer.get(), block_bytes, to);
+          set_block_location(block_number, to);
+
+          by_location.erase(from);
+          by_location[to] = block_number;
+          freed.push_back(from);
+          throttle.account(block_bytes);
+          result.blocks_moved++;
+          moves_this_pass++;
+        };
+
+        begin_step();
+        try
+        {
+          if (space_reused != reuse_seen)
+          {
+            find_blocks();
+          }
+
+          uint32_t moves = 0;
+          while ((next < order.size()) && (moves < blocks_per_step))
+          {
+            const uint64_t block_number = order[next];
+            const uint64_t location = get_block_location(block_number);
+
+            if (location == target)
+            {
+              next++;
+              target += block_bytes;
+              continue;
+            }
+
+            // Anything in the way is moved elsewhere first, and this block follows once that has been saved.
+            std::vector<std::pair<uint64_t, uint64_t>> in_way;
+            for (auto it = by_location.lower_bound((target >= block_bytes) ? (target - block_bytes + 1) : 0);
+                 (it != by_location.end()) && (it->first < (target + block_bytes));
+                 it++)
+            {
+              in_way.push_back(*it);
+            }
+
+            if (!in_way.empty())
+            {
+              for (const auto &entry : in_way)
+              {
+                uint64_t spare = find_spare_space();
+                if (spare == EXTENT_UNALLOCATED)
+                {
+                  // Nowhere to put it, so the blocks stay where they are from here on.
+                  no_spare_space = true;
+                  break;
+                }
+                move_block(entry.second, entry.first, spare);
+                moves++;
+              }
+              break;
+            }
+
+            if (find_overlap(target) != 0)
+            {
+              break;
+            }
+
+            move_block(block_number, location, target);
+            moves++;
+            next++;
+            target += block_bytes;
+          }
+
+          save_changes();
+        }
+        catch (...)
+        {
+          end_block_moves();
+          throw;
+        }
+        end_block_moves();
+
+        stopping = !report(move_work_start + next);
+      }
+
+      // Release the space after the last block. Blocks allocated during this pass may still be beyond it.
+      begin_step();
+      try
+      {
+        uint64_t data_end = std::max(target, geometry.data_start);
+        for (uint64_t block_number = 0; block_number < geometry.block_count; block_number++)
+        {
+          uint64_t location = get_block_location(block_number);
+          if (location != EXTENT_UNALLOCATED)
+          {
+            data_end = std::max(data_end, location + geometry.stored_block_bytes);
+          }
+        }
+
+        // Shortening the file under a view would make reading it fault, so the space is kept until compact() is next called.
+        if (!file->has_mappings())
+        {
+          truncate_block_space(data_end);
+        }
+      }
+      catch (...)
+      {
+        end_block_moves();
+        throw;
+      }
+      end_block_moves();
+
+      if (moves_this_pass == 0)
+      {
+        break;
+      }
+    }
+
+    const uint64_t end_length = file->get_length();
+    if (end_length < start_length)
+    {
+      result.bytes_released = start_length - end_length;
+    }
+
+    return result;
+  }
+};
@@ -0,0 +1,257 @@
+/// @file
+/// @brief Implements a copy-on-write overlay that records changes to another virtual disk.
+
+// Copyright Martin Hughes 2018.
+
+#include "virtualdisk/virt_disk_cow.h"
+#include "virtualdisk/virt_disk_file.h"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace
+{
+  /// The value of a slot table entry for a block that has not been copied to the overlay.
+  const uint32_t COW_SLOT_UNALLOCATED = 0xFFFFFFFF;
+}
+
+namespace virt_disk
+{
+  /// @brief Create a clone of a disk.
+  ///
+  /// @param base_disk The disk to clone. It may be shared with other clones, and is kept open while this one exists.
+  ///
+  /// @param config The block size, and where to keep the changed blocks.
+  cow_disk::cow_disk(std::shared_ptr<virt_disk> base_disk, const cow_config &config) :
+    base{std::move(base_disk)},
+    overlay_path{config.overlay_file},
+    block_size{config.block_size},
+    next_slot{0}
+  {
+    if (!base)
+    {
+      throw std::fstream::failure("No base disk");
+    }
+
+    if ((block_size == 0) || ((block_size % 512) != 0))
+    {
+      throw std::fstream::failure("Invalid block size");
+    }
+
+    disk_length = base->get_length();
+    block_count = (disk_length + block_size - 1) / block_size;
+    if (block_count >= COW_SLOT_UNALLOCATED)
+    {
+      throw std::fstream::failure("Too many blocks");
+    }
+
+    page_count = (block_count + SLOTS_PER_PAGE - 1) / SLOTS_PER_PAGE;
+    slot_pages = std::unique_ptr<std::atomic<slot_page *>[]>(new std::atomic<slot_page *>[page_count]);
+    for (uint64_t i = 0; i < page_count; i++)
+    {
+      slot_pages[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    if (overlay_path.empty())
+    {
+      overlay = std::unique_ptr<disk_file>(new memory_disk_file(block_size));
+    }
+    else
+    {
+      overlay = disk_file::create(overlay_path);
+    }
+  }
+
+  /// @brief Destroys the clone, discarding its changes and deleting any overlay file.
+  ///
+  cow_disk::~cow_disk()
+  {
+    release_cache();
+
+    for (uint64_t i = 0; i < page_count; i++)
+    {
+      delete slot_pages[i].load(std::memory_order_relaxed);
+    }
+
+    overlay.reset();
+    if (!overlay_path.empty())
+    {
+      std::remove(overlay_path.c_str());
+    }
+  }
+
+  void cow_disk::read(void *buffer, uint64_t start_posn, uint64_t length, uint64_t buffer_length)
+  {
+    if (length > buffer_length)
+    {
+      length = buffer_length;
+    }
+
+    read_range(reinterpret_cast<uint8_t *>(buffer), start_posn, length);
+  }
+
+  void cow_disk::write(const void *buffer, uint64_t start_posn, uint64_t length, uint64_t buffer_length)
+  {
+    if (length > buffer_length)
+    {
+      length = buffer_length;
+    }
+
+    write_range(reinterpret_cast<const uint8_t *>(buffer), start_posn, length);
+  }
+
+  uint64_t cow_disk::get_length()
+  {
+    return disk_length;
+  }
+
+  /// @brief Find where a range of the disk is stored - in the overlay if it has been written, otherwise wherever the
+  /// base disk stores it.
+  ///
+  /// @param start_posn The number of bytes into the virtual disk that the range begins.
+  ///
+  /// @param length The length of the range, in bytes.
+  ///
+  /// @param allocate If true, blocks not yet in the overlay are copied there, so that the range can be written.
+  ///
+  /// @param extents Extents covering the whole range, in order, are appended to this vector.
+  void cow_disk::map_range(uint64_t start_posn, uint64_t length, bool allocate, std::vector<disk_extent> &extents)
+  {
+    if ((start_posn > disk_length) || (length > (disk_length - start_posn)))
+    {
+      throw std::fstream::failure("Too long");
+    }
+
+    std::vector<disk_extent> base_extents;
+
+    while (length > 0)
+    {
+      const uint64_t block_number = start_posn / block_size;
+      const uint64_t offset_in_block = start_posn % block_size;
+      const uint64_t bytes_this_block = std::min(block_size - offset_in_block, length);
+
+      uint32_t slot = get_slot(block_number);
+      if ((slot == COW_SLOT_UNALLOCATED) && allocate)
+      {
+        slot = get_or_copy_block(block_number);
+      }
+
+      if (slot != COW_SLOT_UNALLOCATED)
+      {
+        const uint64_t file_offset = (static_cast<uint64_t>(slot) * block_size) + offset_in_block;
+        append_extent(extents, start_posn, bytes_this_block, file_offset);
+      }
+      else
+      {
+        // Pieces the base stores in its own file are reported with that file, since it is not this disk's.
+        base_extents.clear();
+        base->map_range(start_posn, bytes_this_block, false, base_extents);
+        for (const disk_extent &piece : base_extents)
+        {
+          disk_file *file = nullptr;
+          if (piece.file_offset != EXTENT_UNALLOCATED)
+          {
+            file = (piece.file != nullptr) ? piece.file : base->get_backing_file();
+          }
+          append_extent(extents, piece.start_posn, piece.length, piece.file_offset, file);
+        }
+      }
+
+      start_posn += bytes_this_block;
+      length -= bytes_this_block;
+    }
+  }
+
+  disk_file *cow_disk::get_backing_file()
+  {
+    return overlay.get();
+  }
+
+  /// @brief Find which slot of the overlay a block is stored in.
+  ///
+  /// @param block_number The number of the block.
+  ///
+  /// @return The slot, or COW_SLOT_UNALLOCATED if the block has not been written.
+  uint32_t cow_disk::get_slot(uint64_t block_number)
+  {
+    slot_page *page = slot_pages[block_number / SLOTS_PER_PAGE].load(std::memory_order_acquire);
+    if (page == nullptr)
+    {
+      return COW_SLOT_UNALLOCATED;
+    }
+
+    return page->slots[block_number % SLOTS_PER_PAGE].load(std::memory_order_acquire);
+  }
+
+  /// @brief Find the slot of a block, first copying it from the base into a new slot at the end of the overlay if
+  /// needed.
+  ///
+  /// Only once the copy is complete does the block's entry become visible to readers, so until then they still read
+  /// it from the base. The block is copied even if it is about to be overwritten completely: the write is made after
+  /// the entry is visible, so without the copy a reader could see neither the base nor the new data, and a write that
+  /// failed would leave the block holding neither for good. If the copy fails, nothing is published, and the slot is
+  /// given back unless a later one has already been taken.
+  ///
+  /// @param block_number The number of the block.
+  ///
+  /// @return The slot holding the block.
+  uint32_t cow_disk::get_or_copy_block(uint64_t block_number)
+  {
+    std::lock_guard<std::mutex> block_guard(allocation_locks[block_number % ALLOCATION_LOCK_COUNT]);
+
+    // Another thread may have copied this block while we waited for the lock.
+    uint32_t slot = get_slot(block_number);
+    if (slot != COW_SLOT_UNALLOCATED)
+    {
+      return slot;
+    }
+
+    io_stats_recorder *recorder = stats();
+    const uint64_t start_ns = (recorder != nullptr) ? io_stats_recorder::now() : 0;
+
+    slot = next_slot.fetch_add(1);
+    const uint64_t block_start = block_number * block_size;
+    const uint64_t block_bytes = std::min(block_size, disk_length - block_start);
+
+    try
+    {
+      std::unique_ptr<uint8_t[]> contents(new uint8_t[block_bytes]);
+      base->read(contents.get(), block_start, block_bytes, block_bytes);
+      overlay->write_at(contents.get(), block_bytes, static_cast<uint64_t>(slot) * block_size);
+    }
+    catch (...)
+    {
+      // The slot can only be given back if no other block has taken a later one. Otherwise it is left unused.
+      uint32_t expected = slot + 1;
+      next_slot.compare_exchange_strong(expected, slot);
+      throw;
+    }
+
+    std::atomic<slot_page *> &page_ptr = slot_pages[block_number / SLOTS_PER_PAGE];
+    slot_page *page = page_ptr.load(std::memory_order_acquire);
+    if (page == nullptr)
+    {
+      std::unique_ptr<slot_page> new_page(new slot_page);
+      for (std::atomic<uint32_t> &entry : new_page->slots)
+      {
+        entry.store(COW_SLOT_UNALLOCATED, std::memory_order_relaxed);
+      }
+
+      // Blocks sharing the page may be being copied by other threads, under other locks.
+      if (page_ptr.compare_exchange_strong(page, new_page.get(), std::memory_order_acq_rel))
+      {
+        page = new_page.release();
+      }
+    }
+
+    page->slots[block_number % SLOTS_PER_PAGE].store(slot, std::memory_order_release);
+
+    if (recorder != nullptr)
+    {
+      recorder->add(stat_counter::BLOCKS_ALLOCATED, 1);
+      recorder->add_latency(stat_latency::ALLOCATE, start_ns);
+    }
+
+    return slot;
+  }
+};
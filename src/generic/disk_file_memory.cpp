@@ -0,0 +1,208 @@
+/// @file
+/// @brief Implements a backing file held in memory.
+
+// Copyright Martin Hughes 2018.
+
+#include "virtualdisk/virt_disk_file.h"
+
+#include <algorithm>
+#include <string.h>
+
+namespace virt_disk
+{
+  /// @brief Create an empty file in memory.
+  ///
+  /// @param chunk_size The size of the pieces the file's memory is allocated in, in bytes.
+  memory_disk_file::memory_disk_file(uint64_t chunk_size) : chunk_bytes{chunk_size}, file_length{0}
+  {
+    if (chunk_bytes == 0)
+    {
+      throw std::fstream::failure("Invalid chunk size");
+    }
+  }
+
+  void memory_disk_file::read_at(void *buffer, uint64_t length, uint64_t offset)
+  {
+    uint8_t *buffer_uint = reinterpret_cast<uint8_t *>(buffer);
+    std::shared_lock<std::shared_mutex> guard(chunks_lock);
+
+    if ((offset > file_length) || (length > (file_length - offset)))
+    {
+      throw std::fstream::failure("Unexpected end of backing file");
+    }
+
+    while (length > 0)
+    {
+      const uint64_t chunk = offset / chunk_bytes;
+      const uint64_t offset_in_chunk = offset % chunk_bytes;
+      const uint64_t bytes_this_chunk = std::min(chunk_bytes - offset_in_chunk, length);
+
+      if ((chunk < chunks.size()) && chunks[chunk])
+      {
+        memcpy(buffer_uint, chunks[chunk].get() + offset_in_chunk, bytes_this_chunk);
+      }
+      else
+      {
+        memset(buffer_uint, 0, bytes_this_chunk);
+      }
+
+      buffer_uint += bytes_this_chunk;
+      offset += bytes_this_chunk;
+      length -= bytes_this_chunk;
+    }
+  }
+
+  /// @brief Write to the file, allocating any chunks the write covers that do not exist yet.
+  ///
+  /// Writes that fit in existing chunks only share the lock. The lock is only taken exclusively to add chunks or
+  /// extend the file.
+  ///
+  /// @param buffer The buffer to write. Must be at least length bytes long.
+  ///
+  /// @param length The number of bytes to write.
+  ///
+  /// @param offset The offset within the file to begin writing at. The file is extended if needed.
+  void memory_disk_file::write_at(const void *buffer, uint64_t length, uint64_t offset)
+  {
+    if (length == 0)
+    {
+      return;
+    }
+
+    const uint8_t *buffer_uint = reinterpret_cast<const uint8_t *>(buffer);
+    const uint64_t first_chunk = offset / chunk_bytes;
+    const uint64_t end_chunk = ((offset + length - 1) / chunk_bytes) + 1;
+
+    std::shared_lock<std::shared_mutex> shared_guard(chunks_lock);
+    std::unique_lock<std::shared_mutex> exclusive_guard(chunks_lock, std::defer_lock);
+
+    bool ready = ((offset + length) <= file_length) && (end_chunk <= chunks.size());
+    for (uint64_t chunk = first_chunk; (chunk < end_chunk) && ready; chunk++)
+    {
+      ready = (chunks[chunk] != nullptr);
+    }
+
+    if (!ready)
+    {
+      shared_guard.unlock();
+      exclusive_guard.lock();
+
+      if (chunks.size() < end_chunk)
+      {
+        chunks.resize(end_chunk);
+      }
+      for (uint64_t chunk = first_chunk; chunk < end_chunk; chunk++)
+      {
+        if (!chunks[chunk])
+        {
+          chunks[chunk] = std::unique_ptr<uint8_t[]>(new uint8_t[chunk_bytes]());
+        }
+      }
+      file_length = std::max(file_length, offset + length);
+    }
+
+    while (length > 0)
+    {
+      const uint64_t offset_in_chunk = offset % chunk_bytes;
+      const uint64_t bytes_this_chunk = std::min(chunk_bytes - offset_in_chunk, length);
+
+      memcpy(chunks[offset / chunk_bytes].get() + offset_in_chunk, buffer_uint, bytes_this_chunk);
+
+      buffer_uint += bytes_this_chunk;
+      offset += bytes_this_chunk;
+      length -= bytes_this_chunk;
+    }
+  }
+
+  void memory_disk_file::readv_at(const io_segment *segments, uint32_t count, uint64_t offset)
+  {
+    for (uint32_t i = 0; i < count; i++)
+    {
+      read_at(segments[i].buffer, segments[i].length, offset);
+      offset += segments[i].length;
+    }
+  }
+
+  void memory_disk_file::writev_at(const io_segment *segments, uint32_t count, uint64_t offset)
+  {
+    for (uint32_t i = 0; i < count; i++)
+    {
+      write_at(segments[i].buffer, segments[i].length, offset);
+      offset += segments[i].length;
+    }
+  }
+
+  uint64_t memory_disk_file::get_length()
+  {
+    std::shared_lock<std::shared_mutex> guard(chunks_lock);
+    return file_length;
+  }
+
+  void memory_disk_file::set_length(uint64_t new_length)
+  {
+    std::unique_lock<std::shared_mutex> guard(chunks_lock);
+
+    // Anything beyond the new end must read as zeroes if the file is extended again.
+    if (new_length < file_length)
+    {
+      clear_range(new_length, file_length);
+      chunks.resize(std::min(static_cast<uint64_t>(chunks.size()), (new_length + chunk_bytes - 1) / chunk_bytes));
+    }
+
+    file_length = new_length;
+  }
+
+  void memory_disk_file::flush()
+  {
+  }
+
+  /// @brief Release the memory behind part of the file. It reads as zeroes afterwards.
+  ///
+  /// @param offset The offset within the file of the first byte to release.
+  ///
+  /// @param length The number of bytes to release.
+  ///
+  /// @return Always true.
+  bool memory_disk_file::punch_hole(uint64_t offset, uint64_t length)
+  {
+    std::unique_lock<std::shared_mutex> guard(chunks_lock);
+    if (offset < file_length)
+    {
+      clear_range(offset, std::min(file_length, offset + length));
+    }
+
+    return true;
+  }
+
+  /// @brief Make part of the file read as zeroes, freeing the chunks it covers completely. chunks_lock must be held
+  /// exclusively.
+  ///
+  /// @param start_offset The offset within the file of the first byte to clear.
+  ///
+  /// @param end_offset The offset within the file just after the last byte to clear.
+  void memory_disk_file::clear_range(uint64_t start_offset, uint64_t end_offset)
+  {
+    while (start_offset < end_offset)
+    {
+      const uint64_t chunk = start_offset / chunk_bytes;
+      const uint64_t offset_in_chunk = start_offset % chunk_bytes;
+      const uint64_t bytes_this_chunk = std::min(chunk_bytes - offset_in_chunk, end_offset - start_offset);
+
+      if (chunk >= chunks.size())
+      {
+        return;
+      }
+
+      if (bytes_this_chunk == chunk_bytes)
+      {
+        chunks[chunk].reset();
+      }
+      else if (chunks[chunk])
+      {
+        memset(chunks[chunk].get() + offset_in_chunk, 0, bytes_this_chunk);
+      }
+
+      start_offset += bytes_this_chunk;
+    }
+  }
+};
@@ -0,0 +1,797 @@
+/// @file
+/// @brief Implements a backing file using POSIX positional I/O.
+
+// Copyright Martin Hughes 2018.
+
+#ifndef _WIN32
+
+#include "virtualdisk/virt_disk_file.h"
+
+#include <algorithm>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace
+{
+  /// The largest number of segments passed to a single preadv / pwritev call.
+  const uint32_t MAX_SEGMENTS_PER_CALL = IOV_MAX;
+
+  /// The size of each buffer in the direct I/O bounce buffer pool. Larger unaligned requests are split into pieces.
+  const uint64_t BOUNCE_BUFFER_BYTES = 1024 * 1024;
+
+  /// The alignment of the bounce buffers. Filesystems needing more than this are not used for direct I/O.
+  const uint32_t BOUNCE_BUFFER_ALIGNMENT = 4096;
+
+  /// The most unused bounce buffers kept for reuse.
+  const uint32_t MAX_POOLED_BUFFERS = 16;
+
+  /// The alignment assumed for direct I/O if the filesystem cannot report the one it needs.
+  const uint32_t DEFAULT_DIRECT_ALIGNMENT = 4096;
+
+  /// @brief A pool of aligned buffers for carrying out unaligned requests on files opened for direct I/O.
+  ///
+  /// A single pool is shared by all files, so that the memory it holds is bounded however many images are open.
+  class aligned_buffer_pool
+  {
+  public:
+    /// @brief Returns a buffer to the pool when it is no longer needed.
+    ///
+    struct buffer_return
+    {
+      void operator()(uint8_t *buffer) const { aligned_buffer_pool::instance().release(buffer); }
+    };
+
+    /// A buffer of BOUNCE_BUFFER_BYTES bytes, aligned to BOUNCE_BUFFER_ALIGNMENT.
+    typedef std::unique_ptr<uint8_t, buffer_return> buffer_ptr;
+
+    /// @brief Get the pool.
+    ///
+    /// @return The pool shared by all files.
+    static aligned_buffer_pool &instance()
+    {
+      static aligned_buffer_pool pool;
+      return pool;
+    }
+
+    ~aligned_buffer_pool()
+    {
+      for (uint8_t *buffer : free_buffers)
+      {
+        free(buffer);
+      }
+    }
+
+    /// @brief Take a buffer from the pool, allocating a new one if none are free.
+    ///
+    /// @return The buffer, which goes back to the pool when it is destroyed.
+    buffer_ptr acquire()
+    {
+      {
+        std::lock_guard<std::mutex> guard(pool_lock);
+        if (!free_buffers.empty())
+        {
+          uint8_t *buffer = free_buffers.back();
+          free_buffers.pop_back();
+          return buffer_ptr(buffer);
+        }
+      }
+
+      void *buffer = nullptr;
+      if (posix_memalign(&buffer, BOUNCE_BUFFER_ALIGNMENT, BOUNCE_BUFFER_BYTES) != 0)
+      {
+        throw std::bad_alloc();
+      }
+      return buffer_ptr(reinterpret_cast<uint8_t *>(buffer));
+    }
+
+  protected:
+    /// @brief Put a buffer back in the pool, or free it if the pool is already full.
+    ///
+    /// @param buffer The buffer, from acquire().
+    void release(uint8_t *buffer)
+    {
+      {
+        std::lock_guard<std::mutex> guard(pool_lock);
+        if (free_buffers.size() < MAX_POOLED_BUFFERS)
+        {
+          free_buffers.push_back(buffer);
+          return;
+        }
+      }
+
+      free(buffer);
+    }
+
+    /// Protects free_buffers.
+    std::mutex pool_lock;
+
+    /// Buffers waiting to be reused.
+    std::vector<uint8_t *> free_buffers;
+  };
+
+  /// @brief Find the alignment a file opened with O_DIRECT needs for its buffers, offsets and lengths.
+  ///
+  /// @param fd The open file.
+  ///
+  /// @return The alignment, in bytes, or zero if direct I/O cannot be used on this file.
+  uint32_t query_direct_alignment(int fd)
+  {
+#if defined(__linux__) && defined(STATX_DIOALIGN)
+    struct statx info;
+    if ((statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &info) == 0) && ((info.stx_mask & STATX_DIOALIGN) != 0))
+    {
+      uint32_t alignment = std::max(info.stx_dio_offset_align, info.stx_dio_mem_align);
+      return (alignment <= BOUNCE_BUFFER_ALIGNMENT) ? alignment : 0;
+    }
+#endif
+
+    return DEFAULT_DIRECT_ALIGNMENT;
+  }
+
+  /// @brief Read as much of a range of a file as exists.
+  ///
+  /// @param fd The file descriptor to read from.
+  ///
+  /// @param buffer The buffer to read in to.
+  ///
+  /// @param length The number of bytes to read.
+  ///
+  /// @param offset The file offset to begin at.
+  ///
+  /// @return The number of bytes read, which is less than length only if the file ends first.
+  uint64_t read_until_end(int fd, uint8_t *buffer, uint64_t length, uint64_t offset)
+  {
+    uint64_t done = 0;
+    while (done < length)
+    {
+      ssize_t result = pread(fd, buffer + done, length - done, offset + done);
+      if (result < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+        throw std::fstream::failure("Backing file read failed");
+      }
+      if (result == 0)
+      {
+        break;
+      }
+
+      done += result;
+    }
+
+    return done;
+  }
+
+  /// @brief Write the whole of a buffer to a file, restarting after short writes and interruptions.
+  ///
+  /// @param fd The file descriptor to write to.
+  ///
+  /// @param buffer The buffer to write.
+  ///
+  /// @param length The number of bytes to write.
+  ///
+  /// @param offset The file offset to begin at.
+  void write_fully(int fd, const uint8_t *buffer, uint64_t length, uint64_t offset)
+  {
+    while (length > 0)
+    {
+      ssize_t result = pwrite(fd, buffer, length, offset);
+      if (result < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+        throw std::fstream::failure("Backing file write failed");
+      }
+
+      buffer += result;
+      offset += result;
+      length -= result;
+    }
+  }
+
+  /// @brief Carry out a vectored transfer, restarting after short transfers and interruptions.
+  ///
+  /// @param fd The file descriptor to transfer on.
+  ///
+  /// @param segments The buffers to transfer.
+  ///
+  /// @param count The number of entries in segments.
+  ///
+  /// @param offset The file offset to begin at.
+  ///
+  /// @param is_write Whether to call pwritev (true) or preadv (false).
+  void transfer_vector(int fd, const virt_disk::io_segment *segments, uint32_t count, uint64_t offset, bool is_write)
+  {
+    std::vector<iovec> vecs;
+    vecs.reserve(count);
+    for (uint32_t i = 0; i < count; i++)
+    {
+      if (segments[i].length != 0)
+      {
+        vecs.push_back({segments[i].buffer, static_cast<size_t>(segments[i].length)});
+      }
+    }
+
+    size_t first = 0;
+    while (first < vecs.size())
+    {
+      int this_count = static_cast<int>(std::min<size_t>(vecs.size() - first, MAX_SEGMENTS_PER_CALL));
+      ssize_t result = is_write ? pwritev(fd, &vecs[first], this_count, offset) :
+                                  preadv(fd, &vecs[first], this_count, offset);
+      if (result < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+        throw std::fstream::failure(is_write ? "Backing file write failed" : "Backing file read failed");
+      }
+      if ((result == 0) && !is_write)
+      {
+        throw std::fstream::failure("Unexpected end of backing file");
+      }
+
+      offset += result;
+
+      // Skip over the segments that are now complete, and trim the one that was partially transferred.
+      size_t done = static_cast<size_t>(result);
+      while ((first < vecs.size()) && (done >= vecs[first].iov_len))
+      {
+        done -= vecs[first].iov_len;
+        first++;
+      }
+      if (done != 0)
+      {
+        vecs[first].iov_base = reinterpret_cast<uint8_t *>(vecs[first].iov_base) + done;
+        vecs[first].iov_len -= done;
+      }
+    }
+  }
+}
+
+namespace virt_disk
+{
+  /// @brief Open the default backing file implementation for this platform.
+  ///
+  /// @param filename The file to open.
+  ///
+  /// @param direct_io Whether to bypass the page cache, if the filesystem allows it.
+  ///
+  /// @param read_only Whether to open the file for reading only. Writes to it, and changes to its length, then fail.
+  ///
+  /// @return A disk_file for the given file.
+  std::unique_ptr<disk_file> disk_file::open(const std::string &filename, bool direct_io, bool read_only)
+  {
+    return std::unique_ptr<disk_file>(new posix_disk_file(filename, false, direct_io, read_only));
+  }
+
+  /// @brief Create a new, empty, file using the default backing file implementation for this platform.
+  ///
+  /// @param filename The file to create. It must not already exist.
+  ///
+  /// @return A disk_file for the new file.
+  std::unique_ptr<disk_file> disk_file::create(const std::string &filename)
+  {
+    return std::unique_ptr<disk_file>(new posix_disk_file(filename, true));
+  }
+
+  /// @brief Open a file for positional reading and writing.
+  ///
+  /// @param filename The file to open.
+  ///
+  /// @param create_new If true, create the file. It is an error for it to exist already.
+  ///
+  /// @param direct_io If true, bypass the page cache. If the filesystem does not support this, the file is opened
+  ///                  normally.
+  ///
+  /// @param read_only If true, open the file for reading only. It cannot be combined with create_new.
+  posix_disk_file::posix_disk_file(const std::string &filename, bool create_new, bool direct_io, bool read_only) :
+    fd{-1},
+    direct_alignment{0},
+    mapping_length{0}
+  {
+    int flags = (read_only ? O_RDONLY : O_RDWR) | O_CLOEXEC;
+    if (create_new)
+    {
+      flags |= O_CREAT | O_EXCL;
+    }
+
+#ifdef O_DIRECT
+    if (direct_io)
+    {
+      fd = ::open(filename.c_str(), flags | O_DIRECT, 0644);
+      if (fd >= 0)
+      {
+        direct_alignment = query_direct_alignment(fd);
+        if (direct_alignment != 0)
+        {
+          return;
+        }
+
+        // Direct I/O can't be used on this file after all. It exists now, so it is simply opened again normally.
+        close(fd);
+        flags &= ~(O_CREAT | O_EXCL);
+      }
+    }
+#endif
+
+    fd = ::open(filename.c_str(), flags, 0644);
+    if (fd < 0)
+    {
+      throw std::fstream::failure("Failed to open backing file");
+    }
+
+#ifdef F_NOCACHE
+    if (direct_io)
+    {
+      fcntl(fd, F_NOCACHE, 1);
+    }
+#endif
+  }
+
+  posix_disk_file::~posix_disk_file()
+  {
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+  }
+
+  void posix_disk_file::read_at(void *buffer, uint64_t length, uint64_t offset)
+  {
+    uint8_t *buffer_uint = reinterpret_cast<uint8_t *>(buffer);
+
+    if ((direct_alignment != 0) && !is_aligned(buffer, length, offset))
+    {
+      bounced_read(buffer_uint, length, offset);
+      return;
+    }
+
+    while (length > 0)
+    {
+      ssize_t result = pread(fd, buffer_uint, length, offset);
+      if (result < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+        throw std::fstream::failure("Backing file read failed");
+      }
+      if (result == 0)
+      {
+        throw std::fstream::failure("Unexpected end of backing file");
+      }
+
+      buffer_uint += result;
+      offset += result;
+      length -= result;
+    }
+  }
+
+  void posix_disk_file::write_at(const void *buffer, uint64_t length, uint64_t offset)
+  {
+    const uint8_t *buffer_uint = reinterpret_cast<const uint8_t *>(buffer);
+
+    if (direct_alignment == 0)
+    {
+      write_fully(fd, buffer_uint, length, offset);
+    }
+    else if (!is_aligned(buffer, length, offset))
+    {
+      bounced_write(buffer_uint, length, offset);
+    }
+    else
+    {
+      std::shared_lock<std::shared_mutex> length_guard(length_lock);
+      write_fully(fd, buffer_uint, length, offset);
+    }
+  }
+
+  void posix_disk_file::readv_at(const io_segment *segments, uint32_t count, uint64_t offset)
+  {
+    if (direct_alignment != 0)
+    {
+      uint64_t segment_offset = offset;
+      for (uint32_t i = 0; i < count; i++)
+      {
+        if (!is_aligned(segments[i].buffer, segments[i].length, segment_offset))
+        {
+          // Some segments need bouncing, so read each on its own.
+          for (uint32_t j = 0; j < count; j++)
+          {
+            read_at(segments[j].buffer, segments[j].length, offset);
+            offset += segments[j].length;
+          }
+          return;
+        }
+        segment_offset += segments[i].length;
+      }
+    }
+
+    transfer_vector(fd, segments, count, offset, false);
+  }
+
+  void posix_disk_file::writev_at(const io_segment *segments, uint32_t count, uint64_t offset)
+  {
+    if (direct_alignment == 0)
+    {
+      transfer_vector(fd, segments, count, offset, true);
+      return;
+    }
+
+    uint64_t segment_offset = offset;
+    for (uint32_t i = 0; i < count; i++)
+    {
+      if (!is_aligned(segments[i].buffer, segments[i].length, segment_offset))
+      {
+        // Some segments need bouncing, so write each on its own.
+        for (uint32_t j = 0; j < count; j++)
+        {
+          write_at(segments[j].buffer, segments[j].length, offset);
+          offset += segments[j].length;
+        }
+        return;
+      }
+      segment_offset += segments[i].length;
+    }
+
+    std::shared_lock<std::shared_mutex> length_guard(length_lock);
+    transfer_vector(fd, segments, count, offset, true);
+  }
+
+  uint64_t posix_disk_file::get_length()
+  {
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0)
+    {
+      throw std::fstream::failure("Failed to get backing file size");
+    }
+
+    return file_stat.st_size;
+  }
+
+  void posix_disk_file::set_length(uint64_t new_length)
+  {
+    std::unique_lock<std::shared_mutex> length_guard(length_lock);
+    if (ftruncate(fd, new_length) != 0)
+    {
+      throw std::fstream::failure("Failed to resize backing file");
+    }
+
+    // Don't hand out any more views from a mapping that now runs past the end of the file.
+    std::lock_guard<std::mutex> mapping_guard(mapping_lock);
+    if (new_length < mapping_length)
+    {
+      retire_mapping();
+    }
+  }
+
+  void posix_disk_file::flush()
+  {
+    if (fdatasync(fd) != 0)
+    {
+      throw std::fstream::failure("Failed to flush backing file");
+    }
+  }
+
+  bool posix_disk_file::punch_hole(uint64_t offset, uint64_t length)
+  {
+#ifdef __linux__
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+    {
+      return true;
+    }
+
+    if ((errno != EOPNOTSUPP) && (errno != ENOSYS))
+    {
+      throw std::fstream::failure("Failed to release space in backing file");
+    }
+#endif
+
+    return false;
+  }
+
+  bool posix_disk_file::allocate(uint64_t offset, uint64_t length)
+  {
+#ifdef __linux__
+    {
+      std::unique_lock<std::shared_mutex> length_guard(length_lock);
+      if (fallocate(fd, 0, offset, length) == 0)
+      {
+        return true;
+      }
+
+      if ((errno != EOPNOTSUPP) && (errno != ENOSYS))
+      {
+        throw std::fstream::failure("Failed to allocate space in backing file");
+      }
+    }
+#endif
+
+    return disk_file::allocate(offset, length);
+  }
+
+  int posix_disk_file::get_fd()
+  {
+    return fd;
+  }
+
+  uint32_t posix_disk_file::get_direct_alignment()
+  {
+    return direct_alignment;
+  }
+
+  /// @brief Check whether a request can be made directly on a file opened for direct I/O.
+  ///
+  /// @param buffer The memory to transfer to or from.
+  ///
+  /// @param length The number of bytes to transfer.
+  ///
+  /// @param offset The file offset to begin at.
+  ///
+  /// @return True if the buffer, length and offset are all suitably aligned.
+  bool posix_disk_file::is_aligned(const void *buffer, uint64_t length, uint64_t offset)
+  {
+    return ((reinterpret_cast<uintptr_t>(buffer) | length | offset) % direct_alignment) == 0;
+  }
+
+  /// @brief Read a range of a direct I/O file into an unaligned buffer, through aligned bounce buffers.
+  ///
+  /// @param buffer The buffer to read in to.
+  ///
+  /// @param length The number of bytes to read.
+  ///
+  /// @param offset The file offset to begin at.
+  void posix_disk_file::bounced_read(uint8_t *buffer, uint64_t length, uint64_t offset)
+  {
+    aligned_buffer_pool::buffer_ptr bounce = aligned_buffer_pool::instance().acquire();
+
+    while (length > 0)
+    {
+      const uint64_t head = offset % direct_alignment;
+      const uint64_t piece = std::min(length, BOUNCE_BUFFER_BYTES - head);
+      const uint64_t span_length = ((head + piece + direct_alignment - 1) / direct_alignment) * direct_alignment;
+
+      if (read_until_end(fd, bounce.get(), span_length, offset - head) < (head + piece))
+      {
+        throw std::fstream::failure("Unexpected end of backing file");
+      }
+      memcpy(buffer, bounce.get() + head, piece);
+
+      buffer += piece;
+      offset += piece;
+      length -= piece;
+    }
+  }
+
+  /// @brief Write an unaligned buffer, or to an unaligned range, of a direct I/O file through aligned bounce buffers.
+  ///
+  /// @param buffer The buffer to write.
+  ///
+  /// @param length The number of bytes to write.
+  ///
+  /// @param offset The file offset to begin at.
+  void posix_disk_file::bounced_write(const uint8_t *buffer, uint64_t length, uint64_t offset)
+  {
+    aligned_buffer_pool::buffer_ptr bounce = aligned_buffer_pool::instance().acquire();
+
+    while (length > 0)
+    {
+      const uint64_t piece = std::min(length, BOUNCE_BUFFER_BYTES - (offset % direct_alignment));
+      write_unit_span(bounce.get(), buffer, piece, offset, false);
+
+      buffer += piece;
+      offset += piece;
+      length -= piece;
+    }
+  }
+
+  /// @brief Write part of a file through a bounce buffer, as a span of whole aligned units.
+  ///
+  /// If the data only covers part of the first or last unit, the rest of that unit is read first, with the lock for
+  /// the unit held so that another write to a different part of it can't interleave. A span that reaches past the end
+  /// of the file would make the file too long, so in that case the whole write is done while holding length_lock
+  /// exclusively, and the file is then cut back to the right length.
+  ///
+  /// @param bounce An aligned buffer of BOUNCE_BUFFER_BYTES bytes, big enough for the span.
+  ///
+  /// @param buffer The data to write.
+  ///
+  /// @param length The number of bytes to write.
+  ///
+  /// @param offset The file offset to begin at.
+  ///
+  /// @param extending Whether the span is already known to reach past the end of the file.
+  void posix_disk_file::write_unit_span(uint8_t *bounce,
+                                        const uint8_t *buffer,
+                                        uint64_t length,
+                                        uint64_t offset,
+                                        bool extending)
+  {
+    const uint64_t unit = direct_alignment;
+    const uint64_t span_start = offset - (offset % unit);
+    const uint64_t data_end = offset + length;
+    const uint64_t span_end = ((data_end + unit - 1) / unit) * unit;
+    const uint64_t tail_start = span_end - unit;
+    const bool partial_head = (offset != span_start);
+    const bool partial_tail = (data_end != span_end);
+
+    std::shared_lock<std::shared_mutex> shared_length_guard(length_lock, std::defer_lock);
+    std::unique_lock<std::shared_mutex> exclusive_length_guard(length_lock, std::defer_lock);
+    std::unique_lock<std::mutex> first_unit_guard;
+    std::unique_lock<std::mutex> second_unit_guard;
+
+    if (extending)
+    {
+      // Nothing else can write while this is held, so the unit locks aren't needed.
+      exclusive_length_guard.lock();
+    }
+    else
+    {
+      shared_length_guard.lock();
+
+      // Take the locks for the partial units in a fixed order, and only once if they are the same lock.
+      if (partial_head || partial_tail)
+      {
+        uint32_t head_lock = (span_start / unit) % UNIT_LOCK_COUNT;
+        uint32_t tail_lock = (tail_start / unit) % UNIT_LOCK_COUNT;
+        uint32_t low_lock = std::min(partial_head ? head_lock : tail_lock, partial_tail ? tail_lock : head_lock);
+        uint32_t high_lock = std::max(partial_head ? head_lock : tail_lock, partial_tail ? tail_lock : head_lock);
+
+        first_unit_guard = std::unique_lock<std::mutex>(unit_locks[low_lock]);
+        if (high_lock != low_lock)
+        {
+          second_unit_guard = std::unique_lock<std::mutex>(unit_locks[high_lock]);
+        }
+      }
+    }
+
+    // Fill in the parts of the partial units that aren't being written, noting if the file ends within the span.
+    uint64_t file_end = span_end;
+    auto read_unit = [&](uint64_t unit_start)
+    {
+      uint8_t *unit_data = bounce + (unit_start - span_start);
+      uint64_t read_length = read_until_end(fd, unit_data, unit, unit_start);
+      memset(unit_data + read_length, 0, unit - read_length);
+      if (read_length < unit)
+      {
+        file_end = std::min(file_end, unit_start + read_length);
+      }
+    };
+
+    if (partial_head)
+    {
+      read_unit(span_start);
+    }
+    if (partial_tail && (!partial_head || (tail_start != span_start)))
+    {
+      read_unit(tail_start);
+    }
+
+    if (partial_tail && (file_end < span_end) && !extending)
+    {
+      if (second_unit_guard)
+      {
+        second_unit_guard.unlock();
+      }
+      first_unit_guard.unlock();
+      shared_length_guard.unlock();
+
+      write_unit_span(bounce, buffer, length, offset, true);
+      return;
+    }
+
+    memcpy(bounce + (offset - span_start), buffer, length);
+    write_fully(fd, bounce, span_end - span_start, span_start);
+
+    if (partial_tail && (file_end < span_end))
+    {
+      if (ftruncate(fd, std::max(file_end, data_end)) != 0)
+      {
+        throw std::fstream::failure("Failed to resize backing file");
+      }
+    }
+  }
+
+  /// @brief Map part of the file into memory, read-only.
+  ///
+  /// The whole file is mapped once and views are handed out from that mapping, so in the common case this is just a
+  /// pointer calculation. If the file has grown beyond the mapping, a new mapping of the whole file is made.
+  ///
+  /// @param offset The offset within the file of the first byte to map.
+  ///
+  /// @param length The number of bytes to map.
+  ///
+  /// @param access_hint One of the view_access constants, passed on to madvise().
+  ///
+  /// @return A pointer to the byte at offset. The mapping remains valid until all copies of the pointer are gone.
+  std::shared_ptr<const uint8_t> posix_disk_file::map(uint64_t offset, uint64_t length, uint32_t access_hint)
+  {
+    std::shared_ptr<const uint8_t> current;
+    {
+      std::lock_guard<std::mutex> guard(mapping_lock);
+
+      if ((offset + length) > mapping_length)
+      {
+        uint64_t file_length = get_length();
+        if ((offset + length) > file_length)
+        {
+          throw std::fstream::failure("Mapping beyond end of file");
+        }
+
+        void *base = mmap(nullptr, file_length, PROT_READ, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED)
+        {
+          throw std::fstream::failure("Failed to map backing file");
+        }
+
+        retire_mapping();
+        mapping = std::shared_ptr<const uint8_t>(reinterpret_cast<const uint8_t *>(base),
+                                                 [file_length](const uint8_t *p)
+                                                 {
+                                                   munmap(const_cast<uint8_t *>(p), file_length);
+                                                 });
+        mapping_length = file_length;
+      }
+
+      current = mapping;
+    }
+
+    if ((access_hint != view_access::NORMAL) && (length > 0))
+    {
+      // madvise() only accepts page aligned addresses.
+      uint64_t page_size = sysconf(_SC_PAGESIZE);
+      uint64_t aligned_offset = offset - (offset % page_size);
+      int advice = (access_hint == view_access::SEQUENTIAL) ? MADV_SEQUENTIAL : MADV_RANDOM;
+      madvise(const_cast<uint8_t *>(current.get()) + aligned_offset, length + (offset - aligned_offset), advice);
+    }
+
+    // Aliasing constructor - the result points to the requested offset, but keeps the whole mapping alive.
+    return std::shared_ptr<const uint8_t>(current, current.get() + offset);
+  }
+
+  /// @brief Find out whether any pointer returned by map() is still in use.
+  ///
+  /// @return True if a view holds a reference to the current mapping, or to one that has been replaced.
+  bool posix_disk_file::has_mappings()
+  {
+    std::lock_guard<std::mutex> guard(mapping_lock);
+
+    retired_mappings.erase(std::remove_if(retired_mappings.begin(), retired_mappings.end(),
+                                          [](const std::weak_ptr<const uint8_t> &m) { return m.expired(); }),
+                           retired_mappings.end());
+
+    return !retired_mappings.empty() || (mapping.use_count() > 1);
+  }
+
+  /// @brief Stop handing out views from the current mapping, remembering it while views of it remain.
+  ///
+  /// The caller must hold mapping_lock.
+  void posix_disk_file::retire_mapping()
+  {
+    if (mapping.use_count() > 1)
+    {
+      retired_mappings.push_back(mapping);
+    }
+
+    mapping.reset();
+    mapping_length = 0;
+  }
+};
+
+#endif
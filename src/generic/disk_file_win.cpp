@@ -0,0 +1,200 @@
+/// @file
+/// @brief Implements a backing file using Win32 positional I/O.
+
+// Copyright Martin Hughes 2018.
+
+#ifdef _WIN32
+
+#include "virtualdisk/virt_disk_file.h"
+
+#include <windows.h>
+
+namespace virt_disk
+{
+  /// @brief Open the default backing file implementation for this platform.
+  ///
+  /// @param filename The file to open.
+  ///
+  /// @param direct_io Whether to bypass the page cache. Not yet supported on Windows, so the file is opened normally.
+  ///
+  /// @param read_only Whether to open the file for reading only. Writes to it, and changes to its length, then fail.
+  ///
+  /// @return A disk_file for the given file.
+  std::unique_ptr<disk_file> disk_file::open(const std::string &filename, bool direct_io, bool read_only)
+  {
+    return std::unique_ptr<disk_file>(new win_disk_file(filename, false, read_only));
+  }
+
+  /// @brief Create a new, empty, file using the default backing file implementation for this platform.
+  ///
+  /// @param filename The file to create. It must not already exist.
+  ///
+  /// @return A disk_file for the new file.
+  std::unique_ptr<disk_file> disk_file::create(const std::string &filename)
+  {
+    return std::unique_ptr<disk_file>(new win_disk_file(filename, true));
+  }
+
+  /// @brief Open a file for positional reading and writing.
+  ///
+  /// @param filename The file to open.
+  ///
+  /// @param create_new If true, create the file. It is an error for it to exist already.
+  ///
+  /// @param read_only If true, open the file for reading only. It cannot be combined with create_new.
+  win_disk_file::win_disk_file(const std::string &filename, bool create_new, bool read_only) :
+    handle{INVALID_HANDLE_VALUE}
+  {
+    handle = CreateFileA(filename.c_str(),
+                         read_only ? GENERIC_READ : (GENERIC_READ | GENERIC_WRITE),
+                         FILE_SHARE_READ,
+                         nullptr,
+                         create_new ? CREATE_NEW : OPEN_EXISTING,
+                         FILE_ATTRIBUTE_NORMAL,
+                         nullptr);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+      throw std::fstream::failure("Failed to open backing file");
+    }
+  }
+
+  win_disk_file::~win_disk_file()
+  {
+    if (handle != INVALID_HANDLE_VALUE)
+    {
+      CloseHandle(handle);
+    }
+  }
+
+  void win_disk_file::read_at(void *buffer, uint64_t length, uint64_t offset)
+  {
+    uint8_t *buffer_uint = reinterpret_cast<uint8_t *>(buffer);
+
+    while (length > 0)
+    {
+      OVERLAPPED position = { };
+      position.Offset = static_cast<DWORD>(offset);
+      position.OffsetHigh = static_cast<DWORD>(offset >> 32);
+      DWORD this_length = (length > 0x40000000) ? 0x40000000 : static_cast<DWORD>(length);
+      DWORD transferred = 0;
+
+      if (!ReadFile(handle, buffer_uint, this_length, &transferred, &position))
+      {
+        throw std::fstream::failure("Backing file read failed");
+      }
+      if (transferred == 0)
+      {
+        throw std::fstream::failure("Unexpected end of backing file");
+      }
+
+      buffer_uint += transferred;
+      offset += transferred;
+      length -= transferred;
+    }
+  }
+
+  void win_disk_file::write_at(const void *buffer, uint64_t length, uint64_t offset)
+  {
+    const uint8_t *buffer_uint = reinterpret_cast<const uint8_t *>(buffer);
+
+    while (length > 0)
+    {
+      OVERLAPPED position = { };
+      position.Offset = static_cast<DWORD>(offset);
+      position.OffsetHigh = static_cast<DWORD>(offset >> 32);
+      DWORD this_length = (length > 0x40000000) ? 0x40000000 : static_cast<DWORD>(length);
+      DWORD transferred = 0;
+
+      if (!WriteFile(handle, buffer_uint, this_length, &transferred, &position))
+      {
+        throw std::fstream::failure("Backing file write failed");
+      }
+
+      buffer_uint += transferred;
+      offset += transferred;
+      length -= transferred;
+    }
+  }
+
+  void win_disk_file::readv_at(const io_segment *segments, uint32_t count, uint64_t offset)
+  {
+    for (uint32_t i = 0; i < count; i++)
+    {
+      read_at(segments[i].buffer, segments[i].length, offset);
+      offset += segments[i].length;
+    }
+  }
+
+  void win_disk_file::writev_at(const io_segment *segments, uint32_t count, uint64_t offset)
+  {
+    for (uint32_t i = 0; i < count; i++)
+    {
+      write_at(segments[i].buffer, segments[i].length, offset);
+      offset += segments[i].length;
+    }
+  }
+
+  uint64_t win_disk_file::get_length()
+  {
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(handle, &size))
+    {
+      throw std::fstream::failure("Failed to get backing file size");
+    }
+
+    return size.QuadPart;
+  }
+
+  void win_disk_file::set_length(uint64_t new_length)
+  {
+    FILE_END_OF_FILE_INFO info;
+    info.EndOfFile.QuadPart = new_length;
+    if (!SetFileInformationByHandle(handle, FileEndOfFileInfo, &info, sizeof(info)))
+    {
+      throw std::fstream::failure("Failed to resize backing file");
+    }
+  }
+
+  void win_disk_file::flush()
+  {
+    if (!FlushFileBuffers(handle))
+    {
+      throw std::fstream::failure("Failed to flush backing file");
+    }
+  }
+
+  /// @brief Release the storage behind part of the file, by making it sparse and zeroing the range.
+  ///
+  /// @param offset The offset within the file of the first byte to release.
+  ///
+  /// @param length The number of bytes to release.
+  ///
+  /// @return True if the storage was released, false if the filesystem does not support sparse files.
+  bool win_disk_file::punch_hole(uint64_t offset, uint64_t length)
+  {
+    DWORD bytes_returned;
+    if (!DeviceIoControl(handle, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &bytes_returned, nullptr))
+    {
+      return false;
+    }
+
+    FILE_ZERO_DATA_INFORMATION zero_info;
+    zero_info.FileOffset.QuadPart = offset;
+    zero_info.BeyondFinalZero.QuadPart = offset + length;
+    if (!DeviceIoControl(handle,
+                         FSCTL_SET_ZERO_DATA,
+                         &zero_info,
+                         sizeof(zero_info),
+                         nullptr,
+                         0,
+                         &bytes_returned,
+                         nullptr))
+    {
+      throw std::fstream::failure("Failed to release space in backing file");
+    }
+
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,288 @@
+/// @file
+/// @brief Implements conversion of virtual disks from one image format to another.
+
+// Copyright Martin Hughes 2018.
+
+#include "virtualdisk/virt_disk_convert.h"
+#include "virtualdisk/virt_disk_vdi.h"
+#include "virtualdisk/virt_disk_vhd.h"
+#include "virtualdisk/virt_disk_zero.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <exception>
+#include <mutex>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+namespace
+{
+  /// Fixed images have no blocks, so all-zero pieces of this size are skipped instead - they read as zeroes anyway.
+  const uint64_t FIXED_ZERO_CHECK_BYTES = 64 * 1024;
+
+  /// @brief One piece of the disk, read by a reader thread and waiting to be written.
+  ///
+  struct convert_batch
+  {
+    uint64_t start_posn; ///< The position on the disk of the start of the batch.
+    std::unique_ptr<uint8_t[]> buffer; ///< The contents of the batch.
+    std::vector<virt_disk::allocation_extent> data; ///< The parts of the batch that must be written.
+    std::exception_ptr error; ///< Set if the batch could not be read.
+    bool ready; ///< True once the batch has been read, and until it has been written.
+  };
+
+  /// @brief Read one batch of the source disk, and work out which parts of it need writing.
+  ///
+  /// Holes in the source are not read, and pieces that are all zeroes are not written - so the new image is only as
+  /// large as the data really stored.
+  ///
+  /// @param source The disk being converted.
+  ///
+  /// @param batch The batch to fill in. Its buffer must be at least length bytes long.
+  ///
+  /// @param start_posn The position on the disk of the start of the batch.
+  ///
+  /// @param length The length of the batch.
+  ///
+  /// @param zero_check_bytes The size of the pieces that are skipped if they are all zeroes.
+  void read_batch(virt_disk::virt_disk &source,
+                  convert_batch &batch,
+                  uint64_t start_posn,
+                  uint64_t length,
+                  uint64_t zero_check_bytes)
+  {
+    batch.start_posn = start_posn;
+    batch.data.clear();
+
+    std::vector<virt_disk::allocation_extent> allocation;
+    source.get_allocation(start_posn, length, allocation);
+
+    const uint64_t piece_count = (length + zero_check_bytes - 1) / zero_check_bytes;
+    std::vector<bool> piece_has_data(piece_count, false);
+
+    for (const virt_disk::allocation_extent &extent : allocation)
+    {
+      if (extent.allocated)
+      {
+        uint64_t offset = extent.start_posn - start_posn;
+        uint64_t last_piece = (offset + extent.length - 1) / zero_check_bytes;
+        source.read(batch.buffer.get() + offset, extent.start_posn, extent.length, extent.length);
+
+        for (uint64_t piece = offset / zero_check_bytes; piece <= last_piece; piece++)
+        {
+          piece_has_data[piece] = true;
+        }
+      }
+    }
+
+    // Holes that share a piece with data must read as zeroes in the buffer. Other holes are never looked at.
+    for (const virt_disk::allocation_extent &extent : allocation)
+    {
+      if (!extent.allocated)
+      {
+        uint64_t offset = extent.start_posn - start_posn;
+        uint64_t end = offset + extent.length;
+
+        for (uint64_t piece = offset / zero_check_bytes; piece <= ((end - 1) / zero_check_bytes); piece++)
+        {
+          if (piece_has_data[piece])
+          {
+            uint64_t clear_start = std::max(offset, piece * zero_check_bytes);
+            uint64_t clear_end = std::min(end, (piece + 1) * zero_check_bytes);
+            memset(batch.buffer.get() + clear_start, 0, clear_end - clear_start);
+          }
+        }
+      }
+    }
+
+    for (uint64_t piece = 0; piece < piece_count; piece++)
+    {
+      uint64_t offset = piece * zero_check_bytes;
+      uint64_t piece_length = std::min(zero_check_bytes, length - offset);
+
+      if (!piece_has_data[piece] || virt_disk::is_zero_buffer(batch.buffer.get() + offset, piece_length))
+      {
+        continue;
+      }
+
+      if (!batch.data.empty() &&
+          ((batch.data.back().start_posn + batch.data.back().length) == (start_posn + offset)))
+      {
+        batch.data.back().length += piece_length;
+      }
+      else
+      {
+        batch.data.push_back({start_posn + offset, piece_length, true});
+      }
+    }
+  }
+}
+
+namespace virt_disk
+{
+  /// @brief Copy a virtual disk into a new image, possibly of a different format.
+  ///
+  /// The source is read in batches by several threads at once, using its allocation map to skip holes, while the
+  /// calling thread writes completed batches to the new image in order - so blocks in a dynamic image are laid out in
+  /// the same order as on the disk. Pieces of the disk that are all zeroes are not written.
+  ///
+  /// @param source The disk to convert. It may be used by other threads at the same time, but changes made during the
+  ///               conversion may or may not be copied.
+  ///
+  /// @param target_filename The file to create. It must not already exist, and is removed again if conversion fails.
+  ///
+  /// @param config The format of the new image, and how to carry out the conversion.
+  void convert_image(virt_disk &source, const std::string &target_filename, const convert_config &config)
+  {
+    const uint64_t length = source.get_length();
+    uint64_t zero_check_bytes;
+
+    switch (config.format)
+    {
+    case image_format::VDI_NORMAL:
+      zero_check_bytes = (config.block_size != 0) ? config.block_size : VDI_DEFAULT_BLOCK_SIZE;
+      break;
+
+    case image_format::VHD_DYNAMIC:
+      zero_check_bytes = (config.block_size != 0) ? config.block_size : VHD_DEFAULT_BLOCK_SIZE;
+      break;
+
+    default:
+      zero_check_bytes = FIXED_ZERO_CHECK_BYTES;
+      break;
+    }
+
+    create_config target_config;
+    target_config.format = config.format;
+    target_config.block_size = config.block_size;
+    std::unique_ptr<virt_disk> target(virt_disk::create_image(target_filename, length, target_config));
+
+    // Batches are a whole number of blocks of the new image, so that each block is checked for zeroes in one go.
+    const uint64_t batch_bytes = std::max(zero_check_bytes, (config.batch_bytes / zero_check_bytes) * zero_check_bytes);
+    const uint64_t batch_count = (length + batch_bytes - 1) / batch_bytes;
+    const uint32_t slot_count = std::max(1U, config.batches_in_flight);
+    const uint32_t thread_count = std::max(1U, std::min(config.reader_threads, slot_count));
+
+    std::unique_ptr<convert_batch[]> slots(new convert_batch[slot_count]);
+    std::mutex lock;
+    std::condition_variable state_cv;
+    uint64_t next_to_read = 0;
+    uint64_t next_to_write = 0;
+    bool stopping = false;
+
+    // Batch N is read into slot N % slot_count, once batch N - slot_count has been written.
+    auto reader = [&]()
+    {
+      std::unique_lock<std::mutex> guard(lock);
+
+      while (true)
+      {
+        state_cv.wait(guard, [&]()
+        {
+          return stopping || (next_to_read >= batch_count) || (next_to_read < (next_to_write + slot_count));
+        });
+        if (stopping || (next_to_read >= batch_count))
+        {
+          return;
+        }
+
+        uint64_t batch_number = next_to_read++;
+        convert_batch &batch = slots[batch_number % slot_count];
+        guard.unlock();
+
+        try
+        {
+          if (!batch.buffer)
+          {
+            batch.buffer = std::unique_ptr<uint8_t[]>(new uint8_t[batch_bytes]);
+          }
+
+          uint64_t start_posn = batch_number * batch_bytes;
+          read_batch(source, batch, start_posn, std::min(batch_bytes, length - start_posn), zero_check_bytes);
+        }
+        catch (...)
+        {
+          batch.error = std::current_exception();
+        }
+
+        guard.lock();
+        batch.ready = true;
+        state_cv.notify_all();
+      }
+    };
+
+    std::vector<std::thread> threads;
+
+    try
+    {
+      for (uint32_t i = 0; i < slot_count; i++)
+      {
+        slots[i].ready = false;
+      }
+      for (uint32_t i = 0; i < thread_count; i++)
+      {
+        threads.emplace_back(reader);
+      }
+
+      for (uint64_t batch_number = 0; batch_number < batch_count; batch_number++)
+      {
+        convert_batch &batch = slots[batch_number % slot_count];
+        {
+          std::unique_lock<std::mutex> guard(lock);
+          state_cv.wait(guard, [&]() { return batch.ready; });
+        }
+
+        if (batch.error)
+        {
+          std::rethrow_exception(batch.error);
+        }
+
+        for (const allocation_extent &data : batch.data)
+        {
+          target->write(batch.buffer.get() + (data.start_posn - batch.start_posn),
+                        data.start_posn,
+                        data.length,
+                        data.length);
+        }
+
+        {
+          std::lock_guard<std::mutex> guard(lock);
+          batch.ready = false;
+          next_to_write++;
+        }
+        state_cv.notify_all();
+
+        if (config.progress)
+        {
+          config.progress(std::min(length, (batch_number + 1) * batch_bytes), length);
+        }
+      }
+
+      target->flush();
+    }
+    catch (...)
+    {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+      }
+      state_cv.notify_all();
+
+      for (std::thread &thread : threads)
+      {
+        thread.join();
+      }
+
+      target.reset();
+      std::remove(target_filename.c_str());
+      throw;
+    }
+
+    for (std::thread &thread : threads)
+    {
+      thread.join();
+    }
+  }
+};
@@ -0,0 +1,835 @@
+/// @file
+/// @brief Implements the asynchronous request queue, using either io_uring or a pool of worker threads.
+
+// Copyright Martin Hughes 2018.
+
+#include "virtualdisk/virt_disk_async.h"
+#include "virtualdisk/virt_disk_file.h"
+#include "virtualdisk/virt_disk_zero.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <string.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define VIRT_DISK_HAVE_IO_URING
+#endif
+#endif
+
+#ifdef VIRT_DISK_HAVE_IO_URING
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+namespace virt_disk
+{
+  /// @brief A request submitted to an io_queue, which may be made up of several backing file operations.
+  ///
+  struct queued_request
+  {
+    io_callback callback; ///< Called when all operations are complete.
+    uint32_t ops_outstanding; ///< How many backing file operations are still to complete.
+    std::exception_ptr error; ///< The first error to occur in any operation, if any.
+    virt_disk *disk; ///< The disk being accessed.
+    uint32_t io_counter; ///< Returned by disk->begin_io(), to be passed to end_io() once all operations are complete.
+    io_stats_recorder *stats; ///< The disk's statistics recorder when the request was submitted, if any.
+    uint64_t start_ns; ///< When the request was submitted, if stats is set.
+    uint64_t length; ///< The number of bytes requested.
+    bool is_write; ///< Whether this is a write (true) or a read (false).
+  };
+
+  /// @brief A single, contiguous, backing file operation.
+  ///
+  struct file_op
+  {
+    queued_request *parent; ///< The request this operation is part of.
+    disk_file *file; ///< The file to transfer to or from.
+    uint8_t *buffer; ///< The memory to transfer to or from.
+    uint64_t length; ///< The number of bytes still to transfer.
+    uint64_t offset; ///< The file offset of the next byte to transfer.
+    bool is_write; ///< Whether this is a write (true) or a read (false).
+    std::exception_ptr error; ///< Set if the operation failed.
+#ifdef VIRT_DISK_HAVE_IO_URING
+    iovec vec; ///< Describes buffer to io_uring - it must stay valid until the operation completes.
+#endif
+  };
+
+  /// @brief Carries out backing file operations on behalf of an io_queue.
+  ///
+  /// Engines never call request callbacks themselves - they only report which operations are complete.
+  class queue_engine
+  {
+  public:
+    virtual ~queue_engine() = default;
+
+    /// @brief Start a backing file operation.
+    ///
+    /// @param op The operation to start. It is returned by collect() once complete.
+    virtual void submit(file_op *op) = 0;
+
+    /// @brief Gather operations that have completed.
+    ///
+    /// @param completed Completed operations are appended to this vector.
+    ///
+    /// @param wait If true, wait until at least one operation is complete. There must be at least one outstanding.
+    virtual void collect(std::vector<file_op *> &completed, bool wait) = 0;
+
+    /// @brief Is this engine using io_uring?
+    ///
+    /// @return True if so, false otherwise.
+    virtual bool is_io_uring() = 0;
+  };
+};
+
+using namespace virt_disk;
+
+namespace
+{
+  /// @brief Carry out an operation synchronously, recording any failure in the operation.
+  ///
+  /// @param op The operation to carry out.
+  void run_op_sync(file_op *op)
+  {
+    try
+    {
+      if (op->is_write)
+      {
+        op->file->write_at(op->buffer, op->length, op->offset);
+      }
+      else
+      {
+        op->file->read_at(op->buffer, op->length, op->offset);
+      }
+    }
+    catch (...)
+    {
+      op->error = std::current_exception();
+    }
+  }
+
+  /// @brief An engine that carries out operations on a pool of worker threads.
+  ///
+  class pool_engine : public queue_engine
+  {
+  public:
+    /// @brief Start the worker threads.
+    ///
+    /// @param thread_count The number of worker threads to start.
+    pool_engine(uint32_t thread_count) :
+      stopping{false}
+    {
+      for (uint32_t i = 0; i < thread_count; i++)
+      {
+        workers.emplace_back(&pool_engine::worker_main, this);
+      }
+    }
+
+    virtual ~pool_engine() override
+    {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+      }
+      work_ready.notify_all();
+
+      for (std::thread &t : workers)
+      {
+        t.join();
+      }
+    }
+
+    virtual void submit(file_op *op) override
+    {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        pending.push_back(op);
+      }
+      work_ready.notify_one();
+    }
+
+    virtual void collect(std::vector<file_op *> &completed, bool wait) override
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      if (wait)
+      {
+        work_done.wait(guard, [this]() { return !done.empty(); });
+      }
+
+      completed.insert(completed.end(), done.begin(), done.end());
+      done.clear();
+    }
+
+    virtual bool is_io_uring() override
+    {
+      return false;
+    }
+
+  protected:
+    /// @brief Main loop of each worker thread.
+    ///
+    void worker_main()
+    {
+      std::unique_lock<std::mutex> guard(lock);
+
+      while (true)
+      {
+        work_ready.wait(guard, [this]() { return stopping || !pending.empty(); });
+        if (pending.empty())
+        {
+          return;
+        }
+
+        file_op *op = pending.front();
+        pending.pop_front();
+
+        guard.unlock();
+        run_op_sync(op);
+        guard.lock();
+
+        done.push_back(op);
+        work_done.notify_one();
+      }
+    }
+
+    std::mutex lock; ///< Protects all of the members below.
+    std::condition_variable work_ready; ///< Signalled when pending gains an entry, or stopping is set.
+    std::condition_variable work_done; ///< Signalled when done gains an entry.
+    std::deque<file_op *> pending; ///< Operations waiting for a worker.
+    std::vector<file_op *> done; ///< Operations that are complete, but not yet collected.
+    bool stopping; ///< Set when the workers should exit.
+    std::vector<std::thread> workers; ///< The worker threads.
+  };
+
+#ifdef VIRT_DISK_HAVE_IO_URING
+  /// @brief An engine that submits operations to an io_uring instance.
+  ///
+  /// The ring is driven directly through the kernel interface, so there is no dependency on liburing.
+  class uring_engine : public queue_engine
+  {
+  public:
+    /// @brief Try to create an io_uring based engine.
+    ///
+    /// @param entries The requested size of the submission queue.
+    ///
+    /// @return The new engine, or nullptr if io_uring is not available.
+    static std::unique_ptr<queue_engine> create(uint32_t entries)
+    {
+      std::unique_ptr<uring_engine> engine(new uring_engine());
+      if (!engine->setup(entries))
+      {
+        return nullptr;
+      }
+
+      return std::unique_ptr<queue_engine>(engine.release());
+    }
+
+    virtual ~uring_engine() override
+    {
+      if (sqes != nullptr)
+      {
+        munmap(sqes, sqes_size);
+      }
+      if ((cq_ring != nullptr) && (cq_ring != sq_ring))
+      {
+        munmap(cq_ring, cq_ring_size);
+      }
+      if (sq_ring != nullptr)
+      {
+        munmap(sq_ring, sq_ring_size);
+      }
+      if (ring_fd >= 0)
+      {
+        close(ring_fd);
+      }
+    }
+
+    virtual void submit(file_op *op) override
+    {
+      const uint32_t alignment = op->file->get_direct_alignment();
+      const bool misaligned = (alignment != 0) &&
+                              (((reinterpret_cast<uintptr_t>(op->buffer) | op->offset | op->length) % alignment) != 0);
+      if ((op->length == 0) || (op->file->get_fd() < 0) || misaligned)
+      {
+        // Either there's nothing to do, or this operation can't be given to io_uring - the file doesn't have a
+        // descriptor, or bypasses the page cache and the operation isn't aligned - so just carry it out now.
+        run_op_sync(op);
+        done.push_back(op);
+        return;
+      }
+
+      // Never have more operations in flight than the completion queue can hold.
+      while (in_flight >= sq_entries)
+      {
+        enter(1);
+      }
+
+      queue_op(op);
+    }
+
+    virtual void collect(std::vector<file_op *> &completed, bool wait) override
+    {
+      harvest();
+      if (to_submit > 0)
+      {
+        enter(0);
+      }
+      while (wait && done.empty())
+      {
+        enter(1);
+      }
+
+      completed.insert(completed.end(), done.begin(), done.end());
+      done.clear();
+    }
+
+    virtual bool is_io_uring() override
+    {
+      return true;
+    }
+
+  protected:
+    uring_engine() = default;
+
+    /// @brief Create and map the ring.
+    ///
+    /// @param entries The requested size of the submission queue.
+    ///
+    /// @return True if the ring is ready to use, false otherwise.
+    bool setup(uint32_t entries)
+    {
+      io_uring_params params;
+      memset(&params, 0, sizeof(params));
+
+      ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+      if (ring_fd < 0)
+      {
+        return false;
+      }
+
+      sq_entries = params.sq_entries;
+      sq_ring_size = params.sq_off.array + (params.sq_entries * sizeof(uint32_t));
+      cq_ring_size = params.cq_off.cqes + (params.cq_entries * sizeof(io_uring_cqe));
+      if (params.features & IORING_FEAT_SINGLE_MMAP)
+      {
+        sq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        cq_ring_size = sq_ring_size;
+      }
+
+      sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                     IORING_OFF_SQ_RING);
+      if (sq_ring == MAP_FAILED)
+      {
+        sq_ring = nullptr;
+        return false;
+      }
+
+      if (params.features & IORING_FEAT_SINGLE_MMAP)
+      {
+        cq_ring = sq_ring;
+      }
+      else
+      {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                       IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED)
+        {
+          cq_ring = nullptr;
+          return false;
+        }
+      }
+
+      sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+      void *sqe_map = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                           IORING_OFF_SQES);
+      if (sqe_map == MAP_FAILED)
+      {
+        return false;
+      }
+      sqes = reinterpret_cast<io_uring_sqe *>(sqe_map);
+
+      uint8_t *sq_base = reinterpret_cast<uint8_t *>(sq_ring);
+      sq_head = reinterpret_cast<uint32_t *>(sq_base + params.sq_off.head);
+      sq_tail = reinterpret_cast<uint32_t *>(sq_base + params.sq_off.tail);
+      sq_mask = *reinterpret_cast<uint32_t *>(sq_base + params.sq_off.ring_mask);
+      sq_array = reinterpret_cast<uint32_t *>(sq_base + params.sq_off.array);
+
+      uint8_t *cq_base = reinterpret_cast<uint8_t *>(cq_ring);
+      cq_head = reinterpret_cast<uint32_t *>(cq_base + params.cq_off.head);
+      cq_tail = reinterpret_cast<uint32_t *>(cq_base + params.cq_off.tail);
+      cq_mask = *reinterpret_cast<uint32_t *>(cq_base + params.cq_off.ring_mask);
+      cqes = reinterpret_cast<io_uring_cqe *>(cq_base + params.cq_off.cqes);
+
+      return true;
+    }
+
+    /// @brief Place an operation in the submission queue. It is passed to the kernel by the next call to enter().
+    ///
+    /// @param op The operation to queue.
+    void queue_op(file_op *op)
+    {
+      uint32_t tail = *sq_tail;
+      if ((tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE)) >= sq_entries)
+      {
+        enter(0);
+        tail = *sq_tail;
+      }
+
+      op->vec.iov_base = op->buffer;
+      op->vec.iov_len = op->length;
+
+      uint32_t index = tail & sq_mask;
+      io_uring_sqe *sqe = &sqes[index];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = op->is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+      sqe->fd = op->file->get_fd();
+      sqe->off = op->offset;
+      sqe->addr = reinterpret_cast<uint64_t>(&op->vec);
+      sqe->len = 1;
+      sqe->user_data = reinterpret_cast<uint64_t>(op);
+      sq_array[index] = index;
+
+      __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+      to_submit++;
+      in_flight++;
+    }
+
+    /// @brief Submit queued operations to the kernel, optionally waiting for completions, then harvest completions.
+    ///
+    /// @param min_complete The number of completions to wait for.
+    void enter(uint32_t min_complete)
+    {
+      while (true)
+      {
+        uint32_t flags = (min_complete > 0) ? IORING_ENTER_GETEVENTS : 0;
+        long result = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+        if (result >= 0)
+        {
+          to_submit -= std::min(to_submit, static_cast<uint32_t>(result));
+          break;
+        }
+
+        if ((errno == EAGAIN) || (errno == EBUSY))
+        {
+          // The kernel is short of resources - freeing up completion queue space should help.
+          harvest();
+          min_complete = 0;
+          continue;
+        }
+        else if (errno != EINTR)
+        {
+          throw std::fstream::failure("io_uring_enter failed");
+        }
+      }
+
+      harvest();
+    }
+
+    /// @brief Process all entries in the completion queue.
+    ///
+    void harvest()
+    {
+      uint32_t head = *cq_head;
+      uint32_t tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+      std::vector<file_op *> retry;
+
+      while (head != tail)
+      {
+        io_uring_cqe *cqe = &cqes[head & cq_mask];
+        file_op *op = reinterpret_cast<file_op *>(cqe->user_data);
+        int32_t result = cqe->res;
+        head++;
+        in_flight--;
+
+        if (result < 0)
+        {
+          if ((result == -EINTR) || (result == -EAGAIN))
+          {
+            retry.push_back(op);
+            continue;
+          }
+          op->error = std::make_exception_ptr(std::fstream::failure(op->is_write ? "Backing file write failed" :
+                                                                                   "Backing file read failed"));
+        }
+        else if ((result == 0) && !op->is_write)
+        {
+          op->error = std::make_exception_ptr(std::fstream::failure("Unexpected end of backing file"));
+        }
+        else if (static_cast<uint64_t>(result) < op->length)
+        {
+          // Short transfer - go round again for the remainder.
+          op->buffer += result;
+          op->offset += result;
+          op->length -= result;
+          retry.push_back(op);
+          continue;
+        }
+
+        done.push_back(op);
+      }
+
+      __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+      for (file_op *op : retry)
+      {
+        queue_op(op);
+      }
+    }
+
+    int ring_fd{-1}; ///< The io_uring file descriptor.
+    uint32_t sq_entries{0}; ///< The number of entries in the submission queue.
+
+    void *sq_ring{nullptr}; ///< The mapped submission queue ring.
+    size_t sq_ring_size{0}; ///< The size of the sq_ring mapping.
+    void *cq_ring{nullptr}; ///< The mapped completion queue ring. May be the same as sq_ring.
+    size_t cq_ring_size{0}; ///< The size of the cq_ring mapping.
+    io_uring_sqe *sqes{nullptr}; ///< The mapped submission queue entries.
+    size_t sqes_size{0}; ///< The size of the sqes mapping.
+
+    uint32_t *sq_head{nullptr}; ///< Submission queue head, advanced by the kernel.
+    uint32_t *sq_tail{nullptr}; ///< Submission queue tail, advanced by us.
+    uint32_t sq_mask{0}; ///< Mask to convert a submission queue position into an index.
+    uint32_t *sq_array{nullptr}; ///< The submission queue index array.
+    uint32_t *cq_head{nullptr}; ///< Completion queue head, advanced by us.
+    uint32_t *cq_tail{nullptr}; ///< Completion queue tail, advanced by the kernel.
+    uint32_t cq_mask{0}; ///< Mask to convert a completion queue position into an index.
+    io_uring_cqe *cqes{nullptr}; ///< The completion queue entries.
+
+    uint32_t to_submit{0}; ///< Operations queued but not yet passed to the kernel.
+    uint32_t in_flight{0}; ///< Operations queued or submitted, but not yet harvested.
+    std::vector<file_op *> done; ///< Operations that are complete, but not yet collected.
+  };
+#endif
+}
+
+namespace virt_disk
+{
+  /// @brief Create a new, empty, queue.
+  ///
+  /// @param queue_depth The most backing file operations to have in flight at once.
+  ///
+  /// @param allow_io_uring If false, always use the thread pool, even if io_uring is available.
+  io_queue::io_queue(uint32_t queue_depth, bool allow_io_uring) :
+    requests_outstanding{0},
+    depth{queue_depth}
+  {
+    if (depth == 0)
+    {
+      depth = 1;
+    }
+
+#ifdef VIRT_DISK_HAVE_IO_URING
+    if (allow_io_uring)
+    {
+      engine = uring_engine::create(depth);
+    }
+#endif
+
+    if (!engine)
+    {
+      uint32_t threads = std::max(4U, std::thread::hardware_concurrency());
+      engine = std::unique_ptr<queue_engine>(new pool_engine(std::min(threads, depth)));
+    }
+  }
+
+  /// @brief Destroy the queue, first waiting for all outstanding requests to complete.
+  ///
+  /// The callbacks of any outstanding requests are called. Any exceptions they throw are discarded.
+  io_queue::~io_queue()
+  {
+    while (requests_outstanding > 0)
+    {
+      try
+      {
+        reap(requests_outstanding);
+      }
+      catch (...)
+      {
+      }
+    }
+  }
+
+  /// @brief Submit a request to read from a virtual disk.
+  ///
+  /// Errors found while working out which parts of the image to read - for example reading beyond the end of the disk
+  /// - are thrown from this function. Errors during the read itself are passed to the callback.
+  ///
+  /// @param disk The disk to read from.
+  ///
+  /// @param buffer The buffer to read in to. It must remain valid until the request completes.
+  ///
+  /// @param start_posn The number of bytes into the virtual disk to begin reading.
+  ///
+  /// @param length The number of bytes to read from the disk.
+  ///
+  /// @param callback Called from reap() once the request is complete.
+  void io_queue::submit_read(virt_disk &disk, void *buffer, uint64_t start_posn, uint64_t length, io_callback callback)
+  {
+    submit(disk, reinterpret_cast<uint8_t *>(buffer), start_posn, length, false, std::move(callback));
+  }
+
+  /// @brief Submit a request to write to a virtual disk.
+  ///
+  /// Any new blocks needed by the write are allocated before this function returns, and errors doing so are thrown
+  /// from it. Errors during the write itself are passed to the callback.
+  ///
+  /// @param disk The disk to write to.
+  ///
+  /// @param buffer The buffer to write. It must remain valid until the request completes.
+  ///
+  /// @param start_posn The position on the disk to begin writing at.
+  ///
+  /// @param length The number of bytes to write.
+  ///
+  /// @param callback Called from reap() once the request is complete.
+  void io_queue::submit_write(virt_disk &disk,
+                              const void *buffer,
+                              uint64_t start_posn,
+                              uint64_t length,
+                              io_callback callback)
+  {
+    submit(disk,
+           const_cast<uint8_t *>(reinterpret_cast<const uint8_t *>(buffer)),
+           start_posn,
+           length,
+           true,
+           std::move(callback));
+  }
+
+  /// @brief Submit a request to read from a virtual disk, returning a future.
+  ///
+  /// The parameters are the same as submit_read(). The future becomes ready during a later call to reap().
+  ///
+  /// @return A future that becomes ready when the read is complete.
+  std::future<void> io_queue::read(virt_disk &disk, void *buffer, uint64_t start_posn, uint64_t length)
+  {
+    std::shared_ptr<std::promise<void>> promise = std::make_shared<std::promise<void>>();
+    std::future<void> result = promise->get_future();
+
+    submit_read(disk, buffer, start_posn, length, [promise](std::exception_ptr error)
+    {
+      if (error)
+      {
+        promise->set_exception(error);
+      }
+      else
+      {
+        promise->set_value();
+      }
+    });
+
+    return result;
+  }
+
+  /// @brief Submit a request to write to a virtual disk, returning a future.
+  ///
+  /// The parameters are the same as submit_write(). The future becomes ready during a later call to reap().
+  ///
+  /// @return A future that becomes ready when the write is complete.
+  std::future<void> io_queue::write(virt_disk &disk, const void *buffer, uint64_t start_posn, uint64_t length)
+  {
+    std::shared_ptr<std::promise<void>> promise = std::make_shared<std::promise<void>>();
+    std::future<void> result = promise->get_future();
+
+    submit_write(disk, buffer, start_posn, length, [promise](std::exception_ptr error)
+    {
+      if (error)
+      {
+        promise->set_exception(error);
+      }
+      else
+      {
+        promise->set_value();
+      }
+    });
+
+    return result;
+  }
+
+  /// @brief Report completed requests, by calling their callbacks.
+  ///
+  /// @param min_completions Wait until at least this many requests have completed, or there are none outstanding.
+  ///
+  /// @return The number of requests reported.
+  uint32_t io_queue::reap(uint32_t min_completions)
+  {
+    uint32_t reaped = 0;
+    bool wait = false;
+    std::vector<file_op *> completed;
+
+    do
+    {
+      if (wait)
+      {
+        engine->collect(completed, true);
+      }
+      else
+      {
+        engine->collect(completed, false);
+        wait = true;
+      }
+
+      // Collect all results before calling any callbacks, in case one throws.
+      std::deque<queued_request *> finished;
+      for (file_op *op : completed)
+      {
+        queued_request *request = op->parent;
+        if (op->error && !request->error)
+        {
+          request->error = op->error;
+        }
+        delete op;
+
+        request->ops_outstanding--;
+        if (request->ops_outstanding == 0)
+        {
+          finished.push_back(request);
+        }
+      }
+      completed.clear();
+
+      while (!finished.empty())
+      {
+        std::unique_ptr<queued_request> request(finished.front());
+        finished.pop_front();
+        request->disk->end_io(request->io_counter);
+        if (request->stats != nullptr)
+        {
+          request->disk->record_io(request->stats, request->is_write, request->length, request->start_ns);
+        }
+        requests_outstanding--;
+        reaped++;
+
+        if (request->callback)
+        {
+          request->callback(request->error);
+        }
+      }
+    } while ((reaped < min_completions) && (requests_outstanding > 0));
+
+    return reaped;
+  }
+
+  /// @brief Wait for all outstanding requests to complete, calling their callbacks.
+  ///
+  void io_queue::drain()
+  {
+    while (requests_outstanding > 0)
+    {
+      reap(requests_outstanding);
+    }
+  }
+
+  /// @brief How many requests are waiting to be reaped?
+  ///
+  /// @return The number of requests submitted but not yet reported by reap().
+  uint32_t io_queue::outstanding()
+  {
+    return requests_outstanding;
+  }
+
+  /// @brief Is this queue using io_uring?
+  ///
+  /// @return True if io_uring is in use, false if requests are carried out by a thread pool.
+  bool io_queue::using_io_uring()
+  {
+    return engine->is_io_uring();
+  }
+
+  /// @brief Split a request into backing file operations, and submit them.
+  ///
+  /// Parts of the request that are not stored in the backing file are completed immediately. If there are no other
+  /// parts, a placeholder operation is completed so that the request is still reported by reap().
+  ///
+  /// @param disk The disk to access.
+  ///
+  /// @param buffer The buffer to transfer to or from.
+  ///
+  /// @param start_posn The position on the disk to begin at.
+  ///
+  /// @param length The number of bytes to transfer.
+  ///
+  /// @param is_write Whether this is a write (true) or read (false).
+  ///
+  /// @param callback Called from reap() once the request is complete.
+  void io_queue::submit(virt_disk &disk,
+                        uint8_t *buffer,
+                        uint64_t start_posn,
+                        uint64_t length,
+                        bool is_write,
+                        io_callback callback)
+  {
+    std::vector<disk_extent> extents;
+    io_stats_recorder *recorder = disk.stats();
+    const uint64_t start_ns = (recorder != nullptr) ? io_stats_recorder::now() : 0;
+    disk.sync_cache(start_posn, length, is_write);
+
+    // The mapped locations must stay valid until the request is reaped.
+    const uint32_t counter = disk.begin_io();
+    try
+    {
+      if (is_write)
+      {
+        disk.map_write(is_zero_buffer(buffer, length), start_posn, length, extents);
+      }
+      else
+      {
+        disk.map_range(start_posn, length, false, extents);
+      }
+    }
+    catch (...)
+    {
+      disk.end_io(counter);
+      throw;
+    }
+
+    std::unique_ptr<queued_request> request(
+      new queued_request{std::move(callback), 0, nullptr, &disk, counter, recorder, start_ns, length, is_write});
+    std::vector<file_op *> ops;
+    disk_file *file = disk.get_backing_file();
+
+    for (const disk_extent &extent : extents)
+    {
+      uint8_t *extent_buffer = buffer + (extent.start_posn - start_posn);
+      if (extent.file_offset == EXTENT_UNALLOCATED)
+      {
+        if (!is_write)
+        {
+          memset(extent_buffer, 0, extent.length);
+        }
+        continue;
+      }
+
+      disk_file *extent_file = (extent.file != nullptr) ? extent.file : file;
+      ops.push_back(new file_op{request.get(), extent_file, extent_buffer, extent.length, extent.file_offset, is_write});
+
+      if (recorder != nullptr)
+      {
+        recorder->add(is_write ? stat_counter::BACKING_WRITES : stat_counter::BACKING_READS, 1);
+        recorder->add(is_write ? stat_counter::BACKING_BYTES_WRITTEN : stat_counter::BACKING_BYTES_READ, extent.length);
+      }
+    }
+
+    if (ops.empty())
+    {
+      // Nothing needs the backing file, but the request must still pass through the engine to be reaped.
+      ops.push_back(new file_op{request.get(), file, buffer, 0, 0, is_write});
+    }
+
+    request->ops_outstanding = static_cast<uint32_t>(ops.size());
+    requests_outstanding++;
+    request.release();
+
+    for (file_op *op : ops)
+    {
+      engine->submit(op);
+    }
+  }
+};
@@ -0,0 +1,250 @@
+/// @file
+/// @brief Implements the gathering of I/O statistics for virtual disks.
+
+// Copyright Martin Hughes 2018.
+
+#include "virtualdisk/virt_disk_stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+
+namespace
+{
+  /// The smallest latency, in nanoseconds, that shares a bucket with other latencies.
+  const uint64_t LINEAR_LIMIT_NS = 16;
+
+  /// log2 of latency_histogram::SUB_BUCKETS.
+  const uint32_t SUB_BUCKET_BITS = 3;
+
+  /// log2 of LINEAR_LIMIT_NS.
+  const uint32_t FIRST_EXPONENT = 4;
+
+  /// Latencies of 2 to this power nanoseconds or more are all counted in the last bucket.
+  const uint32_t LIMIT_EXPONENT = 40;
+}
+
+namespace virt_disk
+{
+  /// @brief Find which bucket of a histogram a latency is counted in.
+  ///
+  /// @param latency_ns The latency, in nanoseconds.
+  ///
+  /// @return The index of the bucket.
+  uint32_t latency_histogram::bucket_for(uint64_t latency_ns)
+  {
+    if (latency_ns < LINEAR_LIMIT_NS)
+    {
+      return static_cast<uint32_t>(latency_ns);
+    }
+
+    uint32_t exponent = FIRST_EXPONENT;
+    while (((latency_ns >> (exponent + 1)) != 0) && (exponent < LIMIT_EXPONENT))
+    {
+      exponent++;
+    }
+
+    if (exponent >= LIMIT_EXPONENT)
+    {
+      return BUCKET_COUNT - 1;
+    }
+
+    const uint64_t sub_bucket = (latency_ns >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    return static_cast<uint32_t>(LINEAR_LIMIT_NS + ((exponent - FIRST_EXPONENT) * SUB_BUCKETS) + sub_bucket);
+  }
+
+  /// @brief Find the largest latency that is counted in a bucket.
+  ///
+  /// @param bucket The index of the bucket.
+  ///
+  /// @return The largest latency counted in that bucket, in nanoseconds.
+  uint64_t latency_histogram::bucket_upper_bound(uint32_t bucket)
+  {
+    if (bucket < LINEAR_LIMIT_NS)
+    {
+      return bucket;
+    }
+    if (bucket >= (BUCKET_COUNT - 1))
+    {
+      return ~0ULL;
+    }
+
+    const uint32_t exponent = FIRST_EXPONENT + ((bucket - LINEAR_LIMIT_NS) / SUB_BUCKETS);
+    const uint64_t sub_bucket = (bucket - LINEAR_LIMIT_NS) % SUB_BUCKETS;
+    const uint64_t width = 1ULL << (exponent - SUB_BUCKET_BITS);
+    return ((SUB_BUCKETS + sub_bucket) * width) + width - 1;
+  }
+
+  /// @brief Estimate a percentile of the recorded latencies.
+  ///
+  /// The estimate is the upper bound of the bucket holding the percentile, so it is never less than the true value
+  /// and at most 12.5% more than it.
+  ///
+  /// @param fraction The percentile wanted, as a fraction - for example, 0.99 for the 99th percentile.
+  ///
+  /// @return The estimated latency, in nanoseconds. Zero if nothing has been recorded.
+  uint64_t latency_histogram::percentile(double fraction) const
+  {
+    if (count == 0)
+    {
+      return 0;
+    }
+
+    uint64_t wanted = static_cast<uint64_t>(ceil(fraction * static_cast<double>(count)));
+    wanted = std::min(std::max(wanted, static_cast<uint64_t>(1)), count);
+
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < BUCKET_COUNT; i++)
+    {
+      seen += buckets[i];
+      if (seen >= wanted)
+      {
+        return std::min(bucket_upper_bound(i), max_ns);
+      }
+    }
+
+    return max_ns;
+  }
+
+  io_stats_recorder::io_stats_recorder() : slots(new slot[SLOT_COUNT])
+  {
+    reset();
+  }
+
+  /// @brief Get the current time, for measuring latencies.
+  ///
+  /// @return A monotonic time, in nanoseconds.
+  uint64_t io_stats_recorder::now()
+  {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count());
+  }
+
+  /// @brief Add to one of the counters.
+  ///
+  /// @param counter One of the stat_counter constants.
+  ///
+  /// @param amount The amount to add.
+  void io_stats_recorder::add(uint32_t counter, uint64_t amount)
+  {
+    this_thread_slot().counters[counter].fetch_add(amount, std::memory_order_relaxed);
+  }
+
+  /// @brief Record the latency of an operation that has just finished.
+  ///
+  /// @param histogram One of the stat_latency constants.
+  ///
+  /// @param start_ns The value of now() when the operation started.
+  void io_stats_recorder::add_latency(uint32_t histogram, uint64_t start_ns)
+  {
+    const uint64_t end_ns = now();
+    const uint64_t latency_ns = (end_ns > start_ns) ? (end_ns - start_ns) : 0;
+    slot &this_slot = this_thread_slot();
+
+    this_slot.buckets[histogram][latency_histogram::bucket_for(latency_ns)].fetch_add(1, std::memory_order_relaxed);
+    this_slot.total_ns[histogram].fetch_add(latency_ns, std::memory_order_relaxed);
+
+    uint64_t max_ns = this_slot.max_ns[histogram].load(std::memory_order_relaxed);
+    while ((latency_ns > max_ns) &&
+           !this_slot.max_ns[histogram].compare_exchange_weak(max_ns, latency_ns, std::memory_order_relaxed))
+    {
+    }
+  }
+
+  /// @brief Add the time since start_ns to one of the counters.
+  ///
+  /// @param counter One of the stat_counter constants that counts nanoseconds.
+  ///
+  /// @param start_ns The value of now() when the work being timed started.
+  void io_stats_recorder::add_time(uint32_t counter, uint64_t start_ns)
+  {
+    const uint64_t end_ns = now();
+    add(counter, (end_ns > start_ns) ? (end_ns - start_ns) : 0);
+  }
+
+  /// @brief Add up the statistics recorded by every thread.
+  ///
+  /// @return The statistics recorded since this object was created or reset() was last called.
+  io_stats io_stats_recorder::snapshot()
+  {
+    io_stats result{};
+    uint64_t totals[stat_counter::COUNT] = { };
+    latency_histogram *histograms[stat_latency::COUNT] =
+      { &result.read_latency, &result.write_latency, &result.allocate_latency };
+
+    for (uint32_t i = 0; i < SLOT_COUNT; i++)
+    {
+      const slot &this_slot = slots[i];
+      for (uint32_t counter = 0; counter < stat_counter::COUNT; counter++)
+      {
+        totals[counter] += this_slot.counters[counter].load(std::memory_order_relaxed);
+      }
+
+      for (uint32_t h = 0; h < stat_latency::COUNT; h++)
+      {
+        latency_histogram &histogram = *histograms[h];
+        for (uint32_t bucket = 0; bucket < latency_histogram::BUCKET_COUNT; bucket++)
+        {
+          const uint64_t in_bucket = this_slot.buckets[h][bucket].load(std::memory_order_relaxed);
+          histogram.buckets[bucket] += in_bucket;
+          histogram.count += in_bucket;
+        }
+        histogram.total_ns += this_slot.total_ns[h].load(std::memory_order_relaxed);
+        histogram.max_ns = std::max(histogram.max_ns, this_slot.max_ns[h].load(std::memory_order_relaxed));
+      }
+    }
+
+    result.reads = totals[stat_counter::READS];
+    result.writes = totals[stat_counter::WRITES];
+    result.bytes_read = totals[stat_counter::BYTES_READ];
+    result.bytes_written = totals[stat_counter::BYTES_WRITTEN];
+    result.backing_reads = totals[stat_counter::BACKING_READS];
+    result.backing_writes = totals[stat_counter::BACKING_WRITES];
+    result.backing_bytes_read = totals[stat_counter::BACKING_BYTES_READ];
+    result.backing_bytes_written = totals[stat_counter::BACKING_BYTES_WRITTEN];
+    result.data_ns = totals[stat_counter::DATA_NS];
+    result.blocks_allocated = totals[stat_counter::BLOCKS_ALLOCATED];
+    result.zero_fills = totals[stat_counter::ZERO_FILLS];
+    result.zero_fill_bytes = totals[stat_counter::ZERO_FILL_BYTES];
+    result.metadata_writes = totals[stat_counter::METADATA_WRITES];
+    result.metadata_ns = totals[stat_counter::METADATA_NS];
+
+    return result;
+  }
+
+  /// @brief Set every statistic back to zero.
+  ///
+  void io_stats_recorder::reset()
+  {
+    for (uint32_t i = 0; i < SLOT_COUNT; i++)
+    {
+      slot &this_slot = slots[i];
+      for (std::atomic<uint64_t> &counter : this_slot.counters)
+      {
+        counter.store(0, std::memory_order_relaxed);
+      }
+
+      for (uint32_t h = 0; h < stat_latency::COUNT; h++)
+      {
+        for (std::atomic<uint64_t> &bucket : this_slot.buckets[h])
+        {
+          bucket.store(0, std::memory_order_relaxed);
+        }
+        this_slot.total_ns[h].store(0, std::memory_order_relaxed);
+        this_slot.max_ns[h].store(0, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /// @brief Find the slot that the calling thread records its statistics in.
+  ///
+  /// Threads are given slots in turn as they first record something, so a few busy threads never share one.
+  ///
+  /// @return The calling thread's slot.
+  io_stats_recorder::slot &io_stats_recorder::this_thread_slot()
+  {
+    static std::atomic<uint32_t> next_thread_slot{0};
+    static thread_local uint32_t thread_slot = next_thread_slot++ % SLOT_COUNT;
+    return slots[thread_slot];
+  }
+};
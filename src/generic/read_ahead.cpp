@@ -0,0 +1,323 @@
+/// @file
+/// @brief Implements detection of sequential and strided reads, and reading ahead of them into the block cache.
+
+// Copyright Martin Hughes 2018.
+
+#include "virtualdisk/virt_disk_cache.h"
+
+#include <algorithm>
+
+namespace
+{
+  /// The most blocks read from the image in one go by the read-ahead thread.
+  const uint64_t MAX_FETCH_RUN_BLOCKS = 64;
+}
+
+namespace virt_disk
+{
+  /// @brief Start reading ahead for a disk.
+  ///
+  /// @param disk The disk to read ahead. It must have a cache attached, and must outlive this object.
+  ///
+  /// @param config The read-ahead settings.
+  read_ahead::read_ahead(virt_disk *disk, const read_ahead_config &config) :
+    disk{disk},
+    config{config},
+    read_count{0},
+    stopping{false}
+  {
+    this->config.initial_window = std::max(1U, std::min(this->config.initial_window, this->config.max_window));
+    this->config.stream_count = std::max(1U, this->config.stream_count);
+    streams.resize(this->config.stream_count, read_stream{0, 0, 0, 0, this->config.initial_window, 0, 0});
+
+    worker_thread = std::thread(&read_ahead::worker, this);
+  }
+
+  /// @brief Stop reading ahead. Any ranges not yet read are abandoned.
+  ///
+  read_ahead::~read_ahead()
+  {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    pending_cv.notify_one();
+    worker_thread.join();
+  }
+
+  /// @brief Tell the detector about a read, and start reading ahead if it continues a stream.
+  ///
+  /// @param start_posn The position on the disk the read began at.
+  ///
+  /// @param length The length of the read.
+  void read_ahead::note_read(uint64_t start_posn, uint64_t length)
+  {
+    if (length == 0)
+    {
+      return;
+    }
+
+    const uint64_t end_posn = start_posn + length;
+    std::lock_guard<std::mutex> guard(lock);
+    read_count++;
+
+    read_stream *stream = nullptr;
+    read_stream *newest_single = nullptr;
+    read_stream *oldest = &streams[0];
+
+    for (read_stream &candidate : streams)
+    {
+      bool sequential = (candidate.last_used != 0) && (start_posn == candidate.last_end);
+      bool strided = (candidate.stride != 0) && (start_posn == (candidate.last_start + candidate.stride));
+      if (sequential || strided)
+      {
+        stream = &candidate;
+        break;
+      }
+
+      if ((candidate.last_used != 0) &&
+          (candidate.matches == 0) &&
+          (start_posn > candidate.last_end) &&
+          ((newest_single == nullptr) || (candidate.last_used > newest_single->last_used)))
+      {
+        newest_single = &candidate;
+      }
+
+      if (candidate.last_used < oldest->last_used)
+      {
+        oldest = &candidate;
+      }
+    }
+
+    if (stream == nullptr)
+    {
+      if (newest_single != nullptr)
+      {
+        // Two reads in a row that are not adjacent might be the start of a strided stream. A third read at the same
+        // stride confirms it.
+        stream = newest_single;
+      }
+      else
+      {
+        *oldest = read_stream{start_posn, end_posn, 0, 0, config.initial_window, 0, read_count};
+        return;
+      }
+    }
+
+    const bool sequential = (start_posn == stream->last_end);
+    stream->stride = start_posn - stream->last_start;
+    stream->matches++;
+    stream->last_start = start_posn;
+    stream->last_end = end_posn;
+    stream->last_used = read_count;
+
+    if (stream->matches < 2)
+    {
+      return;
+    }
+
+    const uint64_t block_size = disk->cache->get_config().block_size;
+    const uint64_t disk_length = disk->get_length();
+
+    if (sequential)
+    {
+      // Sequential - read ahead the next window of blocks, topping up once half of it has been used.
+      uint64_t window_bytes = stream->window * block_size;
+      if ((end_posn + (window_bytes / 2)) <= stream->prefetched_to)
+      {
+        return;
+      }
+
+      if (stream->prefetched_to > start_posn)
+      {
+        stream->window = std::min(stream->window * 2, config.max_window);
+        window_bytes = stream->window * block_size;
+      }
+
+      uint64_t from = std::max(end_posn, stream->prefetched_to);
+      uint64_t to = std::min(end_posn + window_bytes, disk_length);
+      if (to > from)
+      {
+        queue_range(from, to - from);
+        stream->prefetched_to = to;
+      }
+    }
+    else
+    {
+      // Strided - read ahead the next window of reads at the same stride.
+      if ((start_posn + ((stream->window / 2) * stream->stride)) < stream->prefetched_to)
+      {
+        return;
+      }
+
+      if (stream->prefetched_to > start_posn)
+      {
+        stream->window = std::min(stream->window * 2, config.max_window);
+      }
+
+      for (uint64_t i = 1; i <= stream->window; i++)
+      {
+        uint64_t from = start_posn + (i * stream->stride);
+        if (from >= disk_length)
+        {
+          break;
+        }
+        if (from < stream->prefetched_to)
+        {
+          continue;
+        }
+
+        queue_range(from, std::min(length, disk_length - from));
+        stream->prefetched_to = from + 1;
+      }
+    }
+  }
+
+  /// @brief Queue a range to be read by the worker thread. Must be called with lock held.
+  ///
+  /// If the worker has fallen far behind, the oldest ranges are dropped - they are likely to have been read already.
+  ///
+  /// @param start_posn The position on the disk the range begins.
+  ///
+  /// @param length The length of the range.
+  void read_ahead::queue_range(uint64_t start_posn, uint64_t length)
+  {
+    pending.emplace_back(start_posn, length);
+
+    while (pending.size() > (static_cast<uint64_t>(config.stream_count) * config.max_window))
+    {
+      pending.pop_front();
+    }
+
+    pending_cv.notify_one();
+  }
+
+  /// @brief The body of the worker thread.
+  ///
+  void read_ahead::worker()
+  {
+    std::unique_lock<std::mutex> guard(lock);
+
+    while (true)
+    {
+      pending_cv.wait(guard, [this]() { return stopping || !pending.empty(); });
+      if (stopping)
+      {
+        return;
+      }
+
+      std::pair<uint64_t, uint64_t> range = pending.front();
+      pending.pop_front();
+      guard.unlock();
+
+      try
+      {
+        fetch(range.first, range.second);
+      }
+      catch (std::exception &)
+      {
+        // Read-ahead is only a hint. Any real problem will be reported when the data is read.
+      }
+
+      guard.lock();
+    }
+  }
+
+  /// @brief Read the allocated, uncached blocks covering a range into the cache.
+  ///
+  /// @param start_posn The position on the disk the range begins.
+  ///
+  /// @param length The length of the range.
+  void read_ahead::fetch(uint64_t start_posn, uint64_t length)
+  {
+    block_cache *cache = disk->cache.get();
+    const uint64_t block_size = cache->get_config().block_size;
+    const uint64_t disk_length = disk->get_length();
+    const uint64_t first_block = start_posn / block_size;
+    const uint64_t last_block = (start_posn + length - 1) / block_size;
+    const uint64_t range_start = first_block * block_size;
+    const uint64_t range_end = std::min((last_block + 1) * block_size, disk_length);
+
+    std::vector<disk_extent> extents;
+    disk->map_range(range_start, range_end - range_start, false, extents);
+
+    std::unique_ptr<uint8_t[]> run_buffer;
+    uint64_t generations[MAX_FETCH_RUN_BLOCKS];
+    uint64_t run_first = 0;
+    uint64_t run_count = 0;
+
+    auto read_run = [&]()
+    {
+      if (run_count == 0)
+      {
+        return;
+      }
+
+      uint64_t run_start = run_first * block_size;
+      uint64_t run_end = std::min((run_first + run_count) * block_size, disk_length);
+      if (!run_buffer)
+      {
+        run_buffer = std::unique_ptr<uint8_t[]>(new uint8_t[MAX_FETCH_RUN_BLOCKS * block_size]);
+      }
+      disk->read_uncached(run_buffer.get(), run_start, run_end - run_start);
+
+      for (uint64_t i = 0; i < run_count; i++)
+      {
+        uint64_t block_start = run_start + (i * block_size);
+        cache->insert(disk,
+                      run_first + i,
+                      run_buffer.get() + (i * block_size),
+                      std::min(block_size, run_end - block_start),
+                      false,
+                      generations[i],
+                      true);
+      }
+
+      run_count = 0;
+    };
+
+    size_t extent_idx = 0;
+    for (uint64_t block = first_block; block <= last_block; block++)
+    {
+      uint64_t block_start = block * block_size;
+      uint64_t block_end = std::min(block_start + block_size, disk_length);
+
+      while ((extent_idx < extents.size()) &&
+             ((extents[extent_idx].start_posn + extents[extent_idx].length) <= block_start))
+      {
+        extent_idx++;
+      }
+
+      bool allocated = false;
+      for (size_t i = extent_idx; (i < extents.size()) && (extents[i].start_posn < block_end); i++)
+      {
+        if (extents[i].file_offset != EXTENT_UNALLOCATED)
+        {
+          allocated = true;
+          break;
+        }
+      }
+
+      uint64_t generation;
+      if (!allocated || cache->contains(disk, block, generation))
+      {
+        read_run();
+        continue;
+      }
+
+      if (run_count == 0)
+      {
+        run_first = block;
+      }
+      generations[run_count] = generation;
+      run_count++;
+
+      if (run_count == MAX_FETCH_RUN_BLOCKS)
+      {
+        read_run();
+      }
+    }
+
+    read_run();
+  }
+};
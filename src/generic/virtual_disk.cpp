@@ -6,59 +6,1603 @@
 #include "virtualdisk/virtualdisk.h"
 #include "virtualdisk/virt_disk_vdi.h"
 #include "virtualdisk/virt_disk_vhd.h"
+#include "virtualdisk/virt_disk_file.h"
+#include "virtualdisk/virt_disk_cache.h"
+#include "virtualdisk/virt_disk_zero.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
 #include <functional>
+#include <string.h>
+#include <thread>
 
 namespace
 {
-  typedef std::function<virt_disk::virt_disk *(std::string)> disk_constructor;
+  typedef bool (*format_probe)(const uint8_t *first_sector, const uint8_t *last_sector, uint64_t file_length);
+  typedef std::function<virt_disk::virt_disk *(std::unique_ptr<virt_disk::disk_file>,
+                                               const std::string &,
+                                               const virt_disk::open_config &)> disk_constructor;
 
+  /// @brief How to recognise, and open, one disk image format.
+  ///
   struct format_info
   {
-    disk_constructor constructor_fn;
+    format_probe probe_fn; ///< Decides from the first and last sectors of a file whether it is of this format.
+    disk_constructor constructor_fn; ///< Opens a file of this format.
   };
 
   format_info known_types[] =
     {
       {
-        [](std::string f) { return dynamic_cast<virt_disk::virt_disk *>(new virt_disk::vdi_disk(f)); }
+        virt_disk::vdi_disk::probe,
+        [](std::unique_ptr<virt_disk::disk_file> file, const std::string &, const virt_disk::open_config &config)
+        {
+          return dynamic_cast<virt_disk::virt_disk *>(new virt_disk::vdi_disk(std::move(file), config));
+        }
       },
       {
-        [](std::string f) { return dynamic_cast<virt_disk::virt_disk *>(new virt_disk::vhd_disk(f)); }
+        virt_disk::vhd_disk::probe,
+        [](std::unique_ptr<virt_disk::disk_file> file, const std::string &f, const virt_disk::open_config &config)
+        {
+          return dynamic_cast<virt_disk::virt_disk *>(new virt_disk::vhd_disk(std::move(file), f, config));
+        }
       },
     };
 
   const uint32_t NUM_FORMATS = sizeof(known_types) / sizeof(format_info);
+
+  /// The number of bytes at each end of a file that are given to the format probes.
+  const uint64_t PROBE_SECTOR_BYTES = 512;
+
+  /// The largest view of unallocated space returned by virt_disk::map_view().
+  const uint64_t ZERO_VIEW_BYTES = 1024 * 1024;
+
+  /// The size of each piece of the disk examined in turn by virt_disk::seek_data() and virt_disk::seek_hole().
+  const uint64_t SEEK_CHUNK_BYTES = 256 * 1024 * 1024;
+
+  /// The most consecutive cache misses that virt_disk::read_range() reads from the image in one go.
+  const uint64_t MAX_MISS_RUN_BLOCKS = 64;
+
+  /// How long virt_disk::begin_block_moves() waits for I/O in progress to finish before letting new I/O start again.
+  const std::chrono::milliseconds BLOCK_MOVE_WAIT(100);
 }
 
 namespace virt_disk
 {
   /// @brief Creates a virtual disk image object from the provided filename.
   ///
-  /// In future, this function will look at the image to determine its type, before returning an object of a suitable
-  /// type. At the moment, however, it assumes the image is of VDI format and returns an object to handle that.
+  /// The file is opened once, and its first and last sectors are read and given to each known format's probe in turn.
+  /// Only the first format that recognises the file is constructed - using the file that is already open - so opening
+  /// an image costs no more than opening it as the right format directly.
   ///
   /// @param filename The filename of the disk image to open.
   ///
+  /// @param config Options controlling how the image is opened.
+  ///
   /// @return An object that can be used to access that virtual disk.
-  virt_disk * virt_disk::create_virtual_disk(std::string &filename)
+  virt_disk * virt_disk::create_virtual_disk(std::string &filename, const open_config &config)
   {
-    for (int i = 0; i < NUM_FORMATS; i++)
+    std::unique_ptr<disk_file> file = disk_file::open(filename, config.direct_io, config.read_only);
+    const uint64_t file_length = file->get_length();
+    const uint64_t probe_length = std::min(file_length, PROBE_SECTOR_BYTES);
+
+    uint8_t first_sector[PROBE_SECTOR_BYTES] = { 0 };
+    uint8_t last_sector[PROBE_SECTOR_BYTES] = { 0 };
+    if (probe_length != 0)
     {
-      try
+      file->read_at(first_sector, probe_length, 0);
+      file->read_at(last_sector, probe_length, file_length - probe_length);
+    }
+
+    for (uint32_t i = 0; i < NUM_FORMATS; i++)
+    {
+      if (known_types[i].probe_fn(first_sector, last_sector, file_length))
+      {
+        return known_types[i].constructor_fn(std::move(file), filename, config);
+      }
+    }
+
+    throw std::fstream::failure("No valid format");
+  }
+
+  /// @brief Create a new, empty disk image and open it.
+  ///
+  /// The image's metadata - the VDI header and block map, or the VHD footer, dynamic header and block allocation
+  /// table - is written directly. The data area of a fixed image is made by extending the file, so it is sparse where
+  /// the filesystem allows and even a very large fixed image is created almost at once. Set
+  /// create_config::allocate_space to have the storage allocated up front instead.
+  ///
+  /// @param filename The file to create. It must not already exist. If the image cannot be written, opened or its
+  ///                 space allocated, the new file is removed again - but a file that already existed is left alone.
+  ///
+  /// @param size The size of the virtual disk, in bytes. VHD images are rounded up to a whole number of sectors.
+  ///
+  /// @param config The format of the new image, and how to open it.
+  ///
+  /// @return An object that can be used to access the new disk.
+  virt_disk * virt_disk::create_image(const std::string &filename, uint64_t size, const create_config &config)
+  {
+    switch (config.format)
+    {
+    case image_format::VDI_NORMAL:
+      vdi_disk::create(filename, size, VDI_TYPE_NORMAL, config.block_size);
+      break;
+
+    case image_format::VDI_FIXED:
+      vdi_disk::create(filename, size, VDI_TYPE_FIXED_SIZE, config.block_size);
+      break;
+
+    case image_format::VHD_FIXED:
+      vhd_disk::create(filename, size, vhd_disk_type::FIXED, config.block_size);
+      break;
+
+    case image_format::VHD_DYNAMIC:
+      vhd_disk::create(filename, size, vhd_disk_type::DYNAMIC, config.block_size);
+      break;
+
+    default:
+      throw std::fstream::failure("Unknown image format");
+    }
+
+    std::string image_name = filename;
+    std::unique_ptr<virt_disk> disk;
+
+    try
+    {
+      disk = std::unique_ptr<virt_disk>(create_virtual_disk(image_name, config.open));
+      if (config.allocate_space)
+      {
+        disk->preallocate(0, disk->get_length());
+        disk->flush();
+      }
+    }
+    catch (...)
+    {
+      disk.reset();
+      std::remove(filename.c_str());
+      throw;
+    }
+
+    return disk.release();
+  }
+
+  /// @brief Read a contiguous range of the disk into several buffers.
+  ///
+  /// Without a cache, each run of the range that is contiguous in the backing file is read straight into the buffers
+  /// with one vectored read, however the buffers and the image's blocks line up - so a multi-segment request needs
+  /// neither a bounce buffer nor a call per segment.
+  ///
+  /// @param segments The buffers to fill, in order. The range is as long as all of them together.
+  ///
+  /// @param count The number of entries in segments.
+  ///
+  /// @param start_posn The number of bytes into the virtual disk to begin reading.
+  void virt_disk::readv(const io_segment *segments, uint32_t count, uint64_t start_posn)
+  {
+    disk_io_range range = { start_posn, segments, count };
+    readv(&range, 1);
+  }
+
+  /// @brief Write several buffers to a contiguous range of the disk.
+  ///
+  /// @param segments The buffers to write, in order. The range is as long as all of them together.
+  ///
+  /// @param count The number of entries in segments.
+  ///
+  /// @param start_posn The position on the disk to begin writing at.
+  void virt_disk::writev(const io_segment *segments, uint32_t count, uint64_t start_posn)
+  {
+    disk_io_range range = { start_posn, segments, count };
+    writev(&range, 1);
+  }
+
+  /// @brief Read several separate ranges of the disk, each into its own list of buffers.
+  ///
+  /// Without a cache, all of the ranges are mapped first, so parts of different ranges that lie next to each other in
+  /// the backing file are read together.
+  ///
+  /// @param ranges The ranges to read. They must not overlap.
+  ///
+  /// @param count The number of entries in ranges.
+  void virt_disk::readv(const disk_io_range *ranges, uint32_t count)
+  {
+    io_stats_recorder *recorder = stats();
+    const uint64_t start_ns = (recorder != nullptr) ? io_stats_recorder::now() : 0;
+    uint64_t total_length = 0;
+
+    if (!cache && !combiner)
+    {
+      transfer_uncached(ranges, count, false);
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+      uint64_t posn = ranges[i].start_posn;
+      for (uint32_t j = 0; j < ranges[i].count; j++)
       {
-        virt_disk *disk = known_types[i].constructor_fn(filename);
-        if (disk != nullptr)
+        uint8_t *buffer = reinterpret_cast<uint8_t *>(ranges[i].segments[j].buffer);
+        if (combiner)
         {
-          return disk;
+          combiner->read(buffer, posn, ranges[i].segments[j].length);
         }
+        else if (cache)
+        {
+          read_cached(buffer, posn, ranges[i].segments[j].length);
+        }
+        posn += ranges[i].segments[j].length;
+        total_length += ranges[i].segments[j].length;
       }
-      catch (std::fstream::failure &fault)
+    }
+
+    if (recorder != nullptr)
+    {
+      record_io(recorder, false, total_length, start_ns);
+    }
+  }
+
+  /// @brief Write several separate ranges of the disk, each from its own list of buffers.
+  ///
+  /// @param ranges The ranges to write. They must not overlap.
+  ///
+  /// @param count The number of entries in ranges.
+  void virt_disk::writev(const disk_io_range *ranges, uint32_t count)
+  {
+    io_stats_recorder *recorder = stats();
+    const uint64_t start_ns = (recorder != nullptr) ? io_stats_recorder::now() : 0;
+    uint64_t total_length = 0;
+
+    if (!combiner)
+    {
+      store_ranges(ranges, count);
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+      uint64_t posn = ranges[i].start_posn;
+      for (uint32_t j = 0; j < ranges[i].count; j++)
       {
-        continue;
+        if (combiner)
+        {
+          combiner->write(reinterpret_cast<const uint8_t *>(ranges[i].segments[j].buffer),
+                          posn,
+                          ranges[i].segments[j].length);
+        }
+        posn += ranges[i].segments[j].length;
+        total_length += ranges[i].segments[j].length;
       }
     }
 
-    throw std::fstream::failure("No valid format");
+    if (recorder != nullptr)
+    {
+      record_io(recorder, true, total_length, start_ns);
+    }
+  }
+
+  /// @brief Get a read-only view of part of the disk, mapped directly from the backing file without copying.
+  ///
+  /// Only a range that is contiguous in the backing file can be viewed at once, so the view may be shorter than
+  /// requested. For a fixed size image it never is, but for a dynamic image the view ends at the end of the run of
+  /// contiguous blocks containing start_posn. Unallocated parts of the disk are viewed as zeroes. To process a whole
+  /// range:
+  ///
+  /// @code
+  /// while (length > 0)
+  /// {
+  ///   disk_view view = disk->map_view(start_posn, length, view_access::SEQUENTIAL);
+  ///   process(view.data(), view.size());
+  ///   start_posn += view.size();
+  ///   length -= view.size();
+  /// }
+  /// @endcode
+  ///
+  /// A view always remains safe to read. compact() does not shorten the backing file while any view of it exists, but
+  /// a view of a block that compact() moves or removes goes on showing the old copy, so may no longer match the disk.
+  ///
+  /// @param start_posn The number of bytes into the virtual disk to begin the view.
+  ///
+  /// @param length The maximum length of the view, in bytes.
+  ///
+  /// @param access_hint One of the view_access constants, describing how the view will be used.
+  ///
+  /// @return A view of at least one byte, unless length is zero.
+  disk_view virt_disk::map_view(uint64_t start_posn, uint64_t length, uint32_t access_hint)
+  {
+    std::vector<disk_extent> extents;
+    sync_cache(start_posn, length, false);
+
+    // The view is made as a single I/O, so that compact() cannot move the block between mapping and viewing it, nor
+    // shorten the file without knowing that the view exists.
+    const uint32_t counter = begin_io();
+    disk_view view;
+    try
+    {
+      map_range(start_posn, length, false, extents);
+      if (!extents.empty())
+      {
+        const disk_extent &first = extents.front();
+        if (first.file_offset == EXTENT_UNALLOCATED)
+        {
+          static std::shared_ptr<const uint8_t> zeroes(new uint8_t[ZERO_VIEW_BYTES](),
+                                                       std::default_delete<uint8_t[]>());
+          view = disk_view(zeroes, std::min(first.length, ZERO_VIEW_BYTES));
+        }
+        else
+        {
+          disk_file *file = (first.file != nullptr) ? first.file : get_backing_file();
+          view = disk_view(file->map(first.file_offset, first.length, access_hint), first.length);
+        }
+      }
+    }
+    catch (...)
+    {
+      end_io(counter);
+      throw;
+    }
+
+    end_io(counter);
+    return view;
+  }
+
+  /// @brief Find which parts of a range of the disk are stored in the image, and which are holes.
+  ///
+  /// Holes read as zeroes, so a tool copying or backing up the disk need only read the allocated extents. The map comes
+  /// from the image's own metadata, such as the VDI block map or the VHD block allocation table, so no data is read.
+  /// Allocated extents may still contain zeroes that were written explicitly.
+  ///
+  /// @param start_posn The number of bytes into the virtual disk that the range begins.
+  ///
+  /// @param length The length of the range, in bytes.
+  ///
+  /// @param extents Extents covering the whole range, in order, are appended to this vector. Neighbouring extents
+  ///                always differ in whether they are allocated.
+  void virt_disk::get_allocation(uint64_t start_posn, uint64_t length, std::vector<allocation_extent> &extents)
+  {
+    std::vector<disk_extent> mapped;
+
+    // Data held in a write-back cache only gets space in the image when it is written back.
+    sync_cache(start_posn, length, false);
+    map_range(start_posn, length, false, mapped);
+
+    size_t first_new = extents.size();
+    for (const disk_extent &extent : mapped)
+    {
+      bool allocated = (extent.file_offset != EXTENT_UNALLOCATED);
+      if ((extents.size() > first_new) && (extents.back().allocated == allocated))
+      {
+        extents.back().length += extent.length;
+      }
+      else
+      {
+        extents.push_back({extent.start_posn, extent.length, allocated});
+      }
+    }
+  }
+
+  /// @brief Find the next part of the disk that is stored in the image. Equivalent to lseek() with SEEK_DATA.
+  ///
+  /// @param start_posn The position on the disk to begin searching from.
+  ///
+  /// @return The first allocated position at or after start_posn, or the length of the disk if there is none.
+  uint64_t virt_disk::seek_data(uint64_t start_posn)
+  {
+    return seek_allocation(start_posn, true);
+  }
+
+  /// @brief Find the next hole in the disk. Equivalent to lseek() with SEEK_HOLE.
+  ///
+  /// @param start_posn The position on the disk to begin searching from.
+  ///
+  /// @return The first unallocated position at or after start_posn, or the length of the disk if there is none.
+  uint64_t virt_disk::seek_hole(uint64_t start_posn)
+  {
+    return seek_allocation(start_posn, false);
+  }
+
+  /// @brief Allocate space in the image for a range of the disk now, rather than as it is first written.
+  ///
+  /// For dynamic images, every block holding part of the range that is not yet stored is allocated in one pass. The
+  /// backing file is extended once to hold them all, with its storage allocated by the filesystem where possible, so
+  /// the new blocks are laid out one after another in the file. Writing to the range later costs the same as
+  /// overwriting it. The contents of the disk are not changed. Fixed size images already have every block, so only
+  /// the filesystem's storage behind the range is allocated, where the file is sparse.
+  ///
+  /// @param start_posn The number of bytes into the virtual disk that the range begins.
+  ///
+  /// @param length The length of the range, in bytes.
+  void virt_disk::preallocate(uint64_t start_posn, uint64_t length)
+  {
+    const uint64_t disk_length = get_length();
+    if ((start_posn > disk_length) || (length > (disk_length - start_posn)))
+    {
+      throw std::fstream::failure("Too long");
+    }
+
+    if (length == 0)
+    {
+      return;
+    }
+
+    const uint32_t counter = begin_io();
+
+    try
+    {
+      allocate_blocks(start_posn, length);
+    }
+    catch (...)
+    {
+      end_io(counter);
+      throw;
+    }
+
+    end_io(counter);
+  }
+
+  /// @brief Allocate storage in the backing file for the parts of a range that are stored in it.
+  ///
+  /// This is all that preallocation means for a fixed size image, whose file may be sparse.
+  ///
+  /// @param start_posn The number of bytes into the virtual disk that the range begins.
+  ///
+  /// @param length The length of the range, in bytes.
+  void virt_disk::allocate_blocks(uint64_t start_posn, uint64_t length)
+  {
+    std::vector<disk_extent> extents;
+    map_range(start_posn, length, false, extents);
+
+    disk_file *file = get_backing_file();
+    for (const disk_extent &extent : extents)
+    {
+      if ((extent.file_offset != EXTENT_UNALLOCATED) && (extent.file == nullptr))
+      {
+        file->allocate(extent.file_offset, extent.length);
+      }
+    }
+  }
+
+  /// @brief Find the next position on the disk that is, or is not, allocated.
+  ///
+  /// The disk is examined a piece at a time, so that the search stops early without mapping the whole disk.
+  ///
+  /// @param start_posn The position on the disk to begin searching from.
+  ///
+  /// @param allocated Whether to search for allocated space (true) or a hole (false).
+  ///
+  /// @return The first matching position at or after start_posn, or the length of the disk if there is none.
+  uint64_t virt_disk::seek_allocation(uint64_t start_posn, bool allocated)
+  {
+    const uint64_t disk_length = get_length();
+    std::vector<allocation_extent> extents;
+
+    while (start_posn < disk_length)
+    {
+      uint64_t chunk_length = std::min(SEEK_CHUNK_BYTES, disk_length - start_posn);
+      extents.clear();
+      get_allocation(start_posn, chunk_length, extents);
+
+      for (const allocation_extent &extent : extents)
+      {
+        if (extent.allocated == allocated)
+        {
+          return extent.start_posn;
+        }
+      }
+
+      start_posn += chunk_length;
+    }
+
+    return disk_length;
+  }
+
+  /// @brief Attach a block cache to this disk, replacing any existing cache.
+  ///
+  /// Any dirty blocks belonging to this disk in the old cache are written to the image first. Passing nullptr
+  /// detaches the disk from its cache. This must not be called while other threads are using the disk.
+  ///
+  /// @param new_cache The cache to use. It may be shared with other disks.
+  void virt_disk::set_cache(std::shared_ptr<block_cache> new_cache)
+  {
+    // Read-ahead fills the cache, and write combining writes through it, so both are stopped while the cache changes
+    // and restarted afterwards.
+    std::unique_ptr<read_ahead_config> read_ahead_settings;
+    if (prefetcher)
+    {
+      read_ahead_settings = std::unique_ptr<read_ahead_config>(new read_ahead_config(prefetcher->get_config()));
+      prefetcher.reset();
+    }
+
+    std::unique_ptr<write_combine_config> combine_settings;
+    if (combiner)
+    {
+      combiner->flush();
+      combine_settings = std::unique_ptr<write_combine_config>(new write_combine_config(combiner->get_config()));
+      combiner.reset();
+    }
+
+    if (cache)
+    {
+      cache->release(this);
+      cache.reset();
+    }
+
+    cache = std::move(new_cache);
+
+    if (read_ahead_settings)
+    {
+      set_read_ahead(*read_ahead_settings);
+    }
+
+    if (combine_settings)
+    {
+      set_write_combining(*combine_settings);
+    }
+  }
+
+  /// @brief Enable, reconfigure, or disable read-ahead.
+  ///
+  /// Read-ahead detects sequential and strided streams of calls to read() and reads the blocks ahead of them into the
+  /// cache in the background. A cache must be attached with set_cache() first. Setting max_window to zero disables
+  /// read-ahead. This must not be called while other threads are using the disk.
+  ///
+  /// @param config The read-ahead settings.
+  void virt_disk::set_read_ahead(const read_ahead_config &config)
+  {
+    prefetcher.reset();
+
+    if (config.max_window != 0)
+    {
+      if (!cache)
+      {
+        throw std::fstream::failure("Read-ahead requires a block cache");
+      }
+      prefetcher = std::make_shared<read_ahead>(this, config);
+    }
+  }
+
+  /// @brief Enable, reconfigure, or disable write combining.
+  ///
+  /// Small writes are then gathered in memory and written to the image in larger pieces - see write_combiner. Setting
+  /// max_pending_bytes to zero disables it. Any data already gathered is written to the image first. This must not be
+  /// called while other threads are using the disk.
+  ///
+  /// @param config The write combining settings.
+  void virt_disk::set_write_combining(const write_combine_config &config)
+  {
+    if (combiner)
+    {
+      combiner->flush();
+      combiner.reset();
+    }
+
+    if (config.max_pending_bytes != 0)
+    {
+      combiner = std::make_shared<write_combiner>(this, config);
+    }
+  }
+
+  /// @brief Write any data held by write combining or in a write-back cache, and any deferred metadata, to the image.
+  /// Then flush the image to stable storage.
+  ///
+  void virt_disk::flush()
+  {
+    if (combiner)
+    {
+      combiner->flush();
+    }
+
+    if (cache)
+    {
+      cache->flush_range(this, 0, ~0ULL, false);
+    }
+
+    flush_metadata();
+    get_backing_file()->flush();
+  }
+
+  /// @brief Start or stop gathering statistics about this disk's I/O.
+  ///
+  /// Statistics are not gathered by default. While they are, each read and write costs a few uncontended atomic
+  /// additions and two reads of the clock. Stopping keeps the statistics gathered so far, and starting again carries on
+  /// adding to them.
+  ///
+  /// @param enable Whether to gather statistics.
+  void virt_disk::enable_stats(bool enable)
+  {
+    std::lock_guard<std::mutex> guard(stats_lock);
+    if (enable && !stats_recorder)
+    {
+      stats_recorder = std::unique_ptr<io_stats_recorder>(new io_stats_recorder());
+    }
+
+    active_stats.store(enable ? stats_recorder.get() : nullptr);
+  }
+
+  /// @brief Get the statistics gathered about this disk's I/O.
+  ///
+  /// This may be called while other threads are using the disk. Operations still in progress may be partly counted.
+  ///
+  /// @return The statistics gathered since they were first enabled, or last reset. All zero if they never have been
+  ///         enabled.
+  io_stats virt_disk::get_stats()
+  {
+    std::lock_guard<std::mutex> guard(stats_lock);
+    if (!stats_recorder)
+    {
+      return io_stats{};
+    }
+
+    return stats_recorder->snapshot();
+  }
+
+  /// @brief Set the statistics gathered about this disk's I/O back to zero.
+  ///
+  void virt_disk::reset_stats()
+  {
+    std::lock_guard<std::mutex> guard(stats_lock);
+    if (stats_recorder)
+    {
+      stats_recorder->reset();
+    }
+  }
+
+  /// @brief Record a completed read or write of the disk.
+  ///
+  /// @param recorder The recorder returned by stats() when the operation started.
+  ///
+  /// @param is_write Whether the operation was a write (true) or a read (false).
+  ///
+  /// @param length The number of bytes transferred.
+  ///
+  /// @param start_ns The value of io_stats_recorder::now() when the operation started.
+  void virt_disk::record_io(io_stats_recorder *recorder, bool is_write, uint64_t length, uint64_t start_ns)
+  {
+    recorder->add(is_write ? stat_counter::WRITES : stat_counter::READS, 1);
+    recorder->add(is_write ? stat_counter::BYTES_WRITTEN : stat_counter::BYTES_READ, length);
+    recorder->add_latency(is_write ? stat_latency::WRITE : stat_latency::READ, start_ns);
+  }
+
+  /// @brief Read a range of the disk, through the cache if there is one, and record it in the disk's statistics.
+  ///
+  /// @param buffer The buffer to read in to.
+  ///
+  /// @param start_posn The number of bytes into the virtual disk to begin reading.
+  ///
+  /// @param length The number of bytes to read.
+  void virt_disk::read_range(uint8_t *buffer, uint64_t start_posn, uint64_t length)
+  {
+    io_stats_recorder *recorder = stats();
+    const uint64_t start_ns = (recorder != nullptr) ? io_stats_recorder::now() : 0;
+
+    if (combiner)
+    {
+      combiner->read(buffer, start_posn, length);
+    }
+    else
+    {
+      load_range(buffer, start_posn, length);
+    }
+
+    if (recorder != nullptr)
+    {
+      record_io(recorder, false, length, start_ns);
+    }
+  }
+
+  /// @brief Write a range of the disk, through the cache if there is one, and record it in the disk's statistics.
+  ///
+  /// @param buffer The buffer to write.
+  ///
+  /// @param start_posn The position on the disk to begin writing at.
+  ///
+  /// @param length The number of bytes to write.
+  void virt_disk::write_range(const uint8_t *buffer, uint64_t start_posn, uint64_t length)
+  {
+    io_stats_recorder *recorder = stats();
+    const uint64_t start_ns = (recorder != nullptr) ? io_stats_recorder::now() : 0;
+
+    if (combiner)
+    {
+      combiner->write(buffer, start_posn, length);
+    }
+    else
+    {
+      store_range(buffer, start_posn, length);
+    }
+
+    if (recorder != nullptr)
+    {
+      record_io(recorder, true, length, start_ns);
+    }
+  }
+
+  /// @brief Read a range of the disk through the cache if there is one, bypassing write combining.
+  ///
+  /// @param buffer The buffer to read in to.
+  ///
+  /// @param start_posn The number of bytes into the virtual disk to begin reading.
+  ///
+  /// @param length The number of bytes to read.
+  void virt_disk::load_range(uint8_t *buffer, uint64_t start_posn, uint64_t length)
+  {
+    if (cache)
+    {
+      read_cached(buffer, start_posn, length);
+    }
+    else
+    {
+      read_uncached(buffer, start_posn, length);
+    }
+  }
+
+  /// @brief Write a range of the disk through the cache if there is one, bypassing write combining.
+  ///
+  /// @param buffer The buffer to write.
+  ///
+  /// @param start_posn The position on the disk to begin writing at.
+  ///
+  /// @param length The number of bytes to write.
+  void virt_disk::store_range(const uint8_t *buffer, uint64_t start_posn, uint64_t length)
+  {
+    if (cache)
+    {
+      write_cached(buffer, start_posn, length);
+    }
+    else
+    {
+      write_uncached(buffer, start_posn, length);
+    }
+  }
+
+  /// @brief Write several ranges of the disk through the cache if there is one, bypassing write combining.
+  ///
+  /// Without a cache, the ranges are mapped together so that pieces next to each other in the backing file are
+  /// written with one call.
+  ///
+  /// @param ranges The ranges to write, and their buffers. They must not overlap.
+  ///
+  /// @param count The number of entries in ranges.
+  void virt_disk::store_ranges(const disk_io_range *ranges, uint32_t count)
+  {
+    if (!cache)
+    {
+      transfer_uncached(ranges, count, true);
+      return;
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+      uint64_t posn = ranges[i].start_posn;
+      for (uint32_t j = 0; j < ranges[i].count; j++)
+      {
+        write_cached(reinterpret_cast<const uint8_t *>(ranges[i].segments[j].buffer),
+                     posn,
+                     ranges[i].segments[j].length);
+        posn += ranges[i].segments[j].length;
+      }
+    }
+  }
+
+  /// @brief Read a range of the disk through the cache, which must be attached.
+  ///
+  /// Blocks that miss the cache are read from the image in runs of whole blocks, so that a run of misses costs as few
+  /// backing file operations as an uncached read, and then added to the cache.
+  ///
+  /// @param buffer The buffer to read in to.
+  ///
+  /// @param start_posn The number of bytes into the virtual disk to begin reading.
+  ///
+  /// @param length The number of bytes to read. start_posn + length must not exceed the length of the disk.
+  void virt_disk::read_cached(uint8_t *buffer, uint64_t start_posn, uint64_t length)
+  {
+    if (length == 0)
+    {
+      return;
+    }
+
+    const uint64_t block_size = cache->get_config().block_size;
+    const uint64_t disk_length = get_length();
+    const uint64_t end_posn = start_posn + length;
+    if ((start_posn > disk_length) || (length > (disk_length - start_posn)))
+    {
+      throw std::fstream::failure("Too long");
+    }
+
+    if (prefetcher)
+    {
+      prefetcher->note_read(start_posn, length);
+    }
+
+    std::unique_ptr<uint8_t[]> run_buffer;
+    uint64_t generations[MAX_MISS_RUN_BLOCKS];
+    uint64_t miss_first = 0;
+    uint64_t miss_count = 0;
+
+    auto read_misses = [&]()
+    {
+      if (miss_count == 0)
+      {
+        return;
+      }
+
+      uint64_t run_start = miss_first * block_size;
+      uint64_t run_end = std::min((miss_first + miss_count) * block_size, disk_length);
+      if (!run_buffer)
+      {
+        run_buffer = std::unique_ptr<uint8_t[]>(new uint8_t[MAX_MISS_RUN_BLOCKS * block_size]);
+      }
+      read_uncached(run_buffer.get(), run_start, run_end - run_start);
+
+      for (uint64_t i = 0; i < miss_count; i++)
+      {
+        uint64_t block_start = run_start + (i * block_size);
+        uint64_t block_length = std::min(block_size, run_end - block_start);
+        uint8_t *block_data = run_buffer.get() + (i * block_size);
+        cache->insert(this, miss_first + i, block_data, block_length, false, generations[i]);
+
+        uint64_t copy_start = std::max(start_posn, block_start);
+        uint64_t copy_end = std::min(end_posn, block_start + block_length);
+        memcpy(buffer + (copy_start - start_posn), block_data + (copy_start - block_start), copy_end - copy_start);
+      }
+
+      miss_count = 0;
+    };
+
+    for (uint64_t block = start_posn / block_size; (block * block_size) < end_posn; block++)
+    {
+      uint64_t block_start = block * block_size;
+      uint64_t copy_start = std::max(start_posn, block_start);
+      uint64_t copy_end = std::min(end_posn, block_start + block_size);
+      uint64_t generation;
+
+      if (cache->lookup(this,
+                        block,
+                        buffer + (copy_start - start_posn),
+                        copy_start - block_start,
+                        copy_end - copy_start,
+                        generation))
+      {
+        read_misses();
+        continue;
+      }
+
+      if (miss_count == 0)
+      {
+        miss_first = block;
+      }
+      generations[miss_count] = generation;
+      miss_count++;
+
+      if (miss_count == MAX_MISS_RUN_BLOCKS)
+      {
+        read_misses();
+      }
+    }
+
+    read_misses();
+  }
+
+  /// @brief Write a range of the disk through the cache, which must be attached.
+  ///
+  /// In write-through mode the image is written first and any cached copies are then updated. In write-back mode,
+  /// blocks that are cached are updated in the cache only, as are whole blocks that are not yet cached. Parts of
+  /// blocks that are not cached are written straight to the image.
+  ///
+  /// @param buffer The buffer to write.
+  ///
+  /// @param start_posn The position on the disk to begin writing at.
+  ///
+  /// @param length The number of bytes to write. start_posn + length must not exceed the length of the disk.
+  void virt_disk::write_cached(const uint8_t *buffer, uint64_t start_posn, uint64_t length)
+  {
+    if (length == 0)
+    {
+      return;
+    }
+
+    const uint64_t block_size = cache->get_config().block_size;
+    const uint64_t disk_length = get_length();
+    const uint64_t end_posn = start_posn + length;
+    const bool write_back = (cache->get_config().write_mode == cache_write_mode::WRITE_BACK);
+    if ((start_posn > disk_length) || (length > (disk_length - start_posn)))
+    {
+      throw std::fstream::failure("Too long");
+    }
+
+    if (!write_back)
+    {
+      write_uncached(buffer, start_posn, length);
+    }
+
+    for (uint64_t block = start_posn / block_size; (block * block_size) < end_posn; block++)
+    {
+      uint64_t block_start = block * block_size;
+      uint64_t block_length = std::min(block_size, disk_length - block_start);
+      uint64_t copy_start = std::max(start_posn, block_start);
+      uint64_t copy_end = std::min(end_posn, block_start + block_length);
+      const uint8_t *piece = buffer + (copy_start - start_posn);
+
+      if (cache->update(this, block, piece, copy_start - block_start, copy_end - copy_start, write_back) ||
+          !write_back)
+      {
+        continue;
+      }
+
+      if ((copy_start == block_start) && (copy_end == (block_start + block_length)))
+      {
+        cache->insert(this, block, piece, block_length, true, 0);
+      }
+      else
+      {
+        write_uncached(piece, copy_start, copy_end - copy_start);
+      }
+    }
+  }
+
+  /// @brief Read a range of the disk directly from the image.
+  ///
+  /// @param buffer The buffer to read in to.
+  ///
+  /// @param start_posn The number of bytes into the virtual disk to begin reading.
+  ///
+  /// @param length The number of bytes to read.
+  void virt_disk::read_uncached(uint8_t *buffer, uint64_t start_posn, uint64_t length)
+  {
+    std::vector<disk_extent> extents;
+    const uint32_t counter = begin_io();
+
+    try
+    {
+      map_range(start_posn, length, false, extents);
+      read_extents(buffer, start_posn, extents, max_read_gap);
+    }
+    catch (...)
+    {
+      end_io(counter);
+      throw;
+    }
+
+    end_io(counter);
+  }
+
+  /// @brief Write a range of the disk directly to the image, allocating space as needed.
+  ///
+  /// @param buffer The buffer to write.
+  ///
+  /// @param start_posn The position on the disk to begin writing at.
+  ///
+  /// @param length The number of bytes to write.
+  void virt_disk::write_uncached(const uint8_t *buffer, uint64_t start_posn, uint64_t length)
+  {
+    std::vector<disk_extent> extents;
+    const uint32_t counter = begin_io();
+
+    try
+    {
+      map_write(is_zero_buffer(buffer, length), start_posn, length, extents);
+      write_extents(buffer, start_posn, extents);
+    }
+    catch (...)
+    {
+      end_io(counter);
+      throw;
+    }
+
+    end_io(counter);
+  }
+
+  /// @brief Read or write several ranges of the disk directly from or to the image.
+  ///
+  /// @param ranges The ranges to transfer, and their buffers.
+  ///
+  /// @param count The number of entries in ranges.
+  ///
+  /// @param is_write Whether to write (true) or read (false).
+  void virt_disk::transfer_uncached(const disk_io_range *ranges, uint32_t count, bool is_write)
+  {
+    const uint64_t disk_length = get_length();
+    std::vector<disk_extent> extents;
+    std::vector<extent_buffer> pieces;
+    const uint32_t counter = begin_io();
+
+    try
+    {
+      for (uint32_t i = 0; i < count; i++)
+      {
+        const disk_io_range &range = ranges[i];
+        uint64_t length = 0;
+        bool data_is_zero = true;
+        for (uint32_t j = 0; j < range.count; j++)
+        {
+          const io_segment &segment = range.segments[j];
+          length += segment.length;
+          if (is_write && data_is_zero)
+          {
+            data_is_zero = is_zero_buffer(segment.buffer, segment.length);
+          }
+        }
+
+        if ((range.start_posn > disk_length) || (length > (disk_length - range.start_posn)))
+        {
+          throw std::fstream::failure("Too long");
+        }
+
+        extents.clear();
+        if (is_write)
+        {
+          map_write(data_is_zero, range.start_posn, length, extents);
+        }
+        else
+        {
+          map_range(range.start_posn, length, false, extents);
+        }
+        split_extents(range.segments, range.count, extents, pieces);
+      }
+
+      if (is_write)
+      {
+        write_pieces(pieces);
+      }
+      else
+      {
+        read_pieces(pieces, max_read_gap);
+      }
+    }
+    catch (...)
+    {
+      end_io(counter);
+      throw;
+    }
+
+    end_io(counter);
+  }
+
+  /// @brief Note that an I/O operation is about to map part of the disk, waiting first if blocks are being moved.
+  ///
+  /// Until end_io() is called, compact() will not move any blocks, so the locations found by map_range() stay valid.
+  /// When compact() is not running this costs one uncontended atomic increment.
+  ///
+  /// @return The counter to pass to end_io().
+  uint32_t virt_disk::begin_io()
+  {
+    static std::atomic<uint32_t> next_thread_counter{0};
+    static thread_local uint32_t thread_counter = next_thread_counter++ % IO_COUNTER_COUNT;
+    std::atomic<uint64_t> &count = io_counters[thread_counter].count;
+
+    // Paired with begin_block_moves(): either this thread sees moving_blocks set, or compact() sees the count.
+    count.fetch_add(1);
+    if (moving_blocks.load())
+    {
+      count.fetch_sub(1);
+
+      std::unique_lock<std::mutex> guard(move_lock);
+      move_done.wait(guard, [this]() { return !moving_blocks.load(); });
+      count.fetch_add(1);
+    }
+
+    return thread_counter;
+  }
+
+  /// @brief Note that an I/O operation has finished with the locations it mapped.
+  ///
+  /// @param counter The value returned by begin_io().
+  void virt_disk::end_io(uint32_t counter)
+  {
+    io_counters[counter].count.fetch_sub(1, std::memory_order_release);
+  }
+
+  /// @brief Is any I/O operation between begin_io() and end_io()?
+  ///
+  /// @return True if there is.
+  bool virt_disk::io_in_progress()
+  {
+    for (io_counter &counter : io_counters)
+    {
+      if (counter.count.load() != 0)
+      {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  /// @brief Stop new I/O operations from starting, and wait for those in progress to finish, so blocks can be moved.
+  ///
+  /// Requests submitted to an io_queue count as in progress until they are reaped. If they do not finish within a
+  /// short time, new operations are allowed to start again, so that a thread waiting on this one is never stuck.
+  ///
+  /// @return True if no I/O is in progress, in which case end_block_moves() must be called. False if waiting timed out.
+  bool virt_disk::begin_block_moves()
+  {
+    {
+      std::lock_guard<std::mutex> guard(move_lock);
+      moving_blocks.store(true);
+    }
+
+    const auto deadline = std::chrono::steady_clock::now() + BLOCK_MOVE_WAIT;
+    while (io_in_progress())
+    {
+      if (std::chrono::steady_clock::now() >= deadline)
+      {
+        end_block_moves();
+        return false;
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+
+    return true;
+  }
+
+  /// @brief Let I/O operations start again after begin_block_moves().
+  ///
+  void virt_disk::end_block_moves()
+  {
+    {
+      std::lock_guard<std::mutex> guard(move_lock);
+      moving_blocks.store(false);
+    }
+    move_done.notify_all();
+  }
+
+  /// @brief Find where a write should be stored, allocating space only for data that needs it.
+  ///
+  /// If the data is all zeroes, parts of the range that are already holes stay holes - they read as zeroes anyway - so
+  /// zero-filling a disk does not make the image grow. Those parts are returned as EXTENT_UNALLOCATED, and the rest is
+  /// allocated as usual. Parts stored in a parent image must still be written, since the parent may not hold zeroes.
+  ///
+  /// @param data_is_zero Whether the data to be written is all zeroes.
+  ///
+  /// @param start_posn The position on the disk that the write begins at.
+  ///
+  /// @param length The number of bytes to be written.
+  ///
+  /// @param extents Extents covering the whole range, in order, are appended to this vector.
+  void virt_disk::map_write(bool data_is_zero, uint64_t start_posn, uint64_t length, std::vector<disk_extent> &extents)
+  {
+    if (!data_is_zero)
+    {
+      map_range(start_posn, length, true, extents);
+      return;
+    }
+
+    std::vector<disk_extent> existing;
+    map_range(start_posn, length, false, existing);
+
+    // The part of the range, not yet mapped for writing, that is stored somewhere.
+    uint64_t stored_start = start_posn;
+    uint64_t stored_end = start_posn;
+
+    for (const disk_extent &extent : existing)
+    {
+      if (extent.file_offset != EXTENT_UNALLOCATED)
+      {
+        stored_end = extent.start_posn + extent.length;
+        continue;
+      }
+
+      if (stored_end > stored_start)
+      {
+        map_range(stored_start, stored_end - stored_start, true, extents);
+      }
+
+      mark_zeroed(extent.start_posn, extent.length);
+      append_extent(extents, extent.start_posn, extent.length, EXTENT_UNALLOCATED);
+
+      io_stats_recorder *recorder = stats();
+      if (recorder != nullptr)
+      {
+        recorder->add(stat_counter::ZERO_FILLS, 1);
+        recorder->add(stat_counter::ZERO_FILL_BYTES, extent.length);
+      }
+      stored_start = extent.start_posn + extent.length;
+      stored_end = stored_start;
+    }
+
+    if (stored_end > stored_start)
+    {
+      map_range(stored_start, stored_end - stored_start, true, extents);
+    }
+  }
+
+  /// @brief Make the image up to date with the cache, and with combined writes, for a range of the disk, before
+  /// accessing it some other way.
+  ///
+  /// @param start_posn The number of bytes into the virtual disk that the range begins.
+  ///
+  /// @param length The length of the range, in bytes.
+  ///
+  /// @param invalidate Whether the image is about to be written, so cached copies of the range must be discarded.
+  void virt_disk::sync_cache(uint64_t start_posn, uint64_t length, bool invalidate)
+  {
+    if (combiner && (length != 0))
+    {
+      combiner->flush_range(start_posn, length);
+    }
+
+    if (!cache || (length == 0))
+    {
+      return;
+    }
+
+    if (!invalidate && (cache->get_config().write_mode == cache_write_mode::WRITE_THROUGH))
+    {
+      // Nothing in the cache can be newer than the image.
+      return;
+    }
+
+    const uint64_t block_size = cache->get_config().block_size;
+    cache->flush_range(this, start_posn / block_size, (start_posn + length - 1) / block_size, invalidate);
+  }
+
+  /// @brief Write out combined writes, stop read-ahead, then write back and detach from the cache. Called by the
+  /// destructor of each format, while it can still access the image.
+  ///
+  /// Errors are ignored, since there is no way to report them from a destructor. Call flush() first to see them.
+  void virt_disk::release_cache()
+  {
+    if (combiner)
+    {
+      try
+      {
+        combiner->flush();
+      }
+      catch (std::fstream::failure &)
+      {
+      }
+      combiner.reset();
+    }
+
+    prefetcher.reset();
+
+    if (cache)
+    {
+      try
+      {
+        cache->release(this);
+      }
+      catch (std::fstream::failure &)
+      {
+      }
+      cache.reset();
+    }
+  }
+
+  /// @brief Add an extent to the end of a list, merging it with the previous extent if possible.
+  ///
+  /// The new extent must follow directly on from the previous one on the virtual disk. The two are merged if both are
+  /// unallocated, or if the new extent also follows directly on from the previous one in the same file.
+  ///
+  /// @param extents The list to add to.
+  ///
+  /// @param start_posn The number of bytes into the virtual disk that the new extent begins.
+  ///
+  /// @param length The length of the new extent, in bytes.
+  ///
+  /// @param file_offset The offset of the new extent in its file, or EXTENT_UNALLOCATED.
+  ///
+  /// @param file The file holding the new extent, or nullptr for the disk's own backing file.
+  void virt_disk::append_extent(std::vector<disk_extent> &extents,
+                                uint64_t start_posn,
+                                uint64_t length,
+                                uint64_t file_offset,
+                                disk_file *file)
+  {
+    if (file_offset == EXTENT_UNALLOCATED)
+    {
+      file = nullptr;
+    }
+
+    if (!extents.empty())
+    {
+      disk_extent &last = extents.back();
+      bool both_unallocated = (last.file_offset == EXTENT_UNALLOCATED) && (file_offset == EXTENT_UNALLOCATED);
+      bool contiguous = (last.file_offset != EXTENT_UNALLOCATED) &&
+                        (file_offset != EXTENT_UNALLOCATED) &&
+                        (last.file == file) &&
+                        ((last.file_offset + last.length) == file_offset);
+
+      if (both_unallocated || contiguous)
+      {
+        last.length += length;
+        return;
+      }
+    }
+
+    extents.push_back({start_posn, length, file_offset, file});
+  }
+
+  /// @brief Cut mapped extents at the boundaries between the buffers they are to be transferred to or from.
+  ///
+  /// @param segments The buffers, in order. Together they must be as long as the extents.
+  ///
+  /// @param count The number of entries in segments.
+  ///
+  /// @param extents The extents covering a range of the disk, in order, as produced by map_range().
+  ///
+  /// @param pieces Pieces of the extents, each within a single buffer, are appended to this vector.
+  void virt_disk::split_extents(const io_segment *segments,
+                                uint32_t count,
+                                const std::vector<disk_extent> &extents,
+                                std::vector<extent_buffer> &pieces)
+  {
+    uint32_t segment = 0;
+    uint64_t segment_used = 0;
+
+    for (const disk_extent &extent : extents)
+    {
+      uint64_t done = 0;
+      while (done < extent.length)
+      {
+        while ((segment < count) && (segment_used == segments[segment].length))
+        {
+          segment++;
+          segment_used = 0;
+        }
+
+        if (segment == count)
+        {
+          throw std::fstream::failure("Buffers too short");
+        }
+
+        disk_extent piece = extent;
+        piece.start_posn += done;
+        piece.length = std::min(extent.length - done, segments[segment].length - segment_used);
+        if (piece.file_offset != EXTENT_UNALLOCATED)
+        {
+          piece.file_offset += done;
+        }
+        pieces.push_back({piece, reinterpret_cast<uint8_t *>(segments[segment].buffer) + segment_used});
+
+        done += piece.length;
+        segment_used += piece.length;
+      }
+    }
+  }
+
+  /// @brief Read a mapped range of the disk, using as few backing file operations as possible.
+  ///
+  /// @param buffer The buffer to read in to. It corresponds to start_posn on the virtual disk.
+  ///
+  /// @param start_posn The number of bytes into the virtual disk that the range begins.
+  ///
+  /// @param extents The extents covering the range, as produced by map_range().
+  ///
+  /// @param max_gap The largest gap between extents in the backing file that may be read through, in bytes.
+  void virt_disk::read_extents(uint8_t *buffer,
+                               uint64_t start_posn,
+                               const std::vector<disk_extent> &extents,
+                               uint64_t max_gap)
+  {
+    std::vector<extent_buffer> pieces;
+    pieces.reserve(extents.size());
+    for (const disk_extent &extent : extents)
+    {
+      pieces.push_back({extent, buffer + (extent.start_posn - start_posn)});
+    }
+
+    read_pieces(pieces, max_gap);
+  }
+
+  /// @brief Write a mapped range of the disk, using as few backing file operations as possible.
+  ///
+  /// @param buffer The buffer to write. It corresponds to start_posn on the virtual disk.
+  ///
+  /// @param start_posn The number of bytes into the virtual disk that the range begins.
+  ///
+  /// @param extents The extents covering the range, as produced by map_range() with allocate set. They are always in
+  ///                the disk's own backing file.
+  void virt_disk::write_extents(const uint8_t *buffer, uint64_t start_posn, const std::vector<disk_extent> &extents)
+  {
+    std::vector<extent_buffer> pieces;
+    pieces.reserve(extents.size());
+    for (const disk_extent &extent : extents)
+    {
+      pieces.push_back({extent, const_cast<uint8_t *>(buffer + (extent.start_posn - start_posn))});
+    }
+
+    write_pieces(pieces);
+  }
+
+  /// @brief Read mapped pieces of the disk into their buffers, using as few backing file operations as possible.
+  ///
+  /// Unallocated pieces are filled with zeroes. The remaining pieces are grouped by file and taken in file order, and
+  /// each run of them that is contiguous in a file is read with a single (vectored, if needed) read - even if the
+  /// pieces are out of order on the virtual disk. A run may also bridge small gaps in the file, such as a VHD block
+  /// bitmap, by reading the gap into a scratch buffer. That is much cheaper than a second system call.
+  ///
+  /// @param pieces The pieces to read. They are reordered, and unallocated pieces are removed.
+  ///
+  /// @param max_gap The largest gap between pieces in the backing file that may be read through, in bytes.
+  void virt_disk::read_pieces(std::vector<extent_buffer> &pieces, uint64_t max_gap)
+  {
+    disk_file *own_file = get_backing_file();
+
+    auto is_hole = [](const extent_buffer &piece)
+    {
+      if (piece.extent.file_offset == EXTENT_UNALLOCATED)
+      {
+        memset(piece.buffer, 0, piece.extent.length);
+        return true;
+      }
+      return false;
+    };
+    pieces.erase(std::remove_if(pieces.begin(), pieces.end(), is_hole), pieces.end());
+
+    auto file_of = [own_file](const extent_buffer &piece)
+    {
+      return (piece.extent.file != nullptr) ? piece.extent.file : own_file;
+    };
+
+    io_stats_recorder *recorder = stats();
+    auto read_run = [recorder](disk_file *run_file, const io_segment *segments, uint32_t count, uint64_t offset)
+    {
+      const uint64_t start_ns = (recorder != nullptr) ? io_stats_recorder::now() : 0;
+      if (count == 1)
+      {
+        run_file->read_at(segments[0].buffer, segments[0].length, offset);
+      }
+      else
+      {
+        run_file->readv_at(segments, count, offset);
+      }
+
+      if (recorder != nullptr)
+      {
+        uint64_t bytes = 0;
+        for (uint32_t i = 0; i < count; i++)
+        {
+          bytes += segments[i].length;
+        }
+        recorder->add(stat_counter::BACKING_READS, 1);
+        recorder->add(stat_counter::BACKING_BYTES_READ, bytes);
+        recorder->add_time(stat_counter::DATA_NS, start_ns);
+      }
+    };
+
+    if (pieces.size() == 1)
+    {
+      io_segment segment = { pieces[0].buffer, pieces[0].extent.length };
+      read_run(file_of(pieces[0]), &segment, 1, pieces[0].extent.file_offset);
+      return;
+    }
+
+    auto by_file_offset = [&file_of](const extent_buffer &a, const extent_buffer &b)
+    {
+      if (file_of(a) != file_of(b))
+      {
+        return std::less<disk_file *>()(file_of(a), file_of(b));
+      }
+      return a.extent.file_offset < b.extent.file_offset;
+    };
+    if (!std::is_sorted(pieces.begin(), pieces.end(), by_file_offset))
+    {
+      std::sort(pieces.begin(), pieces.end(), by_file_offset);
+    }
+
+    // Gaps are read into the same scratch buffer, since the contents are thrown away.
+    std::unique_ptr<uint8_t[]> scratch;
+    std::vector<io_segment> segments;
+    disk_file *file = own_file;
+    uint64_t run_start = 0;
+    uint64_t run_end = 0;
+
+    for (const extent_buffer &piece : pieces)
+    {
+      const uint64_t file_offset = piece.extent.file_offset;
+      if (!segments.empty() &&
+          ((file_of(piece) != file) ||
+           (file_offset < run_end) ||
+           ((file_offset - run_end) > max_gap)))
+      {
+        read_run(file, segments.data(), static_cast<uint32_t>(segments.size()), run_start);
+        segments.clear();
+      }
+
+      if (segments.empty())
+      {
+        file = file_of(piece);
+        run_start = file_offset;
+      }
+      else if (file_offset > run_end)
+      {
+        if (!scratch)
+        {
+          scratch = std::unique_ptr<uint8_t[]>(new uint8_t[max_gap]);
+        }
+        segments.push_back({scratch.get(), file_offset - run_end});
+      }
+
+      segments.push_back({piece.buffer, piece.extent.length});
+      run_end = file_offset + piece.extent.length;
+    }
+
+    if (!segments.empty())
+    {
+      read_run(file, segments.data(), static_cast<uint32_t>(segments.size()), run_start);
+    }
+  }
+
+  /// @brief Write mapped pieces of the disk from their buffers, using as few backing file operations as possible.
+  ///
+  /// Pieces are taken in backing file order, and each run of them that is contiguous in the file is written with a
+  /// single (vectored, if needed) write. Unlike read_pieces(), gaps in the file are never bridged since that would
+  /// overwrite whatever lies in the gap. Unallocated pieces are skipped.
+  ///
+  /// @param pieces The pieces to write, as mapped with allocate set - so always in the disk's own backing file. They
+  ///               are reordered, and unallocated pieces are removed.
+  void virt_disk::write_pieces(std::vector<extent_buffer> &pieces)
+  {
+    disk_file *file = get_backing_file();
+
+    auto is_hole = [](const extent_buffer &piece) { return piece.extent.file_offset == EXTENT_UNALLOCATED; };
+    pieces.erase(std::remove_if(pieces.begin(), pieces.end(), is_hole), pieces.end());
+
+    io_stats_recorder *recorder = stats();
+    auto write_run = [recorder, file](const io_segment *segments, uint32_t count, uint64_t offset)
+    {
+      const uint64_t start_ns = (recorder != nullptr) ? io_stats_recorder::now() : 0;
+      if (count == 1)
+      {
+        file->write_at(segments[0].buffer, segments[0].length, offset);
+      }
+      else
+      {
+        file->writev_at(segments, count, offset);
+      }
+
+      if (recorder != nullptr)
+      {
+        uint64_t bytes = 0;
+        for (uint32_t i = 0; i < count; i++)
+        {
+          bytes += segments[i].length;
+        }
+        recorder->add(stat_counter::BACKING_WRITES, 1);
+        recorder->add(stat_counter::BACKING_BYTES_WRITTEN, bytes);
+        recorder->add_time(stat_counter::DATA_NS, start_ns);
+      }
+    };
+
+    if (pieces.size() == 1)
+    {
+      io_segment segment = { pieces[0].buffer, pieces[0].extent.length };
+      write_run(&segment, 1, pieces[0].extent.file_offset);
+      return;
+    }
+
+    auto by_file_offset = [](const extent_buffer &a, const extent_buffer &b)
+    {
+      return a.extent.file_offset < b.extent.file_offset;
+    };
+    if (!std::is_sorted(pieces.begin(), pieces.end(), by_file_offset))
+    {
+      std::sort(pieces.begin(), pieces.end(), by_file_offset);
+    }
+
+    std::vector<io_segment> segments;
+    uint64_t run_start = 0;
+    uint64_t run_end = 0;
+
+    for (const extent_buffer &piece : pieces)
+    {
+      if (!segments.empty() && (piece.extent.file_offset != run_end))
+      {
+        write_run(segments.data(), static_cast<uint32_t>(segments.size()), run_start);
+        segments.clear();
+      }
+
+      if (segments.empty())
+      {
+        run_start = piece.extent.file_offset;
+      }
+
+      segments.push_back({piece.buffer, piece.extent.length});
+      run_end = piece.extent.file_offset + piece.extent.length;
+    }
+
+    if (!segments.empty())
+    {
+      write_run(segments.data(), static_cast<uint32_t>(segments.size()), run_start);
+    }
   }
-};
\ No newline at end of file
+};
@@ -0,0 +1,442 @@
+/// @file
+/// @brief Implements the gathering of small writes into larger ones before they are written to an image.
+
+// Copyright Martin Hughes 2018.
+
+#include "virtualdisk/virt_disk_cache.h"
+
+#include <algorithm>
+#include <string.h>
+
+namespace virt_disk
+{
+  /// @brief Start combining writes for a disk.
+  ///
+  /// @param disk The disk whose writes are combined. It must outlive this object.
+  ///
+  /// @param config The write combining settings.
+  write_combiner::write_combiner(virt_disk *disk, const write_combine_config &config) :
+    disk{disk},
+    config{config},
+    pending_bytes{0},
+    in_flight_bytes{0},
+    held_bytes{0},
+    stopping{false}
+  {
+    this->config.flush_interval_ms = std::max(1U, this->config.flush_interval_ms);
+    worker_thread = std::thread(&write_combiner::worker, this);
+  }
+
+  /// @brief Stop combining writes. Any pending data is abandoned, so call flush() first.
+  ///
+  write_combiner::~write_combiner()
+  {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    pending_cv.notify_one();
+    worker_thread.join();
+  }
+
+  /// @brief Read a range of the disk, including any data that is pending.
+  ///
+  /// The pending data overlapping the range is copied before the image is read, and laid over the top afterwards, so a
+  /// flush that finishes part way through the read makes no difference.
+  ///
+  /// @param buffer The buffer to read in to.
+  ///
+  /// @param start_posn The number of bytes into the virtual disk to begin reading.
+  ///
+  /// @param length The number of bytes to read.
+  void write_combiner::read(uint8_t *buffer, uint64_t start_posn, uint64_t length)
+  {
+    if (held_bytes.load() == 0)
+    {
+      disk->load_range(buffer, start_posn, length);
+      return;
+    }
+
+    const uint64_t end_posn = start_posn + length;
+    std::vector<pending_range> overlay;
+
+    auto copy_overlap = [&](const pending_range &range)
+    {
+      const uint64_t range_end = range.start_posn + range.data.size();
+      if ((range_end <= start_posn) || (range.start_posn >= end_posn))
+      {
+        return;
+      }
+
+      const uint64_t piece_start = std::max(start_posn, range.start_posn);
+      const uint64_t piece_end = std::min(end_posn, range_end);
+      auto first = range.data.begin() + (piece_start - range.start_posn);
+      overlay.push_back({piece_start, std::vector<uint8_t>(first, first + (piece_end - piece_start))});
+    };
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+
+      // Data being flushed is older than anything still pending, so it goes underneath.
+      for (const pending_range &range : in_flight)
+      {
+        copy_overlap(range);
+      }
+      for (auto it = pending.upper_bound(start_posn); (it != pending.end()) && (it->second.start_posn < end_posn); it++)
+      {
+        copy_overlap(it->second);
+      }
+    }
+
+    disk->load_range(buffer, start_posn, length);
+
+    for (const pending_range &piece : overlay)
+    {
+      memcpy(buffer + (piece.start_posn - start_posn), piece.data.data(), piece.data.size());
+    }
+  }
+
+  /// @brief Write a range of the disk - into the pending data if it is small, otherwise straight to the image.
+  ///
+  /// @param buffer The buffer to write.
+  ///
+  /// @param start_posn The position on the disk to begin writing at.
+  ///
+  /// @param length The number of bytes to write.
+  void write_combiner::write(const uint8_t *buffer, uint64_t start_posn, uint64_t length)
+  {
+    const uint64_t disk_length = disk->get_length();
+    if ((start_posn > disk_length) || (length > (disk_length - start_posn)))
+    {
+      throw std::fstream::failure("Too long");
+    }
+
+    if (length == 0)
+    {
+      return;
+    }
+
+    if (length > config.max_write_bytes)
+    {
+      bool overlapped;
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        overlapped = overlaps(start_posn, length);
+      }
+
+      if (!overlapped)
+      {
+        disk->store_range(buffer, start_posn, length);
+        return;
+      }
+
+      // Older pending data in the range must not be written over this data later. Holding flush_lock keeps it from
+      // being flushed while it is removed.
+      std::lock_guard<std::mutex> flush_guard(flush_lock);
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        remove_range(start_posn, length);
+      }
+      disk->store_range(buffer, start_posn, length);
+      return;
+    }
+
+    bool full;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (pending.empty())
+      {
+        oldest_write = std::chrono::steady_clock::now();
+        pending_cv.notify_one();
+      }
+
+      add_range(buffer, start_posn, length);
+      full = (pending_bytes >= config.max_pending_bytes);
+    }
+
+    if (full)
+    {
+      flush();
+    }
+  }
+
+  /// @brief Write all pending data to the image.
+  ///
+  /// If writing fails, the data stays pending - beneath anything written since - and the error is thrown.
+  void write_combiner::flush()
+  {
+    std::lock_guard<std::mutex> flush_guard(flush_lock);
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (pending.empty())
+      {
+        return;
+      }
+
+      for (auto &entry : pending)
+      {
+        in_flight.push_back(std::move(entry.second));
+      }
+      pending.clear();
+      in_flight_bytes = pending_bytes;
+      pending_bytes = 0;
+    }
+
+    // Pending ranges are kept in disk order, which is usually file order too.
+    std::vector<io_segment> segments;
+    std::vector<disk_io_range> ranges;
+    segments.reserve(in_flight.size());
+    ranges.reserve(in_flight.size());
+    for (pending_range &range : in_flight)
+    {
+      segments.push_back({range.data.data(), range.data.size()});
+      ranges.push_back({range.start_posn, &segments.back(), 1});
+    }
+
+    try
+    {
+      disk->store_ranges(ranges.data(), static_cast<uint32_t>(ranges.size()));
+    }
+    catch (...)
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      restore(in_flight);
+      throw;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    in_flight.clear();
+    in_flight_bytes = 0;
+    held_bytes.store(pending_bytes);
+  }
+
+  /// @brief Write all pending data to the image if any of it overlaps a range.
+  ///
+  /// @param start_posn The position on the disk the range begins.
+  ///
+  /// @param length The length of the range.
+  void write_combiner::flush_range(uint64_t start_posn, uint64_t length)
+  {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (!overlaps(start_posn, length))
+      {
+        return;
+      }
+    }
+
+    flush();
+  }
+
+  /// @brief Add data to the pending ranges, merging it with any range it overlaps or adjoins. lock must be held.
+  ///
+  /// When the new data extends a range at its end - a stream of appends, for example - that range's buffer is grown in
+  /// place, so merging costs only the copy of the new data.
+  ///
+  /// @param buffer The data.
+  ///
+  /// @param start_posn The position on the disk the data begins.
+  ///
+  /// @param length The length of the data.
+  void write_combiner::add_range(const uint8_t *buffer, uint64_t start_posn, uint64_t length)
+  {
+    const uint64_t end_posn = start_posn + length;
+
+    // The first range that ends at or after the start of the new data is the first that might join it.
+    auto first = pending.lower_bound(start_posn);
+    if ((first == pending.end()) || (first->second.start_posn > end_posn))
+    {
+      pending.emplace(end_posn, pending_range{start_posn, std::vector<uint8_t>(buffer, buffer + length)});
+      pending_bytes += length;
+      held_bytes.store(pending_bytes + in_flight_bytes);
+      return;
+    }
+
+    auto last = first;
+    uint64_t merged_end = end_posn;
+    while ((last != pending.end()) && (last->second.start_posn <= end_posn))
+    {
+      merged_end = std::max(merged_end, last->first);
+      pending_bytes -= last->second.data.size();
+      last++;
+    }
+
+    const uint64_t merged_start = std::min(start_posn, first->second.start_posn);
+    std::vector<uint8_t> data;
+    if (first->second.start_posn == merged_start)
+    {
+      data = std::move(first->second.data);
+    }
+    data.resize(merged_end - merged_start);
+    if (first->second.start_posn != merged_start)
+    {
+      memcpy(data.data() + (first->second.start_posn - merged_start),
+             first->second.data.data(),
+             first->second.data.size());
+    }
+
+    for (auto it = std::next(first); it != last; it++)
+    {
+      memcpy(data.data() + (it->second.start_posn - merged_start), it->second.data.data(), it->second.data.size());
+    }
+    memcpy(data.data() + (start_posn - merged_start), buffer, length);
+
+    pending.erase(first, last);
+    pending_bytes += data.size();
+    pending.emplace(merged_end, pending_range{merged_start, std::move(data)});
+    held_bytes.store(pending_bytes + in_flight_bytes);
+  }
+
+  /// @brief Discard any pending data in a range. lock must be held.
+  ///
+  /// @param start_posn The position on the disk the range begins.
+  ///
+  /// @param length The length of the range.
+  void write_combiner::remove_range(uint64_t start_posn, uint64_t length)
+  {
+    const uint64_t end_posn = start_posn + length;
+    auto it = pending.upper_bound(start_posn);
+
+    while ((it != pending.end()) && (it->second.start_posn < end_posn))
+    {
+      const uint64_t range_end = it->first;
+      pending_range range = std::move(it->second);
+      it = pending.erase(it);
+      pending_bytes -= range.data.size();
+
+      if (range.start_posn < start_posn)
+      {
+        const uint64_t keep = start_posn - range.start_posn;
+        pending.emplace(start_posn,
+                        pending_range{range.start_posn,
+                                      std::vector<uint8_t>(range.data.begin(), range.data.begin() + keep)});
+        pending_bytes += keep;
+      }
+
+      if (range_end > end_posn)
+      {
+        pending.emplace(range_end,
+                        pending_range{end_posn,
+                                      std::vector<uint8_t>(range.data.begin() + (end_posn - range.start_posn),
+                                                           range.data.end())});
+        pending_bytes += range_end - end_posn;
+      }
+    }
+
+    held_bytes.store(pending_bytes + in_flight_bytes);
+  }
+
+  /// @brief Does any pending or in-flight data overlap a range? lock must be held.
+  ///
+  /// @param start_posn The position on the disk the range begins.
+  ///
+  /// @param length The length of the range.
+  ///
+  /// @return True if it does.
+  bool write_combiner::overlaps(uint64_t start_posn, uint64_t length)
+  {
+    const uint64_t end_posn = start_posn + length;
+    auto it = pending.upper_bound(start_posn);
+    if ((it != pending.end()) && (it->second.start_posn < end_posn))
+    {
+      return true;
+    }
+
+    for (const pending_range &range : in_flight)
+    {
+      if ((range.start_posn < end_posn) && ((range.start_posn + range.data.size()) > start_posn))
+      {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  /// @brief Return data that failed to be written to the pending ranges. lock must be held.
+  ///
+  /// Only the parts not since overwritten by newer pending data are kept.
+  ///
+  /// @param failed The data that failed to be written. It is emptied.
+  void write_combiner::restore(std::vector<pending_range> &failed)
+  {
+    std::vector<pending_range> gaps;
+    for (const pending_range &range : failed)
+    {
+      uint64_t posn = range.start_posn;
+      const uint64_t range_end = range.start_posn + range.data.size();
+      auto it = pending.upper_bound(posn);
+
+      while (posn < range_end)
+      {
+        uint64_t gap_end = range_end;
+        if ((it != pending.end()) && (it->second.start_posn < range_end))
+        {
+          gap_end = std::max(posn, it->second.start_posn);
+        }
+
+        if (gap_end > posn)
+        {
+          auto first = range.data.begin() + (posn - range.start_posn);
+          gaps.push_back({posn, std::vector<uint8_t>(first, first + (gap_end - posn))});
+        }
+
+        if (gap_end == range_end)
+        {
+          break;
+        }
+        posn = it->first;
+        it++;
+      }
+    }
+
+    failed.clear();
+    in_flight_bytes = 0;
+
+    if (pending.empty() && !gaps.empty())
+    {
+      oldest_write = std::chrono::steady_clock::now();
+    }
+    for (const pending_range &gap : gaps)
+    {
+      add_range(gap.data.data(), gap.start_posn, gap.data.size());
+    }
+    held_bytes.store(pending_bytes);
+  }
+
+  /// @brief The body of the worker thread, which flushes pending data once the oldest of it is too old.
+  ///
+  void write_combiner::worker()
+  {
+    const std::chrono::milliseconds interval(config.flush_interval_ms);
+    std::unique_lock<std::mutex> guard(lock);
+
+    while (!stopping)
+    {
+      if (pending.empty())
+      {
+        pending_cv.wait(guard, [this]() { return stopping || !pending.empty(); });
+        continue;
+      }
+
+      const std::chrono::steady_clock::time_point due = oldest_write + interval;
+      if (std::chrono::steady_clock::now() < due)
+      {
+        pending_cv.wait_until(guard, due);
+        continue;
+      }
+
+      guard.unlock();
+      try
+      {
+        flush();
+      }
+      catch (std::exception &)
+      {
+        // The data stays pending, so it is tried again later. If the problem lasts, the next call to flush() reports
+        // it.
+      }
+      guard.lock();
+    }
+  }
+};
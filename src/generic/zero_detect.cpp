@@ -0,0 +1,156 @@
+/// @file
+/// @brief Implements a fast check for buffers that contain only zeroes.
+///
+/// The check is vectorised using AVX2 where the processor supports it, otherwise SSE2, with a plain word-at-a-time
+/// version for other processors.
+
+// Copyright Martin Hughes 2018.
+
+#include "virtualdisk/virt_disk_zero.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define ZERO_DETECT_SSE2
+#endif
+
+// AVX2 code is compiled alongside the baseline code and only used if the processor supports it, which needs the
+// function target attribute.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define ZERO_DETECT_AVX2
+#endif
+
+namespace
+{
+  typedef bool (*zero_check_fn)(const uint8_t *data, uint64_t length);
+
+  /// @brief Check a buffer for zeroes without using any vector instructions.
+  ///
+  /// @param data The buffer to check.
+  ///
+  /// @param length The length of the buffer.
+  ///
+  /// @return True if every byte is zero.
+  bool is_zero_scalar(const uint8_t *data, uint64_t length)
+  {
+    for (; length >= (4 * sizeof(uint64_t)); data += (4 * sizeof(uint64_t)), length -= (4 * sizeof(uint64_t)))
+    {
+      uint64_t words[4];
+      memcpy(words, data, sizeof(words));
+      if ((words[0] | words[1] | words[2] | words[3]) != 0)
+      {
+        return false;
+      }
+    }
+
+    for (; length > 0; data++, length--)
+    {
+      if (*data != 0)
+      {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+#ifdef ZERO_DETECT_SSE2
+  /// @brief Check a buffer for zeroes 64 bytes at a time, using SSE2.
+  ///
+  /// @param data The buffer to check.
+  ///
+  /// @param length The length of the buffer.
+  ///
+  /// @return True if every byte is zero.
+  bool is_zero_sse2(const uint8_t *data, uint64_t length)
+  {
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; length >= 64; data += 64, length -= 64)
+    {
+      __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+      __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16));
+      __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 32));
+      __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 48));
+      __m128i combined = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(combined, zero)) != 0xFFFF)
+      {
+        return false;
+      }
+    }
+
+    return is_zero_scalar(data, length);
+  }
+#endif
+
+#ifdef ZERO_DETECT_AVX2
+  /// @brief Check a buffer for zeroes 128 bytes at a time, using AVX2.
+  ///
+  /// @param data The buffer to check.
+  ///
+  /// @param length The length of the buffer.
+  ///
+  /// @return True if every byte is zero.
+  __attribute__((target("avx2"))) bool is_zero_avx2(const uint8_t *data, uint64_t length)
+  {
+    for (; length >= 128; data += 128, length -= 128)
+    {
+      __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+      __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + 32));
+      __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + 64));
+      __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + 96));
+      __m256i combined = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+
+      if (!_mm256_testz_si256(combined, combined))
+      {
+        return false;
+      }
+    }
+
+    return is_zero_scalar(data, length);
+  }
+#endif
+
+  /// @brief Choose the fastest check the processor supports.
+  ///
+  /// @return The chosen check.
+  zero_check_fn select_zero_check()
+  {
+#ifdef ZERO_DETECT_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+      return is_zero_avx2;
+    }
+#endif
+
+#ifdef ZERO_DETECT_SSE2
+    return is_zero_sse2;
+#else
+    return is_zero_scalar;
+#endif
+  }
+}
+
+namespace virt_disk
+{
+  /// @brief Check whether a buffer contains only zeroes.
+  ///
+  /// The check stops at the first non-zero byte, so buffers of real data are usually rejected almost at once.
+  ///
+  /// @param buffer The buffer to check.
+  ///
+  /// @param length The length of the buffer, in bytes.
+  ///
+  /// @return True if every byte is zero, including when length is zero.
+  bool is_zero_buffer(const void *buffer, uint64_t length)
+  {
+    static const zero_check_fn zero_check = select_zero_check();
+    return zero_check(reinterpret_cast<const uint8_t *>(buffer), length);
+  }
+};
@@ -6,6 +6,35 @@
 #include "virtualdisk/virtualdisk.h"
 #include "virtualdisk/virt_disk_vdi.h"
 
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+
+namespace
+{
+  /// When the file must grow to hold a new block, it grows by this many blocks so that a burst of allocations costs
+  /// one extension of the file.
+  const uint64_t FILE_GROWTH_BLOCKS = 16;
+
+  /// The block map and header are written after this many allocations, if flush() is not called first.
+  const uint32_t METADATA_BATCH_BLOCKS = 64;
+
+  /// The text written at the start of new images.
+  const char VDI_INFO_TEXT[] = "<<< Oracle VM VirtualBox Disk Image >>>\n";
+
+  /// The size of the v1.1 header, excluding the pre-header, written in new images.
+  const uint32_t VDI_HEADER_LENGTH = 0x190;
+
+  /// The data in new images starts at a multiple of this many bytes.
+  const uint64_t VDI_DATA_ALIGNMENT = 1024 * 1024;
+
+  /// The largest piece of the block map written in one go when creating an image, in entries.
+  const uint64_t MAP_WRITE_ENTRIES = 16 * 1024;
+}
+
 namespace virt_disk
 {
   /// @brief Constructs a vdi_disk object.
@@ -13,19 +42,26 @@ namespace virt_disk
   /// This object parses VirtualBox .VDI format disk images.
   ///
   /// @param filename The filename of the disk image to open.
-  vdi_disk::vdi_disk(std::string &filename) :
-    backing_file{filename, std::fstream::binary | std::fstream::in | std::fstream::out},
-    is_ok{false}
+  vdi_disk::vdi_disk(std::string &filename) : vdi_disk{disk_file::open(filename)}
+  {
+  }
+
+  /// @brief Constructs a vdi_disk object from an already open backing file.
+  ///
+  /// @param file The backing file containing the disk image. The new object takes ownership of it.
+  ///
+  /// @param config Options controlling how the image is opened.
+  vdi_disk::vdi_disk(std::unique_ptr<disk_file> file, const open_config &config) :
+    backing_file{std::move(file)},
+    is_ok{false},
+    unsaved_allocations{0}
   {
     if (!backing_file)
     {
       throw std::fstream::failure("Failed to open backing file");
     }
 
-    backing_file.exceptions(std::fstream::failbit | std::fstream::eofbit | std::fstream::badbit);
-
-    backing_file.seekg(0);
-    backing_file.read(reinterpret_cast<char *>(&file_header), sizeof(vdi_header));
+    backing_file->read_at(&file_header, sizeof(vdi_header), 0);
 
     if ((file_header.magic_number == VDI_MAGIC_NUM) &&
         (file_header.version_major == 1) &&
@@ -42,28 +78,171 @@ namespace virt_disk
       throw std::fstream::failure("Failed to construct disk image object");
     }
 
-    block_map = std::unique_ptr<uint32_t[]>(new uint32_t[file_header.number_blocks_allocated]);
-    uint64_t block_map_bytes = file_header.number_blocks_allocated * sizeof(uint32_t);
-    backing_file.seekg(file_header.block_data_offset);
-    backing_file.read(reinterpret_cast<char *>(block_map.get()), block_map_bytes);
+    if (file_header.image_block_size == 0)
+    {
+      throw std::fstream::failure("Invalid block size");
+    }
 
-    if (!backing_file)
+    // The blocks must cover the whole disk, and no more can be allocated than there are. Dividing avoids overflow.
+    const uint64_t blocks_needed = (file_header.disk_size / file_header.image_block_size) +
+                                   (((file_header.disk_size % file_header.image_block_size) != 0) ? 1 : 0);
+    if ((file_header.number_blocks < blocks_needed) ||
+        (file_header.number_blocks_allocated > file_header.number_blocks))
     {
-      throw std::fstream::failure("Image file fstream failed");
+      throw std::fstream::failure("Invalid block count");
     }
+
+    // The block map has one entry for every block in the simulated disk, whether it is allocated or not.
+    block_map = std::unique_ptr<block_table>(new block_table(backing_file.get(),
+                                                             file_header.block_data_offset,
+                                                             file_header.number_blocks,
+                                                             false,
+                                                             config));
+
+    next_block_index = file_header.number_blocks_allocated;
+    file_length = backing_file->get_length();
+    zeroed_from = file_length;
   }
 
-  void vdi_disk::read(void *buffer, uint64_t start_posn, uint64_t length, uint64_t buffer_length)
+  /// @brief Destroys a vdi_disk object, writing any metadata changes that have not yet been written.
+  ///
+  /// Errors cannot be reported from here - call flush() first to see them.
+  vdi_disk::~vdi_disk()
   {
-    uint64_t amount_read = 0;
+    release_cache();
 
-    if (!is_ok || !backing_file)
+    try
     {
-      throw std::fstream::failure("Disk image format not OK");
+      flush_metadata();
+    }
+    catch (std::fstream::failure &)
+    {
+    }
+  }
+
+  /// @brief Decide whether a file looks like a VDI image, without opening it as one.
+  ///
+  /// @param first_sector The first 512 bytes of the file, padded with zeroes if the file is shorter.
+  ///
+  /// @param last_sector The last 512 bytes of the file. Unused.
+  ///
+  /// @param file_length The length of the file, in bytes.
+  ///
+  /// @return True if the file has the VDI magic number.
+  bool vdi_disk::probe(const uint8_t *first_sector, const uint8_t *last_sector, uint64_t file_length)
+  {
+    uint32_t magic_number;
+    const uint64_t magic_offset = offsetof(vdi_header, magic_number);
+
+    if (file_length < (magic_offset + sizeof(magic_number)))
+    {
+      return false;
+    }
+
+    memcpy(&magic_number, first_sector + magic_offset, sizeof(magic_number));
+    return (magic_number == VDI_MAGIC_NUM);
+  }
+
+  /// @brief Create a new VDI image.
+  ///
+  /// A normal image has no blocks allocated, so reads as zeroes throughout. A fixed image has every block allocated in
+  /// order; the space is set aside by extending the file, which reads as zeroes and is sparse where the filesystem
+  /// allows.
+  ///
+  /// @param filename The file to create. It must not already exist, and is removed again if the image cannot be
+  ///                 written.
+  ///
+  /// @param size The size of the virtual disk, in bytes.
+  ///
+  /// @param file_type VDI_TYPE_NORMAL or VDI_TYPE_FIXED_SIZE.
+  ///
+  /// @param block_size The size of each block, in bytes - a multiple of 512. Zero selects VDI_DEFAULT_BLOCK_SIZE.
+  void vdi_disk::create(const std::string &filename, uint64_t size, uint32_t file_type, uint32_t block_size)
+  {
+    if ((file_type != VDI_TYPE_NORMAL) && (file_type != VDI_TYPE_FIXED_SIZE))
+    {
+      throw std::fstream::failure("Only normal and fixed VDI images can be created");
+    }
+
+    if (block_size == 0)
+    {
+      block_size = VDI_DEFAULT_BLOCK_SIZE;
+    }
+
+    uint64_t number_blocks = (size + block_size - 1) / block_size;
+    if (((block_size % 512) != 0) || (number_blocks >= VDI_BLOCK_ZERO))
+    {
+      throw std::fstream::failure("Invalid size for VDI image");
+    }
+
+    const uint64_t block_map_offset = 512;
+    const uint64_t block_map_end = block_map_offset + (number_blocks * sizeof(uint32_t));
+    const uint64_t image_data_offset =
+      ((block_map_end + VDI_DATA_ALIGNMENT - 1) / VDI_DATA_ALIGNMENT) * VDI_DATA_ALIGNMENT;
+
+    // The header fills the first sector. The space after vdi_header holds the creation and modification UUIDs, then
+    // fields that are left as zero.
+    uint8_t header_sector[512] = { 0 };
+    vdi_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.info_test, VDI_INFO_TEXT, sizeof(VDI_INFO_TEXT) - 1);
+    header.magic_number = VDI_MAGIC_NUM;
+    header.version_major = 1;
+    header.version_minor = 1;
+    header.header_len = VDI_HEADER_LENGTH;
+    header.file_type = file_type;
+    header.block_data_offset = static_cast<uint32_t>(block_map_offset);
+    header.image_data_offset = static_cast<uint32_t>(image_data_offset);
+    header.sector_size = 512;
+    header.disk_size = size;
+    header.image_block_size = block_size;
+    header.number_blocks = static_cast<uint32_t>(number_blocks);
+    header.number_blocks_allocated = (file_type == VDI_TYPE_FIXED_SIZE) ? static_cast<uint32_t>(number_blocks) : 0;
+    memcpy(header_sector, &header, sizeof(header));
+
+    std::random_device random_source;
+    for (uint32_t i = 0; i < 32; i++)
+    {
+      header_sector[sizeof(vdi_header) + i] = static_cast<uint8_t>(random_source());
+    }
+
+    std::unique_ptr<disk_file> file = disk_file::create(filename);
+
+    // Don't leave a partly written image behind.
+    try
+    {
+      file->write_at(header_sector, sizeof(header_sector), 0);
+
+      std::vector<uint32_t> map_entries(std::min(number_blocks, MAP_WRITE_ENTRIES));
+      for (uint64_t first = 0; first < number_blocks; first += map_entries.size())
+      {
+        uint64_t count = std::min(static_cast<uint64_t>(map_entries.size()), number_blocks - first);
+        for (uint64_t i = 0; i < count; i++)
+        {
+          map_entries[i] = (file_type == VDI_TYPE_FIXED_SIZE) ? static_cast<uint32_t>(first + i) :
+                                                                VDI_BLOCK_UNALLOCATED;
+        }
+        file->write_at(map_entries.data(), count * sizeof(uint32_t), block_map_offset + (first * sizeof(uint32_t)));
+      }
+
+      uint64_t data_length = (file_type == VDI_TYPE_FIXED_SIZE) ? (number_blocks * block_size) : 0;
+      file->set_length(image_data_offset + data_length);
+      file->flush();
+    }
+    catch (...)
+    {
+      file.reset();
+      std::remove(filename.c_str());
+      throw;
     }
+  }
 
-    // Make it easier for us to manipulate our position within 'buffer'
-    uint8_t *buffer_uint = reinterpret_cast<uint8_t *>(buffer);
+  void vdi_disk::read(void *buffer, uint64_t start_posn, uint64_t length, uint64_t buffer_length)
+  {
+    if (!is_ok)
+    {
+      throw std::fstream::failure("Disk image format not OK");
+    }
 
     // Ensure that we don't try to write beyond the length of buffer.
     if (length > buffer_length)
@@ -71,76 +250,482 @@ namespace virt_disk
       length = buffer_length;
     }
 
-    // Compute a start block and offset. Note that at the moment we simply ignore "image_block_extra_size".
-    uint64_t start_block = start_posn / this->file_header.image_block_size;
-    uint64_t block_offset = start_posn % this->file_header.image_block_size;
-    uint64_t bytes_this_block = this->file_header.image_block_size - block_offset;
-    if (bytes_this_block > length)
+    // VDI files are stored on disk in "blocks" that may be out-of-order, but read_range() works out where each part of
+    // the range is - then reads each physically contiguous run in one go.
+    read_range(reinterpret_cast<uint8_t *>(buffer), start_posn, length);
+  }
+
+  /// @brief Write to the virtual machine disk.
+  ///
+  /// Blocks that are not yet stored in the file are appended to it. The block map and header are updated in memory
+  /// straight away, but written to the file in batches - call flush() to make sure they have been written.
+  ///
+  /// @param buffer The buffer to write to disk.
+  ///
+  /// @param start_posn The position on the disk to begin writing at.
+  ///
+  /// @param length The number of bytes to write. Must be less than, or equal to, buffer_length.
+  ///
+  /// @param buffer_length The total length of the buffer. Must be equal to, or greater than, length.
+  void vdi_disk::write(const void *buffer, uint64_t start_posn, uint64_t length, uint64_t buffer_length)
+  {
+    if (!is_ok)
+    {
+      throw std::fstream::failure("Disk image format not OK");
+    }
+
+    if (length > buffer_length)
+    {
+      length = buffer_length;
+    }
+
+    write_range(reinterpret_cast<const uint8_t *>(buffer), start_posn, length);
+  }
+
+  uint64_t vdi_disk::get_length()
+  {
+    return this->file_header.disk_size;
+  }
+
+  void vdi_disk::map_range(uint64_t start_posn, uint64_t length, bool allocate, std::vector<disk_extent> &extents)
+  {
+    if (!is_ok)
     {
-      bytes_this_block = length;
+      throw std::fstream::failure("Disk image format not OK");
     }
 
-    while(amount_read < length)
+    if ((start_posn > this->file_header.disk_size) || (length > (this->file_header.disk_size - start_posn)))
     {
-      read_one_block(start_block, block_offset, bytes_this_block, buffer_uint);
+      throw std::fstream::failure("Too long");
+    }
 
-      amount_read += bytes_this_block;
+    uint64_t block_size = this->file_header.image_block_size;
+    while (length > 0)
+    {
+      uint64_t block_number = start_posn / block_size;
+      uint64_t block_offset = start_posn % block_size;
+      uint64_t bytes_this_block = block_size - block_offset;
+      if (bytes_this_block > length)
+      {
+        bytes_this_block = length;
+      }
 
-      // Update offsets and lengths for the next block.
-      block_offset = 0;
-      start_block++;
-      buffer_uint += bytes_this_block;
-      bytes_this_block = this->file_header.image_block_size;
+      // Unallocated and zeroed blocks are not stored in the file, and read as zeroes.
+      uint32_t block_on_disk_number;
+      if (allocate)
+      {
+        block_on_disk_number = get_or_allocate_block(block_number);
+      }
+      else
+      {
+        block_on_disk_number = this->block_map->get(block_number);
+      }
 
-      if ((amount_read + bytes_this_block) > length)
+      if ((block_on_disk_number == VDI_BLOCK_UNALLOCATED) || (block_on_disk_number == VDI_BLOCK_ZERO))
+      {
+        append_extent(extents, start_posn, bytes_this_block, EXTENT_UNALLOCATED);
+      }
+      else
       {
-        bytes_this_block = length - amount_read;
+        // Note that at the moment we simply ignore "image_block_extra_size".
+        uint64_t file_offset = (static_cast<uint64_t>(block_on_disk_number) * block_size) +
+                               block_offset +
+                               this->file_header.image_data_offset;
+        append_extent(extents, start_posn, bytes_this_block, file_offset);
       }
+
+      start_posn += bytes_this_block;
+      length -= bytes_this_block;
     }
   }
 
-  void vdi_disk::write(const void *buffer, uint64_t start_posn, uint64_t length, uint64_t buffer_length)
+  disk_file *vdi_disk::get_backing_file()
   {
-    throw std::fstream::failure("Not implemented");
+    return backing_file.get();
   }
 
-  /// @brief Read a complete or partial block from the disk.
+  /// @brief Write any deferred changes to the block map and header, and release space reserved for new blocks.
   ///
-  /// VDI files are stored on disk in "blocks" that may be out-of-order, which means it is easiest to just attempt to
-  /// read one block at a time - which is what this function does.
+  /// Only space that this object added to the end of the file is released. Anything that was already in the file when
+  /// it was opened is left alone, even beyond the blocks the header counts - so an image that is only read is never
+  /// changed.
+  void vdi_disk::flush_metadata()
+  {
+    std::lock_guard<std::mutex> append_guard(append_lock);
+    write_metadata();
+
+    uint64_t used_length = this->file_header.image_data_offset +
+                           (static_cast<uint64_t>(next_block_index) * this->file_header.image_block_size);
+    uint64_t keep_length = std::max(used_length, zeroed_from);
+    if (file_length > keep_length)
+    {
+      backing_file->set_length(keep_length);
+      file_length = keep_length;
+    }
+  }
+
+  /// @brief Mark unallocated blocks that have been written with zeroes as zero blocks in the block map.
   ///
-  /// @param start_block The logical number of the block to read.
+  /// They still take no space in the file. Only blocks wholly inside the range are marked.
   ///
-  /// @param block_offset The offset within the block to begin reading from, in bytes.
+  /// @param start_posn The number of bytes into the virtual disk that the range begins.
+  ///
+  /// @param length The length of the range, in bytes.
+  void vdi_disk::mark_zeroed(uint64_t start_posn, uint64_t length)
+  {
+    const uint64_t block_size = this->file_header.image_block_size;
+    const uint64_t first_block = (start_posn + block_size - 1) / block_size;
+    const uint64_t end_block = (start_posn + length) / block_size;
+
+    for (uint64_t block_number = first_block; block_number < end_block; block_number++)
+    {
+      if (this->block_map->get(block_number) != VDI_BLOCK_UNALLOCATED)
+      {
+        continue;
+      }
+
+      // Don't overwrite the entry of a block another thread has just allocated.
+      std::lock_guard<std::mutex> block_guard(allocation_locks[block_number % ALLOCATION_LOCK_COUNT]);
+      if (this->block_map->get(block_number) == VDI_BLOCK_UNALLOCATED)
+      {
+        this->block_map->set(block_number, VDI_BLOCK_ZERO);
+      }
+    }
+  }
+
+  /// @brief Allocate every block holding part of a range that is not yet stored in the file, including zero blocks.
   ///
-  /// @param bytes_this_block How many bytes to read from this block.
+  /// Space for all of them is allocated in the file in one go before any is handed out, so unless other threads are
+  /// allocating blocks at the same time they are stored one after another. For fixed size images, only the storage
+  /// behind the range is allocated in the file.
   ///
-  /// @param buffer The buffer to read in to. No checks are performed to ensure the buffer is a suitable size.
+  /// @param start_posn The number of bytes into the virtual disk that the range begins.
   ///
-  void vdi_disk::read_one_block(uint64_t start_block,
-                                uint32_t block_offset,
-                                uint32_t bytes_this_block,
-                                uint8_t *buffer)
+  /// @param length The length of the range, in bytes.
+  void vdi_disk::allocate_blocks(uint64_t start_posn, uint64_t length)
   {
-    // Which block within the file represents this block on disk?
-    uint32_t block_on_disk_number = this->block_map[start_block];
+    if (this->file_header.file_type != VDI_TYPE_NORMAL)
+    {
+      virt_disk::allocate_blocks(start_posn, length);
+      return;
+    }
+
+    const uint64_t block_size = this->file_header.image_block_size;
+    const uint64_t first_block = start_posn / block_size;
+    const uint64_t end_block = (start_posn + length + block_size - 1) / block_size;
 
-    // For now, only support already extant blocks
-    if ((block_on_disk_number == ~0) || (block_on_disk_number == ((~0) - 1)))
+    uint64_t missing_blocks = 0;
+    for (uint64_t block_number = first_block; block_number < end_block; block_number++)
     {
-      throw std::fstream::failure("Non-existent block read attempted");
+      uint32_t block_index = this->block_map->get(block_number);
+      if ((block_index == VDI_BLOCK_UNALLOCATED) || (block_index == VDI_BLOCK_ZERO))
+      {
+        missing_blocks++;
+      }
     }
 
-    uint64_t file_offset = (block_on_disk_number * this->file_header.image_block_size) +
-                           block_offset +
-                           this->file_header.image_data_offset;
+    if (missing_blocks == 0)
+    {
+      return;
+    }
 
-    backing_file.seekg(file_offset);
-    backing_file.read(reinterpret_cast<char *>(buffer), bytes_this_block);
+    {
+      std::lock_guard<std::mutex> append_guard(append_lock);
+      if (next_block_index < this->file_header.number_blocks)
+      {
+        uint64_t new_blocks = std::min(missing_blocks,
+                                       static_cast<uint64_t>(this->file_header.number_blocks - next_block_index));
+        uint64_t space_start = this->file_header.image_data_offset +
+                               (static_cast<uint64_t>(next_block_index) * block_size);
+        backing_file->allocate(space_start, new_blocks * block_size);
+        file_length = std::max(file_length, space_start + (new_blocks * block_size));
+      }
+    }
+
+    for (uint64_t block_number = first_block; block_number < end_block; block_number++)
+    {
+      get_or_allocate_block(block_number);
+    }
+
+    std::lock_guard<std::mutex> append_guard(append_lock);
+    write_metadata();
   }
 
-  uint64_t vdi_disk::get_length()
+  /// @brief Describe the layout of the blocks in the file, for compact(). Only normal images can have blocks moved.
+  ///
+  /// @param geometry Receives the layout.
+  ///
+  /// @return True for normal images, false for fixed images.
+  bool vdi_disk::get_block_geometry(block_geometry &geometry)
   {
-    return this->file_header.disk_size;
+    if (this->file_header.file_type != VDI_TYPE_NORMAL)
+    {
+      return false;
+    }
+
+    geometry.block_count = this->file_header.number_blocks;
+    geometry.block_size = this->file_header.image_block_size;
+    geometry.stored_block_bytes = this->file_header.image_block_size;
+    geometry.data_start = this->file_header.image_data_offset;
+    geometry.zero_blocks_removable = true;
+
+    return true;
+  }
+
+  /// @brief Find where a block is stored in the file.
+  ///
+  /// @param block_number The number of the block.
+  ///
+  /// @return The offset of the block in the file, or EXTENT_UNALLOCATED.
+  uint64_t vdi_disk::get_block_location(uint64_t block_number)
+  {
+    uint32_t block_index = this->block_map->get(block_number);
+    if ((block_index == VDI_BLOCK_UNALLOCATED) || (block_index == VDI_BLOCK_ZERO))
+    {
+      return EXTENT_UNALLOCATED;
+    }
+
+    return this->file_header.image_data_offset +
+           (static_cast<uint64_t>(block_index) * this->file_header.image_block_size);
+  }
+
+  /// @brief Point a block's map entry at a new place in the file, or mark it as a zero block.
+  ///
+  /// @param block_number The number of the block.
+  ///
+  /// @param file_offset The new offset of the block, or EXTENT_UNALLOCATED.
+  void vdi_disk::set_block_location(uint64_t block_number, uint64_t file_offset)
+  {
+    if (file_offset == EXTENT_UNALLOCATED)
+    {
+      this->block_map->set(block_number, VDI_BLOCK_ZERO);
+    }
+    else
+    {
+      uint64_t block_index = (file_offset - this->file_header.image_data_offset) / this->file_header.image_block_size;
+      this->block_map->set(block_number, static_cast<uint32_t>(block_index));
+    }
+  }
+
+  /// @brief Set aside the next block in the file, without giving it to any block of the disk.
+  ///
+  /// @return The offset of the space in the file, or EXTENT_UNALLOCATED if every slot in the file is in use.
+  uint64_t vdi_disk::append_block_space()
+  {
+    std::lock_guard<std::mutex> append_guard(append_lock);
+    const uint64_t block_size = this->file_header.image_block_size;
+
+    // The block map cannot refer to more slots than the disk has blocks.
+    if (next_block_index >= this->file_header.number_blocks)
+    {
+      return EXTENT_UNALLOCATED;
+    }
+
+    uint64_t block_posn = this->file_header.image_data_offset + (static_cast<uint64_t>(next_block_index) * block_size);
+    if ((block_posn + block_size) > file_length)
+    {
+      backing_file->set_length(block_posn + block_size);
+      file_length = block_posn + block_size;
+    }
+    next_block_index++;
+
+    return block_posn;
+  }
+
+  /// @brief Give back the space at the end of the file once no block is stored there, and shorten the file.
+  ///
+  /// @param data_end The offset that the next new block will be stored at.
+  void vdi_disk::truncate_block_space(uint64_t data_end)
+  {
+    std::lock_guard<std::mutex> append_guard(append_lock);
+    const uint64_t block_size = this->file_header.image_block_size;
+    uint32_t new_next_index = static_cast<uint32_t>((data_end - this->file_header.image_data_offset + block_size - 1) /
+                                                    block_size);
+
+    if (new_next_index >= next_block_index)
+    {
+      return;
+    }
+
+    next_block_index = new_next_index;
+    backing_file->flush();
+    this->file_header.number_blocks_allocated = next_block_index;
+    backing_file->write_at(&this->file_header, sizeof(vdi_header), 0);
+
+    uint64_t used_length = this->file_header.image_data_offset + (static_cast<uint64_t>(next_block_index) * block_size);
+    backing_file->set_length(used_length);
+    file_length = used_length;
+    zeroed_from = std::min(zeroed_from, file_length);
+  }
+
+  /// @brief Find the index in the file of a block, allocating it at the end of the file if needed.
+  ///
+  /// Allocation only serialises with other allocations of the same block (or one sharing its allocation lock), and
+  /// briefly with other threads allocating blocks.
+  ///
+  /// The file is extended several blocks at a time, and the new space reads as zeroes. Only once the block is ready
+  /// does its map entry become visible to readers. The map and header are written once every METADATA_BATCH_BLOCKS
+  /// allocations, or when flush() is called.
+  ///
+  /// @param block_number The logical number of the block to look up.
+  ///
+  /// @return The index of the block in the file.
+  uint32_t vdi_disk::get_or_allocate_block(uint64_t block_number)
+  {
+    uint32_t block_index = this->block_map->get(block_number);
+    if ((block_index != VDI_BLOCK_UNALLOCATED) && (block_index != VDI_BLOCK_ZERO))
+    {
+      return block_index;
+    }
+
+    if (this->file_header.file_type != VDI_TYPE_NORMAL)
+    {
+      throw std::fstream::failure("Fixed size image is missing a block");
+    }
+
+    std::lock_guard<std::mutex> block_guard(allocation_locks[block_number % ALLOCATION_LOCK_COUNT]);
+
+    // Another thread may have allocated this block while we waited for the lock.
+    block_index = this->block_map->get(block_number);
+    if ((block_index != VDI_BLOCK_UNALLOCATED) && (block_index != VDI_BLOCK_ZERO))
+    {
+      return block_index;
+    }
+
+    io_stats_recorder *recorder = stats();
+    const uint64_t start_ns = (recorder != nullptr) ? io_stats_recorder::now() : 0;
+
+    const uint64_t block_size = this->file_header.image_block_size;
+    uint64_t block_posn;
+    bool needs_zeroing;
+    {
+      std::lock_guard<std::mutex> append_guard(append_lock);
+
+      if (next_block_index >= this->file_header.number_blocks)
+      {
+        block_index = reuse_free_slot(block_number);
+        if (recorder != nullptr)
+        {
+          recorder->add(stat_counter::BLOCKS_ALLOCATED, 1);
+          recorder->add_latency(stat_latency::ALLOCATE, start_ns);
+        }
+        return block_index;
+      }
+
+      block_index = next_block_index;
+      block_posn = this->file_header.image_data_offset + (static_cast<uint64_t>(block_index) * block_size);
+
+      if ((block_posn + block_size) > file_length)
+      {
+        uint64_t remaining_blocks = this->file_header.number_blocks - block_index;
+        uint64_t new_length = block_posn + (std::min(FILE_GROWTH_BLOCKS, remaining_blocks) * block_size);
+        backing_file->set_length(new_length);
+        file_length = new_length;
+      }
+
+      needs_zeroing = (block_posn < zeroed_from);
+      next_block_index++;
+    }
+
+    // Space that existed before the file was opened might not be zero.
+    if (needs_zeroing)
+    {
+      std::unique_ptr<uint8_t[]> zeroes(new uint8_t[block_size]());
+      backing_file->write_at(zeroes.get(), block_size, block_posn);
+    }
+
+    this->block_map->set(block_number, block_index);
+
+    {
+      std::lock_guard<std::mutex> append_guard(append_lock);
+      unsaved_allocations++;
+      if (unsaved_allocations >= METADATA_BATCH_BLOCKS)
+      {
+        write_metadata();
+      }
+    }
+
+    if (recorder != nullptr)
+    {
+      recorder->add(stat_counter::BLOCKS_ALLOCATED, 1);
+      recorder->add_latency(stat_latency::ALLOCATE, start_ns);
+    }
+
+    return block_index;
+  }
+
+  /// @brief Allocate a block in a slot left free in the middle of the file, when there are no more slots at the end.
+  ///
+  /// This only happens after compact() has removed blocks but not yet shortened the file. append_lock must be held,
+  /// and is held until the block map is updated, so no other thread can pick the same slot.
+  ///
+  /// @param block_number The number of the block being allocated.
+  ///
+  /// @return The index in the file of the block.
+  uint32_t vdi_disk::reuse_free_slot(uint64_t block_number)
+  {
+    std::vector<bool> slot_used(next_block_index, false);
+    for (uint64_t other_block = 0; other_block < this->block_map->size(); other_block++)
+    {
+      uint32_t slot = this->block_map->get(other_block);
+      if (slot < next_block_index)
+      {
+        slot_used[slot] = true;
+      }
+    }
+
+    auto free_slot = std::find(slot_used.begin(), slot_used.end(), false);
+    if (free_slot == slot_used.end())
+    {
+      throw std::fstream::failure("Image is full");
+    }
+
+    // The slot may still hold the contents of a block that has been moved or removed.
+    const uint64_t block_size = this->file_header.image_block_size;
+    uint32_t block_index = static_cast<uint32_t>(free_slot - slot_used.begin());
+    std::unique_ptr<uint8_t[]> zeroes(new uint8_t[block_size]());
+    backing_file->write_at(zeroes.get(),
+                           block_size,
+                           this->file_header.image_data_offset + (static_cast<uint64_t>(block_index) * block_size));
+
+    this->block_map->set(block_number, block_index);
+    space_reused++;
+    unsaved_allocations++;
+    if (unsaved_allocations >= METADATA_BATCH_BLOCKS)
+    {
+      write_metadata();
+    }
+
+    return block_index;
+  }
+
+  /// @brief Write the changed part of the block map, and the header, to the file. append_lock must be held.
+  ///
+  /// The file is flushed first, so the map on disk never refers to a block whose zeroes or data have not reached
+  /// stable storage - which matters most for a slot reused after compact(), since it may still hold another block's
+  /// old contents. The header is written next. Its count of allocated blocks covers every block that has been handed
+  /// out, so even if the map is not then written, a later allocation can never reuse a block the map on disk refers to.
+  void vdi_disk::write_metadata()
+  {
+    if (!block_map->has_changes())
+    {
+      return;
+    }
+
+    io_stats_recorder *recorder = stats();
+    const uint64_t start_ns = (recorder != nullptr) ? io_stats_recorder::now() : 0;
+
+    backing_file->flush();
+    this->file_header.number_blocks_allocated = next_block_index;
+    backing_file->write_at(&this->file_header, sizeof(vdi_header), 0);
+
+    block_map->write_changes();
+    unsaved_allocations = 0;
+
+    if (recorder != nullptr)
+    {
+      recorder->add(stat_counter::METADATA_WRITES, 1);
+      recorder->add_time(stat_counter::METADATA_NS, start_ns);
+    }
   }
 } // namespace virt_disk.
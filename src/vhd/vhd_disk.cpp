@@ -1,32 +1,306 @@
 /// @file
 ///
 
-// Known defects:
-// - Neither when reading nor writing do we pay attention to the block bitmap.
-
 #include "virtualdisk/virt_disk_vhd.h"
 
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
 using namespace virt_disk;
 
+namespace
+{
+  /// When the file must grow to hold a new block, space for this many blocks is reserved so that a burst of
+  /// allocations costs one extension of the file.
+  const uint64_t RESERVE_BLOCKS = 16;
+
+  /// The block allocation table is written after this many allocations, if flush() is not called first.
+  const uint32_t METADATA_BATCH_BLOCKS = 64;
+
+  /// Block bitmaps are written in whole units of this size. It is also the size of the sectors they track.
+  const uint64_t SECTOR_BYTES = 512;
+
+  /// The creator application recorded in new images - 'lvd '.
+  const uint32_t CREATOR_APP = 0x6C766420;
+
+  /// The creator host OS recorded in new images - 'Wi2k', the value used by most tools.
+  const uint32_t CREATOR_HOST_OS = 0x5769326B;
+
+  /// Seconds between the start of 1970 and the start of 2000, the epoch of VHD timestamps.
+  const uint64_t VHD_EPOCH_OFFSET = 946684800;
+
+  /// The largest piece of the block allocation table written in one go when creating an image, in bytes.
+  const uint64_t TABLE_WRITE_BYTES = 64 * 1024;
+
+  /// The largest block size accepted, in bytes. Blocks are copied whole by compaction and conversion, so this also
+  /// bounds the buffers they use.
+  const uint64_t MAX_BLOCK_SIZE = 256 * 1024 * 1024;
+
+  /// @brief Check that a dynamic disk's block size is one this class can handle.
+  ///
+  /// @param block_size The size of a block, in bytes.
+  ///
+  /// @return True if the size is a power of two, at least one sector and no more than MAX_BLOCK_SIZE.
+  bool valid_block_size(uint64_t block_size)
+  {
+    return (block_size >= SECTOR_BYTES) && (block_size <= MAX_BLOCK_SIZE) && ((block_size & (block_size - 1)) == 0);
+  }
+
+  /// @brief Calculate the CHS geometry of a disk, as the VHD specification requires.
+  ///
+  /// @param size The size of the disk, in bytes.
+  ///
+  /// @return The geometry in the format of vhd_footer::disk_geometry.
+  uint32_t calculate_geometry(uint64_t size)
+  {
+    uint64_t total_sectors = std::min(size / 512, static_cast<uint64_t>(65535) * 16 * 255);
+    uint64_t sectors_per_track;
+    uint64_t heads;
+    uint64_t cylinder_times_heads;
+
+    if (total_sectors >= (static_cast<uint64_t>(65535) * 16 * 63))
+    {
+      sectors_per_track = 255;
+      heads = 16;
+      cylinder_times_heads = total_sectors / sectors_per_track;
+    }
+    else
+    {
+      sectors_per_track = 17;
+      cylinder_times_heads = total_sectors / sectors_per_track;
+      heads = std::max(static_cast<uint64_t>(4), (cylinder_times_heads + 1023) / 1024);
+
+      if ((cylinder_times_heads >= (heads * 1024)) || (heads > 16))
+      {
+        sectors_per_track = 31;
+        heads = 16;
+        cylinder_times_heads = total_sectors / sectors_per_track;
+      }
+
+      if (cylinder_times_heads >= (heads * 1024))
+      {
+        sectors_per_track = 63;
+        heads = 16;
+        cylinder_times_heads = total_sectors / sectors_per_track;
+      }
+    }
+
+    uint64_t cylinders = cylinder_times_heads / heads;
+    return static_cast<uint32_t>((cylinders << 16) | (heads << 8) | sectors_per_track);
+  }
+
+  /// @brief Calculate the checksum of a VHD structure - the one's complement of the sum of its bytes.
+  ///
+  /// @param data The structure, with its checksum field set to zero.
+  ///
+  /// @param length The length of the structure.
+  ///
+  /// @return The checksum.
+  uint32_t calculate_checksum(const void *data, uint64_t length)
+  {
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(data);
+    uint32_t sum = 0;
+    for (uint64_t i = 0; i < length; i++)
+    {
+      sum += bytes[i];
+    }
+    return ~sum;
+  }
+
+  /// The longest chain of differencing disks that will be opened. Guards against a chain that loops back on itself.
+  const uint32_t MAX_CHAIN_DEPTH = 256;
+
+  /// The longest parent path that will be read from a parent locator, in bytes.
+  const uint32_t MAX_LOCATOR_BYTES = 64 * 1024;
+
+  /// @brief Convert a UTF-16 string to UTF-8.
+  ///
+  /// @param data The string. Conversion stops at the first NUL character.
+  ///
+  /// @param length The length of data, in bytes.
+  ///
+  /// @param big_endian Whether the string is big-endian (true) or little-endian (false).
+  ///
+  /// @return The string in UTF-8.
+  std::string utf16_to_utf8(const uint8_t *data, uint64_t length, bool big_endian)
+  {
+    std::string result;
+
+    for (uint64_t i = 0; (i + 1) < length; i += 2)
+    {
+      uint32_t code = big_endian ? ((data[i] << 8) | data[i + 1]) : ((data[i + 1] << 8) | data[i]);
+      if (code == 0)
+      {
+        break;
+      }
+
+      // Combine surrogate pairs.
+      if ((code >= 0xD800) && (code < 0xDC00) && ((i + 3) < length))
+      {
+        uint32_t low = big_endian ? ((data[i + 2] << 8) | data[i + 3]) : ((data[i + 3] << 8) | data[i + 2]);
+        if ((low >= 0xDC00) && (low < 0xE000))
+        {
+          code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+          i += 2;
+        }
+      }
+
+      if (code < 0x80)
+      {
+        result += static_cast<char>(code);
+      }
+      else if (code < 0x800)
+      {
+        result += static_cast<char>(0xC0 | (code >> 6));
+        result += static_cast<char>(0x80 | (code & 0x3F));
+      }
+      else if (code < 0x10000)
+      {
+        result += static_cast<char>(0xE0 | (code >> 12));
+        result += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+        result += static_cast<char>(0x80 | (code & 0x3F));
+      }
+      else
+      {
+        result += static_cast<char>(0xF0 | (code >> 18));
+        result += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+        result += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+        result += static_cast<char>(0x80 | (code & 0x3F));
+      }
+    }
+
+    return result;
+  }
+
+  /// @brief Work out the path of a parent disk from a path stored in a differencing disk.
+  ///
+  /// @param child_path The path the differencing disk was opened from.
+  ///
+  /// @param parent_path The stored path. Relative paths are taken relative to the differencing disk's directory.
+  ///
+  /// @return The path to try opening.
+  std::string resolve_parent_path(const std::string &child_path, std::string parent_path)
+  {
+#ifndef _WIN32
+    std::replace(parent_path.begin(), parent_path.end(), '\\', '/');
+    const char separator = '/';
+    bool is_absolute = (!parent_path.empty() && (parent_path[0] == '/'));
+#else
+    const char separator = '\\';
+    bool is_absolute = ((parent_path.size() > 1) && (parent_path[1] == ':')) ||
+                       (!parent_path.empty() && (parent_path[0] == '\\'));
+#endif
+
+    if (is_absolute)
+    {
+      return parent_path;
+    }
+
+    size_t last_separator = child_path.find_last_of("/\\");
+    if (last_separator == std::string::npos)
+    {
+      return parent_path;
+    }
+
+    return child_path.substr(0, last_separator) + separator + parent_path;
+  }
+
+  /// @brief Check whether a sector is marked present in a block bitmap.
+  ///
+  /// @param bits The bitmap, in the on-disk format - sector 0 is the most significant bit of the first byte.
+  ///
+  /// @param sector The sector number within the block.
+  ///
+  /// @return True if the sector is present.
+  bool sector_present(const uint8_t *bits, uint64_t sector)
+  {
+    return (bits[sector / 8] & (0x80 >> (sector % 8))) != 0;
+  }
+
+  /// @brief Mark a range of sectors present in a block bitmap.
+  ///
+  /// @param bits The bitmap, in the on-disk format.
+  ///
+  /// @param first The first sector to mark.
+  ///
+  /// @param last The last sector to mark.
+  void set_sectors_present(uint8_t *bits, uint64_t first, uint64_t last)
+  {
+    while ((first <= last) && ((first % 8) != 0))
+    {
+      bits[first / 8] |= (0x80 >> (first % 8));
+      first++;
+    }
+
+    if ((first + 7) <= last)
+    {
+      uint64_t whole_bytes = (last + 1 - first) / 8;
+      memset(bits + (first / 8), 0xFF, whole_bytes);
+      first += whole_bytes * 8;
+    }
+
+    while (first <= last)
+    {
+      bits[first / 8] |= (0x80 >> (first % 8));
+      first++;
+    }
+  }
+}
+
 /// @brief Constructs a vhd_disk object.
 ///
 /// This object parses Microsoft Virtual Hard Disk (VHD) format disk images.
 ///
 /// @param filename The filename of the disk image to open.
-vhd_disk::vhd_disk(std::string &filename) :
-    backing_file{filename, std::fstream::binary | std::fstream::in | std::fstream::out},
-    data_block_bitmap_bytes{0}
+vhd_disk::vhd_disk(std::string &filename) : vhd_disk{disk_file::open(filename), filename}
+{
+}
+
+/// @brief Constructs a vhd_disk object from an already open backing file.
+///
+/// The parent of a differencing disk opened this way is looked for using its absolute path, or relative to the
+/// current directory.
+///
+/// @param file The backing file containing the disk image. The new object takes ownership of it.
+vhd_disk::vhd_disk(std::unique_ptr<disk_file> file) : vhd_disk{std::move(file), std::string()}
+{
+}
+
+/// @brief Constructs a vhd_disk object from an already open backing file, and the path it was opened from.
+///
+/// @param file The backing file containing the disk image. The new object takes ownership of it.
+///
+/// @param path The path of the file, used to find the parent of a differencing disk.
+///
+/// @param config Options controlling how the image, and any parents, are opened.
+///
+/// @param chain_depth The number of differencing disks above this one in a chain. Used internally.
+vhd_disk::vhd_disk(std::unique_ptr<disk_file> file,
+                   const std::string &path,
+                   const open_config &config,
+                   uint32_t chain_depth) :
+    backing_file{std::move(file)},
+    data_block_bitmap_bytes{0},
+    unsaved_allocations{0},
+    bitmap_page_count{0},
+    image_path{path},
+    layout_generations{}
 {
   if (!backing_file)
   {
     throw std::fstream::failure("Failed to open backing file");
   }
 
-  backing_file.exceptions(std::fstream::failbit | std::fstream::eofbit | std::fstream::badbit);
-  backing_file.seekg(0, std::fstream::end);
-  total_file_length = backing_file.tellg();
-  backing_file.seekg(total_file_length - sizeof(vhd_footer), std::fstream::beg);
-  backing_file.read(reinterpret_cast<char *>(&footer_copy), sizeof(footer_copy));
+  total_file_length = backing_file->get_length();
+  if (total_file_length < sizeof(vhd_footer))
+  {
+    throw std::fstream::failure("File is wrong format");
+  }
+  backing_file->read_at(&footer_copy, sizeof(footer_copy), total_file_length - sizeof(vhd_footer));
 
   if ((memcmp(&footer_copy.cookie, &VHD_COOKIE, sizeof(footer_copy.cookie)) != 0) ||
       (footer_copy.format_version != VHD_SUPPORTED_VERSION))
@@ -35,9 +309,10 @@ vhd_disk::vhd_disk(std::string &filename) :
   }
 
   if ((footer_copy.disk_type != vhd_disk_type::FIXED) &&
-      (footer_copy.disk_type != vhd_disk_type::DYNAMIC))
+      (footer_copy.disk_type != vhd_disk_type::DYNAMIC) &&
+      (footer_copy.disk_type != vhd_disk_type::DIFFERENCING))
   {
-    throw std::fstream::failure("Only FIXED and DYNAMIC disks supported");
+    throw std::fstream::failure("Only FIXED, DYNAMIC and DIFFERENCING disks supported");
   }
 
   if (footer_copy.features != 2)
@@ -58,10 +333,9 @@ vhd_disk::vhd_disk(std::string &filename) :
     }
   }
 
-  if (footer_copy.disk_type == vhd_disk_type::DYNAMIC)
+  if (footer_copy.disk_type != vhd_disk_type::FIXED)
   {
-    backing_file.seekg(footer_copy.data_offset, std::fstream::beg);
-    backing_file.read(reinterpret_cast<char *>(&dynamic_header_copy), sizeof(dynamic_header_copy));
+    backing_file->read_at(&dynamic_header_copy, sizeof(dynamic_header_copy), footer_copy.data_offset);
 
     if (dynamic_header_copy.header_version != VHD_SUPPORTED_VERSION)
     {
@@ -75,75 +349,191 @@ vhd_disk::vhd_disk(std::string &filename) :
       throw std::fstream::failure("Dynamic disk structure not correct");
     }
 
+    if (!valid_block_size(dynamic_header_copy.block_size))
+    {
+      throw std::fstream::failure("Invalid block size");
+    }
+
     data_block_bitmap_bytes = (((dynamic_header_copy.block_size - 1) / 512) + 1) / 8;
     // Round this up to the next 512 byte boundary.
     data_block_bitmap_bytes = (((data_block_bitmap_bytes - 1) / 512) + 1) * 512;
 
-    block_allocation_table = std::unique_ptr<boost::endian::big_uint32_t[]>(
-        new boost::endian::big_uint32_t[dynamic_header_copy.max_table_entries]);
-    backing_file.seekg(dynamic_header_copy.table_offset, std::fstream::beg);
-    backing_file.read(reinterpret_cast<char *>(block_allocation_table.get()),
-                      dynamic_header_copy.max_table_entries * 4);
+    // Consecutive blocks are often consecutive in the file too, separated only by the next block's bitmap. Reading
+    // through the bitmap lets a long run of blocks be read in one go.
+    max_read_gap = data_block_bitmap_bytes;
+
+    block_allocation_table = std::unique_ptr<block_table>(new block_table(backing_file.get(),
+                                                                          dynamic_header_copy.table_offset,
+                                                                          dynamic_header_copy.max_table_entries,
+                                                                          true,
+                                                                          config));
+
+    // Bitmaps are loaded the first time each block is used, and their states are held in pages created as needed.
+    sectors_per_block = static_cast<uint32_t>(dynamic_header_copy.block_size / SECTOR_BYTES);
+    bitmap_used_bytes = (sectors_per_block + 7) / 8;
+    bitmap_page_count = (static_cast<uint64_t>(dynamic_header_copy.max_table_entries) + table_page::ENTRIES - 1) /
+                        table_page::ENTRIES;
+    bitmap_pages = std::unique_ptr<std::atomic<bitmap_page *>[]>(new std::atomic<bitmap_page *>[bitmap_page_count]);
+    for (uint64_t i = 0; i < bitmap_page_count; i++)
+    {
+      bitmap_pages[i].store(nullptr, std::memory_order_relaxed);
+    }
+  }
+
+  footer_posn = total_file_length - sizeof(vhd_footer);
+  next_block_posn = footer_posn;
+
+  if (footer_copy.disk_type == vhd_disk_type::DIFFERENCING)
+  {
+    open_parent(config, chain_depth);
   }
 }
 
-void vhd_disk::read(void *buffer, uint64_t start_posn, uint64_t length, uint64_t buffer_length)
+/// @brief Decide whether a file looks like a VHD image, without opening it as one.
+///
+/// @param first_sector The first 512 bytes of the file. Unused.
+///
+/// @param last_sector The last 512 bytes of the file, which hold the footer of a VHD image.
+///
+/// @param file_length The length of the file, in bytes.
+///
+/// @return True if the file ends with a VHD footer cookie.
+bool vhd_disk::probe(const uint8_t *first_sector, const uint8_t *last_sector, uint64_t file_length)
 {
-  if (length > buffer_length)
+  return (file_length >= sizeof(vhd_footer)) && (memcmp(last_sector, VHD_COOKIE, sizeof(VHD_COOKIE)) == 0);
+}
+
+/// @brief Create a new VHD image.
+///
+/// A fixed image is created by extending the file, which reads as zeroes and is sparse where the filesystem allows. A
+/// dynamic image starts with no blocks allocated.
+///
+/// @param filename The file to create. It must not already exist, and is removed again if the image cannot be
+///                 written.
+///
+/// @param size The size of the virtual disk, in bytes. It is rounded up to a whole number of sectors.
+///
+/// @param disk_type vhd_disk_type::FIXED or vhd_disk_type::DYNAMIC.
+///
+/// @param block_size For dynamic images, the size of each block in bytes - a power of two from 512 bytes to 256 MiB.
+///                   Zero selects VHD_DEFAULT_BLOCK_SIZE.
+void vhd_disk::create(const std::string &filename, uint64_t size, uint32_t disk_type, uint32_t block_size)
+{
+  if ((disk_type != vhd_disk_type::FIXED) && (disk_type != vhd_disk_type::DYNAMIC))
   {
-    length = buffer_length;
+    throw std::fstream::failure("Only FIXED and DYNAMIC disks can be created");
   }
 
-  if (this->footer_copy.disk_type == vhd_disk_type::FIXED)
+  if (block_size == 0)
   {
-    this->read_block(buffer, start_posn, length);
+    block_size = VHD_DEFAULT_BLOCK_SIZE;
   }
-  else
+
+  size = ((size + SECTOR_BYTES - 1) / SECTOR_BYTES) * SECTOR_BYTES;
+  uint64_t table_entries = (size + block_size - 1) / block_size;
+  if (!valid_block_size(block_size) || (table_entries > 0xFFFFFFFF))
   {
-    uint64_t cur_posn = start_posn;
-    uint64_t bytes_to_go = length;
-    uint64_t bytes_read = 0;
-    uint64_t block_number;
-    uint64_t offset_in_block;
-    uint64_t bytes_to_read_this_block;
-    uint64_t disk_offset;
-    uint32_t block_ptr;
-    char *write_ptr = reinterpret_cast<char *>(buffer);
+    throw std::fstream::failure("Invalid size for VHD image");
+  }
 
-    while (bytes_to_go > 0)
-    {
-      block_number = cur_posn / dynamic_header_copy.block_size;
-      offset_in_block = cur_posn % dynamic_header_copy.block_size;
+  const uint64_t table_offset = sizeof(vhd_footer) + sizeof(vhd_dynamic_header);
+  const uint64_t table_bytes = (((table_entries * 4) + SECTOR_BYTES - 1) / SECTOR_BYTES) * SECTOR_BYTES;
 
-      if (block_number > dynamic_header_copy.max_table_entries)
-      {
-        throw std::fstream::failure("Disk block number out of range.");
-      }
+  std::random_device random_source;
+  vhd_footer footer;
+  memset(&footer, 0, sizeof(footer));
+  memcpy(&footer.cookie, VHD_COOKIE, sizeof(VHD_COOKIE));
+  footer.features = 2;
+  footer.format_version = VHD_SUPPORTED_VERSION;
+  footer.data_offset = (disk_type == vhd_disk_type::FIXED) ? ~0ULL : sizeof(vhd_footer);
+  footer.timestamp = static_cast<uint32_t>(time(nullptr) - VHD_EPOCH_OFFSET);
+  footer.creater_app = CREATOR_APP;
+  footer.creator_version = VHD_SUPPORTED_VERSION;
+  footer.creator_host_os = CREATOR_HOST_OS;
+  footer.original_size = size;
+  footer.current_size = size;
+  footer.disk_geometry = calculate_geometry(size);
+  footer.disk_type = disk_type;
+  for (uint8_t &id_byte : footer.unique_id)
+  {
+    id_byte = static_cast<uint8_t>(random_source());
+  }
+  footer.checksum = calculate_checksum(&footer, sizeof(footer));
 
-      bytes_to_read_this_block = bytes_to_go;
-      if ((offset_in_block + bytes_to_go) > dynamic_header_copy.block_size)
-      {
-        bytes_to_read_this_block = dynamic_header_copy.block_size - offset_in_block;
-      }
+  std::unique_ptr<disk_file> file = disk_file::create(filename);
 
-      block_ptr = block_allocation_table[block_number];
-      if (block_ptr == 0xFFFFFFFF)
-      {
-        memset(write_ptr, 0, bytes_to_read_this_block);
-      }
-      else
+  // Don't leave a partly written image behind.
+  try
+  {
+    if (disk_type == vhd_disk_type::FIXED)
+    {
+      file->set_length(size + sizeof(footer));
+      file->write_at(&footer, sizeof(footer), size);
+    }
+    else
+    {
+      vhd_dynamic_header header;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.cookie, VHD_DYNAMIC_COOKIE, sizeof(VHD_DYNAMIC_COOKIE));
+      header.data_offset = ~0ULL;
+      header.table_offset = table_offset;
+      header.header_version = VHD_SUPPORTED_VERSION;
+      header.max_table_entries = static_cast<uint32_t>(table_entries);
+      header.block_size = block_size;
+      header.checksum = calculate_checksum(&header, sizeof(header));
+
+      // Every entry starts unallocated - all bits set, which reads the same in either byte order.
+      std::vector<uint8_t> table_piece(std::min(table_bytes, TABLE_WRITE_BYTES), 0xFF);
+      for (uint64_t written = 0; written < table_bytes; written += table_piece.size())
       {
-        disk_offset = (block_ptr * 512) + data_block_bitmap_bytes + offset_in_block;
-        backing_file.seekg(disk_offset, std::fstream::beg);
-        backing_file.read(write_ptr, bytes_to_read_this_block);
+        uint64_t piece_length = std::min(static_cast<uint64_t>(table_piece.size()), table_bytes - written);
+        file->write_at(table_piece.data(), piece_length, table_offset + written);
       }
 
-      write_ptr += bytes_to_read_this_block;
-      offset_in_block = 0;
-      cur_posn += bytes_to_read_this_block;
-      bytes_to_go -= bytes_to_read_this_block;
+      file->write_at(&footer, sizeof(footer), 0);
+      file->write_at(&header, sizeof(header), sizeof(footer));
+      file->write_at(&footer, sizeof(footer), table_offset + table_bytes);
     }
+
+    file->flush();
+  }
+  catch (...)
+  {
+    file.reset();
+    std::remove(filename.c_str());
+    throw;
+  }
+}
+
+/// @brief Destroys a vhd_disk object, writing any metadata changes that have not yet been written.
+///
+/// Errors cannot be reported from here - call flush() first to see them.
+vhd_disk::~vhd_disk()
+{
+  release_cache();
+
+  try
+  {
+    flush_metadata();
+  }
+  catch (std::fstream::failure &)
+  {
+  }
+
+  for (uint64_t i = 0; i < bitmap_page_count; i++)
+  {
+    delete bitmap_pages[i].load(std::memory_order_relaxed);
+  }
+}
+
+void vhd_disk::read(void *buffer, uint64_t start_posn, uint64_t length, uint64_t buffer_length)
+{
+  if (length > buffer_length)
+  {
+    length = buffer_length;
   }
+
+  read_range(reinterpret_cast<uint8_t *>(buffer), start_posn, length);
 }
 
 void vhd_disk::write(const void *buffer, uint64_t start_posn, uint64_t length, uint64_t buffer_length)
@@ -153,132 +543,969 @@ void vhd_disk::write(const void *buffer, uint64_t start_posn, uint64_t length, u
     length = buffer_length;
   }
 
+  write_range(reinterpret_cast<const uint8_t *>(buffer), start_posn, length);
+}
+
+uint64_t vhd_disk::get_length()
+{
+  return footer_copy.current_size;
+}
+
+void vhd_disk::map_range(uint64_t start_posn, uint64_t length, bool allocate, std::vector<disk_extent> &extents)
+{
+  if ((start_posn > footer_copy.current_size) || (length > (footer_copy.current_size - start_posn)))
+  {
+    throw std::fstream::failure("Too long");
+  }
+
   if (this->footer_copy.disk_type == vhd_disk_type::FIXED)
   {
-    if ((start_posn + length) > footer_copy.current_size)
+    extents.push_back({start_posn, length, start_posn});
+    return;
+  }
+
+  while (length > 0)
+  {
+    uint64_t block_number = start_posn / dynamic_header_copy.block_size;
+    uint64_t offset_in_block = start_posn % dynamic_header_copy.block_size;
+
+    if (block_number >= dynamic_header_copy.max_table_entries)
     {
-      throw std::fstream::failure("Too long");
+      throw std::fstream::failure("Disk block number out of range.");
+    }
+
+    uint64_t bytes_this_block = dynamic_header_copy.block_size - offset_in_block;
+    if (bytes_this_block > length)
+    {
+      bytes_this_block = length;
     }
 
-    backing_file.seekp(start_posn);
-    backing_file.write(reinterpret_cast<const char *>(buffer), length);
-  }
-  else
-  {
-    uint64_t cur_posn = start_posn;
-    uint64_t bytes_to_go = length;
-    uint64_t bytes_read = 0;
-    uint64_t block_number;
-    uint64_t offset_in_block;
-    uint64_t bytes_to_write_this_block;
-    uint64_t disk_offset;
     uint32_t block_ptr;
-    const char *write_ptr = reinterpret_cast<const char *>(buffer);
+    if (allocate)
+    {
+      block_ptr = get_or_allocate_block(block_number);
+    }
+    else
+    {
+      block_ptr = block_allocation_table->get(block_number);
+    }
 
-    while (bytes_to_go > 0)
+    if (allocate)
+    {
+      // The sectors are marked present now, so the whole range can be written.
+      set_sector_bits(block_number, block_ptr, offset_in_block, bytes_this_block);
+      uint64_t disk_offset = (static_cast<uint64_t>(block_ptr) * 512) + data_block_bitmap_bytes + offset_in_block;
+      append_extent(extents, start_posn, bytes_this_block, disk_offset);
+    }
+    else if (parent &&
+             ((block_ptr == VHD_BLOCK_UNALLOCATED) ||
+              (get_bitmap_state(block_number, block_ptr) != vhd_bitmap_state::FULL)))
+    {
+      // At least part of the block comes from further down the chain.
+      map_block_layout(block_number, block_ptr, start_posn, bytes_this_block, extents);
+    }
+    else if (block_ptr == VHD_BLOCK_UNALLOCATED)
     {
-      block_number = cur_posn / dynamic_header_copy.block_size;
-      offset_in_block = cur_posn % dynamic_header_copy.block_size;
+      append_extent(extents, start_posn, bytes_this_block, EXTENT_UNALLOCATED);
+    }
+    else
+    {
+      map_block_sectors(block_number, block_ptr, start_posn, offset_in_block, bytes_this_block, extents);
+    }
 
-      if (block_number > dynamic_header_copy.max_table_entries)
-      {
-        throw std::fstream::failure("Disk block number out of range.");
-      }
+    start_posn += bytes_this_block;
+    length -= bytes_this_block;
+  }
+}
 
-      bytes_to_write_this_block = bytes_to_go;
-      if ((offset_in_block + bytes_to_go) > dynamic_header_copy.block_size)
-      {
-        bytes_to_write_this_block = dynamic_header_copy.block_size - offset_in_block;
-      }
+disk_file *vhd_disk::get_backing_file()
+{
+  return backing_file.get();
+}
 
-      block_ptr = block_allocation_table[block_number];
-      if (block_ptr == 0xFFFFFFFF)
-      {
-        // This block is unallocated, so allocate a new one.
-        uint64_t end_of_file_posn;
+/// @brief Write any deferred changes to the block allocation table, and release space reserved for new blocks.
+///
+/// The footer is moved back to follow the last block, and is written there before the file is shortened - so the
+/// file always ends with a footer.
+void vhd_disk::flush_metadata()
+{
+  std::lock_guard<std::mutex> append_guard(append_lock);
+  write_metadata();
 
-        backing_file.seekp(std::fstream::end);
-        end_of_file_posn = backing_file.tellg();
+  if (footer_posn > next_block_posn)
+  {
+    backing_file->write_at(&footer_copy, sizeof(footer_copy), next_block_posn);
+    backing_file->set_length(next_block_posn + sizeof(footer_copy));
+    footer_posn = next_block_posn;
+  }
+}
 
-        // If the file isn't a multiple of the expected sector size then it wasn't well-formatted to begin with, so
-        // we'd struggle to expand it correctly.
-        if ((end_of_file_posn % 512) != 0)
-        {
-          throw std::fstream::failure("File size is not block multiple");
-        }
+/// @brief Allocate every block holding part of a range that is not yet stored in the file.
+///
+/// Space for all of them is reserved in one go, by allocating it in the file and writing the footer after it, so
+/// unless other threads are allocating blocks at the same time they are stored one after another. Blocks of a dynamic
+/// disk are marked as having every sector present, since the new space reads as zeroes - so writing them later does
+/// not change their bitmaps. Blocks of a differencing disk start with no sectors present, so that the parent's data
+/// still shows through. For fixed disks, only the storage behind the range is allocated in the file.
+///
+/// @param start_posn The number of bytes into the virtual disk that the range begins.
+///
+/// @param length The length of the range, in bytes.
+void vhd_disk::allocate_blocks(uint64_t start_posn, uint64_t length)
+{
+  if (this->footer_copy.disk_type == vhd_disk_type::FIXED)
+  {
+    virt_disk::allocate_blocks(start_posn, length);
+    return;
+  }
 
-        // We need to add a new block amount of data to the end of the file, written as zeroes. However, the file
-        // footer actually belongs at the end, so then we need to move it back to the end.
-        backing_file.seekp(dynamic_header_copy.block_size + data_block_bitmap_bytes, std::fstream::end);
-        if (backing_file.tellp() != (end_of_file_posn + dynamic_header_copy.block_size + data_block_bitmap_bytes))
-        {
-          throw std::fstream::failure("Failed to expand file by seeking - unexpected");
-        }
+  const uint64_t block_size = dynamic_header_copy.block_size;
+  const uint64_t first_block = start_posn / block_size;
+  const uint64_t end_block = (start_posn + length + block_size - 1) / block_size;
 
-        // Update the footer.
-        footer_copy.current_size = end_of_file_posn + dynamic_header_copy.block_size + data_block_bitmap_bytes;
-        footer_copy.checksum = 0;
-        char total_so_far = 0;
-        const char *char_ptr = reinterpret_cast<const char *>(&footer_copy);
-        for (uint16_t i = 0; i < sizeof(footer_copy); i++, char_ptr++)
-        {
-          total_so_far += *char_ptr;
-        }
-        footer_copy.checksum = ~total_so_far;
+  std::vector<uint64_t> missing_blocks;
+  for (uint64_t block_number = first_block; block_number < end_block; block_number++)
+  {
+    if (block_allocation_table->get(block_number) == VHD_BLOCK_UNALLOCATED)
+    {
+      missing_blocks.push_back(block_number);
+    }
+  }
 
-        // Write out the new file footer.
-        backing_file.seekp(footer_copy.current_size - sizeof(footer_copy), std::fstream::beg);
-        backing_file.write(reinterpret_cast<const char *>(&footer_copy), sizeof(footer_copy));
+  if (missing_blocks.empty())
+  {
+    return;
+  }
 
-        // It also goes at the beginning!
-        backing_file.seekp(0, std::fstream::beg);
-        backing_file.write(reinterpret_cast<const char *>(&footer_copy), sizeof(footer_copy));
+  const uint64_t new_block_bytes = data_block_bitmap_bytes + block_size;
+  {
+    std::lock_guard<std::mutex> append_guard(append_lock);
 
-        // Now go back and write out the block bitmap. All ones is easiest.
-        backing_file.seekp(end_of_file_posn, std::fstream::beg);
-        for (uint16_t i = 0; i < data_block_bitmap_bytes; i++)
-        {
-          char c = 0xFF;
-          backing_file << c;
-        }
+    if ((next_block_posn % 512) != 0)
+    {
+      throw std::fstream::failure("File size is not block multiple");
+    }
 
-        // Finally, update the block allocation table, both in memory and on disk.
-        block_ptr = end_of_file_posn / 512;
-        block_allocation_table[block_number] = block_ptr;
+    uint64_t new_footer_posn = next_block_posn + (missing_blocks.size() * new_block_bytes);
+    if (new_footer_posn > footer_posn)
+    {
+      backing_file->allocate(next_block_posn, new_footer_posn + sizeof(footer_copy) - next_block_posn);
+      backing_file->write_at(&footer_copy, sizeof(footer_copy), new_footer_posn);
+      footer_posn = new_footer_posn;
+    }
+  }
 
-        backing_file.seekp(dynamic_header_copy.table_offset + (block_number * 4), std::fstream::beg);
-        backing_file.write(reinterpret_cast<const char *>(&block_ptr), 4);
-      }
+  for (uint64_t block_number : missing_blocks)
+  {
+    get_or_allocate_block(block_number);
 
-      if (block_ptr == 0xFFFFFFFF)
+    // Any new block is stored in space that reads as zeroes, whichever thread allocated it.
+    if (!parent)
+    {
+      std::lock_guard<std::mutex> bitmap_guard(bitmap_locks[block_number % ALLOCATION_LOCK_COUNT]);
+      if (block_bitmap_state(block_number).load(std::memory_order_acquire) == vhd_bitmap_state::EMPTY)
       {
-        throw std::fstream::failure("Still got bad block pointer");
-
+        block_bitmap_state(block_number).store(vhd_bitmap_state::FULL, std::memory_order_release);
       }
-      disk_offset = (block_ptr * 512) + data_block_bitmap_bytes + offset_in_block;
-      backing_file.seekp(disk_offset, std::fstream::beg);
-      backing_file.write(write_ptr, bytes_to_write_this_block);
-
-      write_ptr += bytes_to_write_this_block;
-      offset_in_block = 0;
-      cur_posn += bytes_to_write_this_block;
-      bytes_to_go -= bytes_to_write_this_block;
     }
   }
-}
 
-uint64_t vhd_disk::get_length()
-{
-  return footer_copy.current_size;
+  std::lock_guard<std::mutex> append_guard(append_lock);
+  for (uint64_t block_number : missing_blocks)
+  {
+    mark_bitmap_dirty(block_number);
+  }
+  write_metadata();
 }
 
-void vhd_disk::read_block(void *buffer, uint64_t start_posn, uint64_t length)
-{
-  if ((start_posn + length) > footer_copy.current_size)
+/// @brief Describe the layout of the blocks in the file, for compact(). Only dynamic and differencing disks have
+/// blocks that can be moved.
+///
+/// Blocks are only moved to space after all the other structures in the file - the header, the table and any parent
+/// locators.
+///
+/// @param geometry Receives the layout.
+///
+/// @return True for dynamic and differencing disks, false for fixed disks.
+bool vhd_disk::get_block_geometry(block_geometry &geometry)
+{
+  if (this->footer_copy.disk_type == vhd_disk_type::FIXED)
   {
-    throw std::fstream::failure("Too long");
+    return false;
+  }
+
+  const uint64_t block_size = dynamic_header_copy.block_size;
+  uint64_t data_start = std::max(sizeof(vhd_footer),
+                                 static_cast<uint64_t>(footer_copy.data_offset) + sizeof(vhd_dynamic_header));
+  data_start = std::max(data_start,
+                        static_cast<uint64_t>(dynamic_header_copy.table_offset) +
+                        (static_cast<uint64_t>(dynamic_header_copy.max_table_entries) * sizeof(uint32_t)));
+
+  for (const vhd_parent_locator &locator : dynamic_header_copy.parent_locators)
+  {
+    if (locator.platform_code != vhd_locator_platform::NONE)
+    {
+      // Some writers give the space in sectors, others in bytes, so allow for whichever is larger.
+      uint64_t locator_bytes = std::max(static_cast<uint64_t>(locator.platform_data_length),
+                                        static_cast<uint64_t>(locator.platform_data_space) * SECTOR_BYTES);
+      data_start = std::max(data_start, static_cast<uint64_t>(locator.platform_data_offset) + locator_bytes);
+    }
+  }
+
+  geometry.block_count = std::min(static_cast<uint64_t>(dynamic_header_copy.max_table_entries),
+                                  (static_cast<uint64_t>(footer_copy.current_size) + block_size - 1) / block_size);
+  geometry.block_size = block_size;
+  geometry.stored_block_bytes = data_block_bitmap_bytes + block_size;
+  geometry.data_start = ((data_start + SECTOR_BYTES - 1) / SECTOR_BYTES) * SECTOR_BYTES;
+
+  // In a differencing disk, a block of zeroes hides whatever the parent holds there.
+  geometry.zero_blocks_removable = !parent;
+
+  return true;
+}
+
+/// @brief Find where a block, starting with its bitmap, is stored in the file.
+///
+/// @param block_number The number of the block.
+///
+/// @return The offset of the block's bitmap in the file, or EXTENT_UNALLOCATED.
+uint64_t vhd_disk::get_block_location(uint64_t block_number)
+{
+  uint32_t block_ptr = block_allocation_table->get(block_number);
+  return (block_ptr == VHD_BLOCK_UNALLOCATED) ? EXTENT_UNALLOCATED : (static_cast<uint64_t>(block_ptr) * SECTOR_BYTES);
+}
+
+/// @brief Point a block's table entry at a new place in the file, or remove it from the disk.
+///
+/// Called by compact() while no I/O is in progress, so the block's bitmap state may be reset.
+///
+/// @param block_number The number of the block.
+///
+/// @param file_offset The new offset of the block's bitmap, or EXTENT_UNALLOCATED.
+void vhd_disk::set_block_location(uint64_t block_number, uint64_t file_offset)
+{
+  const uint32_t lock_idx = block_number % ALLOCATION_LOCK_COUNT;
+
+  if (file_offset == EXTENT_UNALLOCATED)
+  {
+    std::lock_guard<std::mutex> append_guard(append_lock);
+
+    // Write out any change to the bitmap now, while there is still somewhere to write it.
+    write_metadata();
+    block_allocation_table->set(block_number, VHD_BLOCK_UNALLOCATED);
+
+    std::lock_guard<std::mutex> bitmap_guard(bitmap_locks[lock_idx]);
+    block_bitmap_state(block_number).store(vhd_bitmap_state::UNKNOWN, std::memory_order_release);
+    partial_bitmaps[lock_idx].erase(block_number);
+  }
+  else
+  {
+    // The bitmap copied with the block may be older than the one in memory, so it is written again at the new place.
+    get_bitmap_state(block_number, block_allocation_table->get(block_number));
+
+    std::lock_guard<std::mutex> append_guard(append_lock);
+    block_allocation_table->set(block_number, static_cast<uint32_t>(file_offset / SECTOR_BYTES));
+    mark_bitmap_dirty(block_number);
+  }
+
+  if (parent)
+  {
+    discard_block_layout(block_number);
+  }
+}
+
+/// @brief Set aside space for one block at the end of the file, without giving it to any block of the disk.
+///
+/// @return The offset of the space in the file.
+uint64_t vhd_disk::append_block_space()
+{
+  std::lock_guard<std::mutex> append_guard(append_lock);
+  const uint64_t new_block_bytes = data_block_bitmap_bytes + dynamic_header_copy.block_size;
+
+  if ((next_block_posn + new_block_bytes) > footer_posn)
+  {
+    uint64_t new_footer_posn = next_block_posn + (RESERVE_BLOCKS * new_block_bytes);
+    backing_file->write_at(&footer_copy, sizeof(footer_copy), new_footer_posn);
+    footer_posn = new_footer_posn;
+  }
+
+  uint64_t block_posn = next_block_posn;
+  next_block_posn += new_block_bytes;
+
+  return block_posn;
+}
+
+/// @brief Give back the space at the end of the file once no block is stored there, moving the footer down to follow
+/// the last block.
+///
+/// @param data_end The offset that the next new block will be stored at.
+void vhd_disk::truncate_block_space(uint64_t data_end)
+{
+  std::lock_guard<std::mutex> append_guard(append_lock);
+
+  if (data_end >= next_block_posn)
+  {
+    return;
+  }
+
+  next_block_posn = data_end;
+  backing_file->write_at(&footer_copy, sizeof(footer_copy), next_block_posn);
+  backing_file->set_length(next_block_posn + sizeof(footer_copy));
+  footer_posn = next_block_posn;
+}
+
+/// @brief Find the sector number of a block in a dynamic disk, allocating it at the end of the file if needed.
+///
+/// Allocation only serialises with other allocations of the same block (or one sharing its allocation lock), and with
+/// other threads appending to the file - which is done for as short a time as possible.
+///
+/// When there is no reserved space left, space for several blocks is reserved at once by writing the footer further
+/// along - so the file is never left without one, and the reserved space reads as zeroes. The new block starts with
+/// no sectors present, and map_range() marks sectors present as they are written.
+///
+/// The block's bitmap and table entry on disk are updated in batches, by write_metadata(). Until then, a crash loses
+/// the new block, but leaves a consistent image.
+///
+/// @param block_number The logical number of the block to look up.
+///
+/// @return The sector number of the block.
+uint32_t vhd_disk::get_or_allocate_block(uint64_t block_number)
+{
+  uint32_t block_ptr = block_allocation_table->get(block_number);
+  if (block_ptr != VHD_BLOCK_UNALLOCATED)
+  {
+    return block_ptr;
+  }
+
+  std::lock_guard<std::mutex> block_guard(allocation_locks[block_number % ALLOCATION_LOCK_COUNT]);
+
+  // Another thread may have allocated this block while we waited for the lock.
+  block_ptr = block_allocation_table->get(block_number);
+  if (block_ptr != VHD_BLOCK_UNALLOCATED)
+  {
+    return block_ptr;
+  }
+
+  io_stats_recorder *recorder = stats();
+  const uint64_t start_ns = (recorder != nullptr) ? io_stats_recorder::now() : 0;
+
+  uint64_t new_block_posn;
+  uint64_t new_block_bytes = data_block_bitmap_bytes + dynamic_header_copy.block_size;
+  {
+    std::lock_guard<std::mutex> append_guard(append_lock);
+
+    // If the file isn't a multiple of the expected sector size then it wasn't well-formatted to begin with, so
+    // we'd struggle to expand it correctly.
+    if ((next_block_posn % 512) != 0)
+    {
+      throw std::fstream::failure("File size is not block multiple");
+    }
+
+    if ((next_block_posn + new_block_bytes) > footer_posn)
+    {
+      // Write out the footer in its new position, which also expands the file.
+      uint64_t new_footer_posn = next_block_posn + (RESERVE_BLOCKS * new_block_bytes);
+      backing_file->write_at(&footer_copy, sizeof(footer_copy), new_footer_posn);
+      footer_posn = new_footer_posn;
+    }
+
+    new_block_posn = next_block_posn;
+    next_block_posn += new_block_bytes;
+  }
+
+  // Update the block allocation table in memory. The table and bitmap on disk are updated later, in a batch.
+  block_ptr = static_cast<uint32_t>(new_block_posn / 512);
+  block_bitmap_state(block_number).store(vhd_bitmap_state::EMPTY, std::memory_order_release);
+
+  {
+    std::lock_guard<std::mutex> append_guard(append_lock);
+
+    // The bitmap area of the new block may hold an old footer, so the bitmap must be written before the table entry.
+    // Both are changed under append_lock so that write_metadata() never sees one without the other.
+    mark_bitmap_dirty(block_number);
+    block_allocation_table->set(block_number, block_ptr);
+
+    unsaved_allocations++;
+    if (unsaved_allocations >= METADATA_BATCH_BLOCKS)
+    {
+      write_metadata();
+    }
+  }
+
+  if (recorder != nullptr)
+  {
+    recorder->add(stat_counter::BLOCKS_ALLOCATED, 1);
+    recorder->add_latency(stat_latency::ALLOCATE, start_ns);
+  }
+
+  return block_ptr;
+}
+
+/// @brief Write changed block bitmaps, then the changed sectors of the block allocation table, to the file.
+/// append_lock must be held.
+///
+/// Bitmaps go first, and the file is flushed before the table is written, so that the table on disk never refers to
+/// a block whose bitmap, data or reserved space has not reached stable storage. Data that another thread is still
+/// writing lies in space that reads as zeroes until then, so after a crash it reads as zeroes rather than as some
+/// other block's old contents.
+void vhd_disk::write_metadata()
+{
+  // Fixed disks have no table.
+  const bool table_changed = block_allocation_table && block_allocation_table->has_changes();
+  if (dirty_bitmaps.empty() && !table_changed)
+  {
+    return;
+  }
+
+  io_stats_recorder *recorder = stats();
+  const uint64_t start_ns = (recorder != nullptr) ? io_stats_recorder::now() : 0;
+
+  if (!dirty_bitmaps.empty())
+  {
+    std::unique_ptr<uint8_t[]> bitmap(new uint8_t[data_block_bitmap_bytes]);
+
+    for (uint32_t block_number : dirty_bitmaps)
+    {
+      uint32_t block_ptr = block_allocation_table->get(block_number);
+      {
+        std::lock_guard<std::mutex> bitmap_guard(bitmap_locks[block_number % ALLOCATION_LOCK_COUNT]);
+        uint8_t state = block_bitmap_state(block_number).load(std::memory_order_acquire);
+
+        memset(bitmap.get(), (state == vhd_bitmap_state::FULL) ? 0xFF : 0, data_block_bitmap_bytes);
+        if (state == vhd_bitmap_state::PARTIAL)
+        {
+          memcpy(bitmap.get(),
+                 partial_bitmaps[block_number % ALLOCATION_LOCK_COUNT][block_number].get(),
+                 bitmap_used_bytes);
+        }
+      }
+
+      backing_file->write_at(bitmap.get(), data_block_bitmap_bytes, static_cast<uint64_t>(block_ptr) * 512);
+      get_bitmap_page(block_number)->dirty[block_number % table_page::ENTRIES] = false;
+    }
+
+    dirty_bitmaps.clear();
+  }
+
+  if (table_changed)
+  {
+    backing_file->flush();
+    block_allocation_table->write_changes();
+    unsaved_allocations = 0;
+  }
+
+  if (recorder != nullptr)
+  {
+    recorder->add(stat_counter::METADATA_WRITES, 1);
+    recorder->add_time(stat_counter::METADATA_NS, start_ns);
+  }
+}
+
+/// @brief Find the page of bitmap states covering a block, creating it if no block it covers has been used yet.
+///
+/// @param block_number The logical number of the block.
+///
+/// @return The page.
+vhd_disk::bitmap_page *vhd_disk::get_bitmap_page(uint64_t block_number)
+{
+  std::atomic<bitmap_page *> &page_ptr = bitmap_pages[block_number / table_page::ENTRIES];
+  bitmap_page *page = page_ptr.load(std::memory_order_acquire);
+  if (page != nullptr)
+  {
+    return page;
+  }
+
+  std::unique_ptr<bitmap_page> new_page(new bitmap_page);
+  for (uint32_t i = 0; i < table_page::ENTRIES; i++)
+  {
+    new_page->states[i].store(vhd_bitmap_state::UNKNOWN, std::memory_order_relaxed);
+    new_page->dirty[i] = false;
   }
 
-  backing_file.seekg(start_posn);
-  backing_file.read(reinterpret_cast<char *>(buffer), length);
-}
\ No newline at end of file
+  // Other threads may be creating the same page, for other blocks under other locks. Only one page is kept.
+  if (page_ptr.compare_exchange_strong(page, new_page.get(), std::memory_order_acq_rel))
+  {
+    page = new_page.release();
+  }
+
+  return page;
+}
+
+/// @brief Find the bitmap state of a block.
+///
+/// @param block_number The logical number of the block.
+///
+/// @return The block's vhd_bitmap_state constant, which may be changed through it.
+std::atomic<uint8_t> &vhd_disk::block_bitmap_state(uint64_t block_number)
+{
+  return get_bitmap_page(block_number)->states[block_number % table_page::ENTRIES];
+}
+
+/// @brief Get the state of a block's bitmap, loading it from the file the first time it is needed.
+///
+/// @param block_number The logical number of the block. It must be allocated.
+///
+/// @param block_ptr The sector number of the block in the file.
+///
+/// @return One of the vhd_bitmap_state constants, other than UNKNOWN.
+uint8_t vhd_disk::get_bitmap_state(uint64_t block_number, uint32_t block_ptr)
+{
+  uint8_t state = block_bitmap_state(block_number).load(std::memory_order_acquire);
+  if (state != vhd_bitmap_state::UNKNOWN)
+  {
+    return state;
+  }
+
+  std::lock_guard<std::mutex> bitmap_guard(bitmap_locks[block_number % ALLOCATION_LOCK_COUNT]);
+
+  // Another thread may have loaded it while we waited for the lock.
+  state = block_bitmap_state(block_number).load(std::memory_order_acquire);
+  if (state != vhd_bitmap_state::UNKNOWN)
+  {
+    return state;
+  }
+
+  std::unique_ptr<uint8_t[]> bits(new uint8_t[bitmap_used_bytes]);
+  backing_file->read_at(bits.get(), bitmap_used_bytes, static_cast<uint64_t>(block_ptr) * 512);
+
+  // Only FULL and EMPTY are stored compactly. Anything else keeps a copy of the bits.
+  bool all_set = true;
+  bool all_clear = true;
+  for (uint32_t i = 0; i < bitmap_used_bytes; i++)
+  {
+    all_set = all_set && (bits[i] == 0xFF);
+    all_clear = all_clear && (bits[i] == 0);
+  }
+
+  if (all_set)
+  {
+    state = vhd_bitmap_state::FULL;
+  }
+  else if (all_clear)
+  {
+    state = vhd_bitmap_state::EMPTY;
+  }
+  else
+  {
+    state = vhd_bitmap_state::PARTIAL;
+    partial_bitmaps[block_number % ALLOCATION_LOCK_COUNT][block_number] = std::move(bits);
+  }
+
+  block_bitmap_state(block_number).store(state, std::memory_order_release);
+  return state;
+}
+
+/// @brief Append extents for part of an allocated block, according to which of its sectors are present.
+///
+/// Sectors that are not present read as zeroes, so are returned as EXTENT_UNALLOCATED and never read from the file.
+///
+/// @param block_number The logical number of the block.
+///
+/// @param block_ptr The sector number of the block in the file.
+///
+/// @param start_posn The position on the virtual disk of the start of the range.
+///
+/// @param offset_in_block The offset of the start of the range within the block.
+///
+/// @param length The length of the range. It must not extend beyond the block.
+///
+/// @param extents The list to append to.
+void vhd_disk::map_block_sectors(uint64_t block_number,
+                                 uint32_t block_ptr,
+                                 uint64_t start_posn,
+                                 uint64_t offset_in_block,
+                                 uint64_t length,
+                                 std::vector<disk_extent> &extents)
+{
+  uint64_t data_offset = (static_cast<uint64_t>(block_ptr) * 512) + data_block_bitmap_bytes;
+  uint8_t state = get_bitmap_state(block_number, block_ptr);
+
+  if (state == vhd_bitmap_state::EMPTY)
+  {
+    append_extent(extents, start_posn, length, EXTENT_UNALLOCATED);
+    return;
+  }
+
+  std::unique_lock<std::mutex> bitmap_guard(bitmap_locks[block_number % ALLOCATION_LOCK_COUNT], std::defer_lock);
+  if (state == vhd_bitmap_state::PARTIAL)
+  {
+    bitmap_guard.lock();
+    state = block_bitmap_state(block_number).load(std::memory_order_acquire);
+  }
+
+  if (state == vhd_bitmap_state::FULL)
+  {
+    append_extent(extents, start_posn, length, data_offset + offset_in_block);
+    return;
+  }
+
+  const uint8_t *bits = partial_bitmaps[block_number % ALLOCATION_LOCK_COUNT][block_number].get();
+  uint64_t end_in_block = offset_in_block + length;
+  uint64_t posn = offset_in_block;
+
+  while (posn < end_in_block)
+  {
+    uint64_t sector = posn / SECTOR_BYTES;
+    uint64_t run_end;
+    bool present = sector_present(bits, sector);
+
+    // Whole bytes of the bitmap that are all set or all clear are taken 8 sectors at a time.
+    if (((sector % 8) == 0) && ((bits[sector / 8] == 0xFF) || (bits[sector / 8] == 0)))
+    {
+      run_end = (sector + 8) * SECTOR_BYTES;
+    }
+    else
+    {
+      run_end = (sector + 1) * SECTOR_BYTES;
+    }
+    run_end = std::min(run_end, end_in_block);
+
+    append_extent(extents,
+                  start_posn + (posn - offset_in_block),
+                  run_end - posn,
+                  present ? (data_offset + posn) : EXTENT_UNALLOCATED);
+    posn = run_end;
+  }
+}
+
+/// @brief Mark the sectors covering part of a block present, before they are written.
+///
+/// A sector that was not present reads as zeroes - or from the parent, in a differencing disk - so if the write only
+/// covers part of it the rest is filled in the file first. The bitmap on disk is updated later, by write_metadata().
+///
+/// @param block_number The logical number of the block.
+///
+/// @param block_ptr The sector number of the block in the file.
+///
+/// @param offset_in_block The offset of the start of the range within the block.
+///
+/// @param length The length of the range. It must not extend beyond the block.
+void vhd_disk::set_sector_bits(uint64_t block_number, uint32_t block_ptr, uint64_t offset_in_block, uint64_t length)
+{
+  // The most common case, writing to a block that is already full, needs no lock at all.
+  if (get_bitmap_state(block_number, block_ptr) == vhd_bitmap_state::FULL)
+  {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> bitmap_guard(bitmap_locks[block_number % ALLOCATION_LOCK_COUNT]);
+    uint8_t state = block_bitmap_state(block_number).load(std::memory_order_acquire);
+    if (state == vhd_bitmap_state::FULL)
+    {
+      return;
+    }
+
+    std::unique_ptr<uint8_t[]> &bits = partial_bitmaps[block_number % ALLOCATION_LOCK_COUNT][block_number];
+    if (state == vhd_bitmap_state::EMPTY)
+    {
+      bits = std::unique_ptr<uint8_t[]>(new uint8_t[bitmap_used_bytes]());
+    }
+
+    uint64_t data_offset = (static_cast<uint64_t>(block_ptr) * 512) + data_block_bitmap_bytes;
+    uint64_t end_in_block = offset_in_block + length;
+    uint64_t first_sector = offset_in_block / SECTOR_BYTES;
+    uint64_t last_sector = (end_in_block - 1) / SECTOR_BYTES;
+    uint8_t fill[SECTOR_BYTES];
+
+    // Get the current contents of a sector that is not present.
+    auto read_missing_sector = [&](uint64_t sector)
+    {
+      memset(fill, 0, SECTOR_BYTES);
+      if (parent)
+      {
+        uint64_t sector_posn = (block_number * dynamic_header_copy.block_size) + (sector * SECTOR_BYTES);
+        uint64_t parent_length = parent->get_length();
+        if (sector_posn < parent_length)
+        {
+          uint64_t read_length = std::min(SECTOR_BYTES, parent_length - sector_posn);
+          parent->read(fill, sector_posn, read_length, SECTOR_BYTES);
+        }
+      }
+    };
+
+    if (((offset_in_block % SECTOR_BYTES) != 0) && !sector_present(bits.get(), first_sector))
+    {
+      uint64_t sector_start = first_sector * SECTOR_BYTES;
+      read_missing_sector(first_sector);
+      backing_file->write_at(fill, offset_in_block - sector_start, data_offset + sector_start);
+    }
+
+    if (((end_in_block % SECTOR_BYTES) != 0) && !sector_present(bits.get(), last_sector))
+    {
+      uint64_t sector_end = (last_sector + 1) * SECTOR_BYTES;
+      read_missing_sector(last_sector);
+      backing_file->write_at(fill + (end_in_block % SECTOR_BYTES),
+                             sector_end - end_in_block,
+                             data_offset + end_in_block);
+    }
+
+    set_sectors_present(bits.get(), first_sector, last_sector);
+
+    bool all_set = true;
+    for (uint32_t i = 0; (i < bitmap_used_bytes) && all_set; i++)
+    {
+      all_set = (bits[i] == 0xFF);
+    }
+
+    if (all_set)
+    {
+      block_bitmap_state(block_number).store(vhd_bitmap_state::FULL, std::memory_order_release);
+      partial_bitmaps[block_number % ALLOCATION_LOCK_COUNT].erase(block_number);
+    }
+    else
+    {
+      block_bitmap_state(block_number).store(vhd_bitmap_state::PARTIAL, std::memory_order_release);
+    }
+
+    if (parent)
+    {
+      discard_block_layout(block_number);
+    }
+  }
+
+  std::lock_guard<std::mutex> append_guard(append_lock);
+  mark_bitmap_dirty(block_number);
+  if (dirty_bitmaps.size() >= METADATA_BATCH_BLOCKS)
+  {
+    write_metadata();
+  }
+}
+
+/// @brief Note that a block's bitmap must be written by the next write_metadata(). append_lock must be held.
+///
+/// @param block_number The logical number of the block.
+void vhd_disk::mark_bitmap_dirty(uint64_t block_number)
+{
+  bool &dirty = get_bitmap_page(block_number)->dirty[block_number % table_page::ENTRIES];
+  if (!dirty)
+  {
+    dirty = true;
+    dirty_bitmaps.push_back(static_cast<uint32_t>(block_number));
+  }
+}
+
+/// @brief Open the parent of a differencing disk.
+///
+/// The parent locators are tried first, then the parent's name relative to this disk. A candidate is only accepted if
+/// its unique ID matches the one recorded in this disk, so a different file that happens to have the same name is
+/// never used.
+///
+/// @param config Options controlling how the parent is opened.
+///
+/// @param chain_depth The number of differencing disks above this one in the chain.
+void vhd_disk::open_parent(const open_config &config, uint32_t chain_depth)
+{
+  if (chain_depth >= MAX_CHAIN_DEPTH)
+  {
+    throw std::fstream::failure("Chain of differencing disks too long");
+  }
+
+  std::vector<std::string> candidates;
+
+  for (const vhd_parent_locator &locator : dynamic_header_copy.parent_locators)
+  {
+    uint32_t platform_code = locator.platform_code;
+    uint32_t data_length = locator.platform_data_length;
+    if ((platform_code == vhd_locator_platform::NONE) || (data_length == 0) || (data_length > MAX_LOCATOR_BYTES))
+    {
+      continue;
+    }
+
+    std::unique_ptr<uint8_t[]> data(new uint8_t[data_length]);
+    try
+    {
+      backing_file->read_at(data.get(), data_length, locator.platform_data_offset);
+    }
+    catch (std::fstream::failure &)
+    {
+      continue;
+    }
+
+    std::string path;
+    if ((platform_code == vhd_locator_platform::W2RU) || (platform_code == vhd_locator_platform::W2KU))
+    {
+      path = utf16_to_utf8(data.get(), data_length, false);
+    }
+    else if (platform_code == vhd_locator_platform::MACX)
+    {
+      path.assign(reinterpret_cast<const char *>(data.get()), strnlen(reinterpret_cast<const char *>(data.get()),
+                                                                      data_length));
+      const std::string url_prefix = "file://";
+      if (path.compare(0, url_prefix.size(), url_prefix) == 0)
+      {
+        path.erase(0, url_prefix.size());
+      }
+    }
+
+    if (!path.empty())
+    {
+      candidates.push_back(resolve_parent_path(image_path, path));
+    }
+  }
+
+  std::string parent_name = utf16_to_utf8(dynamic_header_copy.parent_unicode_name,
+                                          sizeof(dynamic_header_copy.parent_unicode_name),
+                                          true);
+  if (!parent_name.empty())
+  {
+    candidates.push_back(resolve_parent_path(image_path, parent_name));
+  }
+
+  for (const std::string &candidate : candidates)
+  {
+    try
+    {
+      // Parents are only ever read, so they can be shared with other chains and need not be writable.
+      std::unique_ptr<vhd_disk> candidate_disk(new vhd_disk(disk_file::open(candidate, config.direct_io, true),
+                                                                   candidate,
+                                                                   config,
+                                                                   chain_depth + 1));
+      if (memcmp(candidate_disk->footer_copy.unique_id, dynamic_header_copy.parent_unique_id, 16) == 0)
+      {
+        parent = std::move(candidate_disk);
+        return;
+      }
+    }
+    catch (std::fstream::failure &)
+    {
+      // Try the next candidate.
+    }
+  }
+
+  throw std::fstream::failure("Parent disk not found");
+}
+
+/// @brief Map part of a block of a differencing disk, some of which is stored further down the chain.
+///
+/// The first time a block is mapped, its layout across the whole chain is worked out and cached. Later calls only copy
+/// the relevant part of the cached layout.
+///
+/// @param block_number The logical number of the block.
+///
+/// @param block_ptr The sector number of the block in this disk's file, or VHD_BLOCK_UNALLOCATED.
+///
+/// @param start_posn The position on the disk of the start of the range. The range lies within the block.
+///
+/// @param length The length of the range, in bytes.
+///
+/// @param extents Extents covering the range are appended to this vector.
+void vhd_disk::map_block_layout(uint64_t block_number,
+                                uint32_t block_ptr,
+                                uint64_t start_posn,
+                                uint64_t length,
+                                std::vector<disk_extent> &extents)
+{
+  const uint32_t lock_idx = block_number % ALLOCATION_LOCK_COUNT;
+  std::shared_ptr<const std::vector<disk_extent>> layout;
+  uint64_t generation;
+  {
+    std::lock_guard<std::mutex> guard(layout_locks[lock_idx]);
+    auto cached = block_layouts[lock_idx].find(block_number);
+    if (cached != block_layouts[lock_idx].end())
+    {
+      layout = cached->second;
+    }
+    generation = layout_generations[lock_idx];
+  }
+
+  if (!layout)
+  {
+    // Build the layout without holding the lock - set_sector_bits() discards layouts while holding a bitmap lock, which
+    // map_block_sectors() also takes.
+    const uint64_t block_start = block_number * dynamic_header_copy.block_size;
+    const uint64_t parent_length = parent->get_length();
+    std::vector<disk_extent> own_extents;
+    std::shared_ptr<std::vector<disk_extent>> new_layout = std::make_shared<std::vector<disk_extent>>();
+
+    if (block_ptr == VHD_BLOCK_UNALLOCATED)
+    {
+      append_extent(own_extents, block_start, dynamic_header_copy.block_size, EXTENT_UNALLOCATED);
+    }
+    else
+    {
+      map_block_sectors(block_number, block_ptr, block_start, 0, dynamic_header_copy.block_size, own_extents);
+    }
+
+    std::vector<disk_extent> parent_extents;
+    for (const disk_extent &own : own_extents)
+    {
+      if (own.file_offset != EXTENT_UNALLOCATED)
+      {
+        append_extent(*new_layout, own.start_posn, own.length, own.file_offset, backing_file.get());
+        continue;
+      }
+
+      uint64_t parent_end = std::min(own.start_posn + own.length, std::max(own.start_posn, parent_length));
+      if (parent_end > own.start_posn)
+      {
+        parent_extents.clear();
+        parent->map_range(own.start_posn, parent_end - own.start_posn, false, parent_extents);
+        for (const disk_extent &piece : parent_extents)
+        {
+          append_extent(*new_layout,
+                        piece.start_posn,
+                        piece.length,
+                        piece.file_offset,
+                        (piece.file != nullptr) ? piece.file : parent->get_backing_file());
+        }
+      }
+
+      // Anything beyond the end of the parent reads as zeroes.
+      if ((own.start_posn + own.length) > parent_end)
+      {
+        append_extent(*new_layout, parent_end, own.start_posn + own.length - parent_end, EXTENT_UNALLOCATED);
+      }
+    }
+
+    layout = new_layout;
+
+    std::lock_guard<std::mutex> guard(layout_locks[lock_idx]);
+    if (layout_generations[lock_idx] == generation)
+    {
+      block_layouts[lock_idx][block_number] = layout;
+    }
+  }
+
+  // Copy the part of the layout covering the range.
+  auto first = std::upper_bound(layout->begin(),
+                                layout->end(),
+                                start_posn,
+                                [](uint64_t posn, const disk_extent &extent) { return posn < extent.start_posn; });
+  if (first != layout->begin())
+  {
+    --first;
+  }
+
+  const uint64_t end_posn = start_posn + length;
+  for (auto it = first; (it != layout->end()) && (it->start_posn < end_posn); ++it)
+  {
+    uint64_t piece_start = std::max(start_posn, it->start_posn);
+    uint64_t piece_end = std::min(end_posn, it->start_posn + it->length);
+    if (piece_end <= piece_start)
+    {
+      continue;
+    }
+
+    uint64_t file_offset = it->file_offset;
+    if (file_offset != EXTENT_UNALLOCATED)
+    {
+      file_offset += piece_start - it->start_posn;
+    }
+
+    // Extents stored in this disk's own file are reported without a file, like any other.
+    disk_file *file = (it->file == backing_file.get()) ? nullptr : it->file;
+    append_extent(extents, piece_start, piece_end - piece_start, file_offset, file);
+  }
+}
+
+/// @brief Forget the cached layout of a block, because which of its sectors are present has changed.
+///
+/// @param block_number The logical number of the block.
+void vhd_disk::discard_block_layout(uint64_t block_number)
+{
+  const uint32_t lock_idx = block_number % ALLOCATION_LOCK_COUNT;
+  std::lock_guard<std::mutex> guard(layout_locks[lock_idx]);
+  layout_generations[lock_idx]++;
+  block_layouts[lock_idx].erase(block_number);
+}
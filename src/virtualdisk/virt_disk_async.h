@@ -0,0 +1,78 @@
+/// @file
+/// @brief Declares a completion-based, asynchronous interface to virtual disks.
+
+// Copyright Martin Hughes 2018.
+
+#pragma once
+
+#include "virtualdisk.h"
+
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+
+namespace virt_disk
+{
+  /// @brief Called when an asynchronous request completes.
+  ///
+  /// @param error nullptr if the request succeeded, otherwise the exception that the equivalent synchronous call
+  ///              would have thrown.
+  typedef std::function<void(std::exception_ptr error)> io_callback;
+
+  class queue_engine;
+  struct queued_request;
+
+  /// @brief A queue of asynchronous requests to one or more virtual disks.
+  ///
+  /// Requests are submitted with submit_read() and submit_write(), or read() and write() for a std::future based
+  /// interface. Each request is split into one backing file operation per contiguous part of the image - so a large
+  /// request that spans many blocks is carried out in parallel, up to the depth of the queue.
+  ///
+  /// Completed requests are only reported by reap(). Callbacks are called, and futures become ready, from within
+  /// reap() in the calling thread - it is easy to resume a coroutine or post to an event loop from a callback.
+  ///
+  /// On Linux the queue uses io_uring, if the kernel allows it. Otherwise, requests are carried out by a pool of
+  /// worker threads.
+  ///
+  /// An io_queue object must only be used from one thread at a time, but any number of queues may submit requests to
+  /// the same virt_disk object.
+  class io_queue
+  {
+  public:
+    io_queue(uint32_t queue_depth = 64, bool allow_io_uring = true);
+    ~io_queue();
+
+    io_queue(const io_queue &) = delete;
+    io_queue &operator=(const io_queue &) = delete;
+
+    void submit_read(virt_disk &disk, void *buffer, uint64_t start_posn, uint64_t length, io_callback callback);
+    void submit_write(virt_disk &disk,
+                      const void *buffer,
+                      uint64_t start_posn,
+                      uint64_t length,
+                      io_callback callback);
+
+    std::future<void> read(virt_disk &disk, void *buffer, uint64_t start_posn, uint64_t length);
+    std::future<void> write(virt_disk &disk, const void *buffer, uint64_t start_posn, uint64_t length);
+
+    uint32_t reap(uint32_t min_completions = 0);
+    void drain();
+
+    uint32_t outstanding();
+    bool using_io_uring();
+
+  protected:
+    void submit(virt_disk &disk, uint8_t *buffer, uint64_t start_posn, uint64_t length, bool is_write,
+                io_callback callback);
+
+    /// The engine that carries out backing file operations.
+    std::unique_ptr<queue_engine> engine;
+
+    /// The number of requests submitted but not yet reaped.
+    uint32_t requests_outstanding;
+
+    /// The most backing file operations to have in flight at once.
+    uint32_t depth;
+  };
+};
@@ -0,0 +1,292 @@
+/// @file
+/// @brief Declares a block cache that can be shared between virtual disks.
+
+// Copyright Martin Hughes 2018.
+
+#pragma once
+
+#include "virtualdisk.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace virt_disk
+{
+  /// @brief Constants that select the cache eviction policy.
+  ///
+  namespace cache_policy
+  {
+    const uint32_t CLOCK = 0; ///< Second-chance CLOCK. Cheap, approximates LRU.
+    const uint32_t ARC = 1; ///< Adaptive Replacement Cache. Resists being flushed by large sequential scans.
+  };
+
+  /// @brief Constants that select how writes are handled by the cache.
+  ///
+  namespace cache_write_mode
+  {
+    const uint32_t WRITE_THROUGH = 0; ///< Writes go straight to the image, and update any cached copy.
+    const uint32_t WRITE_BACK = 1; ///< Writes are held in the cache until evicted, or virt_disk::flush() is called.
+  };
+
+  /// @brief Configuration of a block_cache.
+  ///
+  struct cache_config
+  {
+    uint64_t capacity_bytes = 64 * 1024 * 1024; ///< The most data to hold, in bytes.
+    uint32_t block_size = 64 * 1024; ///< The size of each cached block, in bytes.
+    uint32_t shard_count = 16; ///< The number of independently locked shards.
+    uint32_t policy = cache_policy::CLOCK; ///< One of the cache_policy constants.
+    uint32_t write_mode = cache_write_mode::WRITE_THROUGH; ///< One of the cache_write_mode constants.
+  };
+
+  /// @brief Counters describing the effectiveness of a block_cache.
+  ///
+  struct cache_stats
+  {
+    uint64_t hits; ///< Lookups satisfied from the cache.
+    uint64_t misses; ///< Lookups that had to go to the image.
+    uint64_t insertions; ///< Blocks added to the cache.
+    uint64_t evictions; ///< Blocks removed to make space for others.
+    uint64_t write_backs; ///< Dirty blocks written to the image.
+    uint64_t blocks_cached; ///< The number of blocks currently held.
+  };
+
+  class cache_shard;
+
+  /// @brief A cache of virtual disk blocks, keyed by disk and logical block number.
+  ///
+  /// One cache can be attached to any number of disks with virt_disk::set_cache(), so that they share one memory
+  /// budget. The cache is split into shards, each with its own lock, to keep contention between threads low.
+  ///
+  /// Reads through read(), and writes through write(), are coherent with the cache. Asynchronous requests and mapped
+  /// views bypass it, so write-back data in their range is written to the image before they start.
+  class block_cache
+  {
+  public:
+    block_cache(const cache_config &config = cache_config());
+    ~block_cache();
+
+    block_cache(const block_cache &) = delete;
+    block_cache &operator=(const block_cache &) = delete;
+
+    cache_stats get_stats();
+    void reset_stats();
+
+    /// @brief Get the configuration this cache was created with.
+    ///
+    /// @return The configuration.
+    const cache_config &get_config() { return config; };
+
+  protected:
+    friend class virt_disk;
+    friend class read_ahead;
+
+    bool lookup(virt_disk *owner,
+                uint64_t block,
+                uint8_t *buffer,
+                uint64_t offset,
+                uint64_t length,
+                uint64_t &generation);
+    void insert(virt_disk *owner,
+                uint64_t block,
+                const uint8_t *data,
+                uint64_t length,
+                bool dirty,
+                uint64_t generation,
+                bool prefetched = false);
+    bool contains(virt_disk *owner, uint64_t block, uint64_t &generation);
+    bool update(virt_disk *owner, uint64_t block, const uint8_t *data, uint64_t offset, uint64_t length, bool dirty);
+    void flush_range(virt_disk *owner, uint64_t first_block, uint64_t last_block, bool invalidate);
+    void release(virt_disk *owner);
+
+    cache_shard &shard_for(virt_disk *owner, uint64_t block);
+
+    /// The configuration of the cache.
+    cache_config config;
+
+    /// The shards that make up the cache.
+    std::unique_ptr<cache_shard[]> shards;
+  };
+
+  /// @brief Configuration of read-ahead, given to virt_disk::set_read_ahead().
+  ///
+  /// Window sizes are in units of the cache block size.
+  struct read_ahead_config
+  {
+    uint32_t initial_window = 4; ///< Blocks to read ahead when a stream is first detected.
+    uint32_t max_window = 64; ///< The largest the window may grow to. Zero disables read-ahead.
+    uint32_t stream_count = 8; ///< The number of independent streams that can be tracked at once.
+  };
+
+  /// @brief The state of one stream of reads, as seen by read_ahead.
+  ///
+  struct read_stream
+  {
+    uint64_t last_start; ///< The start of the most recent read in the stream.
+    uint64_t last_end; ///< The end of the most recent read in the stream.
+    uint64_t stride; ///< The distance between the starts of the last two reads, or zero.
+    uint32_t matches; ///< How many reads in a row have continued the stream.
+    uint32_t window; ///< The current read-ahead window, in blocks.
+    uint64_t prefetched_to; ///< Position on the disk up to which data has been queued for read-ahead.
+    uint64_t last_used; ///< When the stream was last continued, for choosing a stream to replace.
+  };
+
+  /// @brief Detects sequential and strided streams of reads on one disk, and reads ahead of them into its cache.
+  ///
+  /// Each call to virt_disk::read() is matched against the streams being tracked. A read that starts where the
+  /// previous read in a stream ended, or one stride after the previous read started, continues that stream. Once a
+  /// stream has been continued twice, the blocks ahead of it are read into the cache by a background thread. The window
+  /// doubles every time the stream catches up with data read ahead for it, up to read_ahead_config::max_window, and
+  /// falls back to the initial size when a new stream starts.
+  ///
+  /// Only allocated blocks that are not already cached are read - holes in dynamic images cost nothing.
+  class read_ahead
+  {
+  public:
+    read_ahead(virt_disk *disk, const read_ahead_config &config);
+    ~read_ahead();
+
+    read_ahead(const read_ahead &) = delete;
+    read_ahead &operator=(const read_ahead &) = delete;
+
+    void note_read(uint64_t start_posn, uint64_t length);
+
+    /// @brief Get the configuration this object was created with.
+    ///
+    /// @return The configuration.
+    const read_ahead_config &get_config() { return config; };
+
+  protected:
+    void queue_range(uint64_t start_posn, uint64_t length);
+    void worker();
+    void fetch(uint64_t start_posn, uint64_t length);
+
+    /// The disk being read ahead.
+    virt_disk *disk;
+
+    /// The configuration of read-ahead.
+    read_ahead_config config;
+
+    /// Protects every member below.
+    std::mutex lock;
+
+    /// The streams being tracked.
+    std::vector<read_stream> streams;
+
+    /// Counts calls to note_read(), to age streams.
+    uint64_t read_count;
+
+    /// Ranges waiting to be read by the worker thread, oldest first.
+    std::deque<std::pair<uint64_t, uint64_t>> pending;
+
+    /// Signalled when a range is queued, or the worker should stop.
+    std::condition_variable pending_cv;
+
+    /// Set to make the worker thread exit.
+    bool stopping;
+
+    /// The thread that carries out read-ahead.
+    std::thread worker_thread;
+  };
+
+  /// @brief Configuration of write combining, given to virt_disk::set_write_combining().
+  ///
+  struct write_combine_config
+  {
+    uint64_t max_pending_bytes = 4 * 1024 * 1024; ///< Write to the image once this much is held. Zero disables.
+    uint64_t max_write_bytes = 64 * 1024; ///< Writes larger than this go straight to the image.
+    uint32_t flush_interval_ms = 100; ///< The longest that data is held before it is written to the image.
+  };
+
+  /// @brief Gathers small writes to one disk in memory, and writes them to the image in larger pieces.
+  ///
+  /// Writes of up to write_combine_config::max_write_bytes are copied into a set of pending ranges. A write that
+  /// overlaps or adjoins a pending range is merged with it, so a run of sector-sized writes becomes one large write.
+  /// Pending data is written to the image when there is more than max_pending_bytes of it, when the oldest of it has
+  /// been held for flush_interval_ms - by a background thread - or when flush() is called. All the ranges are written
+  /// with one call to virt_disk::writev(), so ranges that end up next to each other in the backing file cost one
+  /// system call.
+  ///
+  /// Reads see pending data. Larger writes replace any pending data they overlap.
+  class write_combiner
+  {
+  public:
+    write_combiner(virt_disk *disk, const write_combine_config &config);
+    ~write_combiner();
+
+    write_combiner(const write_combiner &) = delete;
+    write_combiner &operator=(const write_combiner &) = delete;
+
+    void read(uint8_t *buffer, uint64_t start_posn, uint64_t length);
+    void write(const uint8_t *buffer, uint64_t start_posn, uint64_t length);
+    void flush();
+    void flush_range(uint64_t start_posn, uint64_t length);
+
+    /// @brief Get the configuration this object was created with.
+    ///
+    /// @return The configuration.
+    const write_combine_config &get_config() { return config; };
+
+  protected:
+    /// @brief A range of the disk, and the data waiting to be written to it.
+    ///
+    struct pending_range
+    {
+      uint64_t start_posn; ///< The position on the disk the range begins.
+      std::vector<uint8_t> data; ///< The data to write.
+    };
+
+    void add_range(const uint8_t *buffer, uint64_t start_posn, uint64_t length);
+    void remove_range(uint64_t start_posn, uint64_t length);
+    bool overlaps(uint64_t start_posn, uint64_t length);
+    void restore(std::vector<pending_range> &failed);
+    void worker();
+
+    /// The disk whose writes are combined.
+    virt_disk *disk;
+
+    /// The configuration of write combining.
+    write_combine_config config;
+
+    /// Held while data is being written to the image, so that only one flush runs at once. Taken before lock.
+    std::mutex flush_lock;
+
+    /// Protects every member below.
+    std::mutex lock;
+
+    /// Data waiting to be written, keyed by the end position of each range. Ranges never overlap or adjoin.
+    std::map<uint64_t, pending_range> pending;
+
+    /// The number of bytes in pending.
+    uint64_t pending_bytes;
+
+    /// When the oldest data in pending was written.
+    std::chrono::steady_clock::time_point oldest_write;
+
+    /// Data being written to the image by a flush, which reads must still see until it is there.
+    std::vector<pending_range> in_flight;
+
+    /// The number of bytes in in_flight.
+    uint64_t in_flight_bytes;
+
+    /// The number of bytes in pending and in_flight together. Read without the lock, so that reads can skip looking
+    /// for pending data when there is none.
+    std::atomic<uint64_t> held_bytes;
+
+    /// Signalled when data is added to an empty set of pending ranges, or the worker should stop.
+    std::condition_variable pending_cv;
+
+    /// Set to make the worker thread exit.
+    bool stopping;
+
+    /// The thread that writes data that has been held too long.
+    std::thread worker_thread;
+  };
+};
@@ -0,0 +1,32 @@
+/// @file
+/// @brief Declares functions for converting virtual disks from one image format to another.
+
+// Copyright Martin Hughes 2018.
+
+#pragma once
+
+#include "virtualdisk.h"
+
+#include <functional>
+
+namespace virt_disk
+{
+  /// @brief Configuration of convert_image().
+  ///
+  /// At most batches_in_flight * batch_bytes bytes of the disk are held in memory at once, whatever its size.
+  struct convert_config
+  {
+    uint32_t format = image_format::VHD_DYNAMIC; ///< The format of the new image - one of the image_format constants.
+    uint32_t block_size = 0; ///< The block size of the new image, in bytes. Zero selects the format's default.
+    uint64_t batch_bytes = 8 * 1024 * 1024; ///< The size of each piece of the disk read in one go.
+    uint32_t reader_threads = 2; ///< The number of threads reading from the source disk.
+    uint32_t batches_in_flight = 8; ///< The most batches being read, or waiting to be written, at once.
+
+    /// Called after each batch is written, with the number of bytes of the disk converted so far and the total.
+    std::function<void(uint64_t done, uint64_t total)> progress;
+  };
+
+  void convert_image(virt_disk &source,
+                     const std::string &target_filename,
+                     const convert_config &config = convert_config());
+};
@@ -0,0 +1,105 @@
+/// @file
+/// @brief Declares a copy-on-write overlay that records changes to another virtual disk.
+
+// Copyright Martin Hughes 2018.
+
+#pragma once
+
+#include "virtualdisk.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace virt_disk
+{
+  /// @brief Options for a cow_disk.
+  ///
+  struct cow_config
+  {
+    /// How much of the disk is copied from the base when part of it is first written, in bytes - a multiple of 512.
+    uint32_t block_size = 64 * 1024;
+
+    /// The file to keep changed blocks in. It must not already exist, and is deleted when the overlay is destroyed. If
+    /// empty, changed blocks are kept in memory instead.
+    std::string overlay_file;
+  };
+
+  /// @brief A throwaway copy-on-write clone of another virtual disk.
+  ///
+  /// The base disk is only ever read. The first write to each block of the clone copies that block from the base into
+  /// the overlay, and from then on the block is read from and written to the overlay. Blocks that have not been
+  /// written are read straight from the base's image, so the clone costs nothing until it is changed. Creating one
+  /// reads nothing, and only allocates a small table whose pages are filled in as blocks are written.
+  ///
+  /// Any number of clones may share one base, and each may be used from many threads, like any other virt_disk. The
+  /// base must not be written to or compacted while clones of it exist - opening it with open_config::read_only makes
+  /// sure of that. The overlay has no metadata of its own, so
+  /// the changes are lost when the clone is destroyed.
+  class cow_disk : public virt_disk
+  {
+  public:
+    cow_disk(std::shared_ptr<virt_disk> base_disk, const cow_config &config = cow_config());
+    ~cow_disk();
+
+    virtual void read(void *buffer, uint64_t start_posn, uint64_t length, uint64_t buffer_length) override;
+    virtual void write(const void *buffer, uint64_t start_posn, uint64_t length, uint64_t buffer_length) override;
+
+    virtual uint64_t get_length() override;
+
+  protected:
+    virtual void map_range(uint64_t start_posn,
+                           uint64_t length,
+                           bool allocate,
+                           std::vector<disk_extent> &extents) override;
+    virtual disk_file *get_backing_file() override;
+
+    uint32_t get_slot(uint64_t block_number);
+    uint32_t get_or_copy_block(uint64_t block_number);
+
+    /// The number of entries in each page of the slot table.
+    static const uint32_t SLOTS_PER_PAGE = 4096;
+
+    /// @brief A page of the slot table. Entries are COW_SLOT_UNALLOCATED until their block is copied to the overlay.
+    ///
+    struct slot_page
+    {
+      std::atomic<uint32_t> slots[SLOTS_PER_PAGE]; ///< The slot in the overlay holding each block.
+    };
+
+    /// The disk this is a clone of.
+    std::shared_ptr<virt_disk> base;
+
+    /// The file holding the blocks that have been written.
+    std::unique_ptr<disk_file> overlay;
+
+    /// The name of the overlay file, or empty if it is held in memory.
+    std::string overlay_path;
+
+    /// The size of the disk, in bytes.
+    uint64_t disk_length;
+
+    /// The size of each block, in bytes.
+    uint64_t block_size;
+
+    /// The number of blocks on the disk.
+    uint64_t block_count;
+
+    /// The slot table - where in the overlay each block is stored, as a number of blocks from its start. Pages are
+    /// created the first time a block they cover is written, and never removed, so they can be read without a lock.
+    std::unique_ptr<std::atomic<slot_page *>[]> slot_pages;
+
+    /// The number of pages in slot_pages.
+    uint64_t page_count;
+
+    /// The next free slot in the overlay.
+    std::atomic<uint32_t> next_slot;
+
+    /// The number of locks in allocation_locks.
+    static const uint32_t ALLOCATION_LOCK_COUNT = 64;
+
+    /// Copying block N to the overlay holds allocation_locks[N % ALLOCATION_LOCK_COUNT], so that it is only done once.
+    std::mutex allocation_locks[ALLOCATION_LOCK_COUNT];
+  };
+};
@@ -0,0 +1,278 @@
+/// @file
+/// @brief Declares the interface used by the disk formats to access their backing files.
+
+// Copyright Martin Hughes 2018.
+
+#pragma once
+
+#include "virtualdisk.h"
+
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+
+namespace virt_disk
+{
+  /// @brief An abstract backing file for a virtual disk.
+  ///
+  /// All access is positional - each call carries its own file offset - so implementations hold no shared cursor and
+  /// every member may be called from any number of threads at once. Short transfers are completed internally; if the
+  /// full request cannot be satisfied, std::fstream::failure is thrown.
+  ///
+  /// The disk formats use the default implementation returned by disk_file::open(), but a different implementation
+  /// can be provided to their constructors instead.
+  class disk_file
+  {
+  protected:
+    disk_file() = default;
+
+  public:
+    static std::unique_ptr<disk_file> open(const std::string &filename, bool direct_io = false, bool read_only = false);
+    static std::unique_ptr<disk_file> create(const std::string &filename);
+    virtual ~disk_file() = default;
+
+    disk_file(const disk_file &) = delete;
+    disk_file &operator=(const disk_file &) = delete;
+
+    /// @brief Read from the file.
+    ///
+    /// @param buffer The buffer to read in to. Must be at least length bytes long.
+    ///
+    /// @param length The number of bytes to read.
+    ///
+    /// @param offset The offset within the file to begin reading from.
+    virtual void read_at(void *buffer, uint64_t length, uint64_t offset) = 0;
+
+    /// @brief Write to the file.
+    ///
+    /// @param buffer The buffer to write. Must be at least length bytes long.
+    ///
+    /// @param length The number of bytes to write.
+    ///
+    /// @param offset The offset within the file to begin writing at. The file is extended if needed.
+    virtual void write_at(const void *buffer, uint64_t length, uint64_t offset) = 0;
+
+    /// @brief Read a contiguous range of the file into several buffers.
+    ///
+    /// @param segments The buffers to fill, in order.
+    ///
+    /// @param count The number of entries in segments.
+    ///
+    /// @param offset The offset within the file to begin reading from.
+    virtual void readv_at(const io_segment *segments, uint32_t count, uint64_t offset) = 0;
+
+    /// @brief Write several buffers to a contiguous range of the file.
+    ///
+    /// @param segments The buffers to write, in order.
+    ///
+    /// @param count The number of entries in segments.
+    ///
+    /// @param offset The offset within the file to begin writing at. The file is extended if needed.
+    virtual void writev_at(const io_segment *segments, uint32_t count, uint64_t offset) = 0;
+
+    /// @brief Get the current length of the file.
+    ///
+    /// @return The length of the file, in bytes.
+    virtual uint64_t get_length() = 0;
+
+    /// @brief Truncate or extend the file. Extended regions read back as zeroes.
+    ///
+    /// @param new_length The new length of the file, in bytes.
+    virtual void set_length(uint64_t new_length) = 0;
+
+    /// @brief Flush any written data through to stable storage.
+    ///
+    virtual void flush() = 0;
+
+    /// @brief Release the storage behind part of the file, leaving a hole that reads as zeroes. The length of the file
+    /// does not change.
+    ///
+    /// @param offset The offset within the file of the first byte to release.
+    ///
+    /// @param length The number of bytes to release.
+    ///
+    /// @return True if the storage was released, false if the file or filesystem cannot do this.
+    virtual bool punch_hole(uint64_t offset, uint64_t length) { return false; }
+
+    /// @brief Set aside storage for part of the file, extending the file if the range goes beyond its end. The range
+    /// reads as zeroes if it was beyond the end, and is unchanged otherwise.
+    ///
+    /// @param offset The offset within the file of the first byte to allocate.
+    ///
+    /// @param length The number of bytes to allocate.
+    ///
+    /// @return True if storage was allocated, false if the file was only extended because the file or filesystem
+    ///         cannot allocate storage in advance.
+    virtual bool allocate(uint64_t offset, uint64_t length)
+    {
+      if ((offset + length) > get_length())
+      {
+        set_length(offset + length);
+      }
+      return false;
+    }
+
+    /// @brief Get the POSIX file descriptor underlying this file, for use by asynchronous I/O engines.
+    ///
+    /// @return The file descriptor, or -1 if this file does not have one.
+    virtual int get_fd() { return -1; }
+
+    /// @brief Get the alignment needed by I/O through the file descriptor returned by get_fd().
+    ///
+    /// The members of this class accept any buffer, offset and length, but if the file bypasses the page cache then
+    /// I/O made directly on its file descriptor must have all three aligned to this.
+    ///
+    /// @return The alignment, in bytes, or zero if there is no restriction.
+    virtual uint32_t get_direct_alignment() { return 0; }
+
+    /// @brief Map part of the file into memory, read-only.
+    ///
+    /// @param offset The offset within the file of the first byte to map.
+    ///
+    /// @param length The number of bytes to map.
+    ///
+    /// @param access_hint One of the view_access constants.
+    ///
+    /// @return A pointer to the byte at offset. The mapping remains valid until all copies of the pointer are gone.
+    virtual std::shared_ptr<const uint8_t> map(uint64_t offset, uint64_t length, uint32_t access_hint)
+    {
+      throw std::fstream::failure("Memory mapping not supported");
+    }
+
+    /// @brief Find out whether any pointer returned by map() is still in use.
+    ///
+    /// Reading a mapping beyond the end of the file faults, so the file must not be shortened while this is true.
+    ///
+    /// @return True if some part of the file is still mapped.
+    virtual bool has_mappings() { return false; }
+  };
+
+#ifndef _WIN32
+  /// @brief A disk_file using POSIX pread / pwrite on a raw file descriptor.
+  ///
+  /// In direct I/O mode the file is opened with O_DIRECT, so its data bypasses the page cache. Requests whose buffer,
+  /// offset and length are not aligned as the filesystem requires are carried out through aligned bounce buffers taken
+  /// from a shared pool. Writes that only cover part of an aligned unit read the rest of the unit first - these are
+  /// serialised with each other, so neighbouring writes never undo each other, but as with any disk, overlapping
+  /// writes from different threads are not ordered.
+  class posix_disk_file : public disk_file
+  {
+  public:
+    posix_disk_file(const std::string &filename,
+                    bool create_new = false,
+                    bool direct_io = false,
+                    bool read_only = false);
+    virtual ~posix_disk_file() override;
+
+    virtual void read_at(void *buffer, uint64_t length, uint64_t offset) override;
+    virtual void write_at(const void *buffer, uint64_t length, uint64_t offset) override;
+    virtual void readv_at(const io_segment *segments, uint32_t count, uint64_t offset) override;
+    virtual void writev_at(const io_segment *segments, uint32_t count, uint64_t offset) override;
+    virtual uint64_t get_length() override;
+    virtual void set_length(uint64_t new_length) override;
+    virtual void flush() override;
+    virtual bool punch_hole(uint64_t offset, uint64_t length) override;
+    virtual bool allocate(uint64_t offset, uint64_t length) override;
+    virtual int get_fd() override;
+    virtual uint32_t get_direct_alignment() override;
+    virtual std::shared_ptr<const uint8_t> map(uint64_t offset, uint64_t length, uint32_t access_hint) override;
+    virtual bool has_mappings() override;
+
+  protected:
+    bool is_aligned(const void *buffer, uint64_t length, uint64_t offset);
+    void bounced_read(uint8_t *buffer, uint64_t length, uint64_t offset);
+    void bounced_write(const uint8_t *buffer, uint64_t length, uint64_t offset);
+    void write_unit_span(uint8_t *bounce, const uint8_t *buffer, uint64_t length, uint64_t offset, bool extending);
+    void retire_mapping();
+
+    /// The file descriptor of the open file.
+    int fd;
+
+    /// The alignment needed for I/O on fd, or zero if the file was not opened for direct I/O.
+    uint32_t direct_alignment;
+
+    /// The number of locks in unit_locks.
+    static const uint32_t UNIT_LOCK_COUNT = 64;
+
+    /// A write that covers only part of aligned unit N holds unit_locks[N % UNIT_LOCK_COUNT] while it reads, changes
+    /// and writes back the unit.
+    std::mutex unit_locks[UNIT_LOCK_COUNT];
+
+    /// Held exclusively while the length of the file changes, and shared by partial unit writes, which must not have
+    /// the end of the file move under them.
+    std::shared_mutex length_lock;
+
+    /// Protects mapping, mapping_length and retired_mappings.
+    std::mutex mapping_lock;
+
+    /// A read-only mapping of the whole file, as it was when the mapping was made. Views into it hold their own
+    /// references, so it can be replaced when the file grows.
+    std::shared_ptr<const uint8_t> mapping;
+
+    /// The number of bytes covered by mapping.
+    uint64_t mapping_length;
+
+    /// Mappings that have been replaced, but which views may still be using.
+    std::vector<std::weak_ptr<const uint8_t>> retired_mappings;
+  };
+#else
+  /// @brief A disk_file using Win32 ReadFile / WriteFile with explicit offsets.
+  ///
+  class win_disk_file : public disk_file
+  {
+  public:
+    win_disk_file(const std::string &filename, bool create_new = false, bool read_only = false);
+    virtual ~win_disk_file() override;
+
+    virtual void read_at(void *buffer, uint64_t length, uint64_t offset) override;
+    virtual void write_at(const void *buffer, uint64_t length, uint64_t offset) override;
+    virtual void readv_at(const io_segment *segments, uint32_t count, uint64_t offset) override;
+    virtual void writev_at(const io_segment *segments, uint32_t count, uint64_t offset) override;
+    virtual uint64_t get_length() override;
+    virtual void set_length(uint64_t new_length) override;
+    virtual void flush() override;
+    virtual bool punch_hole(uint64_t offset, uint64_t length) override;
+
+  protected:
+    /// The Win32 HANDLE of the open file.
+    void *handle;
+  };
+#endif
+
+  /// @brief A disk_file held entirely in memory, which is lost when the object is destroyed.
+  ///
+  /// The contents are stored in chunks that are only allocated once something is written to them, so a long file that
+  /// is mostly unwritten takes little memory - like a sparse file. Reads and writes of existing chunks share a lock,
+  /// so they can run from many threads at once. Mapping is not supported.
+  class memory_disk_file : public disk_file
+  {
+  public:
+    memory_disk_file(uint64_t chunk_size = 1024 * 1024);
+
+    virtual void read_at(void *buffer, uint64_t length, uint64_t offset) override;
+    virtual void write_at(const void *buffer, uint64_t length, uint64_t offset) override;
+    virtual void readv_at(const io_segment *segments, uint32_t count, uint64_t offset) override;
+    virtual void writev_at(const io_segment *segments, uint32_t count, uint64_t offset) override;
+    virtual uint64_t get_length() override;
+    virtual void set_length(uint64_t new_length) override;
+    virtual void flush() override;
+    virtual bool punch_hole(uint64_t offset, uint64_t length) override;
+
+  protected:
+    void clear_range(uint64_t start_offset, uint64_t end_offset);
+
+    /// The size of each chunk, in bytes.
+    const uint64_t chunk_bytes;
+
+    /// Held exclusively while chunks are added or removed, or the length changes, and shared by reads and by writes
+    /// to chunks that already exist.
+    std::shared_mutex chunks_lock;
+
+    /// The chunks of the file, in order. Chunks that have never been written are nullptr, and read as zeroes.
+    std::vector<std::unique_ptr<uint8_t[]>> chunks;
+
+    /// The length of the file, in bytes.
+    uint64_t file_length;
+  };
+};
@@ -0,0 +1,139 @@
+/// @file
+/// @brief Declares the I/O statistics that a virtual disk can gather about itself.
+
+// Copyright Martin Hughes 2018.
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+
+namespace virt_disk
+{
+  /// @brief A histogram of operation latencies, with buckets of equal relative width - like an HDR histogram.
+  ///
+  /// Latencies below 16 ns each have their own bucket. Above that, each doubling of latency is split into 8 buckets,
+  /// so every recorded latency is known to within 12.5%. Latencies of 2^40 ns (about 18 minutes) or more all go in
+  /// the last bucket.
+  struct latency_histogram
+  {
+    /// The number of buckets in each doubling of latency.
+    static const uint32_t SUB_BUCKETS = 8;
+
+    /// The number of buckets.
+    static const uint32_t BUCKET_COUNT = 304;
+
+    uint64_t buckets[BUCKET_COUNT]; ///< The number of latencies recorded in each bucket.
+    uint64_t count; ///< The number of latencies recorded.
+    uint64_t total_ns; ///< The sum of the latencies recorded, in nanoseconds.
+    uint64_t max_ns; ///< The largest latency recorded, in nanoseconds.
+
+    static uint32_t bucket_for(uint64_t latency_ns);
+    static uint64_t bucket_upper_bound(uint32_t bucket);
+    uint64_t percentile(double fraction) const;
+  };
+
+  /// @brief A snapshot of the I/O a virt_disk has done since its statistics were enabled or last reset.
+  ///
+  /// "Backing" counts are the calls made to the backing file to transfer the disk's data - so backing_reads / reads
+  /// is the number of system calls each read of the disk costs. Metadata is written separately, and counted only in
+  /// metadata_writes and metadata_ns.
+  struct io_stats
+  {
+    uint64_t reads; ///< Calls that read from the disk, including readv() and io_queue reads.
+    uint64_t writes; ///< Calls that wrote to the disk, including writev() and io_queue writes.
+    uint64_t bytes_read; ///< Bytes read from the disk.
+    uint64_t bytes_written; ///< Bytes written to the disk.
+    uint64_t backing_reads; ///< Calls made to the backing files to read data.
+    uint64_t backing_writes; ///< Calls made to the backing file to write data.
+    uint64_t backing_bytes_read; ///< Bytes read from the backing files, including small gaps read through.
+    uint64_t backing_bytes_written; ///< Bytes written to the backing file.
+    uint64_t data_ns; ///< Time spent in calls to the backing files to transfer data, except for an io_queue's calls.
+    uint64_t blocks_allocated; ///< Blocks newly allocated in the image.
+    uint64_t zero_fills; ///< Ranges of zeroes written to holes, which were left as holes rather than stored.
+    uint64_t zero_fill_bytes; ///< Bytes of zeroes left as holes.
+    uint64_t metadata_writes; ///< Times that changed metadata, such as the block table, was written to the image.
+    uint64_t metadata_ns; ///< Time spent writing metadata, in nanoseconds.
+
+    latency_histogram read_latency; ///< The latency of each read of the disk.
+    latency_histogram write_latency; ///< The latency of each write to the disk.
+    latency_histogram allocate_latency; ///< The time taken to allocate each new block.
+  };
+
+  /// @brief The counters kept by an io_stats_recorder.
+  ///
+  namespace stat_counter
+  {
+    const uint32_t READS = 0;
+    const uint32_t WRITES = 1;
+    const uint32_t BYTES_READ = 2;
+    const uint32_t BYTES_WRITTEN = 3;
+    const uint32_t BACKING_READS = 4;
+    const uint32_t BACKING_WRITES = 5;
+    const uint32_t BACKING_BYTES_READ = 6;
+    const uint32_t BACKING_BYTES_WRITTEN = 7;
+    const uint32_t DATA_NS = 8;
+    const uint32_t BLOCKS_ALLOCATED = 9;
+    const uint32_t ZERO_FILLS = 10;
+    const uint32_t ZERO_FILL_BYTES = 11;
+    const uint32_t METADATA_WRITES = 12;
+    const uint32_t METADATA_NS = 13;
+
+    const uint32_t COUNT = 14; ///< The number of counters.
+  };
+
+  /// @brief The latency histograms kept by an io_stats_recorder.
+  ///
+  namespace stat_latency
+  {
+    const uint32_t READ = 0;
+    const uint32_t WRITE = 1;
+    const uint32_t ALLOCATE = 2;
+
+    const uint32_t COUNT = 3; ///< The number of histograms.
+  };
+
+  /// @brief Gathers the statistics for one virt_disk.
+  ///
+  /// Every thread updates one of a number of slots, each on its own cache line, picked when the thread first records
+  /// something - so threads do not contend, and the cost of recording is a few uncontended atomic additions. A
+  /// snapshot adds the slots together. Updates made while a snapshot or reset is in progress may or may not be
+  /// included in it.
+  class io_stats_recorder
+  {
+  public:
+    io_stats_recorder();
+
+    io_stats_recorder(const io_stats_recorder &) = delete;
+    io_stats_recorder &operator=(const io_stats_recorder &) = delete;
+
+    static uint64_t now();
+
+    void add(uint32_t counter, uint64_t amount);
+    void add_latency(uint32_t histogram, uint64_t start_ns);
+    void add_time(uint32_t counter, uint64_t start_ns);
+
+    io_stats snapshot();
+    void reset();
+
+  protected:
+    /// The number of slots.
+    static const uint32_t SLOT_COUNT = 16;
+
+    /// @brief The statistics recorded by a group of threads.
+    ///
+    struct alignas(64) slot
+    {
+      std::atomic<uint64_t> counters[stat_counter::COUNT]; ///< Indexed by the stat_counter constants.
+      std::atomic<uint64_t> buckets[stat_latency::COUNT][latency_histogram::BUCKET_COUNT]; ///< Histogram buckets.
+      std::atomic<uint64_t> total_ns[stat_latency::COUNT]; ///< The sum of the latencies in each histogram.
+      std::atomic<uint64_t> max_ns[stat_latency::COUNT]; ///< The largest latency in each histogram.
+    };
+
+    slot &this_thread_slot();
+
+    /// The slots.
+    std::unique_ptr<slot[]> slots;
+  };
+};
@@ -0,0 +1,104 @@
+/// @file
+/// @brief Declares the in-memory copy of a block table that is stored in a disk image.
+
+// Copyright Martin Hughes 2018.
+
+#pragma once
+
+#include "virtualdisk.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace virt_disk
+{
+  /// @brief One page of a block_table.
+  ///
+  struct table_page
+  {
+    /// The number of entries in a page - 4 KiB of table.
+    static const uint32_t ENTRIES = 1024;
+
+    std::atomic<uint32_t> entries[ENTRIES]; ///< The entries, in native byte order.
+    std::atomic<bool> referenced; ///< Set when the page is used, cleared as the CLOCK hand passes.
+    std::atomic<bool> dirty; ///< Set when an entry has changed since the page was last written.
+  };
+
+  /// @brief A table of 32-bit entries stored in a disk image, such as the VDI block map or the VHD BAT.
+  ///
+  /// The table is held in pages of 4 KiB, in native byte order. Pages are either all read when the table is created,
+  /// or each is read the first time it is used - so opening a huge image costs the same as opening a small one.
+  ///
+  /// Without a page limit, pages stay loaded once read and get() never takes a lock. With a limit, get() takes a
+  /// short lock, and unchanged pages are evicted by CLOCK - an approximation of least-recently-used. Changed pages stay
+  /// loaded until write_changes() has written them.
+  class block_table
+  {
+  public:
+    block_table(disk_file *file, uint64_t file_offset, uint64_t entry_count, bool big_endian, const open_config &config);
+    ~block_table();
+
+    block_table(const block_table &) = delete;
+    block_table &operator=(const block_table &) = delete;
+
+    uint32_t get(uint64_t index);
+    void set(uint64_t index, uint32_t value);
+
+    bool has_changes();
+    void write_changes();
+
+    /// @brief Get the number of entries in the table.
+    ///
+    /// @return The number of entries.
+    uint64_t size() { return entry_count; };
+
+  protected:
+    table_page *load_page(uint64_t page_number);
+    void read_pages(uint64_t first_page, uint64_t page_count, table_page **pages_out);
+    void evict_page(uint32_t held_lock);
+
+    /// The file the table is stored in.
+    disk_file *file;
+
+    /// The offset of the table in the file.
+    uint64_t file_offset;
+
+    /// The number of entries in the table.
+    uint64_t entry_count;
+
+    /// Whether the table is stored big-endian (true) or little-endian (false).
+    bool big_endian;
+
+    /// The most pages held at once, or zero for no limit.
+    uint64_t max_pages;
+
+    /// The number of pages in the table.
+    uint64_t page_count;
+
+    /// One pointer for each page of the table, or nullptr if the page is not loaded.
+    std::unique_ptr<std::atomic<table_page *>[]> pages;
+
+    /// The number of pages currently loaded.
+    std::atomic<uint64_t> loaded_pages;
+
+    /// The number of locks in page_locks.
+    static const uint32_t PAGE_LOCK_COUNT = 64;
+
+    /// Page N is loaded, and with a page limit is read and evicted, while holding page_locks[N % PAGE_LOCK_COUNT].
+    std::mutex page_locks[PAGE_LOCK_COUNT];
+
+    /// Protects clock_hand, and ensures only one thread looks for a page to evict at a time.
+    std::mutex clock_lock;
+
+    /// The next page the CLOCK hand will consider for eviction.
+    uint64_t clock_hand;
+
+    /// Protects dirty_pages.
+    std::mutex dirty_lock;
+
+    /// The pages that have changed since they were last written.
+    std::vector<uint64_t> dirty_pages;
+  };
+};
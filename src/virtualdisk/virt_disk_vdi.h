@@ -3,9 +3,15 @@
 
 // Copyright Martin Hughes 2018.
 
+#pragma once
+
 #include "virtualdisk.h"
+#include "virt_disk_file.h"
+#include "virt_disk_table.h"
 
+#include <atomic>
 #include <memory>
+#include <mutex>
 
 namespace virt_disk
 {
@@ -90,6 +96,15 @@ namespace virt_disk
   /// Constant representing fixed-size .VDI files.
   const uint32_t VDI_TYPE_FIXED_SIZE = 2;
 
+  /// The block size used for new images if none is given.
+  const uint32_t VDI_DEFAULT_BLOCK_SIZE = 1024 * 1024;
+
+  /// The value of a block map entry for a block that has not been allocated.
+  const uint32_t VDI_BLOCK_UNALLOCATED = ~0U;
+
+  /// The value of a block map entry for a block that is known to contain only zeroes, and is not stored in the file.
+  const uint32_t VDI_BLOCK_ZERO = ~0U - 1;
+
   /// @brief Represents a VirtualBox VDI format disk image.
   ///
   /// This class is not directly exposed by including "virtualdisk.h", but can be instantiated directly if
@@ -98,7 +113,11 @@ namespace virt_disk
   {
   public:
     vdi_disk(std::string &filename);
-    ~vdi_disk() { };
+    vdi_disk(std::unique_ptr<disk_file> file, const open_config &config = open_config());
+    ~vdi_disk();
+
+    static bool probe(const uint8_t *first_sector, const uint8_t *last_sector, uint64_t file_length);
+    static void create(const std::string &filename, uint64_t size, uint32_t file_type, uint32_t block_size = 0);
 
     virtual void read(void *buffer, uint64_t start_posn, uint64_t length, uint64_t buffer_length) override;
     virtual void write(const void *buffer, uint64_t start_posn, uint64_t length, uint64_t buffer_length) override;
@@ -106,23 +125,59 @@ namespace virt_disk
     virtual uint64_t get_length() override;
 
   protected:
+    virtual void map_range(uint64_t start_posn,
+                           uint64_t length,
+                           bool allocate,
+                           std::vector<disk_extent> &extents) override;
+    virtual disk_file *get_backing_file() override;
+    virtual void flush_metadata() override;
+    virtual void mark_zeroed(uint64_t start_posn, uint64_t length) override;
+    virtual void allocate_blocks(uint64_t start_posn, uint64_t length) override;
+    virtual bool get_block_geometry(block_geometry &geometry) override;
+    virtual uint64_t get_block_location(uint64_t block_number) override;
+    virtual void set_block_location(uint64_t block_number, uint64_t file_offset) override;
+    virtual uint64_t append_block_space() override;
+    virtual void truncate_block_space(uint64_t data_end) override;
+
+    uint32_t get_or_allocate_block(uint64_t block_number);
+    uint32_t reuse_free_slot(uint64_t block_number);
+    void write_metadata();
 
     /// The file object representing the actual file we're treating as a virtual machine hard disk.
-    std::fstream backing_file;
+    std::unique_ptr<disk_file> backing_file;
 
     /// A buffered copy of the header of the .VDI file.
     vdi_header file_header;
 
-    /// A buffered copy of the block-to-disk map in the .VDI file.
-    std::unique_ptr<uint32_t[]> block_map;
+    /// A buffered copy of the block-to-disk map in the .VDI file. Entries only change from VDI_BLOCK_UNALLOCATED or
+    /// VDI_BLOCK_ZERO to a block index, except by compact() while no I/O is in progress - so unless a table page limit
+    /// is set they can be read without taking a lock.
+    std::unique_ptr<block_table> block_map;
 
     /// Whether or not this object is constructed and operating correctly.
     bool is_ok;
 
-    // Magic numbers.
+    /// The number of locks in allocation_locks.
+    static const uint32_t ALLOCATION_LOCK_COUNT = 64;
+
+    /// Serialises allocation of each block. Block N is protected by entry (N % ALLOCATION_LOCK_COUNT).
+    std::mutex allocation_locks[ALLOCATION_LOCK_COUNT];
+
+    /// Protects the members below, and the header and block map on disk.
+    std::mutex append_lock;
+
+    /// The index in the file of the next block to be allocated. The header's count is updated from this when it is
+    /// written.
+    uint32_t next_block_index;
+
+    /// The current length of the backing file, including any space reserved for blocks not yet allocated.
+    uint64_t file_length;
 
-    // Member functions.
+    /// The length of the backing file when it was opened, or when compact() last shortened it. Space beyond this was
+    /// added by this object, so it is known to read as zeroes, and flush_metadata() may give back what is unused.
+    uint64_t zeroed_from;
 
-    void read_one_block(uint64_t start_block, uint32_t block_offset, uint32_t bytes_this_block, uint8_t *buffer);
+    /// The number of blocks allocated since the metadata was last written.
+    uint32_t unsaved_allocations;
   };
 };
\ No newline at end of file
@@ -4,8 +4,14 @@
 #pragma once
 
 #include "virtualdisk.h"
+#include "virt_disk_file.h"
+#include "virt_disk_table.h"
 
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include <boost/endian/conversion.hpp>
 #include <boost/endian/buffers.hpp>
 #include <boost/endian/arithmetic.hpp>
@@ -21,8 +27,17 @@ namespace virt_disk
   {
     const uint32_t NONE = 0; ///< Invalid file format.
     const uint32_t FIXED = 2; ///< Fixed-size format.
-    const uint32_t DYNAMIC = 3; ///< Dynamic-size format - not yet supported.
-    const uint32_t DIFFERENCING = 4; ///< Differencing format - not yet supported.
+    const uint32_t DYNAMIC = 3; ///< Dynamic-size format.
+    const uint32_t DIFFERENCING = 4; ///< Differencing format - a dynamic disk that records changes to a parent disk.
+  };
+
+  /// @brief Constants that identify how a parent locator in a differencing VHD stores the parent's path.
+  namespace vhd_locator_platform
+  {
+    const uint32_t NONE = 0; ///< The locator is unused.
+    const uint32_t W2RU = 0x57327275; ///< 'W2ru' - Windows relative path, UTF-16LE.
+    const uint32_t W2KU = 0x57326B75; ///< 'W2ku' - Windows absolute path, UTF-16LE.
+    const uint32_t MACX = 0x4D616358; ///< 'MacX' - file URL, UTF-8.
   };
 
   /// @brief Structure of the footer for VHD files
@@ -50,12 +65,17 @@ namespace virt_disk
   };
   static_assert(sizeof(vhd_footer) == 512, "sizeof(vhd_footer) != 512, check compiler packing options");
 
-  /// @brief A string to help us locate the parts of a differencing VHD file. Unused by this library at present.
+  /// @brief Describes where a differencing VHD file stores one form of its parent's path.
   ///
   struct vhd_parent_locator
   {
-    uint8_t string[24]; ///< The helper string.
+    big_uint32_t platform_code; ///< One of the vhd_locator_platform constants.
+    big_uint32_t platform_data_space; ///< The number of sectors reserved for the path.
+    big_uint32_t platform_data_length; ///< The length of the path, in bytes.
+    big_uint32_t reserved; ///< Set to zero.
+    big_uint64_t platform_data_offset; ///< The absolute byte offset of the path in the file.
   };
+  static_assert(sizeof(vhd_parent_locator) == 24, "Sizeof vhd_parent_locator wrong");
 
   /// @brief The header used in a dynamic VHD file.
   ///
@@ -68,11 +88,11 @@ namespace virt_disk
     big_uint32_t max_table_entries; ///< The maximum number of entries in the block allocation table.
     big_uint32_t block_size; ///< The size, in bytes, of a block on the disk.
     big_uint32_t checksum; ///< One's complement of the sum of all the bytes in this header.
-    uint8_t parent_unique_id[16]; ///< Unusued in dynamic disks.
+    uint8_t parent_unique_id[16]; ///< The unique_id of the parent of a differencing disk. Unused in dynamic disks.
     big_uint32_t parent_time_stamp; ///< Should be set to the modification time of this disk, but we ignore.
     big_uint32_t reserved_1; ///< Reserved.
-    uint8_t parent_unicode_name[512]; ///< Unused for dynamic disks.
-    vhd_parent_locator parent_locators[8]; ///< Unused for dynamic disks.
+    uint8_t parent_unicode_name[512]; ///< File name of the parent of a differencing disk, UTF-16BE.
+    vhd_parent_locator parent_locators[8]; ///< Where to find the parent of a differencing disk.
     uint8_t reserved_2[256]; ///< Reserved.
   };
   static_assert(sizeof(vhd_dynamic_header) == 1024, "Sizeof vhd_dynamic_header wrong");
@@ -89,14 +109,45 @@ namespace virt_disk
   ///
   const uint32_t VHD_SUPPORTED_VERSION = 0x00010000;
 
+  /// The block size used for new dynamic images if none is given.
+  ///
+  const uint32_t VHD_DEFAULT_BLOCK_SIZE = 2 * 1024 * 1024;
+
+  /// The value of a block allocation table entry for a block that has not been allocated.
+  ///
+  const uint32_t VHD_BLOCK_UNALLOCATED = 0xFFFFFFFF;
+
+  /// @brief Constants summarising the sector bitmap of an allocated block in a dynamic VHD.
+  ///
+  /// A block only moves from EMPTY towards FULL, never back, so FULL and EMPTY can be acted on without a lock.
+  namespace vhd_bitmap_state
+  {
+    const uint8_t UNKNOWN = 0; ///< The bitmap has not been loaded yet.
+    const uint8_t EMPTY = 1; ///< No sectors in the block are present.
+    const uint8_t PARTIAL = 2; ///< Some sectors are present. The bits are held in vhd_disk::partial_bitmaps.
+    const uint8_t FULL = 3; ///< Every sector in the block is present.
+  };
+
   /// @brief Represents a VHD format virtual hard disk.
   ///
-  /// At present, only the fixed-size version of this format is supported.
+  /// Fixed, dynamic and differencing disks are supported. The parent of a differencing disk is opened read-only along
+  /// with it, and so on down the chain. Sectors not present in a differencing disk are read from its parent.
+  ///
+  /// To keep long chains cheap, the layout of each block that is not wholly stored in this disk - which parts come
+  /// from which layer of the chain - is worked out once and cached, then reused by every later read of that block.
   class vhd_disk : public virt_disk
   {
   public:
     vhd_disk(std::string &filename);
-    ~vhd_disk() { };
+    vhd_disk(std::unique_ptr<disk_file> file);
+    vhd_disk(std::unique_ptr<disk_file> file,
+             const std::string &path,
+             const open_config &config = open_config(),
+             uint32_t chain_depth = 0);
+    ~vhd_disk();
+
+    static bool probe(const uint8_t *first_sector, const uint8_t *last_sector, uint64_t file_length);
+    static void create(const std::string &filename, uint64_t size, uint32_t disk_type, uint32_t block_size = 0);
 
     virtual void read(void *buffer, uint64_t start_posn, uint64_t length, uint64_t buffer_length) override;
     virtual void write(const void *buffer, uint64_t start_posn, uint64_t length, uint64_t buffer_length) override;
@@ -104,16 +155,127 @@ namespace virt_disk
     virtual uint64_t get_length() override;
 
   protected:
-    std::fstream backing_file;
+    virtual void map_range(uint64_t start_posn,
+                           uint64_t length,
+                           bool allocate,
+                           std::vector<disk_extent> &extents) override;
+    virtual disk_file *get_backing_file() override;
+    virtual void flush_metadata() override;
+    virtual void allocate_blocks(uint64_t start_posn, uint64_t length) override;
+    virtual bool get_block_geometry(block_geometry &geometry) override;
+    virtual uint64_t get_block_location(uint64_t block_number) override;
+    virtual void set_block_location(uint64_t block_number, uint64_t file_offset) override;
+    virtual uint64_t append_block_space() override;
+    virtual void truncate_block_space(uint64_t data_end) override;
+
+    std::unique_ptr<disk_file> backing_file;
     vhd_footer footer_copy;
     uint64_t total_file_length;
     vhd_dynamic_header dynamic_header_copy;
 
-    uint16_t data_block_bitmap_bytes;
-    std::unique_ptr<boost::endian::big_uint32_t[]> block_allocation_table;
+    uint32_t data_block_bitmap_bytes;
+
+    /// The block allocation table, converted to native byte order. Entries are only changed from
+    /// VHD_BLOCK_UNALLOCATED to a sector number, except by compact() while no I/O is in progress - so unless a table
+    /// page limit is set they can be read without taking a lock.
+    std::unique_ptr<block_table> block_allocation_table;
+
+    /// The number of locks in allocation_locks.
+    static const uint32_t ALLOCATION_LOCK_COUNT = 64;
+
+    /// Serialises allocation of each block. Block N is protected by entry (N % ALLOCATION_LOCK_COUNT).
+    std::mutex allocation_locks[ALLOCATION_LOCK_COUNT];
+
+    /// Serialises appending new blocks to the end of the backing file.
+    std::mutex append_lock;
+
+    /// Offset of the footer at the end of the backing file. Protected by append_lock.
+    uint64_t footer_posn;
+
+    /// Offset in the backing file where the next new block will go. Space between here and footer_posn has been
+    /// reserved for new blocks. Protected by append_lock.
+    uint64_t next_block_posn;
+
+    /// The number of blocks allocated since the table was last written. Protected by append_lock.
+    uint32_t unsaved_allocations;
+
+    /// The number of 512-byte sectors in each block.
+    uint32_t sectors_per_block;
+
+    /// The number of bytes of each block bitmap that hold sector bits. The rest of the bitmap is padding.
+    uint32_t bitmap_used_bytes;
+
+    /// @brief The bitmap states of the blocks covered by one page of the block allocation table.
+    ///
+    struct bitmap_page
+    {
+      /// One of the vhd_bitmap_state constants for each block.
+      std::atomic<uint8_t> states[table_page::ENTRIES];
+
+      /// Whether each block's bitmap has changed since it was last written. Protected by append_lock.
+      bool dirty[table_page::ENTRIES];
+    };
+
+    /// The bitmap states of each page of blocks, or nullptr for pages none of whose blocks have been used. Pages are
+    /// created the first time a block they cover is used, and never removed, so they can be read without a lock - and
+    /// opening a huge image to use a few blocks costs no more than a small one.
+    std::unique_ptr<std::atomic<bitmap_page *>[]> bitmap_pages;
+
+    /// The number of pages in bitmap_pages.
+    uint64_t bitmap_page_count;
+
+    /// The sector bits of blocks in the PARTIAL state, in the on-disk format. Only those blocks have entries, so this
+    /// costs nothing for blocks that are empty or full. Block N is in partial_bitmaps[N % ALLOCATION_LOCK_COUNT], and
+    /// is protected by bitmap_locks[N % ALLOCATION_LOCK_COUNT].
+    std::unordered_map<uint64_t, std::unique_ptr<uint8_t[]>> partial_bitmaps[ALLOCATION_LOCK_COUNT];
+
+    /// Serialises loading and changing the bitmap of each block.
+    std::mutex bitmap_locks[ALLOCATION_LOCK_COUNT];
+
+    /// The blocks whose bitmaps have changed since they were last written. Protected by append_lock.
+    std::vector<uint32_t> dirty_bitmaps;
+
+    /// The path this disk was opened from, used to find the parent of a differencing disk. May be empty.
+    std::string image_path;
+
+    /// The parent of a differencing disk, or nullptr.
+    std::unique_ptr<vhd_disk> parent;
+
+    /// For differencing disks, the cached layout of each block across the whole chain, as extents covering the block.
+    /// Entries are built on first use and discarded whenever the block's bitmap changes. Block N is in
+    /// block_layouts[N % ALLOCATION_LOCK_COUNT], and is protected by layout_locks[N % ALLOCATION_LOCK_COUNT].
+    std::unordered_map<uint64_t, std::shared_ptr<const std::vector<disk_extent>>> block_layouts[ALLOCATION_LOCK_COUNT];
+
+    /// Incremented whenever the corresponding entries of block_layouts are discarded, so that a layout built from
+    /// out-of-date bitmaps is never cached. Protected by layout_locks.
+    uint64_t layout_generations[ALLOCATION_LOCK_COUNT];
+
+    /// Protect block_layouts and layout_generations.
+    std::mutex layout_locks[ALLOCATION_LOCK_COUNT];
 
     static_assert(sizeof(boost::endian::big_uint32_t) == sizeof(uint32_t), "Wrong endian type size");
 
-    virtual void read_block(void *buffer, uint64_t start_posn, uint64_t length);
+    uint32_t get_or_allocate_block(uint64_t block_number);
+    void write_metadata();
+
+    bitmap_page *get_bitmap_page(uint64_t block_number);
+    std::atomic<uint8_t> &block_bitmap_state(uint64_t block_number);
+    uint8_t get_bitmap_state(uint64_t block_number, uint32_t block_ptr);
+    void map_block_sectors(uint64_t block_number,
+                           uint32_t block_ptr,
+                           uint64_t start_posn,
+                           uint64_t offset_in_block,
+                           uint64_t length,
+                           std::vector<disk_extent> &extents);
+    void set_sector_bits(uint64_t block_number, uint32_t block_ptr, uint64_t offset_in_block, uint64_t length);
+    void mark_bitmap_dirty(uint64_t block_number);
+
+    void open_parent(const open_config &config, uint32_t chain_depth);
+    void map_block_layout(uint64_t block_number,
+                          uint32_t block_ptr,
+                          uint64_t start_posn,
+                          uint64_t length,
+                          std::vector<disk_extent> &extents);
+    void discard_block_layout(uint64_t block_number);
   };
 };
\ No newline at end of file
@@ -0,0 +1,13 @@
+/// @file
+/// @brief Declares a fast check for buffers that contain only zeroes.
+
+// Copyright Martin Hughes 2018.
+
+#pragma once
+
+#include <stdint.h>
+
+namespace virt_disk
+{
+  bool is_zero_buffer(const void *buffer, uint64_t length);
+};
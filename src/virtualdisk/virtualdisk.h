@@ -7,7 +7,15 @@
 
 #include <stdint.h>
 #include <string>
+#include <atomic>
+#include <condition_variable>
 #include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "virt_disk_stats.h"
 
 namespace virt_disk
 {
@@ -19,15 +27,197 @@ namespace virt_disk
   /// - pp is the patch level.
   const uint32_t VERSION = 0x00000000;
 
+  class block_cache;
+  class cache_shard;
+  class disk_file;
+  class io_queue;
+  class read_ahead;
+  struct read_ahead_config;
+  class write_combiner;
+  struct write_combine_config;
+
+  /// Value of disk_extent::file_offset for parts of the disk that are not stored in the backing file.
+  ///
+  const uint64_t EXTENT_UNALLOCATED = ~0ULL;
+
+  /// @brief A contiguous range of the virtual disk, and where it is stored.
+  ///
+  struct disk_extent
+  {
+    uint64_t start_posn; ///< The number of bytes into the virtual disk that this extent begins.
+    uint64_t length; ///< The length of this extent, in bytes.
+    uint64_t file_offset; ///< Offset of the extent in its file, or EXTENT_UNALLOCATED if it reads as zeroes.
+    disk_file *file; ///< The file holding the extent, if not the disk's own backing file - such as a parent image.
+  };
+
+  /// @brief One segment of a scatter-gather I/O request.
+  ///
+  struct io_segment
+  {
+    void *buffer; ///< The memory to read into, or write from.
+    uint64_t length; ///< The number of bytes in this segment.
+  };
+
+  /// @brief A contiguous range of the virtual disk, and the buffers it is read into or written from.
+  ///
+  struct disk_io_range
+  {
+    uint64_t start_posn; ///< The number of bytes into the virtual disk that the range begins.
+    const io_segment *segments; ///< The buffers, in order. The range is as long as all of them together.
+    uint32_t count; ///< The number of entries in segments.
+  };
+
+  /// @brief A contiguous range of the virtual disk that is either stored in the image, or is a hole.
+  ///
+  struct allocation_extent
+  {
+    uint64_t start_posn; ///< The number of bytes into the virtual disk that this extent begins.
+    uint64_t length; ///< The length of this extent, in bytes.
+    bool allocated; ///< True if the extent is stored in the image, false if it is a hole that reads as zeroes.
+  };
+
+  /// @brief Hints describing how a mapped view of a disk will be accessed.
+  ///
+  namespace view_access
+  {
+    const uint32_t NORMAL = 0; ///< No particular pattern.
+    const uint32_t SEQUENTIAL = 1; ///< Front to back - read ahead aggressively.
+    const uint32_t RANDOM = 2; ///< Scattered accesses - don't read ahead.
+  };
+
+  /// @brief Constants that identify the kinds of image the library can create.
+  ///
+  namespace image_format
+  {
+    const uint32_t VDI_NORMAL = 0; ///< A VDI image that grows as it is written.
+    const uint32_t VDI_FIXED = 1; ///< A VDI image with space for every block set aside when it is created.
+    const uint32_t VHD_FIXED = 2; ///< A fixed VHD image - the contents of the disk followed by a footer.
+    const uint32_t VHD_DYNAMIC = 3; ///< A dynamic VHD image that grows as it is written.
+  };
+
+  /// @brief Constants that select when the block table of a dynamic image is read into memory.
+  ///
+  namespace table_load
+  {
+    const uint32_t EAGER = 0; ///< The whole table is read when the image is opened.
+    const uint32_t ON_DEMAND = 1; ///< Each 4 KiB page of the table is read the first time it is needed.
+  };
+
+  /// @brief Options used when opening a disk image.
+  ///
+  struct open_config
+  {
+    uint32_t table_loading = table_load::EAGER; ///< One of the table_load constants.
+
+    /// The most 4 KiB pages of the block table to hold in memory at once, or zero for no limit. Only used with
+    /// table_load::ON_DEMAND.
+    uint32_t max_table_pages = 0;
+
+    /// Whether to bypass the operating system's page cache when accessing the image and any parent images. Only
+    /// supported on POSIX systems - if the filesystem does not allow it, the image is opened normally.
+    bool direct_io = false;
+
+    /// Whether to open the image for reading only. Writing to the disk, or compacting it, then fails - so this suits
+    /// images that must never change, such as the base of a cow_disk. Parent images are always opened read-only.
+    bool read_only = false;
+  };
+
+  /// @brief Options for virt_disk::create_image().
+  ///
+  struct create_config
+  {
+    uint32_t format = image_format::VHD_DYNAMIC; ///< The format of the new image - one of the image_format constants.
+    uint32_t block_size = 0; ///< The block size of the new image, in bytes. Zero selects the format's default.
+
+    /// Whether to set aside storage for the whole disk straight away. Fixed images are otherwise sparse files where the
+    /// filesystem allows; with this set their storage is allocated instead, using fallocate() where possible. Dynamic
+    /// images have every block allocated, as by virt_disk::preallocate().
+    bool allocate_space = false;
+
+    open_config open; ///< How to open the new image.
+  };
+
+  /// @brief Options for virt_disk::compact().
+  ///
+  struct compact_config
+  {
+    bool reclaim_zero_blocks = true; ///< Whether to remove blocks that contain only zeroes.
+    bool reorder_blocks = false; ///< Whether to move blocks so that their order in the file matches the disk.
+    uint32_t blocks_per_step = 16; ///< The most blocks moved or removed at once, while other I/O waits.
+    uint64_t max_bytes_per_second = 0; ///< Limits how fast the image is read and copied, or zero for no limit.
+
+    /// Called after each step with the amount of work done so far and the total, in blocks. Returning false stops
+    /// compaction early, leaving the image consistent.
+    std::function<bool(uint64_t done, uint64_t total)> progress;
+  };
+
+  /// @brief What virt_disk::compact() did.
+  ///
+  struct compact_result
+  {
+    uint64_t blocks_removed = 0; ///< The number of blocks containing only zeroes that were removed.
+    uint64_t blocks_moved = 0; ///< The number of blocks copied to a new place in the file.
+    uint64_t bytes_released = 0; ///< How much shorter the file became, plus the size of any holes punched in it.
+  };
+
+  /// @brief A read-only view of part of a virtual disk, mapped directly from the backing file without copying.
+  ///
+  /// The view remains valid for as long as this object (or a copy of it) exists, even after the disk object is
+  /// destroyed. Writes to the disk are visible through the view.
+  class disk_view
+  {
+  public:
+    disk_view() : view_length{0} { };
+
+    /// @brief Construct a view.
+    ///
+    /// @param data The first byte of the view. The pointer keeps the underlying mapping alive.
+    ///
+    /// @param length The number of bytes in the view.
+    disk_view(std::shared_ptr<const uint8_t> data, uint64_t length) : view_data{std::move(data)}, view_length{length} { };
+
+    /// @brief Get the first byte of the view.
+    ///
+    /// @return A pointer to the data, or nullptr for an empty view.
+    const uint8_t *data() const { return view_data.get(); };
+
+    /// @brief Get the length of the view.
+    ///
+    /// @return The number of bytes in the view.
+    uint64_t size() const { return view_length; };
+
+  protected:
+    /// The first byte of the view, which also holds a reference to the mapping it lies in.
+    std::shared_ptr<const uint8_t> view_data;
+
+    /// The number of bytes in the view.
+    uint64_t view_length;
+  };
+
   /// @brief A class representing a generic virtual disk file.
   ///
+  /// The formats provided by this library access their backing file using positional I/O only, so read() and write()
+  /// may be called from several threads at once on a single object:
+  ///
+  /// - Reads never take a lock.
+  /// - Writes to blocks that are already allocated never take a lock.
+  /// - Writes that allocate a new block in a dynamic image serialise only with other allocations of the same block,
+  ///   and briefly with other threads extending the backing file.
+  /// - While compact() is running, reads and writes wait for each of its steps to finish - a few blocks are moved in
+  ///   each step.
+  ///
+  /// Reads and writes of overlapping ranges from different threads are not ordered with respect to each other - as
+  /// with a real disk, callers must arrange this themselves if it matters.
   class virt_disk
   {
   protected:
     virt_disk() = default;
 
   public:
-    static virt_disk *create_virtual_disk(std::string &filename);
+    static virt_disk *create_virtual_disk(std::string &filename, const open_config &config = open_config());
+    static virt_disk *create_image(const std::string &filename,
+                                   uint64_t size,
+                                   const create_config &config = create_config());
     virtual ~virt_disk() = default;
 
     /// @brief Reads from the virtual machine disk into a provided buffer.
@@ -56,6 +246,238 @@ namespace virt_disk
     ///
     /// @return The size of the virtual disk, in bytes.
     virtual uint64_t get_length() = 0;
+
+    virtual void readv(const io_segment *segments, uint32_t count, uint64_t start_posn);
+    virtual void writev(const io_segment *segments, uint32_t count, uint64_t start_posn);
+    virtual void readv(const disk_io_range *ranges, uint32_t count);
+    virtual void writev(const disk_io_range *ranges, uint32_t count);
+
+    virtual disk_view map_view(uint64_t start_posn, uint64_t length, uint32_t access_hint = view_access::NORMAL);
+
+    void get_allocation(uint64_t start_posn, uint64_t length, std::vector<allocation_extent> &extents);
+    uint64_t seek_data(uint64_t start_posn);
+    uint64_t seek_hole(uint64_t start_posn);
+    void preallocate(uint64_t start_posn, uint64_t length);
+
+    void set_cache(std::shared_ptr<block_cache> new_cache);
+    void set_read_ahead(const read_ahead_config &config);
+    void set_write_combining(const write_combine_config &config);
+    virtual void flush();
+
+    compact_result compact(const compact_config &config = compact_config());
+
+    void enable_stats(bool enable);
+    io_stats get_stats();
+    void reset_stats();
+
+  protected:
+    friend class io_queue;
+    friend class block_cache;
+    friend class cache_shard;
+    friend class cow_disk;
+    friend class read_ahead;
+    friend class write_combiner;
+
+    /// @brief Find where a range of the virtual disk is stored in the backing file.
+    ///
+    /// @param start_posn The number of bytes into the virtual disk that the range begins.
+    ///
+    /// @param length The length of the range, in bytes.
+    ///
+    /// @param allocate If true, any parts of the range that are not yet stored in the backing file are allocated, so
+    ///                 that the range can be written to. If false, they are returned as EXTENT_UNALLOCATED.
+    ///
+    /// @param extents Extents covering the whole range, in order, are appended to this vector. Neighbouring extents
+    ///                that are contiguous in the backing file are merged.
+    virtual void map_range(uint64_t start_posn,
+                           uint64_t length,
+                           bool allocate,
+                           std::vector<disk_extent> &extents) = 0;
+
+    /// @brief Get the file this disk is stored in.
+    ///
+    /// @return The backing file. It remains owned by this object.
+    virtual disk_file *get_backing_file() = 0;
+
+    /// @brief Write any metadata changes that are held in memory to the backing file.
+    ///
+    /// Formats that defer metadata updates, to batch them, override this. It is called by flush().
+    virtual void flush_metadata() { };
+
+    /// @brief Record that part of the disk which is a hole has been written with zeroes, without storing it.
+    ///
+    /// Formats that can note this in their metadata override it. The range reads as zeroes either way.
+    ///
+    /// @param start_posn The number of bytes into the virtual disk that the range begins.
+    ///
+    /// @param length The length of the range, in bytes.
+    virtual void mark_zeroed(uint64_t start_posn, uint64_t length) { };
+
+    /// @brief Allocate every block of a dynamic image that holds part of a range, so that writing the range later
+    /// needs no allocation. The range still reads the same.
+    ///
+    /// Formats that allocate blocks override this. The default only allocates storage in the backing file for the
+    /// parts of the range that are already stored in it. The range has already been checked against the length of
+    /// the disk.
+    ///
+    /// @param start_posn The number of bytes into the virtual disk that the range begins.
+    ///
+    /// @param length The length of the range, in bytes.
+    virtual void allocate_blocks(uint64_t start_posn, uint64_t length);
+
+    /// @brief How the blocks of a dynamic image are laid out in its backing file, so that compact() can move them.
+    ///
+    struct block_geometry
+    {
+      uint64_t block_count; ///< The number of blocks on the disk.
+      uint64_t block_size; ///< The number of bytes of the disk in each block.
+      uint64_t stored_block_bytes; ///< The space each stored block takes in the file, including per-block metadata.
+      uint64_t data_start; ///< The lowest offset in the file that blocks may be stored at.
+      bool zero_blocks_removable; ///< Whether a block containing only zeroes can be removed without changing the disk.
+    };
+
+    /// @brief Describe the layout of the blocks in the backing file.
+    ///
+    /// Formats whose blocks can be moved override this, and the other block functions below. Without them, compact()
+    /// only punches holes in the backing file where it contains zeroes.
+    ///
+    /// @param geometry Receives the layout.
+    ///
+    /// @return True if the blocks can be moved.
+    virtual bool get_block_geometry(block_geometry &geometry) { return false; };
+
+    /// @brief Find where a block is stored.
+    ///
+    /// @param block_number The number of the block.
+    ///
+    /// @return The offset in the backing file of the start of the block, or EXTENT_UNALLOCATED if it is not stored.
+    virtual uint64_t get_block_location(uint64_t block_number) { return EXTENT_UNALLOCATED; };
+
+    /// @brief Record that a block has been copied to a new place in the backing file, or removed.
+    ///
+    /// Only called by compact() while no other I/O is in progress. The change is written by flush_metadata().
+    ///
+    /// @param block_number The number of the block.
+    ///
+    /// @param file_offset The new offset of the block, or EXTENT_UNALLOCATED to remove it - it then reads as zeroes.
+    virtual void set_block_location(uint64_t block_number, uint64_t file_offset) { };
+
+    /// @brief Set aside space for one more block at the end of the backing file, as if allocating a block.
+    ///
+    /// @return The offset of the space in the backing file, or EXTENT_UNALLOCATED if the image has no room for it.
+    virtual uint64_t append_block_space() { throw std::fstream::failure("Blocks cannot be moved"); };
+
+    /// @brief Shorten the backing file, once no block is stored at or beyond a given offset.
+    ///
+    /// Only called by compact() while no other I/O is in progress, once the metadata is up to date on disk.
+    ///
+    /// @param data_end The offset that the next block appended to the file will be stored at.
+    virtual void truncate_block_space(uint64_t data_end) { };
+
+    /// @brief Part of an extent, along with the memory it is read into or written from.
+    ///
+    struct extent_buffer
+    {
+      disk_extent extent; ///< The part of the disk, and where it is stored.
+      uint8_t *buffer; ///< The memory holding the extent's data, which is contiguous.
+    };
+
+    static void append_extent(std::vector<disk_extent> &extents,
+                              uint64_t start_posn,
+                              uint64_t length,
+                              uint64_t file_offset,
+                              disk_file *file = nullptr);
+    static void split_extents(const io_segment *segments,
+                              uint32_t count,
+                              const std::vector<disk_extent> &extents,
+                              std::vector<extent_buffer> &pieces);
+    void read_extents(uint8_t *buffer, uint64_t start_posn, const std::vector<disk_extent> &extents, uint64_t max_gap);
+    void write_extents(const uint8_t *buffer, uint64_t start_posn, const std::vector<disk_extent> &extents);
+    void read_pieces(std::vector<extent_buffer> &pieces, uint64_t max_gap);
+    void write_pieces(std::vector<extent_buffer> &pieces);
+    void map_write(bool data_is_zero, uint64_t start_posn, uint64_t length, std::vector<disk_extent> &extents);
+
+    uint32_t begin_io();
+    void end_io(uint32_t counter);
+    bool begin_block_moves();
+    void end_block_moves();
+    bool io_in_progress();
+
+    compact_result punch_zero_ranges(const compact_config &config);
+    compact_result move_blocks(const compact_config &config, const block_geometry &geometry);
+
+    void read_range(uint8_t *buffer, uint64_t start_posn, uint64_t length);
+    void write_range(const uint8_t *buffer, uint64_t start_posn, uint64_t length);
+    void read_cached(uint8_t *buffer, uint64_t start_posn, uint64_t length);
+    void write_cached(const uint8_t *buffer, uint64_t start_posn, uint64_t length);
+    void load_range(uint8_t *buffer, uint64_t start_posn, uint64_t length);
+    void store_range(const uint8_t *buffer, uint64_t start_posn, uint64_t length);
+    void store_ranges(const disk_io_range *ranges, uint32_t count);
+    void read_uncached(uint8_t *buffer, uint64_t start_posn, uint64_t length);
+    void write_uncached(const uint8_t *buffer, uint64_t start_posn, uint64_t length);
+    void transfer_uncached(const disk_io_range *ranges, uint32_t count, bool is_write);
+    void sync_cache(uint64_t start_posn, uint64_t length, bool invalidate);
+    uint64_t seek_allocation(uint64_t start_posn, bool allocated);
+    void release_cache();
+
+    /// @brief Get the recorder to add statistics to.
+    ///
+    /// @return The recorder, or nullptr if statistics are not being gathered.
+    io_stats_recorder *stats() { return active_stats.load(std::memory_order_relaxed); }
+    void record_io(io_stats_recorder *recorder, bool is_write, uint64_t length, uint64_t start_ns);
+
+    /// The block cache attached to this disk, if any.
+    std::shared_ptr<block_cache> cache;
+
+    /// Reads ahead of sequential or strided streams of reads into the cache, if enabled.
+    std::shared_ptr<read_ahead> prefetcher;
+
+    /// Gathers small writes into larger ones, if enabled.
+    std::shared_ptr<write_combiner> combiner;
+
+    /// The largest gap in the backing file that read_uncached() will read through to join two extents, in bytes.
+    uint64_t max_read_gap{0};
+
+    /// @brief A count of I/O operations in progress, padded to fill a cache line.
+    ///
+    struct alignas(64) io_counter
+    {
+      std::atomic<uint64_t> count{0}; ///< The number of operations in progress that were counted here.
+    };
+
+    /// The number of entries in io_counters.
+    static const uint32_t IO_COUNTER_COUNT = 16;
+
+    /// Counts of I/O operations that have mapped part of the disk and not yet finished with the mapping. Each thread
+    /// uses one entry, so that threads rarely share a cache line.
+    io_counter io_counters[IO_COUNTER_COUNT];
+
+    /// Set while compact() is moving blocks. New I/O waits until it is clear.
+    std::atomic<bool> moving_blocks{false};
+
+    /// Protects changes to moving_blocks.
+    std::mutex move_lock;
+
+    /// Signalled when moving_blocks is cleared.
+    std::condition_variable move_done;
+
+    /// Ensures only one call to compact() runs at once.
+    std::mutex compact_lock;
+
+    /// Incremented whenever a new block is stored in space that compact() freed, rather than at the end of the file,
+    /// so compact() knows to look again at where the blocks are.
+    std::atomic<uint64_t> space_reused{0};
+
+    /// Gathers this disk's statistics, once enable_stats() has first been called. Never freed before the disk, so
+    /// that threads still recording into it are safe.
+    std::unique_ptr<io_stats_recorder> stats_recorder;
+
+    /// The recorder that statistics are currently added to - stats_recorder if statistics are enabled, otherwise
+    /// nullptr.
+    std::atomic<io_stats_recorder *> active_stats{nullptr};
+
+    /// Protects changes to stats_recorder.
+    std::mutex stats_lock;
   };
 }
 
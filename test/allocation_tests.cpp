@@ -0,0 +1,139 @@
+/// @file
+/// @brief Tests of the allocation map queries: get_allocation(), seek_data() and seek_hole().
+
+// Copyright Martin Hughes 2018.
+
+#include "test_helpers.h"
+#include "virtualdisk/virt_disk_cache.h"
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace test_helpers;
+
+namespace
+{
+  /// The size of the disks used by these tests.
+  const uint64_t DISK_SIZE = 8 * 1024 * 1024;
+
+  /// The block size of the images used by these tests.
+  const uint64_t BLOCK_SIZE = 64 * 1024;
+
+  /// @brief Write random data over whole blocks.
+  ///
+  /// @param disk The disk to write to.
+  ///
+  /// @param first_block The first block to write.
+  ///
+  /// @param block_count The number of blocks to write.
+  void write_blocks(virt_disk::virt_disk &disk, uint64_t first_block, uint64_t block_count)
+  {
+    mt19937_64 rng(first_block);
+    vector<uint8_t> data = random_bytes(rng, block_count * BLOCK_SIZE);
+    disk.write(data.data(), first_block * BLOCK_SIZE, data.size(), data.size());
+  }
+
+  /// @brief Compare a list of extents with the expected one.
+  ///
+  /// @param expected The expected extents.
+  ///
+  /// @param actual The extents returned by get_allocation().
+  void expect_extents(const vector<virt_disk::allocation_extent> &expected,
+                      const vector<virt_disk::allocation_extent> &actual)
+  {
+    ASSERT_EQ(expected.size(), actual.size());
+    for (size_t i = 0; i < expected.size(); i++)
+    {
+      EXPECT_EQ(expected[i].start_posn, actual[i].start_posn) << "extent " << i;
+      EXPECT_EQ(expected[i].length, actual[i].length) << "extent " << i;
+      EXPECT_EQ(expected[i].allocated, actual[i].allocated) << "extent " << i;
+    }
+  }
+};
+
+// A dynamic image reports the blocks that have been written as allocated, and the rest as holes.
+TEST(allocation, dynamic_vhd)
+{
+  scratch_dir scratch;
+  string filename = scratch.path("disk");
+  ASSERT_NO_FATAL_FAILURE(make_image(filename, image_type::VHD_DYNAMIC, DISK_SIZE, BLOCK_SIZE));
+  unique_ptr<virt_disk::virt_disk> disk = open_image(filename);
+
+  vector<virt_disk::allocation_extent> extents;
+  disk->get_allocation(0, DISK_SIZE, extents);
+  expect_extents({ { 0, DISK_SIZE, false } }, extents);
+  EXPECT_EQ(DISK_SIZE, disk->seek_data(0));
+  EXPECT_EQ(0U, disk->seek_hole(0));
+
+  write_blocks(*disk, 2, 2);
+  write_blocks(*disk, 7, 1);
+
+  extents.clear();
+  disk->get_allocation(0, DISK_SIZE, extents);
+  expect_extents({ { 0, 2 * BLOCK_SIZE, false },
+                   { 2 * BLOCK_SIZE, 2 * BLOCK_SIZE, true },
+                   { 4 * BLOCK_SIZE, 3 * BLOCK_SIZE, false },
+                   { 7 * BLOCK_SIZE, BLOCK_SIZE, true },
+                   { 8 * BLOCK_SIZE, DISK_SIZE - (8 * BLOCK_SIZE), false } },
+                 extents);
+
+  // Part of the disk, starting and ending part way through blocks. Extents are added to what is already there.
+  extents.clear();
+  extents.push_back({ 1, 2, true });
+  disk->get_allocation((2 * BLOCK_SIZE) + 512, 3 * BLOCK_SIZE, extents);
+  expect_extents({ { 1, 2, true },
+                   { (2 * BLOCK_SIZE) + 512, (2 * BLOCK_SIZE) - 512, true },
+                   { 4 * BLOCK_SIZE, BLOCK_SIZE + 512, false } },
+                 extents);
+
+  EXPECT_EQ(2 * BLOCK_SIZE, disk->seek_data(0));
+  EXPECT_EQ((2 * BLOCK_SIZE) + 100, disk->seek_data((2 * BLOCK_SIZE) + 100));
+  EXPECT_EQ(4 * BLOCK_SIZE, disk->seek_hole(2 * BLOCK_SIZE));
+  EXPECT_EQ(7 * BLOCK_SIZE, disk->seek_data(4 * BLOCK_SIZE));
+  EXPECT_EQ(8 * BLOCK_SIZE, disk->seek_hole(7 * BLOCK_SIZE));
+  EXPECT_EQ(DISK_SIZE, disk->seek_data(8 * BLOCK_SIZE));
+  EXPECT_EQ((8 * BLOCK_SIZE) + 5, disk->seek_hole((8 * BLOCK_SIZE) + 5));
+
+  // The same once reopened.
+  disk.reset();
+  disk = open_image(filename);
+  EXPECT_EQ(7 * BLOCK_SIZE, disk->seek_data(4 * BLOCK_SIZE));
+  EXPECT_EQ(8 * BLOCK_SIZE, disk->seek_hole(7 * BLOCK_SIZE));
+}
+
+// Every part of a fixed image is allocated, and no part of a VDI image with no blocks yet is.
+TEST(allocation, fixed_and_empty)
+{
+  scratch_dir scratch;
+  for (const image_kind &kind : ALL_IMAGE_KINDS)
+  {
+    string filename = scratch.path(kind.name);
+    ASSERT_NO_FATAL_FAILURE(make_image(filename, kind.type, DISK_SIZE, BLOCK_SIZE));
+    unique_ptr<virt_disk::virt_disk> disk = open_image(filename);
+    bool fixed = (kind.type == image_type::VDI_FIXED) || (kind.type == image_type::VHD_FIXED);
+
+    vector<virt_disk::allocation_extent> extents;
+    disk->get_allocation(0, DISK_SIZE, extents);
+    expect_extents({ { 0, DISK_SIZE, fixed } }, extents);
+    EXPECT_EQ(fixed ? BLOCK_SIZE : DISK_SIZE, disk->seek_data(BLOCK_SIZE)) << kind.name;
+    EXPECT_EQ(fixed ? DISK_SIZE : BLOCK_SIZE, disk->seek_hole(BLOCK_SIZE)) << kind.name;
+  }
+}
+
+// Data still held in a write-back cache is reported as allocated.
+TEST(allocation, write_back_cache)
+{
+  scratch_dir scratch;
+  string filename = scratch.path("disk");
+  ASSERT_NO_FATAL_FAILURE(make_image(filename, image_type::VHD_DYNAMIC, DISK_SIZE, BLOCK_SIZE));
+  unique_ptr<virt_disk::virt_disk> disk = open_image(filename);
+
+  virt_disk::cache_config config;
+  config.block_size = BLOCK_SIZE;
+  config.write_mode = virt_disk::cache_write_mode::WRITE_BACK;
+  disk->set_cache(make_shared<virt_disk::block_cache>(config));
+  write_blocks(*disk, 5, 1);
+
+  EXPECT_EQ(5 * BLOCK_SIZE, disk->seek_data(0));
+  EXPECT_EQ(6 * BLOCK_SIZE, disk->seek_hole(5 * BLOCK_SIZE));
+}
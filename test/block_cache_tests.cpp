@@ -0,0 +1,299 @@
+/// @file
+/// @brief Tests of block_cache, in both write modes and with both eviction policies.
+
+// Copyright Martin Hughes 2018.
+
+#include "test_helpers.h"
+#include "virtualdisk/virt_disk_cache.h"
+
+#include <gtest/gtest.h>
+
+#include <fstream>
+
+using namespace std;
+using namespace test_helpers;
+
+namespace
+{
+  /// The size of the disks used by these tests.
+  const uint64_t DISK_SIZE = 8 * 1024 * 1024;
+
+  /// The block size of the images, and of the caches, used by these tests.
+  const uint32_t BLOCK_SIZE = 64 * 1024;
+
+  /// @brief Read part of a file directly, without going through a virtual disk.
+  ///
+  /// @param filename The file to read.
+  ///
+  /// @param start_posn The offset into the file to begin reading.
+  ///
+  /// @param length The number of bytes to read.
+  ///
+  /// @return The bytes read.
+  vector<uint8_t> read_file(const string &filename, uint64_t start_posn, uint64_t length)
+  {
+    vector<uint8_t> contents(length, 0);
+    ifstream file(filename, ios::binary);
+    file.seekg(start_posn);
+    file.read(reinterpret_cast<char *>(contents.data()), length);
+    return contents;
+  }
+
+  /// @brief Make a cache configuration for a test.
+  ///
+  /// @param blocks The number of blocks the cache can hold.
+  ///
+  /// @param policy One of the cache_policy constants.
+  ///
+  /// @param write_mode One of the cache_write_mode constants.
+  ///
+  /// @return The configuration. It has one shard, so the cache holds exactly the number of blocks asked for.
+  virt_disk::cache_config small_cache(uint32_t blocks, uint32_t policy, uint32_t write_mode)
+  {
+    virt_disk::cache_config config;
+    config.capacity_bytes = static_cast<uint64_t>(blocks) * BLOCK_SIZE;
+    config.block_size = BLOCK_SIZE;
+    config.shard_count = 1;
+    config.policy = policy;
+    config.write_mode = write_mode;
+    return config;
+  }
+
+  /// @brief The parameters of a block_cache test.
+  ///
+  struct cache_kind
+  {
+    image_kind image; ///< The kind of image to cache.
+    uint32_t policy; ///< One of the cache_policy constants.
+    uint32_t write_mode; ///< One of the cache_write_mode constants.
+  };
+
+  class block_cache_test : public testing::TestWithParam<cache_kind>
+  {
+  protected:
+    scratch_dir scratch;
+  };
+
+  vector<cache_kind> all_cache_kinds()
+  {
+    vector<cache_kind> kinds;
+    for (const image_kind &image : VHD_IMAGE_KINDS)
+    {
+      for (uint32_t policy : { virt_disk::cache_policy::CLOCK, virt_disk::cache_policy::ARC })
+      {
+        kinds.push_back({ image, policy, virt_disk::cache_write_mode::WRITE_THROUGH });
+        kinds.push_back({ image, policy, virt_disk::cache_write_mode::WRITE_BACK });
+      }
+    }
+    return kinds;
+  }
+
+  string cache_kind_name(const testing::TestParamInfo<cache_kind> &info)
+  {
+    return string(info.param.image.name) +
+           ((info.param.policy == virt_disk::cache_policy::ARC) ? "_arc" : "_clock") +
+           ((info.param.write_mode == virt_disk::cache_write_mode::WRITE_BACK) ? "_write_back" : "_write_through");
+  }
+};
+
+INSTANTIATE_TEST_SUITE_P(all_modes, block_cache_test, testing::ValuesIn(all_cache_kinds()), cache_kind_name);
+
+// With a cache far smaller than the disk, so that blocks are evicted all the time, the disk still reads back what was
+// written - both through the cache and once reopened without it.
+TEST_P(block_cache_test, matches_model)
+{
+  string filename = scratch.path("disk");
+  ASSERT_NO_FATAL_FAILURE(make_image(filename, GetParam().image.type, DISK_SIZE, BLOCK_SIZE));
+  unique_ptr<virt_disk::virt_disk> disk = open_image(filename);
+  shared_ptr<virt_disk::block_cache> cache =
+    make_shared<virt_disk::block_cache>(small_cache(8, GetParam().policy, GetParam().write_mode));
+  disk->set_cache(cache);
+
+  vector<uint8_t> model(DISK_SIZE, 0);
+  mt19937_64 rng(40);
+  for (uint32_t round = 0; round < 4; round++)
+  {
+    write_random(*disk, model, rng, 100, 3 * BLOCK_SIZE);
+    ASSERT_EQ(model, read_disk(*disk));
+  }
+
+  virt_disk::cache_stats stats = cache->get_stats();
+  EXPECT_GT(stats.evictions, 0U);
+  EXPECT_LE(stats.blocks_cached, 8U);
+
+  disk->flush();
+  disk.reset();
+  disk = open_image(filename);
+  EXPECT_EQ(model, read_disk(*disk));
+}
+
+// A second read of the same data is served from the cache.
+TEST_P(block_cache_test, repeated_reads_hit)
+{
+  string filename = scratch.path("disk");
+  ASSERT_NO_FATAL_FAILURE(make_image(filename, GetParam().image.type, DISK_SIZE, BLOCK_SIZE));
+  unique_ptr<virt_disk::virt_disk> disk = open_image(filename);
+  vector<uint8_t> model(DISK_SIZE, 0);
+  mt19937_64 rng(41);
+  write_random(*disk, model, rng, 50, 2 * BLOCK_SIZE);
+
+  shared_ptr<virt_disk::block_cache> cache =
+    make_shared<virt_disk::block_cache>(small_cache(16, GetParam().policy, GetParam().write_mode));
+  disk->set_cache(cache);
+
+  vector<uint8_t> contents(4 * BLOCK_SIZE);
+  disk->read(contents.data(), BLOCK_SIZE, contents.size(), contents.size());
+  virt_disk::cache_stats stats = cache->get_stats();
+  EXPECT_EQ(0U, stats.hits);
+  EXPECT_EQ(4U, stats.misses);
+  EXPECT_EQ(4U, stats.blocks_cached);
+
+  cache->reset_stats();
+  disk->read(contents.data(), BLOCK_SIZE, contents.size(), contents.size());
+  stats = cache->get_stats();
+  EXPECT_EQ(4U, stats.hits);
+  EXPECT_EQ(0U, stats.misses);
+  EXPECT_TRUE(equal(contents.begin(), contents.end(), model.begin() + BLOCK_SIZE));
+}
+
+// One cache can be shared by several disks, and keeps their blocks apart.
+TEST_P(block_cache_test, shared_between_disks)
+{
+  shared_ptr<virt_disk::block_cache> cache =
+    make_shared<virt_disk::block_cache>(small_cache(32, GetParam().policy, GetParam().write_mode));
+  vector<unique_ptr<virt_disk::virt_disk>> disks;
+  vector<vector<uint8_t>> models;
+  mt19937_64 rng(42);
+
+  for (uint32_t i = 0; i < 3; i++)
+  {
+    string filename = scratch.path("disk" + to_string(i));
+    ASSERT_NO_FATAL_FAILURE(make_image(filename, GetParam().image.type, DISK_SIZE, BLOCK_SIZE));
+    disks.push_back(open_image(filename));
+    disks.back()->set_cache(cache);
+    models.push_back(vector<uint8_t>(DISK_SIZE, 0));
+  }
+
+  // The same positions on every disk, so that each has blocks with the same numbers in the cache.
+  for (uint32_t i = 0; i < disks.size(); i++)
+  {
+    vector<uint8_t> data = random_bytes(rng, 5 * BLOCK_SIZE);
+    disks[i]->write(data.data(), BLOCK_SIZE / 2, data.size(), data.size());
+    copy(data.begin(), data.end(), models[i].begin() + (BLOCK_SIZE / 2));
+  }
+  for (uint32_t i = 0; i < disks.size(); i++)
+  {
+    EXPECT_EQ(models[i], read_disk(*disks[i])) << "disk " << i;
+  }
+
+  // Removing one disk's blocks leaves the others' alone.
+  disks[1].reset();
+  EXPECT_EQ(models[0], read_disk(*disks[0]));
+  EXPECT_EQ(models[2], read_disk(*disks[2]));
+}
+
+// Write-back holds written data in the cache until it is flushed, where write-through sends it to the image at once.
+TEST(block_cache, write_back_waits_for_flush)
+{
+  scratch_dir scratch;
+  string filename = scratch.path("disk");
+  ASSERT_NO_FATAL_FAILURE(make_image(filename, image_type::VHD_FIXED, DISK_SIZE, BLOCK_SIZE));
+  unique_ptr<virt_disk::virt_disk> disk = open_image(filename);
+  shared_ptr<virt_disk::block_cache> cache = make_shared<virt_disk::block_cache>(
+    small_cache(16, virt_disk::cache_policy::CLOCK, virt_disk::cache_write_mode::WRITE_BACK));
+  disk->set_cache(cache);
+
+  // A fixed VHD stores the disk at the start of the file, so the file shows what has reached the image.
+  mt19937_64 rng(43);
+  vector<uint8_t> data = random_bytes(rng, 3 * BLOCK_SIZE);
+  disk->write(data.data(), BLOCK_SIZE, data.size(), data.size());
+  EXPECT_EQ(vector<uint8_t>(data.size(), 0), read_file(filename, BLOCK_SIZE, data.size()));
+  EXPECT_EQ(0U, cache->get_stats().write_backs);
+
+  vector<uint8_t> contents(data.size());
+  disk->read(contents.data(), BLOCK_SIZE, contents.size(), contents.size());
+  EXPECT_EQ(data, contents);
+
+  disk->flush();
+  EXPECT_EQ(data, read_file(filename, BLOCK_SIZE, data.size()));
+  EXPECT_EQ(3U, cache->get_stats().write_backs);
+
+  // Write-through, on the other hand.
+  cache = make_shared<virt_disk::block_cache>(
+    small_cache(16, virt_disk::cache_policy::CLOCK, virt_disk::cache_write_mode::WRITE_THROUGH));
+  disk->set_cache(cache);
+  data = random_bytes(rng, 2 * BLOCK_SIZE);
+  disk->write(data.data(), 6 * BLOCK_SIZE, data.size(), data.size());
+  EXPECT_EQ(data, read_file(filename, 6 * BLOCK_SIZE, data.size()));
+}
+
+// Evicting a dirty block writes it to the image first.
+TEST(block_cache, eviction_writes_back)
+{
+  scratch_dir scratch;
+  string filename = scratch.path("disk");
+  ASSERT_NO_FATAL_FAILURE(make_image(filename, image_type::VHD_FIXED, DISK_SIZE, BLOCK_SIZE));
+  unique_ptr<virt_disk::virt_disk> disk = open_image(filename);
+  shared_ptr<virt_disk::block_cache> cache = make_shared<virt_disk::block_cache>(
+    small_cache(4, virt_disk::cache_policy::CLOCK, virt_disk::cache_write_mode::WRITE_BACK));
+  disk->set_cache(cache);
+
+  mt19937_64 rng(44);
+  vector<uint8_t> data = random_bytes(rng, 12 * BLOCK_SIZE);
+  for (uint64_t block = 0; block < 12; block++)
+  {
+    disk->write(data.data() + (block * BLOCK_SIZE), block * BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE);
+  }
+
+  // At most four blocks can still be waiting in the cache; the rest must have been written back.
+  virt_disk::cache_stats stats = cache->get_stats();
+  EXPECT_LE(stats.blocks_cached, 4U);
+  EXPECT_GE(stats.write_backs, 8U);
+  vector<uint8_t> on_disk = read_file(filename, 0, data.size());
+  uint64_t blocks_on_disk = 0;
+  for (uint64_t block = 0; block < 12; block++)
+  {
+    blocks_on_disk += equal(data.begin() + (block * BLOCK_SIZE),
+                            data.begin() + ((block + 1) * BLOCK_SIZE),
+                            on_disk.begin() + (block * BLOCK_SIZE)) ? 1 : 0;
+  }
+  EXPECT_GE(blocks_on_disk, 8U);
+
+  disk->flush();
+  EXPECT_EQ(data, read_file(filename, 0, data.size()));
+}
+
+// Once blocks have been used more than once, ARC keeps them through a long scan of blocks that are used only once.
+TEST(block_cache, arc_resists_scans)
+{
+  scratch_dir scratch;
+  string filename = scratch.path("disk");
+  ASSERT_NO_FATAL_FAILURE(make_image(filename, image_type::VHD_FIXED, DISK_SIZE, BLOCK_SIZE));
+  unique_ptr<virt_disk::virt_disk> disk = open_image(filename);
+  shared_ptr<virt_disk::block_cache> cache = make_shared<virt_disk::block_cache>(
+    small_cache(8, virt_disk::cache_policy::ARC, virt_disk::cache_write_mode::WRITE_THROUGH));
+  disk->set_cache(cache);
+
+  const uint64_t hot_blocks = 4;
+  vector<uint8_t> buffer(BLOCK_SIZE);
+  for (uint32_t pass = 0; pass < 2; pass++)
+  {
+    for (uint64_t block = 0; block < hot_blocks; block++)
+    {
+      disk->read(buffer.data(), block * BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE);
+    }
+  }
+  for (uint64_t block = hot_blocks; block < (DISK_SIZE / BLOCK_SIZE); block++)
+  {
+    disk->read(buffer.data(), block * BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE);
+  }
+
+  cache->reset_stats();
+  for (uint64_t block = 0; block < hot_blocks; block++)
+  {
+    disk->read(buffer.data(), block * BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE);
+  }
+  virt_disk::cache_stats stats = cache->get_stats();
+  EXPECT_EQ(hot_blocks, stats.hits);
+  EXPECT_EQ(0U, stats.misses);
+}
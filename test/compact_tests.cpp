@@ -0,0 +1,245 @@
+/// @file
+/// @brief Tests that compacting an image never changes the disk's contents.
+
+// Copyright Martin Hughes 2018.
+
+#include "test_helpers.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <string.h>
+
+using namespace std;
+using namespace test_helpers;
+
+namespace
+{
+  /// The size of the disks used by these tests.
+  const uint64_t DISK_SIZE = 8 * 1024 * 1024;
+
+  /// The block size of the dynamic images used by these tests.
+  const uint32_t BLOCK_SIZE = 64 * 1024;
+
+  /// The number of blocks on the disks used by these tests.
+  const uint64_t BLOCK_COUNT = DISK_SIZE / BLOCK_SIZE;
+
+  /// @brief Build a new image for a test, and open it.
+  ///
+  /// @param filename The file to create.
+  ///
+  /// @param type One of the image_type constants.
+  ///
+  /// @return The open disk.
+  unique_ptr<virt_disk::virt_disk> new_disk(const string &filename, uint32_t type)
+  {
+    make_image(filename, type, DISK_SIZE, BLOCK_SIZE);
+    return open_image(filename);
+  }
+
+  class compact_test : public testing::TestWithParam<image_kind>
+  {
+  protected:
+    scratch_dir scratch;
+  };
+
+  class compact_dynamic_test : public compact_test
+  {
+  };
+};
+
+INSTANTIATE_TEST_SUITE_P(all_formats, compact_test, testing::ValuesIn(ALL_IMAGE_KINDS), image_kind_name);
+INSTANTIATE_TEST_SUITE_P(dynamic_formats,
+                         compact_dynamic_test,
+                         testing::ValuesIn(DYNAMIC_IMAGE_KINDS),
+                         image_kind_name);
+
+// Compacting, with and without reordering, keeps the contents of the disk - both while it is open and once reopened.
+TEST_P(compact_test, matches_model)
+{
+  string filename = scratch.path("disk");
+  vector<uint8_t> model(DISK_SIZE, 0);
+  mt19937_64 rng(10);
+
+  unique_ptr<virt_disk::virt_disk> disk = new_disk(filename, GetParam().type);
+  write_random(*disk, model, rng, 300, 2 * BLOCK_SIZE);
+  for (uint64_t block = 0; block < BLOCK_COUNT; block += 3)
+  {
+    zero_range(*disk, model, block * BLOCK_SIZE, BLOCK_SIZE);
+  }
+
+  virt_disk::compact_config config;
+  config.blocks_per_step = 4;
+  disk->compact(config);
+  ASSERT_EQ(model, read_disk(*disk));
+
+  // Write some more, so there are blocks out of order again, then compact putting them in order.
+  write_random(*disk, model, rng, 100, BLOCK_SIZE);
+  config.reorder_blocks = true;
+  disk->compact(config);
+  ASSERT_EQ(model, read_disk(*disk));
+  disk.reset();
+
+  disk = open_image(filename);
+  EXPECT_EQ(model, read_disk(*disk));
+}
+
+// Compacting while a view is held does not shorten the file under it, so the view can still be read. The space is
+// given back by a later compaction.
+TEST_P(compact_dynamic_test, view_then_compact)
+{
+  string filename = scratch.path("disk");
+  vector<uint8_t> model(DISK_SIZE, 0);
+  mt19937_64 rng(11);
+
+  // Block 1 is written last, so is stored at the end of the file.
+  unique_ptr<virt_disk::virt_disk> disk = new_disk(filename, GetParam().type);
+  vector<uint8_t> block_data(BLOCK_SIZE, 1);
+  for (uint64_t block = 2; block < 10; block++)
+  {
+    disk->write(block_data.data(), block * BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE);
+  }
+  for (uint8_t &byte : block_data)
+  {
+    byte = static_cast<uint8_t>(rng());
+  }
+  disk->write(block_data.data(), BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE);
+  memcpy(model.data() + BLOCK_SIZE, block_data.data(), BLOCK_SIZE);
+  disk->flush();
+
+  // Once the blocks before it only hold zeroes, compaction removes them and moves block 1 down.
+  virt_disk::disk_view view = disk->map_view(BLOCK_SIZE, BLOCK_SIZE);
+  ASSERT_EQ(BLOCK_SIZE, view.size());
+  for (uint64_t block = 2; block < 10; block++)
+  {
+    zero_range(*disk, model, block * BLOCK_SIZE, BLOCK_SIZE);
+  }
+
+  uint64_t length = file_length(filename);
+  virt_disk::compact_result result = disk->compact();
+  EXPECT_EQ(length, file_length(filename));
+  EXPECT_EQ(0U, result.bytes_released);
+  EXPECT_EQ(0, memcmp(view.data(), block_data.data(), BLOCK_SIZE));
+  ASSERT_EQ(model, read_disk(*disk));
+
+  view = virt_disk::disk_view();
+  result = disk->compact();
+  EXPECT_LT(file_length(filename), length);
+  EXPECT_EQ(length - file_length(filename), result.bytes_released);
+  ASSERT_EQ(model, read_disk(*disk));
+  disk.reset();
+
+  disk = open_image(filename);
+  EXPECT_EQ(model, read_disk(*disk));
+}
+
+// Blocks written out of order, some of which are later zeroed, are removed and put in order. The file shrinks by
+// exactly the amount reported, and the disk reads the same once reopened.
+TEST_P(compact_dynamic_test, zeroed_and_out_of_order_blocks)
+{
+  string filename = scratch.path("disk");
+  vector<uint8_t> model(DISK_SIZE, 0);
+  mt19937_64 rng(12);
+
+  vector<uint64_t> order(BLOCK_COUNT);
+  for (uint64_t block = 0; block < BLOCK_COUNT; block++)
+  {
+    order[block] = block;
+  }
+  shuffle(order.begin(), order.end(), rng);
+
+  unique_ptr<virt_disk::virt_disk> disk = new_disk(filename, GetParam().type);
+  vector<uint8_t> block_data(BLOCK_SIZE);
+  for (uint64_t block : order)
+  {
+    for (uint8_t &byte : block_data)
+    {
+      byte = static_cast<uint8_t>(rng());
+    }
+    disk->write(block_data.data(), block * BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE);
+    memcpy(model.data() + (block * BLOCK_SIZE), block_data.data(), BLOCK_SIZE);
+  }
+
+  uint64_t zeroed_blocks = 0;
+  for (uint64_t block = 0; block < BLOCK_COUNT; block += 4)
+  {
+    zero_range(*disk, model, block * BLOCK_SIZE, BLOCK_SIZE);
+    zeroed_blocks++;
+  }
+  disk->flush();
+
+  uint64_t length = file_length(filename);
+  virt_disk::compact_config config;
+  config.reorder_blocks = true;
+  config.blocks_per_step = 5;
+  virt_disk::compact_result result = disk->compact(config);
+  EXPECT_EQ(zeroed_blocks, result.blocks_removed);
+  EXPECT_GT(result.blocks_moved, 0U);
+  EXPECT_LT(file_length(filename), length);
+  EXPECT_EQ(length - file_length(filename), result.bytes_released);
+  ASSERT_EQ(model, read_disk(*disk));
+
+  // The blocks are now in order, so there is nothing left to do.
+  length = file_length(filename);
+  result = disk->compact(config);
+  EXPECT_EQ(0U, result.blocks_removed);
+  EXPECT_EQ(0U, result.blocks_moved);
+  EXPECT_EQ(0U, result.bytes_released);
+  EXPECT_EQ(length, file_length(filename));
+  disk.reset();
+
+  EXPECT_EQ(length, file_length(filename));
+  disk = open_image(filename);
+  EXPECT_EQ(model, read_disk(*disk));
+}
+
+// Blocks moved by compaction are flushed before the tables pointing at them are written, and the tables are flushed
+// before the space the blocks moved from is reused - so a crash at any point leaves an image that reads correctly.
+TEST_P(compact_dynamic_test, flushes_between_steps)
+{
+  string filename = scratch.path("disk");
+  vector<uint8_t> model(DISK_SIZE, 0);
+  mt19937_64 rng(13);
+
+  ASSERT_NO_FATAL_FAILURE(make_image(filename, GetParam().type, DISK_SIZE, BLOCK_SIZE));
+  const uint64_t tables_end = file_length(filename) - ((GetParam().type == image_type::VHD_DYNAMIC) ? 512 : 0);
+  recording_file *file;
+  unique_ptr<virt_disk::virt_disk> disk = open_recorded(filename, GetParam().type, file);
+  write_random(*disk, model, rng, 300, 2 * BLOCK_SIZE);
+  for (uint64_t block = 0; block < BLOCK_COUNT; block += 3)
+  {
+    zero_range(*disk, model, block * BLOCK_SIZE, BLOCK_SIZE);
+  }
+  disk->flush();
+  file->take_events();
+
+  virt_disk::compact_config config;
+  config.reorder_blocks = true;
+  config.blocks_per_step = 3;
+  virt_disk::compact_result result = disk->compact(config);
+  ASSERT_GT(result.blocks_moved, 0U);
+  vector<recording_file::event> events = file->take_events();
+  EXPECT_EQ(events.size(), find_unflushed(events, tables_end, BLOCK_SIZE));
+
+  bool tables_unflushed = false;
+  for (size_t i = 0; i < events.size(); i++)
+  {
+    if (events[i].flush)
+    {
+      tables_unflushed = false;
+    }
+    else if (events[i].offset < tables_end)
+    {
+      tables_unflushed = true;
+    }
+    else if (events[i].length >= BLOCK_SIZE)
+    {
+      ASSERT_FALSE(tables_unflushed) << "event " << i;
+    }
+  }
+
+  ASSERT_EQ(model, read_disk(*disk));
+  disk.reset();
+  disk = open_image(filename);
+  EXPECT_EQ(model, read_disk(*disk));
+}
@@ -0,0 +1,88 @@
+/// @file
+/// @brief Tests that converting an image to another format keeps the disk's contents.
+
+// Copyright Martin Hughes 2018.
+
+#include "test_helpers.h"
+#include "virtualdisk/virt_disk_convert.h"
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace test_helpers;
+
+namespace
+{
+  /// The size of the disks used by these tests. Not a whole number of batches or blocks.
+  const uint64_t DISK_SIZE = (6 * 1024 * 1024) + 512;
+
+  /// The block size of the dynamic images used by these tests.
+  const uint32_t BLOCK_SIZE = 64 * 1024;
+
+  // The test images are named by their image_type, which numbers them the same way as image_format.
+  static_assert((image_type::VDI_NORMAL == virt_disk::image_format::VDI_NORMAL) &&
+                (image_type::VDI_FIXED == virt_disk::image_format::VDI_FIXED) &&
+                (image_type::VHD_FIXED == virt_disk::image_format::VHD_FIXED) &&
+                (image_type::VHD_DYNAMIC == virt_disk::image_format::VHD_DYNAMIC),
+                "image_type and image_format differ");
+
+  class convert_test : public testing::TestWithParam<tuple<image_kind, image_kind>>
+  {
+  protected:
+    scratch_dir scratch;
+  };
+
+  string conversion_name(const testing::TestParamInfo<tuple<image_kind, image_kind>> &info)
+  {
+    return string(get<0>(info.param).name) + "_to_" + get<1>(info.param).name;
+  }
+};
+
+INSTANTIATE_TEST_SUITE_P(all_formats,
+                         convert_test,
+                         testing::Combine(testing::ValuesIn(ALL_IMAGE_KINDS), testing::ValuesIn(ALL_IMAGE_KINDS)),
+                         conversion_name);
+
+// The new image holds the same disk as the old one, and the old one is not changed.
+TEST_P(convert_test, matches_model)
+{
+  string source_filename = scratch.path("source");
+  string target_filename = scratch.path("target");
+  vector<uint8_t> model(DISK_SIZE, 0);
+  mt19937_64 rng(20);
+
+  ASSERT_NO_FATAL_FAILURE(make_image(source_filename, get<0>(GetParam()).type, DISK_SIZE, BLOCK_SIZE));
+  unique_ptr<virt_disk::virt_disk> source = open_image(source_filename);
+  write_random(*source, model, rng, 100, 3 * BLOCK_SIZE);
+  zero_range(*source, model, 0, 2 * BLOCK_SIZE);
+
+  // Small batches, so that the conversion is done in many pieces by several threads.
+  virt_disk::convert_config convert;
+  convert.format = get<1>(GetParam()).type;
+  convert.block_size = BLOCK_SIZE;
+  convert.batch_bytes = 3 * BLOCK_SIZE;
+  convert.reader_threads = 3;
+  convert.batches_in_flight = 4;
+  virt_disk::convert_image(*source, target_filename, convert);
+
+  unique_ptr<virt_disk::virt_disk> target = open_image(target_filename);
+  ASSERT_EQ(DISK_SIZE, target->get_length());
+  EXPECT_EQ(model, read_disk(*target));
+  EXPECT_EQ(model, read_disk(*source));
+}
+
+// Converting refuses to overwrite an existing file.
+TEST(convert, existing_target)
+{
+  scratch_dir scratch;
+  string source_filename = scratch.path("source");
+  string target_filename = scratch.path("target");
+
+  ASSERT_NO_FATAL_FAILURE(make_image(source_filename, image_type::VHD_DYNAMIC, DISK_SIZE, BLOCK_SIZE));
+  ASSERT_NO_FATAL_FAILURE(make_image(target_filename, image_type::VHD_DYNAMIC, DISK_SIZE, BLOCK_SIZE));
+  unique_ptr<virt_disk::virt_disk> source = open_image(source_filename);
+  uint64_t length = file_length(target_filename);
+
+  EXPECT_THROW(virt_disk::convert_image(*source, target_filename), std::fstream::failure);
+  EXPECT_EQ(length, file_length(target_filename));
+}
@@ -0,0 +1,274 @@
+/// @file
+/// @brief Tests of cow_disk, the copy-on-write clone of another disk.
+
+// Copyright Martin Hughes 2018.
+
+#include "test_helpers.h"
+#include "virtualdisk/virt_disk_cow.h"
+
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string.h>
+#include <thread>
+
+#ifndef _WIN32
+#include <csignal>
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+using namespace test_helpers;
+
+namespace
+{
+  /// The size of the disks used by these tests. Not a whole number of blocks, so the last block is partly used.
+  const uint64_t DISK_SIZE = (8 * 1024 * 1024) + (3 * 512);
+
+  /// The block size of the dynamic images used by these tests.
+  const uint32_t BLOCK_SIZE = 64 * 1024;
+
+  /// The block size of the clones used by these tests - smaller than the images' blocks, so they do not line up.
+  const uint32_t COW_BLOCK_SIZE = 16 * 1024;
+
+  class cow_test : public testing::TestWithParam<image_kind>
+  {
+  protected:
+    /// @brief Build an image for the base disk and fill it with random data, then open it read-only.
+    ///
+    void SetUp() override
+    {
+      base_filename = scratch.path("base");
+      ASSERT_NO_FATAL_FAILURE(make_image(base_filename, GetParam().type, DISK_SIZE, BLOCK_SIZE));
+      unique_ptr<virt_disk::virt_disk> disk = open_image(base_filename);
+      base_model = vector<uint8_t>(DISK_SIZE, 0);
+      write_random(*disk, base_model, rng, 100, 2 * BLOCK_SIZE);
+      disk.reset();
+
+      virt_disk::open_config config;
+      config.read_only = true;
+      base = shared_ptr<virt_disk::virt_disk>(virt_disk::virt_disk::create_virtual_disk(base_filename, config));
+    }
+
+    scratch_dir scratch;
+    string base_filename;
+    shared_ptr<virt_disk::virt_disk> base;
+    vector<uint8_t> base_model;
+    mt19937_64 rng{110};
+  };
+};
+
+INSTANTIATE_TEST_SUITE_P(all_formats, cow_test, testing::ValuesIn(ALL_IMAGE_KINDS), image_kind_name);
+
+// A clone reads as its base until written, and writes to it never reach the base - whether the overlay is kept in
+// memory or in a file.
+TEST_P(cow_test, clone_matches_model)
+{
+  for (bool in_file : { false, true })
+  {
+    virt_disk::cow_config config;
+    config.block_size = COW_BLOCK_SIZE;
+    if (in_file)
+    {
+      config.overlay_file = scratch.path("overlay");
+    }
+
+    virt_disk::cow_disk clone(base, config);
+    ASSERT_EQ(DISK_SIZE, clone.get_length());
+    vector<uint8_t> model = base_model;
+    ASSERT_EQ(model, read_disk(clone));
+
+    write_random(clone, model, rng, 200, 3 * COW_BLOCK_SIZE);
+    zero_range(clone, model, 5 * COW_BLOCK_SIZE, 2 * COW_BLOCK_SIZE);
+    vector<uint8_t> last_block = random_bytes(rng, DISK_SIZE % COW_BLOCK_SIZE);
+    clone.write(last_block.data(), DISK_SIZE - last_block.size(), last_block.size(), last_block.size());
+    memcpy(model.data() + (DISK_SIZE - last_block.size()), last_block.data(), last_block.size());
+
+    ASSERT_EQ(model, read_disk(clone));
+    EXPECT_EQ(base_model, read_disk(*base));
+  }
+
+  // Nothing is left behind once the clones are gone.
+  EXPECT_FALSE(filesystem::exists(scratch.path("overlay")));
+  base.reset();
+  unique_ptr<virt_disk::virt_disk> disk = open_image(base_filename);
+  EXPECT_EQ(base_model, read_disk(*disk));
+}
+
+// Clones of the same base are independent of each other.
+TEST_P(cow_test, clones_share_base)
+{
+  virt_disk::cow_config config;
+  config.block_size = COW_BLOCK_SIZE;
+  vector<unique_ptr<virt_disk::cow_disk>> clones;
+  vector<vector<uint8_t>> models;
+  for (uint32_t i = 0; i < 3; i++)
+  {
+    clones.push_back(unique_ptr<virt_disk::cow_disk>(new virt_disk::cow_disk(base, config)));
+    models.push_back(base_model);
+  }
+
+  // Each clone writes the same ranges, with different data.
+  for (uint32_t i = 0; i < 50; i++)
+  {
+    uint64_t length = 1 + (rng() % (2 * COW_BLOCK_SIZE));
+    uint64_t start_posn = rng() % (DISK_SIZE - length + 1);
+    for (uint32_t c = 0; c < clones.size(); c++)
+    {
+      vector<uint8_t> data = random_bytes(rng, length);
+      clones[c]->write(data.data(), start_posn, length, length);
+      memcpy(models[c].data() + start_posn, data.data(), length);
+    }
+  }
+
+  for (uint32_t c = 0; c < clones.size(); c++)
+  {
+    EXPECT_EQ(models[c], read_disk(*clones[c])) << "clone " << c;
+  }
+  EXPECT_EQ(base_model, read_disk(*base));
+}
+
+// Threads writing to different parts of a clone at once all see their own data, and the rest still reads as the base.
+TEST_P(cow_test, concurrent_writers)
+{
+  const uint32_t thread_count = 4;
+  const uint64_t region = DISK_SIZE / thread_count;
+  virt_disk::cow_config config;
+  config.block_size = COW_BLOCK_SIZE;
+  virt_disk::cow_disk clone(base, config);
+  vector<uint8_t> model = base_model;
+
+  vector<thread> threads;
+  for (uint32_t t = 0; t < thread_count; t++)
+  {
+    threads.emplace_back([&, t]()
+                         {
+                           mt19937_64 thread_rng(120 + t);
+                           for (uint32_t i = 0; i < 100; i++)
+                           {
+                             uint64_t length = 1 + (thread_rng() % (2 * COW_BLOCK_SIZE));
+                             uint64_t start_posn = (t * region) + (thread_rng() % (region - length));
+                             vector<uint8_t> data = random_bytes(thread_rng, length);
+                             clone.write(data.data(), start_posn, length, length);
+                             memcpy(model.data() + start_posn, data.data(), length);
+                           }
+                         });
+  }
+  for (thread &worker : threads)
+  {
+    worker.join();
+  }
+
+  EXPECT_EQ(model, read_disk(clone));
+  EXPECT_EQ(base_model, read_disk(*base));
+}
+
+// A base opened read-only refuses writes, and its image is left exactly as it was while clones of it are written.
+TEST_P(cow_test, read_only_base)
+{
+  ifstream before_stream(base_filename, ios::binary);
+  vector<char> before((istreambuf_iterator<char>(before_stream)), istreambuf_iterator<char>());
+  before_stream.close();
+
+  {
+    virt_disk::cow_config config;
+    config.block_size = COW_BLOCK_SIZE;
+    virt_disk::cow_disk clone(base, config);
+    vector<uint8_t> model = base_model;
+    write_random(clone, model, rng, 100, 3 * COW_BLOCK_SIZE);
+    clone.flush();
+    EXPECT_EQ(model, read_disk(clone));
+  }
+
+  vector<uint8_t> data = random_bytes(rng, 512);
+  EXPECT_THROW(base->write(data.data(), 0, data.size(), data.size()), std::fstream::failure);
+  base.reset();
+
+  ifstream after_stream(base_filename, ios::binary);
+  vector<char> after((istreambuf_iterator<char>(after_stream)), istreambuf_iterator<char>());
+  EXPECT_EQ(before, after);
+}
+
+#ifndef _WIN32
+// Writes of whole blocks that fail because the overlay file cannot grow leave those blocks reading as the base, and
+// writing them again succeeds once it can.
+TEST_P(cow_test, failed_write_keeps_base)
+{
+  const uint64_t block_count = 8;
+  virt_disk::cow_config config;
+  config.block_size = COW_BLOCK_SIZE;
+  config.overlay_file = scratch.path("overlay");
+  virt_disk::cow_disk clone(base, config);
+  vector<uint8_t> model = base_model;
+  vector<vector<uint8_t>> new_data;
+  for (uint64_t block = 0; block < block_count; block++)
+  {
+    new_data.push_back(random_bytes(rng, COW_BLOCK_SIZE));
+  }
+
+  // Writes beyond the first half of the blocks fail, rather than raising a signal.
+  struct rlimit old_limit;
+  ASSERT_EQ(0, getrlimit(RLIMIT_FSIZE, &old_limit));
+  struct rlimit limit = old_limit;
+  limit.rlim_cur = (block_count / 2) * COW_BLOCK_SIZE;
+  void (*old_handler)(int) = signal(SIGXFSZ, SIG_IGN);
+  ASSERT_EQ(0, setrlimit(RLIMIT_FSIZE, &limit));
+
+  vector<bool> written(block_count, false);
+  for (uint64_t block = 0; block < block_count; block++)
+  {
+    try
+    {
+      clone.write(new_data[block].data(), block * COW_BLOCK_SIZE, COW_BLOCK_SIZE, COW_BLOCK_SIZE);
+      written[block] = true;
+    }
+    catch (exception &)
+    {
+    }
+  }
+
+  setrlimit(RLIMIT_FSIZE, &old_limit);
+  signal(SIGXFSZ, old_handler);
+  ASSERT_TRUE(written[0]);
+  ASSERT_FALSE(written[block_count - 1]);
+
+  for (uint64_t block = 0; block < block_count; block++)
+  {
+    if (written[block])
+    {
+      memcpy(model.data() + (block * COW_BLOCK_SIZE), new_data[block].data(), COW_BLOCK_SIZE);
+    }
+  }
+  ASSERT_EQ(model, read_disk(clone));
+
+  for (uint64_t block = 0; block < block_count; block++)
+  {
+    clone.write(new_data[block].data(), block * COW_BLOCK_SIZE, COW_BLOCK_SIZE, COW_BLOCK_SIZE);
+    memcpy(model.data() + (block * COW_BLOCK_SIZE), new_data[block].data(), COW_BLOCK_SIZE);
+  }
+  EXPECT_EQ(model, read_disk(clone));
+  EXPECT_EQ(base_model, read_disk(*base));
+}
+#endif
+
+// Bad settings are refused.
+TEST(cow_disk, bad_config)
+{
+  scratch_dir scratch;
+  string filename = scratch.path("base");
+  ASSERT_NO_FATAL_FAILURE(make_image(filename, image_type::VHD_DYNAMIC, DISK_SIZE, BLOCK_SIZE));
+  shared_ptr<virt_disk::virt_disk> base(open_image(filename));
+
+  virt_disk::cow_config config;
+  EXPECT_ANY_THROW(virt_disk::cow_disk(nullptr, config));
+  config.block_size = 1000;
+  EXPECT_ANY_THROW(virt_disk::cow_disk(base, config));
+
+  // The overlay file must not already exist, and is left alone if it does.
+  config.block_size = COW_BLOCK_SIZE;
+  config.overlay_file = filename;
+  EXPECT_ANY_THROW(virt_disk::cow_disk(base, config));
+  EXPECT_TRUE(filesystem::exists(filename));
+}
@@ -0,0 +1,158 @@
+/// @file
+/// @brief Tests of creating new images with virt_disk::create_image().
+
+// Copyright Martin Hughes 2018.
+
+#include "test_helpers.h"
+
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <fstream>
+
+#ifndef _WIN32
+#include <csignal>
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+using namespace test_helpers;
+
+namespace
+{
+  /// The size of the disks used by these tests. Not a whole number of blocks, so the last block is partly used.
+  const uint64_t DISK_SIZE = (8 * 1024 * 1024) + (5 * 512);
+
+  /// The block size of the dynamic images used by these tests.
+  const uint32_t BLOCK_SIZE = 64 * 1024;
+
+  /// @brief Make the settings to create an image with.
+  ///
+  /// @param format One of the image_format constants.
+  ///
+  /// @return The settings.
+  virt_disk::create_config config_for(uint32_t format)
+  {
+    virt_disk::create_config config;
+    config.format = format;
+    config.block_size = BLOCK_SIZE;
+    return config;
+  }
+
+  class create_test : public testing::TestWithParam<image_kind>
+  {
+  protected:
+    scratch_dir scratch;
+  };
+};
+
+INSTANTIATE_TEST_SUITE_P(all_formats, create_test, testing::ValuesIn(ALL_IMAGE_KINDS), image_kind_name);
+
+// A new image reads as zeroes, keeps what is written to it, and is recognised when opened again.
+TEST_P(create_test, round_trip)
+{
+  string filename = scratch.path("disk");
+  vector<uint8_t> model(DISK_SIZE, 0);
+  mt19937_64 rng(130);
+
+  unique_ptr<virt_disk::virt_disk> disk(
+    virt_disk::virt_disk::create_image(filename, DISK_SIZE, config_for(GetParam().type)));
+  ASSERT_EQ(DISK_SIZE, disk->get_length());
+  ASSERT_EQ(model, read_disk(*disk));
+
+  write_random(*disk, model, rng, 100, 3 * BLOCK_SIZE);
+  disk.reset();
+
+  disk = open_image(filename);
+  ASSERT_EQ(DISK_SIZE, disk->get_length());
+  EXPECT_EQ(model, read_disk(*disk));
+}
+
+// With allocate_space set, every part of the new disk is allocated.
+TEST_P(create_test, allocate_space)
+{
+  string filename = scratch.path("disk");
+  virt_disk::create_config config = config_for(GetParam().type);
+  config.allocate_space = true;
+
+  unique_ptr<virt_disk::virt_disk> disk(virt_disk::virt_disk::create_image(filename, DISK_SIZE, config));
+  EXPECT_EQ(DISK_SIZE, disk->seek_hole(0));
+  EXPECT_EQ(vector<uint8_t>(DISK_SIZE, 0), read_disk(*disk));
+  disk.reset();
+
+  disk = open_image(filename);
+  EXPECT_EQ(DISK_SIZE, disk->seek_hole(0));
+}
+
+// An existing file is never overwritten.
+TEST_P(create_test, existing_file_kept)
+{
+  string filename = scratch.path("disk");
+  ofstream(filename) << "keep";
+
+  EXPECT_ANY_THROW(delete virt_disk::virt_disk::create_image(filename, DISK_SIZE, config_for(GetParam().type)));
+  ASSERT_TRUE(filesystem::exists(filename));
+  EXPECT_EQ(4U, file_length(filename));
+}
+
+#ifndef _WIN32
+// An image that cannot be written in full is removed again.
+TEST_P(create_test, failure_removes_file)
+{
+  string filename = scratch.path("disk");
+
+  // Writes beyond 1 MiB into any file fail, rather than raising a signal.
+  struct rlimit old_limit;
+  ASSERT_EQ(0, getrlimit(RLIMIT_FSIZE, &old_limit));
+  struct rlimit limit = old_limit;
+  limit.rlim_cur = 1024 * 1024;
+  void (*old_handler)(int) = signal(SIGXFSZ, SIG_IGN);
+  ASSERT_EQ(0, setrlimit(RLIMIT_FSIZE, &limit));
+
+  // A small block size, so that even the table of a dynamic image is too big.
+  virt_disk::create_config config = config_for(GetParam().type);
+  config.block_size = 4096;
+  bool thrown = false;
+  try
+  {
+    delete virt_disk::virt_disk::create_image(filename, 1ULL << 32, config);
+  }
+  catch (exception &)
+  {
+    thrown = true;
+  }
+
+  setrlimit(RLIMIT_FSIZE, &old_limit);
+  signal(SIGXFSZ, old_handler);
+  EXPECT_TRUE(thrown);
+  EXPECT_FALSE(filesystem::exists(filename));
+}
+#endif
+
+// Unknown formats are refused without creating anything.
+TEST(create_image, unknown_format)
+{
+  scratch_dir scratch;
+  string filename = scratch.path("disk");
+  EXPECT_ANY_THROW(delete virt_disk::virt_disk::create_image(filename, DISK_SIZE, config_for(99)));
+  EXPECT_FALSE(filesystem::exists(filename));
+}
+
+// A dynamic VHD is only created with a block size that opening it would accept.
+TEST(create_image, bad_vhd_block_size)
+{
+  scratch_dir scratch;
+  string filename = scratch.path("disk");
+  virt_disk::create_config config = config_for(image_type::VHD_DYNAMIC);
+
+  for (uint32_t block_size : { 256U, 1000U, 3U * 512U, 512U * 1024U * 1024U })
+  {
+    config.block_size = block_size;
+    EXPECT_ANY_THROW(delete virt_disk::virt_disk::create_image(filename, DISK_SIZE, config)) << block_size;
+    EXPECT_FALSE(filesystem::exists(filename));
+  }
+
+  config.block_size = 512;
+  unique_ptr<virt_disk::virt_disk> disk(virt_disk::virt_disk::create_image(filename, DISK_SIZE, config));
+  EXPECT_EQ(DISK_SIZE, disk->get_length());
+}
@@ -0,0 +1,135 @@
+/// @file
+/// @brief Tests of chains of differencing VHD images.
+
+// Copyright Martin Hughes 2018.
+
+#include "test_helpers.h"
+
+#include <gtest/gtest.h>
+
+#include <filesystem>
+
+using namespace std;
+using namespace test_helpers;
+
+namespace
+{
+  /// The size of the disks used by these tests.
+  const uint64_t DISK_SIZE = 8 * 1024 * 1024;
+
+  /// The block size of the images used by these tests.
+  const uint32_t BLOCK_SIZE = 64 * 1024;
+};
+
+// A differencing VHD reads through to its parent until written, and its writes never change the parent.
+TEST(differencing_vhd, round_trip)
+{
+  scratch_dir scratch;
+  string parent_filename = scratch.path("parent.vhd");
+  string child_filename = scratch.path("child.vhd");
+  vector<uint8_t> parent_model(DISK_SIZE, 0);
+  mt19937_64 rng(3);
+
+  ASSERT_NO_FATAL_FAILURE(make_image(parent_filename, image_type::VHD_DYNAMIC, DISK_SIZE, BLOCK_SIZE));
+  unique_ptr<virt_disk::virt_disk> disk = open_image(parent_filename);
+  write_random(*disk, parent_model, rng, 100, 2 * BLOCK_SIZE);
+  disk.reset();
+
+  ASSERT_NO_FATAL_FAILURE(make_image(child_filename, image_type::VHD_DYNAMIC, DISK_SIZE, BLOCK_SIZE));
+  ASSERT_NO_FATAL_FAILURE(make_differencing(parent_filename, child_filename));
+
+  vector<uint8_t> child_model = parent_model;
+  disk = open_image(child_filename);
+  ASSERT_EQ(child_model, read_disk(*disk));
+
+  write_random(*disk, child_model, rng, 200, 2 * BLOCK_SIZE);
+  zero_range(*disk, child_model, 3 * BLOCK_SIZE, BLOCK_SIZE);
+  ASSERT_EQ(child_model, read_disk(*disk));
+  disk.reset();
+
+  disk = open_image(child_filename);
+  EXPECT_EQ(child_model, read_disk(*disk));
+  disk.reset();
+
+  disk = open_image(parent_filename);
+  EXPECT_EQ(parent_model, read_disk(*disk));
+}
+
+// Each level of a chain sees the writes made at its own level and below, whichever level holds each sector.
+TEST(differencing_vhd, three_level_chain)
+{
+  scratch_dir scratch;
+  vector<string> filenames = { scratch.path("base.vhd"), scratch.path("middle.vhd"), scratch.path("top.vhd") };
+  vector<vector<uint8_t>> models;
+  vector<uint8_t> model(DISK_SIZE, 0);
+  mt19937_64 rng(4);
+
+  for (size_t level = 0; level < filenames.size(); level++)
+  {
+    ASSERT_NO_FATAL_FAILURE(make_image(filenames[level], image_type::VHD_DYNAMIC, DISK_SIZE, BLOCK_SIZE));
+    if (level > 0)
+    {
+      ASSERT_NO_FATAL_FAILURE(make_differencing(filenames[level - 1], filenames[level]));
+    }
+
+    // Writes of odd lengths and offsets leave blocks with only some of their sectors present at each level.
+    unique_ptr<virt_disk::virt_disk> disk = open_image(filenames[level]);
+    write_random(*disk, model, rng, 60, BLOCK_SIZE / 2);
+    disk.reset();
+    models.push_back(model);
+  }
+
+  for (size_t level = 0; level < filenames.size(); level++)
+  {
+    unique_ptr<virt_disk::virt_disk> disk = open_image(filenames[level]);
+    EXPECT_EQ(models[level], read_disk(*disk)) << "level " << level;
+  }
+}
+
+// A file opened read-only can be read, but not written or resized.
+TEST(disk_file, read_only_open)
+{
+  scratch_dir scratch;
+  string filename = scratch.path("disk.vhd");
+  ASSERT_NO_FATAL_FAILURE(make_image(filename, image_type::VHD_DYNAMIC, DISK_SIZE, BLOCK_SIZE));
+  const uint64_t length = file_length(filename);
+
+  unique_ptr<virt_disk::disk_file> file = virt_disk::disk_file::open(filename, false, true);
+  EXPECT_EQ(length, file->get_length());
+  vector<uint8_t> buffer(512, 1);
+  file->read_at(buffer.data(), buffer.size(), 0);
+  EXPECT_THROW(file->write_at(buffer.data(), buffer.size(), 0), std::fstream::failure);
+  EXPECT_THROW(file->set_length(length + 512), std::fstream::failure);
+  file.reset();
+
+  EXPECT_EQ(length, file_length(filename));
+}
+
+// Parents are opened read-only, so a chain can be used when its parent cannot be written.
+TEST(differencing_vhd, read_only_parent)
+{
+  scratch_dir scratch;
+  string parent_filename = scratch.path("parent.vhd");
+  string child_filename = scratch.path("child.vhd");
+  vector<uint8_t> model(DISK_SIZE, 0);
+  mt19937_64 rng(5);
+
+  ASSERT_NO_FATAL_FAILURE(make_image(parent_filename, image_type::VHD_DYNAMIC, DISK_SIZE, BLOCK_SIZE));
+  unique_ptr<virt_disk::virt_disk> disk = open_image(parent_filename);
+  write_random(*disk, model, rng, 100, 2 * BLOCK_SIZE);
+  disk.reset();
+
+  ASSERT_NO_FATAL_FAILURE(make_image(child_filename, image_type::VHD_DYNAMIC, DISK_SIZE, BLOCK_SIZE));
+  ASSERT_NO_FATAL_FAILURE(make_differencing(parent_filename, child_filename));
+  filesystem::permissions(parent_filename, filesystem::perms::owner_read, filesystem::perm_options::replace);
+
+  disk = open_image(child_filename);
+  ASSERT_EQ(model, read_disk(*disk));
+  write_random(*disk, model, rng, 100, 2 * BLOCK_SIZE);
+  disk.reset();
+
+  disk = open_image(child_filename);
+  EXPECT_EQ(model, read_disk(*disk));
+  disk.reset();
+  filesystem::permissions(parent_filename, filesystem::perms::owner_all, filesystem::perm_options::replace);
+}
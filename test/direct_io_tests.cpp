@@ -0,0 +1,188 @@
+/// @file
+/// @brief Tests of direct I/O, where unaligned requests go through aligned bounce buffers.
+
+// Copyright Martin Hughes 2018.
+
+#include "test_helpers.h"
+#include "virtualdisk/virt_disk_file.h"
+
+#include <gtest/gtest.h>
+
+#include <fstream>
+#include <string.h>
+#include <thread>
+
+using namespace std;
+using namespace test_helpers;
+
+namespace
+{
+  /// The size of the disks used by these tests.
+  const uint64_t DISK_SIZE = 8 * 1024 * 1024;
+
+  /// The block size of the dynamic images used by these tests.
+  const uint32_t BLOCK_SIZE = 64 * 1024;
+
+  /// The length of the plain files used by these tests - not a whole number of sectors.
+  const uint64_t FILE_SIZE = (3 * 1024 * 1024) + 1000;
+
+  /// @brief Make a file filled with random data.
+  ///
+  /// @param filename The file to create.
+  ///
+  /// @param rng The source of the data.
+  ///
+  /// @return The contents of the file.
+  vector<uint8_t> make_file(const string &filename, mt19937_64 &rng)
+  {
+    vector<uint8_t> contents = random_bytes(rng, FILE_SIZE);
+    ofstream(filename, ios::binary).write(reinterpret_cast<const char *>(contents.data()), contents.size());
+    return contents;
+  }
+
+  /// @brief Open a file for direct I/O.
+  ///
+  /// @param filename The file to open.
+  ///
+  /// @return The open file, or nullptr if the filesystem cannot do direct I/O.
+  unique_ptr<virt_disk::disk_file> open_direct(const string &filename)
+  {
+    unique_ptr<virt_disk::disk_file> file = virt_disk::disk_file::open(filename, true);
+    return (file->get_direct_alignment() != 0) ? move(file) : nullptr;
+  }
+
+  class direct_io_test : public testing::TestWithParam<image_kind>
+  {
+  protected:
+    scratch_dir scratch;
+  };
+};
+
+INSTANTIATE_TEST_SUITE_P(all_formats, direct_io_test, testing::ValuesIn(ALL_IMAGE_KINDS), image_kind_name);
+
+// Reads and writes of any buffer, offset and length - including past the end of the file - match a model of it.
+TEST(direct_io, unaligned_file_access)
+{
+  scratch_dir scratch;
+  string filename = scratch.path("file");
+  mt19937_64 rng(90);
+  vector<uint8_t> model = make_file(filename, rng);
+  unique_ptr<virt_disk::disk_file> file = open_direct(filename);
+  if (!file)
+  {
+    GTEST_SKIP() << "The filesystem cannot do direct I/O";
+  }
+
+  // Buffers are offset from an aligned allocation by a random amount.
+  vector<uint8_t> storage(4 * 1024 * 1024);
+  for (uint32_t i = 0; i < 300; i++)
+  {
+    uint64_t length = 1 + (rng() % (2 * 1024 * 1024));
+    uint64_t offset = rng() % (model.size() + 5000);
+    uint8_t *buffer = storage.data() + (rng() % 4096);
+
+    if ((rng() % 2) == 0)
+    {
+      vector<uint8_t> data = random_bytes(rng, length);
+      memcpy(buffer, data.data(), length);
+      file->write_at(buffer, length, offset);
+      if ((offset + length) > model.size())
+      {
+        model.resize(offset + length, 0);
+      }
+      memcpy(model.data() + offset, data.data(), length);
+      ASSERT_EQ(model.size(), file->get_length());
+    }
+    else
+    {
+      length = min(length, model.size() - min(offset, model.size()));
+      if (length == 0)
+      {
+        continue;
+      }
+      file->read_at(buffer, length, offset);
+      ASSERT_EQ(0, memcmp(buffer, model.data() + offset, length)) << "read " << i;
+    }
+  }
+  file.reset();
+
+  ASSERT_EQ(model.size(), file_length(filename));
+  vector<uint8_t> contents(model.size());
+  ifstream(filename, ios::binary).read(reinterpret_cast<char *>(contents.data()), contents.size());
+  EXPECT_EQ(model, contents);
+}
+
+// Threads writing neighbouring sectors at once, which share aligned units, never undo each other's writes.
+TEST(direct_io, neighbouring_writes)
+{
+  const uint32_t thread_count = 8;
+  const uint64_t sector = 512;
+  scratch_dir scratch;
+  string filename = scratch.path("file");
+  mt19937_64 rng(91);
+  vector<uint8_t> model = make_file(filename, rng);
+  unique_ptr<virt_disk::disk_file> file = open_direct(filename);
+  if (!file)
+  {
+    GTEST_SKIP() << "The filesystem cannot do direct I/O";
+  }
+
+  // Thread t writes every sector whose number modulo thread_count is t, so every unit is written by every thread.
+  vector<thread> threads;
+  for (uint32_t t = 0; t < thread_count; t++)
+  {
+    threads.emplace_back([&, t]()
+                         {
+                           vector<uint8_t> data(sector, static_cast<uint8_t>(t + 1));
+                           for (uint64_t posn = t * sector; (posn + sector) <= FILE_SIZE;
+                                posn += thread_count * sector)
+                           {
+                             file->write_at(data.data(), sector, posn);
+                           }
+                         });
+  }
+  for (thread &worker : threads)
+  {
+    worker.join();
+  }
+
+  vector<uint8_t> contents(FILE_SIZE);
+  file->read_at(contents.data(), contents.size(), 0);
+  for (uint64_t posn = 0; (posn + sector) <= FILE_SIZE; posn += sector)
+  {
+    uint8_t expected = static_cast<uint8_t>(((posn / sector) % thread_count) + 1);
+    ASSERT_EQ(vector<uint8_t>(sector, expected), vector<uint8_t>(contents.begin() + posn,
+                                                                 contents.begin() + posn + sector))
+      << "sector " << (posn / sector);
+  }
+  EXPECT_EQ(0, memcmp(contents.data() + (FILE_SIZE - (FILE_SIZE % sector)),
+                      model.data() + (FILE_SIZE - (FILE_SIZE % sector)),
+                      FILE_SIZE % sector));
+  EXPECT_EQ(FILE_SIZE, file->get_length());
+}
+
+// Images opened for direct I/O read and write the same as when they are not, and are left in a state that opens
+// normally afterwards.
+TEST_P(direct_io_test, matches_model)
+{
+  string filename = scratch.path("disk");
+  ASSERT_NO_FATAL_FAILURE(make_image(filename, GetParam().type, DISK_SIZE, BLOCK_SIZE));
+  vector<uint8_t> model(DISK_SIZE, 0);
+  mt19937_64 rng(92);
+
+  string name = filename;
+  virt_disk::open_config config;
+  config.direct_io = true;
+  unique_ptr<virt_disk::virt_disk> disk(virt_disk::virt_disk::create_virtual_disk(name, config));
+  write_random(*disk, model, rng, 200, 3 * BLOCK_SIZE);
+  ASSERT_EQ(model, read_disk(*disk));
+  disk.reset();
+
+  disk = open_image(filename);
+  ASSERT_EQ(model, read_disk(*disk));
+  write_random(*disk, model, rng, 50, 3 * BLOCK_SIZE);
+  disk.reset();
+
+  disk = unique_ptr<virt_disk::virt_disk>(virt_disk::virt_disk::create_virtual_disk(name, config));
+  EXPECT_EQ(model, read_disk(*disk));
+}
@@ -0,0 +1,229 @@
+/// @file
+/// @brief Tests that each image format stores what is written to it, and leaves the file alone when it is not.
+
+// Copyright Martin Hughes 2018.
+
+#include "test_helpers.h"
+#include "virtualdisk/virt_disk_cache.h"
+#include "virtualdisk/virt_disk_vdi.h"
+#include "virtualdisk/virt_disk_vhd.h"
+
+#include <gtest/gtest.h>
+
+#include <fstream>
+
+using namespace std;
+using namespace test_helpers;
+
+namespace
+{
+  /// The size of the disks used by these tests. Not a whole number of blocks, so the last block is partly used.
+  const uint64_t DISK_SIZE = (8 * 1024 * 1024) + (5 * 512);
+
+  /// The block size of the dynamic images used by these tests - small, so that a test touches many blocks.
+  const uint32_t BLOCK_SIZE = 64 * 1024;
+
+  class image_test : public testing::TestWithParam<image_kind>
+  {
+  protected:
+    scratch_dir scratch;
+  };
+};
+
+INSTANTIATE_TEST_SUITE_P(all_formats, image_test, testing::ValuesIn(ALL_IMAGE_KINDS), image_kind_name);
+
+// A new image reads as zeroes, and everything written to it is still there once it has been closed and reopened.
+TEST_P(image_test, round_trip)
+{
+  string filename = scratch.path("disk");
+  vector<uint8_t> model(DISK_SIZE, 0);
+  mt19937_64 rng(1);
+
+  ASSERT_NO_FATAL_FAILURE(make_image(filename, GetParam().type, DISK_SIZE, BLOCK_SIZE));
+  unique_ptr<virt_disk::virt_disk> disk = open_image(filename);
+  ASSERT_EQ(DISK_SIZE, disk->get_length());
+  ASSERT_EQ(model, read_disk(*disk));
+
+  write_random(*disk, model, rng, 200, 3 * BLOCK_SIZE);
+  zero_range(*disk, model, BLOCK_SIZE, 2 * BLOCK_SIZE);
+  ASSERT_EQ(model, read_disk(*disk));
+  disk.reset();
+
+  disk = open_image(filename);
+  ASSERT_EQ(DISK_SIZE, disk->get_length());
+  ASSERT_EQ(model, read_disk(*disk));
+
+  // And again, writing to an image that already has blocks allocated.
+  write_random(*disk, model, rng, 50, 3 * BLOCK_SIZE);
+  disk->flush();
+  disk.reset();
+
+  disk = open_image(filename);
+  ASSERT_EQ(model, read_disk(*disk));
+}
+
+// Opening and closing an image without writing to it leaves the file the same length, even if it has more space on
+// the end than the image uses.
+TEST_P(image_test, open_close_keeps_length)
+{
+  string filename = scratch.path("disk");
+  vector<uint8_t> model(DISK_SIZE, 0);
+  mt19937_64 rng(2);
+
+  ASSERT_NO_FATAL_FAILURE(make_image(filename, GetParam().type, DISK_SIZE, BLOCK_SIZE));
+  unique_ptr<virt_disk::virt_disk> disk = open_image(filename);
+  write_random(*disk, model, rng, 20, BLOCK_SIZE);
+  disk.reset();
+
+  uint64_t length = file_length(filename);
+  disk = open_image(filename);
+  ASSERT_EQ(model, read_disk(*disk));
+  disk.reset();
+  EXPECT_EQ(length, file_length(filename));
+
+  // A VHD must end with its footer, but a VDI may have unused space after its last block.
+  if ((GetParam().type == image_type::VDI_NORMAL) || (GetParam().type == image_type::VDI_FIXED))
+  {
+    vector<char> padding(4096, 0);
+    ofstream(filename, ios::binary | ios::app).write(padding.data(), padding.size());
+    length = file_length(filename);
+
+    disk = open_image(filename);
+    ASSERT_EQ(model, read_disk(*disk));
+    disk->flush();
+    disk.reset();
+    EXPECT_EQ(length, file_length(filename));
+  }
+}
+
+// A range whose end would wrap past the largest position is refused, rather than treated as a short range near the
+// start of the disk - with and without a cache.
+TEST_P(image_test, wrapping_range_refused)
+{
+  string filename = scratch.path("disk");
+  ASSERT_NO_FATAL_FAILURE(make_image(filename, GetParam().type, DISK_SIZE, BLOCK_SIZE));
+  unique_ptr<virt_disk::virt_disk> disk = open_image(filename);
+  vector<uint8_t> buffer(2 * BLOCK_SIZE, 0xAA);
+  const uint64_t start_posn = ~0ULL - BLOCK_SIZE + 1;
+
+  for (bool cached : { false, true })
+  {
+    if (cached)
+    {
+      virt_disk::cache_config config;
+      config.capacity_bytes = 16 * BLOCK_SIZE;
+      config.block_size = BLOCK_SIZE;
+      config.write_mode = virt_disk::cache_write_mode::WRITE_BACK;
+      disk->set_cache(make_shared<virt_disk::block_cache>(config));
+    }
+
+    EXPECT_ANY_THROW(disk->read(buffer.data(), start_posn, buffer.size(), buffer.size()));
+    EXPECT_ANY_THROW(disk->write(buffer.data(), start_posn, buffer.size(), buffer.size()));
+  }
+
+  disk->flush();
+  EXPECT_EQ(vector<uint8_t>(DISK_SIZE, 0), read_disk(*disk));
+}
+
+namespace
+{
+  class image_dynamic_test : public image_test
+  {
+  };
+
+};
+
+INSTANTIATE_TEST_SUITE_P(dynamic_formats, image_dynamic_test, testing::ValuesIn(DYNAMIC_IMAGE_KINDS), image_kind_name);
+
+// Everything written to the file - new blocks, their VHD bitmaps and the space reserved for them - is flushed before
+// the table is written, so the table on disk never refers to data that has not reached the file.
+TEST_P(image_dynamic_test, data_flushed_before_table)
+{
+  string filename = scratch.path("disk");
+  vector<uint8_t> model(DISK_SIZE, 0);
+  mt19937_64 rng(3);
+
+  ASSERT_NO_FATAL_FAILURE(make_image(filename, GetParam().type, DISK_SIZE, BLOCK_SIZE));
+  const uint64_t tables_end = file_length(filename) - ((GetParam().type == image_type::VHD_DYNAMIC) ? 512 : 0);
+  recording_file *file;
+  unique_ptr<virt_disk::virt_disk> disk = open_recorded(filename, GetParam().type, file);
+
+  // Enough writes to allocate every block, so the table is written in batches as well as by flush().
+  write_random(*disk, model, rng, 400, 2 * BLOCK_SIZE);
+  disk->flush();
+  vector<recording_file::event> events = file->take_events();
+  EXPECT_EQ(events.size(), find_unflushed(events, tables_end, 1));
+  disk.reset();
+
+  disk = open_image(filename);
+  EXPECT_EQ(model, read_disk(*disk));
+}
+
+// A dynamic VHD whose block size is not a power of two between one sector and 256 MiB is refused when opened.
+TEST(vhd_disk, bad_block_size_refused)
+{
+  scratch_dir scratch;
+  string filename = scratch.path("disk.vhd");
+  ASSERT_NO_FATAL_FAILURE(make_image(filename, image_type::VHD_DYNAMIC, DISK_SIZE, BLOCK_SIZE));
+
+  auto set_block_size = [&](uint32_t block_size)
+  {
+    virt_disk::vhd_dynamic_header header;
+    fstream file(filename, ios::binary | ios::in | ios::out);
+    file.seekg(sizeof(virt_disk::vhd_footer));
+    file.read(reinterpret_cast<char *>(&header), sizeof(header));
+    header.block_size = block_size;
+    file.seekp(sizeof(virt_disk::vhd_footer));
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    ASSERT_TRUE(file.good());
+  };
+
+  for (uint32_t block_size : { 0U, 256U, 1000U, 3U * 512U, BLOCK_SIZE + 512U, 512U * 1024U * 1024U, 0x80000000U })
+  {
+    ASSERT_NO_FATAL_FAILURE(set_block_size(block_size));
+    EXPECT_ANY_THROW(open_image(filename)) << "block size " << block_size;
+  }
+
+  ASSERT_NO_FATAL_FAILURE(set_block_size(BLOCK_SIZE));
+  unique_ptr<virt_disk::virt_disk> disk = open_image(filename);
+  EXPECT_EQ(vector<uint8_t>(DISK_SIZE, 0), read_disk(*disk));
+}
+
+// A VDI whose header has no block size, too few blocks to hold the disk, or more blocks allocated than it has, is
+// refused when opened.
+TEST(vdi_disk, bad_header_refused)
+{
+  scratch_dir scratch;
+  string filename = scratch.path("disk.vdi");
+  ASSERT_NO_FATAL_FAILURE(make_image(filename, image_type::VDI_NORMAL, DISK_SIZE, BLOCK_SIZE));
+
+  virt_disk::vdi_header good_header;
+  {
+    ifstream file(filename, ios::binary);
+    file.read(reinterpret_cast<char *>(&good_header), sizeof(good_header));
+    ASSERT_TRUE(file.good());
+  }
+
+  auto write_header = [&](const virt_disk::vdi_header &header)
+  {
+    fstream file(filename, ios::binary | ios::in | ios::out);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    ASSERT_TRUE(file.good());
+  };
+
+  vector<virt_disk::vdi_header> bad_headers(4, good_header);
+  bad_headers[0].image_block_size = 0;
+  bad_headers[1].number_blocks = good_header.number_blocks - 1;
+  bad_headers[2].disk_size = good_header.disk_size + BLOCK_SIZE;
+  bad_headers[3].number_blocks_allocated = good_header.number_blocks + 1;
+
+  for (size_t i = 0; i < bad_headers.size(); i++)
+  {
+    ASSERT_NO_FATAL_FAILURE(write_header(bad_headers[i]));
+    EXPECT_ANY_THROW(open_image(filename)) << "header " << i;
+  }
+
+  ASSERT_NO_FATAL_FAILURE(write_header(good_header));
+  unique_ptr<virt_disk::virt_disk> disk = open_image(filename);
+  EXPECT_EQ(vector<uint8_t>(DISK_SIZE, 0), read_disk(*disk));
+}
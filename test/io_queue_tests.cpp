@@ -0,0 +1,169 @@
+/// @file
+/// @brief Tests of io_queue, the asynchronous interface to virtual disks.
+
+// Copyright Martin Hughes 2018.
+
+#include "test_helpers.h"
+#include "virtualdisk/virt_disk_async.h"
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+
+using namespace std;
+using namespace test_helpers;
+
+namespace
+{
+  /// The size of the disks used by these tests.
+  const uint64_t DISK_SIZE = 8 * 1024 * 1024;
+
+  /// The block size of the dynamic images used by these tests.
+  const uint32_t BLOCK_SIZE = 64 * 1024;
+
+  /// The number of requests submitted at once by these tests - more than the depth of the queue.
+  const uint32_t REQUEST_COUNT = 64;
+
+  /// The depth of the queues used by these tests.
+  const uint32_t QUEUE_DEPTH = 8;
+
+  /// @brief The parameters of an io_queue test.
+  ///
+  struct queue_kind
+  {
+    image_kind image; ///< The kind of image to access.
+    bool allow_io_uring; ///< Whether the queue may use io_uring, or must use its thread pool.
+  };
+
+  class io_queue_test : public testing::TestWithParam<queue_kind>
+  {
+  protected:
+    scratch_dir scratch;
+  };
+
+  vector<queue_kind> all_queue_kinds()
+  {
+    vector<queue_kind> kinds;
+    for (const image_kind &image : VHD_IMAGE_KINDS)
+    {
+      kinds.push_back({ image, true });
+      kinds.push_back({ image, false });
+    }
+    return kinds;
+  }
+
+  string queue_kind_name(const testing::TestParamInfo<queue_kind> &info)
+  {
+    return string(info.param.image.name) + (info.param.allow_io_uring ? "_io_uring" : "_threads");
+  }
+};
+
+INSTANTIATE_TEST_SUITE_P(all_engines, io_queue_test, testing::ValuesIn(all_queue_kinds()), queue_kind_name);
+
+// Many writes in flight at once, each spanning several blocks, all land where they should - and reads in flight at
+// once all return the right data.
+TEST_P(io_queue_test, many_requests_match_model)
+{
+  string filename = scratch.path("disk");
+  ASSERT_NO_FATAL_FAILURE(make_image(filename, GetParam().image.type, DISK_SIZE, BLOCK_SIZE));
+  unique_ptr<virt_disk::virt_disk> disk = open_image(filename);
+  vector<uint8_t> model(DISK_SIZE, 0);
+  mt19937_64 rng(30);
+
+  // Requests in flight together must not overlap, so each has its own slice of the disk.
+  const uint64_t slice = DISK_SIZE / REQUEST_COUNT;
+  virt_disk::io_queue queue(QUEUE_DEPTH, GetParam().allow_io_uring);
+  vector<vector<uint8_t>> buffers;
+  vector<future<void>> writes;
+  for (uint32_t i = 0; i < REQUEST_COUNT; i++)
+  {
+    uint64_t length = 1 + (rng() % slice);
+    uint64_t start_posn = (i * slice) + (rng() % (slice - length + 1));
+    buffers.push_back(random_bytes(rng, length));
+    memcpy(model.data() + start_posn, buffers.back().data(), length);
+    writes.push_back(queue.write(*disk, buffers.back().data(), start_posn, length));
+  }
+  queue.drain();
+  EXPECT_EQ(0U, queue.outstanding());
+  for (future<void> &write : writes)
+  {
+    EXPECT_NO_THROW(write.get());
+  }
+  ASSERT_EQ(model, read_disk(*disk));
+
+  // Read the disk back in pieces that cross block boundaries, with callbacks this time.
+  vector<uint8_t> contents(DISK_SIZE, 0xAA);
+  const uint64_t piece = (DISK_SIZE / REQUEST_COUNT) + 4608;
+  uint32_t completed = 0;
+  uint32_t failed = 0;
+  uint32_t submitted = 0;
+  for (uint64_t posn = 0; posn < DISK_SIZE; posn += piece)
+  {
+    queue.submit_read(*disk, contents.data() + posn, posn, min(piece, DISK_SIZE - posn),
+                      [&](exception_ptr error)
+                      {
+                        completed++;
+                        failed += (error != nullptr) ? 1 : 0;
+                      });
+    submitted++;
+  }
+  while (queue.outstanding() > 0)
+  {
+    queue.reap(1);
+  }
+  EXPECT_EQ(submitted, completed);
+  EXPECT_EQ(0U, failed);
+  EXPECT_EQ(model, contents);
+}
+
+// Requests to more than one disk can share a queue, and are each reported exactly once.
+TEST_P(io_queue_test, shared_between_disks)
+{
+  const uint32_t disk_count = 3;
+  vector<unique_ptr<virt_disk::virt_disk>> disks;
+  vector<vector<uint8_t>> data;
+  mt19937_64 rng(31);
+  virt_disk::io_queue queue(QUEUE_DEPTH, GetParam().allow_io_uring);
+  vector<uint32_t> completions(disk_count, 0);
+
+  for (uint32_t i = 0; i < disk_count; i++)
+  {
+    string filename = scratch.path("disk" + to_string(i));
+    ASSERT_NO_FATAL_FAILURE(make_image(filename, GetParam().image.type, DISK_SIZE, BLOCK_SIZE));
+    disks.push_back(open_image(filename));
+    data.push_back(random_bytes(rng, 3 * BLOCK_SIZE));
+    queue.submit_write(*disks[i], data[i].data(), BLOCK_SIZE / 2, data[i].size(),
+                       [&completions, i](exception_ptr error)
+                       {
+                         EXPECT_EQ(nullptr, error);
+                         completions[i]++;
+                       });
+  }
+  queue.drain();
+
+  for (uint32_t i = 0; i < disk_count; i++)
+  {
+    EXPECT_EQ(1U, completions[i]);
+    vector<uint8_t> contents(data[i].size());
+    disks[i]->read(contents.data(), BLOCK_SIZE / 2, contents.size(), contents.size());
+    EXPECT_EQ(data[i], contents);
+  }
+}
+
+// A request beyond the end of the disk is refused when it is submitted, and leaves the queue usable.
+TEST_P(io_queue_test, beyond_end_of_disk)
+{
+  string filename = scratch.path("disk");
+  ASSERT_NO_FATAL_FAILURE(make_image(filename, GetParam().image.type, DISK_SIZE, BLOCK_SIZE));
+  unique_ptr<virt_disk::virt_disk> disk = open_image(filename);
+  virt_disk::io_queue queue(QUEUE_DEPTH, GetParam().allow_io_uring);
+  vector<uint8_t> buffer(4096, 0);
+
+  EXPECT_ANY_THROW(queue.read(*disk, buffer.data(), DISK_SIZE - 512, buffer.size()));
+  EXPECT_ANY_THROW(queue.write(*disk, buffer.data(), DISK_SIZE, buffer.size()));
+  EXPECT_EQ(0U, queue.outstanding());
+
+  future<void> read = queue.read(*disk, buffer.data(), DISK_SIZE - buffer.size(), buffer.size());
+  queue.drain();
+  EXPECT_NO_THROW(read.get());
+}
@@ -0,0 +1,193 @@
+/// @file
+/// @brief Tests that read-ahead fetches the blocks ahead of sequential and strided streams of reads.
+
+// Copyright Martin Hughes 2018.
+
+#include "test_helpers.h"
+#include "virtualdisk/virt_disk_cache.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <thread>
+
+using namespace std;
+using namespace test_helpers;
+
+namespace
+{
+  /// The size of the disks used by these tests.
+  const uint64_t DISK_SIZE = 8 * 1024 * 1024;
+
+  /// The block size of the images, and of the caches, used by these tests.
+  const uint32_t BLOCK_SIZE = 64 * 1024;
+
+  /// The number of blocks read ahead when a stream is first found.
+  const uint32_t WINDOW = 4;
+
+  /// @brief Wait for the cache to have had a number of blocks inserted, which read-ahead does in the background.
+  ///
+  /// @param cache The cache to watch.
+  ///
+  /// @param insertions The number of insertions to wait for.
+  ///
+  /// @return True if they happened, false if the wait timed out.
+  bool wait_for_insertions(virt_disk::block_cache &cache, uint64_t insertions)
+  {
+    for (uint32_t i = 0; i < 1000; i++)
+    {
+      if (cache.get_stats().insertions >= insertions)
+      {
+        return true;
+      }
+      this_thread::sleep_for(chrono::milliseconds(5));
+    }
+    return false;
+  }
+
+  class read_ahead_test : public testing::TestWithParam<image_kind>
+  {
+  protected:
+    /// @brief Build an empty image for the test.
+    ///
+    void SetUp() override
+    {
+      string filename = scratch.path("disk");
+      ASSERT_NO_FATAL_FAILURE(make_image(filename, GetParam().type, DISK_SIZE, BLOCK_SIZE));
+      disk = open_image(filename);
+      model = vector<uint8_t>(DISK_SIZE, 0);
+    }
+
+    /// @brief Write random data over a range of blocks.
+    ///
+    /// @param first_block The first block to write.
+    ///
+    /// @param block_count The number of blocks to write.
+    void fill_blocks(uint64_t first_block, uint64_t block_count)
+    {
+      vector<uint8_t> data = random_bytes(rng, block_count * BLOCK_SIZE);
+      disk->write(data.data(), first_block * BLOCK_SIZE, data.size(), data.size());
+      copy(data.begin(), data.end(), model.begin() + (first_block * BLOCK_SIZE));
+    }
+
+    /// @brief Attach a cache with room for the whole disk, and read-ahead.
+    ///
+    void start_read_ahead()
+    {
+      virt_disk::cache_config config;
+      config.capacity_bytes = DISK_SIZE;
+      config.block_size = BLOCK_SIZE;
+      config.shard_count = 1;
+      cache = make_shared<virt_disk::block_cache>(config);
+      disk->set_cache(cache);
+
+      virt_disk::read_ahead_config read_ahead;
+      read_ahead.initial_window = WINDOW;
+      disk->set_read_ahead(read_ahead);
+    }
+
+    /// @brief Read one block, and check it against the model.
+    ///
+    /// @param block The block to read.
+    void read_block(uint64_t block)
+    {
+      vector<uint8_t> contents(BLOCK_SIZE);
+      disk->read(contents.data(), block * BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE);
+      EXPECT_TRUE(equal(contents.begin(), contents.end(), model.begin() + (block * BLOCK_SIZE))) << "block " << block;
+    }
+
+    scratch_dir scratch;
+    unique_ptr<virt_disk::virt_disk> disk;
+    shared_ptr<virt_disk::block_cache> cache;
+    vector<uint8_t> model;
+    mt19937_64 rng{50};
+  };
+};
+
+INSTANTIATE_TEST_SUITE_P(vhd_formats, read_ahead_test, testing::ValuesIn(VHD_IMAGE_KINDS), image_kind_name);
+
+// Read-ahead needs a cache to read into.
+TEST_P(read_ahead_test, needs_cache)
+{
+  EXPECT_ANY_THROW(disk->set_read_ahead(virt_disk::read_ahead_config()));
+}
+
+// The third read in a row of adjacent blocks starts read-ahead, so the blocks after it are already cached when read.
+TEST_P(read_ahead_test, sequential)
+{
+  fill_blocks(0, 32);
+  start_read_ahead();
+
+  for (uint64_t block = 0; block < 3; block++)
+  {
+    read_block(block);
+  }
+  ASSERT_TRUE(wait_for_insertions(*cache, 3 + WINDOW));
+
+  cache->reset_stats();
+  for (uint64_t block = 3; block < (3 + WINDOW); block++)
+  {
+    read_block(block);
+  }
+  virt_disk::cache_stats stats = cache->get_stats();
+  EXPECT_EQ(WINDOW, stats.hits);
+  EXPECT_EQ(0U, stats.misses);
+}
+
+// Reads one stride apart are read ahead at the same stride.
+TEST_P(read_ahead_test, strided)
+{
+  const uint64_t stride = 8;
+  fill_blocks(0, DISK_SIZE / BLOCK_SIZE);
+  start_read_ahead();
+
+  for (uint64_t i = 0; i < 3; i++)
+  {
+    read_block(i * stride);
+  }
+  ASSERT_TRUE(wait_for_insertions(*cache, 3 + WINDOW));
+
+  cache->reset_stats();
+  for (uint64_t i = 3; i < (3 + WINDOW); i++)
+  {
+    read_block(i * stride);
+  }
+  virt_disk::cache_stats stats = cache->get_stats();
+  EXPECT_EQ(WINDOW, stats.hits);
+  EXPECT_EQ(0U, stats.misses);
+}
+
+// Blocks that are not allocated in a dynamic image are not read ahead.
+TEST(read_ahead, skips_holes)
+{
+  scratch_dir scratch;
+  string filename = scratch.path("disk");
+  ASSERT_NO_FATAL_FAILURE(make_image(filename, image_type::VHD_DYNAMIC, DISK_SIZE, BLOCK_SIZE));
+  unique_ptr<virt_disk::virt_disk> disk = open_image(filename);
+
+  // A run of allocated blocks followed by a hole, and a run long enough to be read ahead.
+  vector<uint8_t> data(3 * BLOCK_SIZE, 1);
+  disk->write(data.data(), 0, data.size(), data.size());
+  data = vector<uint8_t>((3 + WINDOW) * BLOCK_SIZE, 2);
+  disk->write(data.data(), 64 * BLOCK_SIZE, data.size(), data.size());
+
+  virt_disk::cache_config config;
+  config.capacity_bytes = DISK_SIZE;
+  config.block_size = BLOCK_SIZE;
+  config.shard_count = 1;
+  shared_ptr<virt_disk::block_cache> cache = make_shared<virt_disk::block_cache>(config);
+  disk->set_cache(cache);
+  virt_disk::read_ahead_config read_ahead;
+  read_ahead.initial_window = WINDOW;
+  disk->set_read_ahead(read_ahead);
+
+  // The first stream only has a hole ahead of it. Read-ahead works through its queue in order, so once the blocks ahead
+  // of the second stream are cached, the first stream's turn has been and gone.
+  vector<uint8_t> buffer(BLOCK_SIZE);
+  for (uint64_t block : { 0, 1, 2, 64, 65, 66 })
+  {
+    disk->read(buffer.data(), block * BLOCK_SIZE, BLOCK_SIZE, BLOCK_SIZE);
+  }
+  ASSERT_TRUE(wait_for_insertions(*cache, 6 + WINDOW));
+  EXPECT_EQ(6 + WINDOW, cache->get_stats().insertions);
+}
@@ -0,0 +1,192 @@
+/// @file
+/// @brief Tests of loading block tables on demand, and of limiting how much of them is held in memory.
+
+// Copyright Martin Hughes 2018.
+
+#include "test_helpers.h"
+
+#include "virtualdisk/virt_disk_vhd.h"
+
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <fstream>
+#include <string.h>
+#include <thread>
+
+using namespace std;
+using namespace test_helpers;
+
+namespace
+{
+  /// The block size of the images used by these tests. Small, so that the table spans many 4 KiB pages.
+  const uint32_t BLOCK_SIZE = 4096;
+
+  /// The size of the disks used by these tests - sixteen pages of table.
+  const uint64_t DISK_SIZE = 64 * 1024 * 1024;
+
+  /// The most table pages held by the tests that limit it.
+  const uint32_t MAX_PAGES = 2;
+
+  /// @brief Open an image with a given way of loading its table.
+  ///
+  /// @param filename The image to open.
+  ///
+  /// @param table_loading One of the table_load constants.
+  ///
+  /// @param max_table_pages The most table pages to hold, or zero for no limit.
+  ///
+  /// @return The open disk.
+  unique_ptr<virt_disk::virt_disk> open_with(const string &filename, uint32_t table_loading, uint32_t max_table_pages)
+  {
+    string name = filename;
+    virt_disk::open_config config;
+    config.table_loading = table_loading;
+    config.max_table_pages = max_table_pages;
+    return unique_ptr<virt_disk::virt_disk>(virt_disk::virt_disk::create_virtual_disk(name, config));
+  }
+
+  class table_test : public testing::TestWithParam<image_kind>
+  {
+  protected:
+    scratch_dir scratch;
+  };
+};
+
+INSTANTIATE_TEST_SUITE_P(all_formats, table_test, testing::ValuesIn(ALL_IMAGE_KINDS), image_kind_name);
+
+// Writes all over the disk, with the table loaded on demand and at most two pages of it held, read back the same
+// however the image is opened afterwards.
+TEST_P(table_test, limited_pages_match_model)
+{
+  string filename = scratch.path("disk");
+  ASSERT_NO_FATAL_FAILURE(make_image(filename, GetParam().type, DISK_SIZE, BLOCK_SIZE));
+  vector<uint8_t> model(DISK_SIZE, 0);
+  mt19937_64 rng(60);
+
+  unique_ptr<virt_disk::virt_disk> disk = open_with(filename, virt_disk::table_load::ON_DEMAND, MAX_PAGES);
+  write_random(*disk, model, rng, 500, 4 * BLOCK_SIZE);
+  ASSERT_EQ(model, read_disk(*disk));
+  write_random(*disk, model, rng, 500, 4 * BLOCK_SIZE);
+  disk->flush();
+  ASSERT_EQ(model, read_disk(*disk));
+  disk.reset();
+
+  for (uint32_t max_table_pages : { 0U, 1U, MAX_PAGES })
+  {
+    disk = open_with(filename, virt_disk::table_load::ON_DEMAND, max_table_pages);
+    EXPECT_EQ(model, read_disk(*disk)) << "on demand, " << max_table_pages << " pages";
+  }
+  disk = open_with(filename, virt_disk::table_load::EAGER, 0);
+  EXPECT_EQ(model, read_disk(*disk)) << "eager";
+
+  // And the other way round - written with the whole table loaded, read a page at a time.
+  write_random(*disk, model, rng, 200, 4 * BLOCK_SIZE);
+  disk.reset();
+  disk = open_with(filename, virt_disk::table_load::ON_DEMAND, 1);
+  EXPECT_EQ(model, read_disk(*disk));
+}
+
+// Threads writing to different parts of the disk at once, so that table pages are loaded and evicted under each other,
+// all see their own data.
+TEST_P(table_test, limited_pages_concurrent)
+{
+  const uint32_t thread_count = 4;
+  const uint64_t region = DISK_SIZE / thread_count;
+  string filename = scratch.path("disk");
+  ASSERT_NO_FATAL_FAILURE(make_image(filename, GetParam().type, DISK_SIZE, BLOCK_SIZE));
+  vector<uint8_t> model(DISK_SIZE, 0);
+
+  unique_ptr<virt_disk::virt_disk> disk = open_with(filename, virt_disk::table_load::ON_DEMAND, MAX_PAGES);
+  vector<thread> threads;
+  for (uint32_t t = 0; t < thread_count; t++)
+  {
+    threads.emplace_back([&, t]()
+                         {
+                           mt19937_64 rng(70 + t);
+                           for (uint32_t i = 0; i < 300; i++)
+                           {
+                             // Each region spans four pages of the table, and only two are held.
+                             uint64_t length = 1 + (rng() % (2 * BLOCK_SIZE));
+                             uint64_t start_posn = (t * region) + (rng() % (region - length));
+                             vector<uint8_t> data = random_bytes(rng, length);
+                             disk->write(data.data(), start_posn, length, length);
+                             memcpy(model.data() + start_posn, data.data(), length);
+
+                             vector<uint8_t> contents(length);
+                             disk->read(contents.data(), start_posn, length, length);
+                             EXPECT_EQ(0, memcmp(contents.data(), model.data() + start_posn, length));
+                           }
+                         });
+  }
+  for (thread &worker : threads)
+  {
+    worker.join();
+  }
+
+  ASSERT_EQ(model, read_disk(*disk));
+  disk.reset();
+  disk = open_with(filename, virt_disk::table_load::EAGER, 0);
+  EXPECT_EQ(model, read_disk(*disk));
+}
+
+#ifdef __linux__
+// Opening a dynamic VHD with a huge table on demand costs memory only for the parts of the disk that are used - the
+// state of each block's bitmap is held in pages created as they are needed, like the table itself.
+TEST(vhd_disk, huge_table_on_demand)
+{
+  // 64M blocks - a 256 MiB table, and 256 GiB disk. Only the first of its entries are initialised.
+  const uint32_t huge_entries = 64 * 1024 * 1024;
+  scratch_dir scratch;
+  string filename = scratch.path("disk.vhd");
+  ASSERT_NO_FATAL_FAILURE(make_image(filename, image_type::VHD_DYNAMIC, DISK_SIZE, BLOCK_SIZE));
+
+  {
+    virt_disk::vhd_footer footer;
+    virt_disk::vhd_dynamic_header header;
+    fstream file(filename, ios::binary | ios::in | ios::out);
+    file.read(reinterpret_cast<char *>(&footer), sizeof(footer));
+    file.read(reinterpret_cast<char *>(&header), sizeof(header));
+    footer.current_size = static_cast<uint64_t>(huge_entries) * BLOCK_SIZE;
+    header.max_table_entries = huge_entries;
+    const uint64_t footer_posn = header.table_offset + (static_cast<uint64_t>(huge_entries) * sizeof(uint32_t));
+
+    file.seekp(0);
+    file.write(reinterpret_cast<const char *>(&footer), sizeof(footer));
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.close();
+    filesystem::resize_file(filename, footer_posn);
+    file.open(filename, ios::binary | ios::in | ios::out);
+    file.seekp(footer_posn);
+    file.write(reinterpret_cast<const char *>(&footer), sizeof(footer));
+    ASSERT_TRUE(file.good());
+  }
+
+  auto resident_bytes = []()
+  {
+    uint64_t total_pages = 0;
+    uint64_t resident_pages = 0;
+    ifstream statm("/proc/self/statm");
+    statm >> total_pages >> resident_pages;
+    return resident_pages * 4096;
+  };
+
+  vector<uint8_t> model(DISK_SIZE, 0);
+  vector<uint8_t> contents(DISK_SIZE, 0);
+  mt19937_64 rng(80);
+
+  const uint64_t before = resident_bytes();
+  unique_ptr<virt_disk::virt_disk> disk = open_with(filename, virt_disk::table_load::ON_DEMAND, MAX_PAGES);
+  ASSERT_EQ(static_cast<uint64_t>(huge_entries) * BLOCK_SIZE, disk->get_length());
+  write_random(*disk, model, rng, 100, 4 * BLOCK_SIZE);
+  EXPECT_LT(resident_bytes(), before + (16 * 1024 * 1024));
+
+  disk->read(contents.data(), 0, DISK_SIZE, DISK_SIZE);
+  EXPECT_EQ(model, contents);
+  disk.reset();
+
+  disk = open_with(filename, virt_disk::table_load::ON_DEMAND, 0);
+  disk->read(contents.data(), 0, DISK_SIZE, DISK_SIZE);
+  EXPECT_EQ(model, contents);
+}
+#endif
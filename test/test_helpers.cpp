@@ -0,0 +1,540 @@
+/// @file
+/// @brief Helpers shared by the test cases.
+
+// Copyright Martin Hughes 2018.
+
+#include "test_helpers.h"
+#include "virtualdisk/virt_disk_vdi.h"
+#include "virtualdisk/virt_disk_vhd.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <string.h>
+
+using namespace std;
+
+namespace
+{
+  /// The largest piece of the disk read at once by read_disk().
+  const uint64_t READ_CHUNK = 4 * 1024 * 1024;
+
+  /// The size of a sector, in bytes.
+  const uint64_t SECTOR_BYTES = 512;
+
+  /// Where the block map of a VDI image built by make_image() begins.
+  const uint64_t VDI_MAP_OFFSET = 512;
+
+  /// A VDI block map entry for a block that is not stored in the image.
+  const uint32_t VDI_UNALLOCATED_ENTRY = ~0U;
+
+  /// The value of vdi_header::header_len for a version 1.1 header.
+  const uint32_t VDI_HEADER_LENGTH = 0x190;
+
+  /// @brief Calculate a VHD footer or header checksum - the one's complement of the sum of its bytes.
+  ///
+  /// @param data The structure, with its checksum field set to zero.
+  ///
+  /// @param length The length of the structure, in bytes.
+  ///
+  /// @return The checksum.
+  uint32_t vhd_checksum(const void *data, uint64_t length)
+  {
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(data);
+    uint32_t sum = 0;
+    for (uint64_t i = 0; i < length; i++)
+    {
+      sum += bytes[i];
+    }
+    return ~sum;
+  }
+
+  /// @brief Build a VDI image.
+  ///
+  /// @param file The new, empty, file to write the image to.
+  ///
+  /// @param fixed Whether every block is allocated, in order.
+  ///
+  /// @param size The size of the disk, in bytes.
+  ///
+  /// @param block_size The size of each block, in bytes.
+  void make_vdi(fstream &file, bool fixed, uint64_t size, uint32_t block_size)
+  {
+    const uint32_t block_count = static_cast<uint32_t>((size + block_size - 1) / block_size);
+    const uint64_t data_offset = ((VDI_MAP_OFFSET + (block_count * sizeof(uint32_t)) + SECTOR_BYTES - 1) /
+                                  SECTOR_BYTES) * SECTOR_BYTES;
+
+    virt_disk::vdi_header header;
+    memset(&header, 0, sizeof(header));
+    strcpy(header.info_test, "<<< Oracle VM VirtualBox Disk Image >>>\n");
+    header.magic_number = virt_disk::VDI_MAGIC_NUM;
+    header.version_major = 1;
+    header.version_minor = 1;
+    header.header_len = VDI_HEADER_LENGTH;
+    header.file_type = fixed ? virt_disk::VDI_TYPE_FIXED_SIZE : virt_disk::VDI_TYPE_NORMAL;
+    header.block_data_offset = static_cast<uint32_t>(VDI_MAP_OFFSET);
+    header.image_data_offset = static_cast<uint32_t>(data_offset);
+    header.sector_size = SECTOR_BYTES;
+    header.disk_size = size;
+    header.image_block_size = block_size;
+    header.number_blocks = block_count;
+    header.number_blocks_allocated = fixed ? block_count : 0;
+
+    vector<uint32_t> map(block_count);
+    for (uint32_t i = 0; i < block_count; i++)
+    {
+      map[i] = fixed ? i : VDI_UNALLOCATED_ENTRY;
+    }
+
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.seekp(VDI_MAP_OFFSET);
+    file.write(reinterpret_cast<const char *>(map.data()), map.size() * sizeof(uint32_t));
+
+    uint64_t file_end = data_offset + (fixed ? (static_cast<uint64_t>(block_count) * block_size) : 0);
+    if (file_end > VDI_MAP_OFFSET + (map.size() * sizeof(uint32_t)))
+    {
+      file.seekp(file_end - 1);
+      file.put(0);
+    }
+  }
+
+  /// @brief Build a fixed or dynamic VHD image.
+  ///
+  /// @param file The new, empty, file to write the image to.
+  ///
+  /// @param dynamic Whether the image is dynamic, with no blocks allocated, or fixed.
+  ///
+  /// @param size The size of the disk, in bytes - a multiple of 512.
+  ///
+  /// @param block_size The size of each block of a dynamic image, in bytes.
+  void make_vhd(fstream &file, bool dynamic, uint64_t size, uint32_t block_size)
+  {
+    random_device random_source;
+
+    virt_disk::vhd_footer footer;
+    memset(&footer, 0, sizeof(footer));
+    memcpy(&footer.cookie, virt_disk::VHD_COOKIE, sizeof(virt_disk::VHD_COOKIE));
+    footer.features = 2;
+    footer.format_version = virt_disk::VHD_SUPPORTED_VERSION;
+    footer.data_offset = dynamic ? sizeof(footer) : ~0ULL;
+    footer.original_size = size;
+    footer.current_size = size;
+    footer.disk_type = dynamic ? virt_disk::vhd_disk_type::DYNAMIC : virt_disk::vhd_disk_type::FIXED;
+    for (uint8_t &id_byte : footer.unique_id)
+    {
+      id_byte = static_cast<uint8_t>(random_source());
+    }
+    footer.checksum = vhd_checksum(&footer, sizeof(footer));
+
+    if (!dynamic)
+    {
+      file.seekp(size);
+      file.write(reinterpret_cast<const char *>(&footer), sizeof(footer));
+      return;
+    }
+
+    const uint32_t table_entries = static_cast<uint32_t>((size + block_size - 1) / block_size);
+    const uint64_t table_offset = sizeof(footer) + sizeof(virt_disk::vhd_dynamic_header);
+    const uint64_t table_bytes = (((table_entries * 4) + SECTOR_BYTES - 1) / SECTOR_BYTES) * SECTOR_BYTES;
+
+    virt_disk::vhd_dynamic_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.cookie, virt_disk::VHD_DYNAMIC_COOKIE, sizeof(virt_disk::VHD_DYNAMIC_COOKIE));
+    header.data_offset = ~0ULL;
+    header.table_offset = table_offset;
+    header.header_version = virt_disk::VHD_SUPPORTED_VERSION;
+    header.max_table_entries = table_entries;
+    header.block_size = block_size;
+    header.checksum = vhd_checksum(&header, sizeof(header));
+
+    // Every entry starts unallocated - all bits set, which reads the same in either byte order.
+    vector<char> table(table_bytes, static_cast<char>(0xFF));
+    file.write(reinterpret_cast<const char *>(&footer), sizeof(footer));
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(table.data(), table.size());
+    file.write(reinterpret_cast<const char *>(&footer), sizeof(footer));
+  }
+};
+
+namespace test_helpers
+{
+  const vector<image_kind> ALL_IMAGE_KINDS =
+    {
+      { "vdi_normal", image_type::VDI_NORMAL },
+      { "vdi_fixed", image_type::VDI_FIXED },
+      { "vhd_fixed", image_type::VHD_FIXED },
+      { "vhd_dynamic", image_type::VHD_DYNAMIC },
+    };
+
+  const vector<image_kind> DYNAMIC_IMAGE_KINDS =
+    {
+      { "vdi_normal", image_type::VDI_NORMAL },
+      { "vhd_dynamic", image_type::VHD_DYNAMIC },
+    };
+
+  const vector<image_kind> VHD_IMAGE_KINDS =
+    {
+      { "vhd_fixed", image_type::VHD_FIXED },
+      { "vhd_dynamic", image_type::VHD_DYNAMIC },
+    };
+
+  /// @brief Name a parameterised test after the kind of image it runs against.
+  ///
+  /// @param info The parameter of the test.
+  ///
+  /// @return The name of the kind of image.
+  string image_kind_name(const testing::TestParamInfo<image_kind> &info)
+  {
+    return info.param.name;
+  }
+
+  /// @brief Create a new, empty, scratch directory.
+  ///
+  scratch_dir::scratch_dir()
+  {
+    random_device random_source;
+    for (uint32_t attempt = 0; dir.empty(); attempt++)
+    {
+      filesystem::path candidate = filesystem::temp_directory_path() /
+                                   ("virtualdisk_test_" + to_string(random_source()));
+      if (filesystem::create_directory(candidate))
+      {
+        dir = candidate.string();
+      }
+      else if (attempt >= 100)
+      {
+        throw std::fstream::failure("Failed to create scratch directory");
+      }
+    }
+  }
+
+  /// @brief Remove the scratch directory and everything in it.
+  ///
+  scratch_dir::~scratch_dir()
+  {
+    error_code ignored;
+    filesystem::remove_all(dir, ignored);
+  }
+
+  /// @brief Get the path of a file in the scratch directory.
+  ///
+  /// @param name The name of the file.
+  ///
+  /// @return The full path of the file.
+  string scratch_dir::path(const string &name) const
+  {
+    return dir + "/" + name;
+  }
+
+  /// @brief Build a new image, without using the library's own code for creating images.
+  ///
+  /// @param filename The file to create. It must not already exist.
+  ///
+  /// @param type One of the image_type constants.
+  ///
+  /// @param size The size of the disk, in bytes - a multiple of 512.
+  ///
+  /// @param block_size The size of each block of a VDI or dynamic VHD image, in bytes - a multiple of 512.
+  void make_image(const string &filename, uint32_t type, uint64_t size, uint32_t block_size)
+  {
+    ASSERT_FALSE(filesystem::exists(filename));
+    fstream file(filename, ios::binary | ios::in | ios::out | ios::trunc);
+    switch (type)
+    {
+    case image_type::VDI_NORMAL:
+    case image_type::VDI_FIXED:
+      make_vdi(file, (type == image_type::VDI_FIXED), size, block_size);
+      break;
+
+    default:
+      make_vhd(file, (type == image_type::VHD_DYNAMIC), size, block_size);
+      break;
+    }
+    ASSERT_TRUE(file.good());
+  }
+
+  /// @brief Open an existing image.
+  ///
+  /// @param filename The image to open.
+  ///
+  /// @return The open disk.
+  unique_ptr<virt_disk::virt_disk> open_image(const string &filename)
+  {
+    string name = filename;
+    return unique_ptr<virt_disk::virt_disk>(virt_disk::virt_disk::create_virtual_disk(name));
+  }
+
+  /// @brief Read the whole of a disk.
+  ///
+  /// @param disk The disk to read.
+  ///
+  /// @return The contents of the disk.
+  vector<uint8_t> read_disk(virt_disk::virt_disk &disk)
+  {
+    vector<uint8_t> contents(disk.get_length());
+    for (uint64_t posn = 0; posn < contents.size(); posn += READ_CHUNK)
+    {
+      uint64_t length = min(READ_CHUNK, contents.size() - posn);
+      disk.read(contents.data() + posn, posn, length, length);
+    }
+    return contents;
+  }
+
+  /// @brief Make a buffer of random data.
+  ///
+  /// @param rng The source of the data.
+  ///
+  /// @param length The length of the buffer, in bytes.
+  ///
+  /// @return The buffer.
+  vector<uint8_t> random_bytes(mt19937_64 &rng, uint64_t length)
+  {
+    vector<uint8_t> data(length);
+    for (uint8_t &byte : data)
+    {
+      byte = static_cast<uint8_t>(rng());
+    }
+    return data;
+  }
+
+  /// @brief Write random data to random ranges of a disk, making the same changes to a model of its contents.
+  ///
+  /// The ranges are of any length and alignment, so they often begin and end part way through a sector or block.
+  ///
+  /// @param disk The disk to write to.
+  ///
+  /// @param model The expected contents of the disk. Updated to match.
+  ///
+  /// @param rng The source of random offsets, lengths and data.
+  ///
+  /// @param count The number of writes to make.
+  ///
+  /// @param max_length The longest write, in bytes.
+  void write_random(virt_disk::virt_disk &disk,
+                    vector<uint8_t> &model,
+                    mt19937_64 &rng,
+                    uint32_t count,
+                    uint64_t max_length)
+  {
+    for (uint32_t i = 0; i < count; i++)
+    {
+      uint64_t length = 1 + (rng() % min(max_length, static_cast<uint64_t>(model.size())));
+      uint64_t start_posn = rng() % (model.size() - length + 1);
+      vector<uint8_t> buffer = random_bytes(rng, length);
+      disk.write(buffer.data(), start_posn, length, length);
+      memcpy(model.data() + start_posn, buffer.data(), length);
+    }
+  }
+
+  /// @brief Write zeroes to a range of a disk, making the same change to a model of its contents.
+  ///
+  /// @param disk The disk to write to.
+  ///
+  /// @param model The expected contents of the disk. Updated to match.
+  ///
+  /// @param start_posn The position on the disk to begin writing at.
+  ///
+  /// @param length The number of bytes to write.
+  void zero_range(virt_disk::virt_disk &disk, vector<uint8_t> &model, uint64_t start_posn, uint64_t length)
+  {
+    vector<uint8_t> zeroes(length, 0);
+    disk.write(zeroes.data(), start_posn, length, length);
+    memset(model.data() + start_posn, 0, length);
+  }
+
+  /// @brief Get the length of a file.
+  ///
+  /// @param filename The file to examine.
+  ///
+  /// @return The length of the file, in bytes.
+  uint64_t file_length(const string &filename)
+  {
+    return filesystem::file_size(filename);
+  }
+
+  /// @brief Turn a newly created, empty, dynamic VHD into a differencing disk recording changes to another VHD.
+  ///
+  /// The library only creates fixed and dynamic images, so the child is converted by changing its footer and dynamic
+  /// header. The parent is found by its name, relative to the child.
+  ///
+  /// @param parent_filename The parent image. It must be in the same directory as the child.
+  ///
+  /// @param child_filename A dynamic VHD of the same size as the parent, with nothing written to it.
+  void make_differencing(const string &parent_filename, const string &child_filename)
+  {
+    virt_disk::vhd_footer parent_footer;
+    ifstream parent(parent_filename, ios::binary);
+    parent.seekg(-static_cast<int64_t>(sizeof(parent_footer)), ios::end);
+    parent.read(reinterpret_cast<char *>(&parent_footer), sizeof(parent_footer));
+    ASSERT_TRUE(parent.good());
+
+    fstream child(child_filename, ios::binary | ios::in | ios::out);
+    virt_disk::vhd_footer footer;
+    virt_disk::vhd_dynamic_header header;
+    child.read(reinterpret_cast<char *>(&footer), sizeof(footer));
+    child.read(reinterpret_cast<char *>(&header), sizeof(header));
+    ASSERT_TRUE(child.good());
+
+    footer.disk_type = virt_disk::vhd_disk_type::DIFFERENCING;
+    footer.checksum = 0;
+    footer.checksum = vhd_checksum(&footer, sizeof(footer));
+
+    memcpy(header.parent_unique_id, parent_footer.unique_id, sizeof(header.parent_unique_id));
+    memset(header.parent_unicode_name, 0, sizeof(header.parent_unicode_name));
+    string parent_name = filesystem::path(parent_filename).filename().string();
+    for (size_t i = 0; (i < parent_name.size()) && ((i * 2) + 1 < sizeof(header.parent_unicode_name)); i++)
+    {
+      header.parent_unicode_name[(i * 2) + 1] = static_cast<uint8_t>(parent_name[i]);
+    }
+    header.checksum = 0;
+    header.checksum = vhd_checksum(&header, sizeof(header));
+
+    child.seekp(0);
+    child.write(reinterpret_cast<const char *>(&footer), sizeof(footer));
+    child.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    child.seekp(-static_cast<int64_t>(sizeof(footer)), ios::end);
+    child.write(reinterpret_cast<const char *>(&footer), sizeof(footer));
+    ASSERT_TRUE(child.good());
+  }
+
+  /// @brief Wrap another file.
+  ///
+  /// @param inner The file to pass requests on to.
+  recording_file::recording_file(unique_ptr<virt_disk::disk_file> inner) : inner{move(inner)}
+  {
+  }
+
+  void recording_file::read_at(void *buffer, uint64_t length, uint64_t offset)
+  {
+    inner->read_at(buffer, length, offset);
+  }
+
+  void recording_file::write_at(const void *buffer, uint64_t length, uint64_t offset)
+  {
+    {
+      lock_guard<mutex> events_guard(events_lock);
+      events.push_back({ false, offset, length });
+    }
+    inner->write_at(buffer, length, offset);
+  }
+
+  void recording_file::readv_at(const virt_disk::io_segment *segments, uint32_t count, uint64_t offset)
+  {
+    inner->readv_at(segments, count, offset);
+  }
+
+  void recording_file::writev_at(const virt_disk::io_segment *segments, uint32_t count, uint64_t offset)
+  {
+    uint64_t length = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+      length += segments[i].length;
+    }
+    {
+      lock_guard<mutex> events_guard(events_lock);
+      events.push_back({ false, offset, length });
+    }
+    inner->writev_at(segments, count, offset);
+  }
+
+  uint64_t recording_file::get_length()
+  {
+    return inner->get_length();
+  }
+
+  void recording_file::set_length(uint64_t new_length)
+  {
+    inner->set_length(new_length);
+  }
+
+  void recording_file::flush()
+  {
+    inner->flush();
+    lock_guard<mutex> events_guard(events_lock);
+    events.push_back({ true, 0, 0 });
+  }
+
+  bool recording_file::punch_hole(uint64_t offset, uint64_t length)
+  {
+    return inner->punch_hole(offset, length);
+  }
+
+  bool recording_file::allocate(uint64_t offset, uint64_t length)
+  {
+    return inner->allocate(offset, length);
+  }
+
+  bool recording_file::has_mappings()
+  {
+    return inner->has_mappings();
+  }
+
+  /// @brief Get the writes and flushes made so far, and start a new list.
+  ///
+  /// @return The writes and flushes made since this was last called, oldest first.
+  vector<recording_file::event> recording_file::take_events()
+  {
+    lock_guard<mutex> events_guard(events_lock);
+    vector<event> taken;
+    taken.swap(events);
+    return taken;
+  }
+
+  /// @brief Open an existing image through a recording_file.
+  ///
+  /// @param filename The image to open.
+  ///
+  /// @param type The image_type constant the image was built with.
+  ///
+  /// @param file Set to the file the image is read and written through.
+  ///
+  /// @return The open disk.
+  unique_ptr<virt_disk::virt_disk> open_recorded(const string &filename, uint32_t type, recording_file *&file)
+  {
+    unique_ptr<recording_file> wrapper(new recording_file(virt_disk::disk_file::open(filename)));
+    file = wrapper.get();
+    if ((type == image_type::VDI_NORMAL) || (type == image_type::VDI_FIXED))
+    {
+      return unique_ptr<virt_disk::virt_disk>(new virt_disk::vdi_disk(move(wrapper)));
+    }
+    return unique_ptr<virt_disk::virt_disk>(new virt_disk::vhd_disk(move(wrapper)));
+  }
+
+  /// @brief Check that data written to an image is flushed before the image's tables are next written.
+  ///
+  /// Otherwise a crash could leave the tables referring to data that never reached the file.
+  ///
+  /// @param events The writes and flushes made, oldest first.
+  ///
+  /// @param tables_end The offset within the file that the image's tables end at. Writes below it are table writes.
+  ///
+  /// @param min_data_length Only writes above tables_end at least this long count as data - smaller ones, such as
+  ///                        a VHD footer, are ignored.
+  ///
+  /// @return The index of the first table write made before the data written ahead of it was flushed, or the number
+  ///         of events if there is none.
+  size_t find_unflushed(const vector<recording_file::event> &events, uint64_t tables_end, uint64_t min_data_length)
+  {
+    bool data_unflushed = false;
+    for (size_t i = 0; i < events.size(); i++)
+    {
+      const recording_file::event &e = events[i];
+      if (e.flush)
+      {
+        data_unflushed = false;
+      }
+      else if (e.offset < tables_end)
+      {
+        if (data_unflushed)
+        {
+          return i;
+        }
+      }
+      else if (e.length >= min_data_length)
+      {
+        data_unflushed = true;
+      }
+    }
+    return events.size();
+  }
+};
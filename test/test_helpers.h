@@ -0,0 +1,132 @@
+/// @file
+/// @brief Declares helpers shared by the test cases.
+
+// Copyright Martin Hughes 2018.
+
+#pragma once
+
+#include "virtualdisk/virt_disk_file.h"
+#include "virtualdisk/virtualdisk.h"
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace test_helpers
+{
+  /// @brief Constants that identify the kinds of image make_image() can build.
+  ///
+  namespace image_type
+  {
+    const uint32_t VDI_NORMAL = 0; ///< A VDI image with no blocks allocated.
+    const uint32_t VDI_FIXED = 1; ///< A VDI image with every block allocated, in order.
+    const uint32_t VHD_FIXED = 2; ///< A fixed VHD image.
+    const uint32_t VHD_DYNAMIC = 3; ///< A dynamic VHD image with no blocks allocated.
+  };
+
+  /// @brief One kind of image for a parameterised test to run against.
+  ///
+  struct image_kind
+  {
+    const char *name; ///< Used in the names of the tests.
+    uint32_t type; ///< One of the image_type constants.
+  };
+
+  /// Every kind of image make_image() can build.
+  extern const std::vector<image_kind> ALL_IMAGE_KINDS;
+
+  /// The kinds of image whose blocks are allocated as they are written.
+  extern const std::vector<image_kind> DYNAMIC_IMAGE_KINDS;
+
+  /// The kinds of VHD image.
+  extern const std::vector<image_kind> VHD_IMAGE_KINDS;
+
+  std::string image_kind_name(const testing::TestParamInfo<image_kind> &info);
+
+  /// @brief A temporary directory for the images made by one test, removed along with its contents when destroyed.
+  ///
+  class scratch_dir
+  {
+  public:
+    scratch_dir();
+    ~scratch_dir();
+
+    std::string path(const std::string &name) const;
+
+  protected:
+    /// The full path of the directory.
+    std::string dir;
+  };
+
+  void make_image(const std::string &filename, uint32_t type, uint64_t size, uint32_t block_size);
+
+  std::unique_ptr<virt_disk::virt_disk> open_image(const std::string &filename);
+
+  std::vector<uint8_t> read_disk(virt_disk::virt_disk &disk);
+
+  std::vector<uint8_t> random_bytes(std::mt19937_64 &rng, uint64_t length);
+
+  void write_random(virt_disk::virt_disk &disk,
+                    std::vector<uint8_t> &model,
+                    std::mt19937_64 &rng,
+                    uint32_t count,
+                    uint64_t max_length);
+
+  void zero_range(virt_disk::virt_disk &disk, std::vector<uint8_t> &model, uint64_t start_posn, uint64_t length);
+
+  uint64_t file_length(const std::string &filename);
+
+  void make_differencing(const std::string &parent_filename, const std::string &child_filename);
+
+  /// @brief A backing file that passes requests on to another, keeping a list of the writes and flushes made.
+  ///
+  class recording_file : public virt_disk::disk_file
+  {
+  public:
+    /// @brief One write or flush.
+    ///
+    struct event
+    {
+      bool flush; ///< True for a flush, false for a write.
+      uint64_t offset; ///< The offset within the file that a write began at.
+      uint64_t length; ///< The number of bytes written.
+    };
+
+    recording_file(std::unique_ptr<virt_disk::disk_file> inner);
+
+    virtual void read_at(void *buffer, uint64_t length, uint64_t offset) override;
+    virtual void write_at(const void *buffer, uint64_t length, uint64_t offset) override;
+    virtual void readv_at(const virt_disk::io_segment *segments, uint32_t count, uint64_t offset) override;
+    virtual void writev_at(const virt_disk::io_segment *segments, uint32_t count, uint64_t offset) override;
+    virtual uint64_t get_length() override;
+    virtual void set_length(uint64_t new_length) override;
+    virtual void flush() override;
+    virtual bool punch_hole(uint64_t offset, uint64_t length) override;
+    virtual bool allocate(uint64_t offset, uint64_t length) override;
+    virtual bool has_mappings() override;
+
+    std::vector<event> take_events();
+
+  protected:
+    /// The file requests are passed on to.
+    std::unique_ptr<virt_disk::disk_file> inner;
+
+    /// Protects events.
+    std::mutex events_lock;
+
+    /// The writes and flushes made since take_events() was last called, oldest first.
+    std::vector<event> events;
+  };
+
+  std::unique_ptr<virt_disk::virt_disk> open_recorded(const std::string &filename,
+                                                      uint32_t type,
+                                                      recording_file *&file);
+
+  size_t find_unflushed(const std::vector<recording_file::event> &events,
+                        uint64_t tables_end,
+                        uint64_t min_data_length);
+};
@@ -3,13 +3,12 @@
 
 // Copyright Martin Hughes 2018.
 
-#include <fstream>
-
-using namespace std;
+#include <gtest/gtest.h>
 
 /// @brief Test main function
 /// @internal
-void main()
+int main(int argc, char **argv)
 {
-  // Well, maybe one day at least...
-}
\ No newline at end of file
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,216 @@
+/// @file
+/// @brief Tests of scatter-gather I/O through readv() and writev().
+
+// Copyright Martin Hughes 2018.
+
+#include "test_helpers.h"
+#include "virtualdisk/virt_disk_cache.h"
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+
+using namespace std;
+using namespace test_helpers;
+
+namespace
+{
+  /// The size of the disks used by these tests.
+  const uint64_t DISK_SIZE = 8 * 1024 * 1024;
+
+  /// The block size of the dynamic images used by these tests.
+  const uint32_t BLOCK_SIZE = 64 * 1024;
+
+  /// @brief Split a length into a random list of buffers.
+  ///
+  /// @param rng The source of the split points.
+  ///
+  /// @param length The total length of the buffers.
+  ///
+  /// @return The buffers. Some may be empty.
+  vector<vector<uint8_t>> random_split(mt19937_64 &rng, uint64_t length)
+  {
+    vector<vector<uint8_t>> buffers;
+    while (length > 0)
+    {
+      uint64_t piece = min(length, rng() % (BLOCK_SIZE + 1024));
+      buffers.push_back(vector<uint8_t>(piece, 0));
+      length -= piece;
+    }
+    return buffers;
+  }
+
+  /// @brief Describe a list of buffers as segments.
+  ///
+  /// @param buffers The buffers.
+  ///
+  /// @return A segment for each buffer.
+  vector<virt_disk::io_segment> segments_for(vector<vector<uint8_t>> &buffers)
+  {
+    vector<virt_disk::io_segment> segments;
+    for (vector<uint8_t> &buffer : buffers)
+    {
+      segments.push_back({ buffer.data(), buffer.size() });
+    }
+    return segments;
+  }
+
+  /// @brief The parameters of a vectored I/O test.
+  ///
+  struct vectored_kind
+  {
+    image_kind image; ///< The kind of image to use.
+    bool cached; ///< Whether the disk has a write-back cache attached.
+  };
+
+  class vectored_io_test : public testing::TestWithParam<vectored_kind>
+  {
+  protected:
+    /// @brief Build an empty image for the test, and open it.
+    ///
+    void SetUp() override
+    {
+      string filename = scratch.path("disk");
+      ASSERT_NO_FATAL_FAILURE(make_image(filename, GetParam().image.type, DISK_SIZE, BLOCK_SIZE));
+      disk = open_image(filename);
+      if (GetParam().cached)
+      {
+        virt_disk::cache_config config;
+        config.capacity_bytes = 16 * BLOCK_SIZE;
+        config.block_size = BLOCK_SIZE;
+        config.write_mode = virt_disk::cache_write_mode::WRITE_BACK;
+        disk->set_cache(make_shared<virt_disk::block_cache>(config));
+      }
+      model = vector<uint8_t>(DISK_SIZE, 0);
+    }
+
+    scratch_dir scratch;
+    unique_ptr<virt_disk::virt_disk> disk;
+    vector<uint8_t> model;
+  };
+
+  vector<vectored_kind> all_vectored_kinds()
+  {
+    vector<vectored_kind> kinds;
+    for (const image_kind &image : ALL_IMAGE_KINDS)
+    {
+      kinds.push_back({ image, false });
+      kinds.push_back({ image, true });
+    }
+    return kinds;
+  }
+
+  string vectored_kind_name(const testing::TestParamInfo<vectored_kind> &info)
+  {
+    return string(info.param.image.name) + (info.param.cached ? "_cached" : "_uncached");
+  }
+};
+
+INSTANTIATE_TEST_SUITE_P(all_formats, vectored_io_test, testing::ValuesIn(all_vectored_kinds()), vectored_kind_name);
+
+// Ranges written from one random split of buffers read back the same into another.
+TEST_P(vectored_io_test, single_range)
+{
+  mt19937_64 rng(80);
+  for (uint32_t i = 0; i < 200; i++)
+  {
+    uint64_t length = 1 + (rng() % (4 * BLOCK_SIZE));
+    uint64_t start_posn = rng() % (DISK_SIZE - length + 1);
+
+    vector<vector<uint8_t>> buffers = random_split(rng, length);
+    uint64_t posn = start_posn;
+    for (vector<uint8_t> &buffer : buffers)
+    {
+      buffer = random_bytes(rng, buffer.size());
+      memcpy(model.data() + posn, buffer.data(), buffer.size());
+      posn += buffer.size();
+    }
+    vector<virt_disk::io_segment> segments = segments_for(buffers);
+    disk->writev(segments.data(), segments.size(), start_posn);
+
+    buffers = random_split(rng, length);
+    segments = segments_for(buffers);
+    disk->readv(segments.data(), segments.size(), start_posn);
+    posn = start_posn;
+    for (vector<uint8_t> &buffer : buffers)
+    {
+      ASSERT_EQ(0, memcmp(buffer.data(), model.data() + posn, buffer.size())) << "write " << i;
+      posn += buffer.size();
+    }
+  }
+
+  ASSERT_EQ(model, read_disk(*disk));
+  disk->flush();
+}
+
+// Several separate ranges, some in the same block, are written and read with one call each.
+TEST_P(vectored_io_test, several_ranges)
+{
+  mt19937_64 rng(81);
+  for (uint32_t i = 0; i < 50; i++)
+  {
+    // Ranges in ascending order, with gaps of up to a block between them.
+    vector<vector<vector<uint8_t>>> range_buffers;
+    vector<vector<virt_disk::io_segment>> range_segments;
+    vector<virt_disk::disk_io_range> ranges;
+    uint64_t posn = rng() % (DISK_SIZE / 2);
+    uint32_t range_count = 1 + (rng() % 6);
+    for (uint32_t r = 0; r < range_count; r++)
+    {
+      uint64_t length = 1 + (rng() % BLOCK_SIZE);
+      range_buffers.push_back(random_split(rng, length));
+      for (vector<uint8_t> &buffer : range_buffers.back())
+      {
+        buffer = random_bytes(rng, buffer.size());
+      }
+      ranges.push_back({ posn, nullptr, 0 });
+      posn += length + (rng() % BLOCK_SIZE);
+    }
+    for (uint32_t r = 0; r < range_count; r++)
+    {
+      range_segments.push_back(segments_for(range_buffers[r]));
+      ranges[r].segments = range_segments[r].data();
+      ranges[r].count = range_segments[r].size();
+
+      uint64_t model_posn = ranges[r].start_posn;
+      for (vector<uint8_t> &buffer : range_buffers[r])
+      {
+        memcpy(model.data() + model_posn, buffer.data(), buffer.size());
+        model_posn += buffer.size();
+      }
+    }
+    disk->writev(ranges.data(), ranges.size());
+
+    for (uint32_t r = 0; r < range_count; r++)
+    {
+      for (vector<uint8_t> &buffer : range_buffers[r])
+      {
+        fill(buffer.begin(), buffer.end(), 0xAA);
+      }
+    }
+    disk->readv(ranges.data(), ranges.size());
+    for (uint32_t r = 0; r < range_count; r++)
+    {
+      uint64_t model_posn = ranges[r].start_posn;
+      for (vector<uint8_t> &buffer : range_buffers[r])
+      {
+        ASSERT_EQ(0, memcmp(buffer.data(), model.data() + model_posn, buffer.size())) << "call " << i;
+        model_posn += buffer.size();
+      }
+    }
+  }
+
+  ASSERT_EQ(model, read_disk(*disk));
+}
+
+// A range that runs off the end of the disk is refused.
+TEST_P(vectored_io_test, beyond_end_of_disk)
+{
+  vector<uint8_t> first(4096);
+  vector<uint8_t> second(4096);
+  virt_disk::io_segment segments[2] = { { first.data(), first.size() }, { second.data(), second.size() } };
+
+  EXPECT_ANY_THROW(disk->readv(segments, 2, DISK_SIZE - 4096));
+  EXPECT_ANY_THROW(disk->writev(segments, 2, DISK_SIZE - 4096));
+  disk->readv(segments, 2, DISK_SIZE - 8192);
+}
@@ -0,0 +1,225 @@
+/// @file
+/// @brief Tests of write combining - merging small writes, and keeping them when writing them to the image fails.
+
+// Copyright Martin Hughes 2018.
+
+#include "test_helpers.h"
+#include "virtualdisk/virt_disk_cache.h"
+#include "virtualdisk/virt_disk_file.h"
+#include "virtualdisk/virt_disk_vhd.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string.h>
+#include <thread>
+
+using namespace std;
+using namespace test_helpers;
+
+namespace
+{
+  /// The size of the disks used by these tests.
+  const uint64_t DISK_SIZE = 8 * 1024 * 1024;
+
+  /// The size of the small writes made by these tests.
+  const uint64_t SECTOR = 512;
+
+  /// @brief A backing file that counts writes, and can be made to fail them.
+  ///
+  class faulty_file : public virt_disk::disk_file
+  {
+  public:
+    /// @brief Wrap another file.
+    ///
+    /// @param inner The file to pass requests on to.
+    faulty_file(unique_ptr<virt_disk::disk_file> inner) : inner{move(inner)}, writes{0}, fail{false} {};
+
+    virtual void read_at(void *buffer, uint64_t length, uint64_t offset) override
+    {
+      inner->read_at(buffer, length, offset);
+    };
+
+    virtual void write_at(const void *buffer, uint64_t length, uint64_t offset) override
+    {
+      before_write();
+      inner->write_at(buffer, length, offset);
+    };
+
+    virtual void readv_at(const virt_disk::io_segment *segments, uint32_t count, uint64_t offset) override
+    {
+      inner->readv_at(segments, count, offset);
+    };
+
+    virtual void writev_at(const virt_disk::io_segment *segments, uint32_t count, uint64_t offset) override
+    {
+      before_write();
+      inner->writev_at(segments, count, offset);
+    };
+
+    virtual uint64_t get_length() override { return inner->get_length(); };
+    virtual void set_length(uint64_t new_length) override { inner->set_length(new_length); };
+    virtual void flush() override { inner->flush(); };
+
+    /// Called at the start of each failing write, before it fails.
+    function<void()> on_failure;
+
+    /// The file requests are passed on to.
+    unique_ptr<virt_disk::disk_file> inner;
+
+    /// The number of calls that have written to the file.
+    atomic<uint64_t> writes;
+
+    /// Set to make writes fail.
+    atomic<bool> fail;
+
+  protected:
+    /// @brief Count a write, and fail it if asked to.
+    ///
+    void before_write()
+    {
+      if (fail)
+      {
+        if (on_failure)
+        {
+          on_failure();
+        }
+        throw std::fstream::failure("Injected failure");
+      }
+      writes++;
+    }
+  };
+
+  class write_combine_test : public testing::Test
+  {
+  protected:
+    /// @brief Build a fixed VHD for the test, and open it through a faulty_file with write combining on.
+    ///
+    void SetUp() override
+    {
+      filename = scratch.path("disk.vhd");
+      ASSERT_NO_FATAL_FAILURE(make_image(filename, image_type::VHD_FIXED, DISK_SIZE, 0));
+      unique_ptr<faulty_file> wrapper(new faulty_file(virt_disk::disk_file::open(filename)));
+      file = wrapper.get();
+      disk = unique_ptr<virt_disk::virt_disk>(new virt_disk::vhd_disk(move(wrapper)));
+
+      // Nothing is written to the image until the test asks.
+      virt_disk::write_combine_config config;
+      config.flush_interval_ms = 60000;
+      disk->set_write_combining(config);
+      model = vector<uint8_t>(DISK_SIZE, 0);
+    }
+
+    /// @brief Write data to the disk and the model.
+    ///
+    /// @param data The data to write.
+    ///
+    /// @param start_posn The position on the disk to begin writing at.
+    void write(const vector<uint8_t> &data, uint64_t start_posn)
+    {
+      disk->write(data.data(), start_posn, data.size(), data.size());
+      memcpy(model.data() + start_posn, data.data(), data.size());
+    }
+
+    scratch_dir scratch;
+    string filename;
+    faulty_file *file;
+    unique_ptr<virt_disk::virt_disk> disk;
+    vector<uint8_t> model;
+    mt19937_64 rng{100};
+  };
+};
+
+// Adjacent sector writes, made in any order, are merged and written to the image with one call.
+TEST_F(write_combine_test, merges_adjacent_writes)
+{
+  const uint64_t start_posn = 100 * SECTOR;
+  vector<uint64_t> order(256);
+  for (uint64_t i = 0; i < order.size(); i++)
+  {
+    order[i] = i;
+  }
+  shuffle(order.begin(), order.end(), rng);
+
+  for (uint64_t i : order)
+  {
+    write(random_bytes(rng, SECTOR), start_posn + (i * SECTOR));
+  }
+  EXPECT_EQ(0U, file->writes);
+  ASSERT_EQ(model, read_disk(*disk));
+
+  disk->flush();
+  EXPECT_EQ(1U, file->writes);
+  disk.reset();
+
+  disk = open_image(filename);
+  EXPECT_EQ(model, read_disk(*disk));
+}
+
+// A large write replaces any pending data beneath it, so that data is never written over it later.
+TEST_F(write_combine_test, large_write_replaces_pending)
+{
+  write(random_bytes(rng, SECTOR), 10 * SECTOR);
+  write(random_bytes(rng, 3 * SECTOR), 300 * SECTOR);
+  write(random_bytes(rng, 1024 * 1024), 0);
+  ASSERT_EQ(model, read_disk(*disk));
+
+  disk->flush();
+  disk.reset();
+  disk = open_image(filename);
+  EXPECT_EQ(model, read_disk(*disk));
+}
+
+// Pending data is written to the image once it has been held for the flush interval.
+TEST_F(write_combine_test, timed_flush)
+{
+  virt_disk::write_combine_config config;
+  config.flush_interval_ms = 20;
+  disk->set_write_combining(config);
+
+  write(random_bytes(rng, SECTOR), 7 * SECTOR);
+  for (uint32_t i = 0; (i < 1000) && (file->writes == 0); i++)
+  {
+    this_thread::sleep_for(chrono::milliseconds(5));
+  }
+  EXPECT_EQ(1U, file->writes);
+}
+
+// When writing pending data to the image fails, it stays pending - beneath anything written while the write was being
+// made - and is written by the next flush.
+TEST_F(write_combine_test, failed_flush_restores)
+{
+  for (uint64_t i = 0; i < 40; i++)
+  {
+    write(random_bytes(rng, SECTOR), (i * 3) * SECTOR);
+  }
+  write(random_bytes(rng, 8 * SECTOR), 1000 * SECTOR);
+
+  // Part of the data being flushed is written again while the flush is under way.
+  vector<uint8_t> newer = random_bytes(rng, 2 * SECTOR);
+  bool rewritten = false;
+  file->on_failure = [&]()
+                     {
+                       if (!rewritten)
+                       {
+                         rewritten = true;
+                         write(newer, 1003 * SECTOR);
+                       }
+                     };
+  file->fail = true;
+  EXPECT_ANY_THROW(disk->flush());
+  EXPECT_TRUE(rewritten);
+  EXPECT_EQ(0U, file->writes);
+  ASSERT_EQ(model, read_disk(*disk));
+
+  file->fail = false;
+  disk->flush();
+  ASSERT_EQ(model, read_disk(*disk));
+  disk.reset();
+
+  disk = open_image(filename);
+  EXPECT_EQ(model, read_disk(*disk));
+}